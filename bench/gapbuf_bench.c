@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include <gapbuf.h>
+#include <grapheme.h>
+
+// Random edits compared against a full rebuild of the marks
+#define CHECK_EDITS 200000
+// Edits stop growing the text past this length
+#define CHECK_MAX_LEN 300
+// Edits of a long cue per timing loop
+#define TIME_EDITS 1000000
+// Length of the long cue
+#define TIME_CUE_LEN 8000
+
+// Pieces inserted by the random edits, chosen to hit each grapheme rule
+static const char *pieces[] = {
+    "a", "x", " ", "\n", "\r", "\r\n",
+    // Combining marks, alone and after a base
+    "e\xcc\x81", "\xcc\x81", "\xe0\xa4\x95", "\xe0\xa5\x8d",
+    // CJK, ideographic and no-break spaces
+    "\xe4\xb8\xad", "\xe6\x96\x87", "\xe3\x80\x80", "\xc2\xa0",
+    // Emoji, ZWJ, skin tone and variation selector
+    "\xf0\x9f\x91\xa8", "\xe2\x80\x8d", "\xf0\x9f\x91\xa9", "\xf0\x9f\x8f\xbb", "\xef\xb8\x8f",
+    // Regional indicators
+    "\xf0\x9f\x87\xab", "\xf0\x9f\x87\xb7",
+    // Hangul jamo and a precomposed syllable
+    "\xe1\x84\x80", "\xe1\x85\xa1", "\xe1\x86\xa8", "\xea\xb0\x80",
+    // Broken UTF-8
+    "\xe4\xb8", "\x80", "\xff",
+};
+
+#define NUM_PIECES (int)(sizeof(pieces) / sizeof(pieces[0]))
+
+// Internal function to copy the text and marks of a buffer without moving its gap
+static void get_text_marks(const GapBuffer *gb, char *text, unsigned char *marks)
+{
+    int len = gap_len(gb);
+    for (int i = 0; i < len; i++)
+    {
+        int at = i < gb->gap_start ? i : i + gb->gap_end - gb->gap_start;
+        text[i] = gb->data[at];
+        marks[i] = gb->marks[at];
+    }
+}
+
+// Internal function to print the text and both marks of a mismatch
+static void dump_mismatch(int edit, const char *text, const unsigned char *got, const unsigned char *want, int len)
+{
+    printf("Marks differ from a rebuild after edit %d, byte:incremental,rebuilt\n", edit);
+    for (int i = 0; i < len; i++)
+        printf("%02x:%d,%d%c", (unsigned char)text[i], got[i], want[i], got[i] != want[i] ? '!' : ' ');
+    printf("\n");
+}
+
+// Apply random inserts and deletes, checking the incremental marks against a full rebuild
+// Return 0 if they always matched
+static int check_boundaries()
+{
+    GapBuffer gb = {0};
+    GapBuffer ref = {0};
+    static char text[CHECK_MAX_LEN * 2];
+    static unsigned char got[CHECK_MAX_LEN * 2];
+    static unsigned char want[CHECK_MAX_LEN * 2];
+
+    srand(47);
+    for (int edit = 0; edit < CHECK_EDITS; edit++)
+    {
+        int len = gap_len(&gb);
+        if (len > CHECK_MAX_LEN || (len > 0 && rand() % 3 == 0))
+        {
+            // Byte ranges split code points, grapheme ranges split nothing
+            int pos = rand() % len;
+            int n = 1 + rand() % 4;
+            if (rand() % 2)
+            {
+                pos = gap_prev_grapheme(&gb, pos + 1);
+                n = gap_next_grapheme(&gb, pos) - pos;
+            }
+            if (pos + n > len)
+                n = len - pos;
+            gap_delete(&gb, pos, n);
+        }
+        else
+        {
+            char piece[64] = "";
+            int k = 1 + rand() % 3;
+            for (int i = 0; i < k; i++)
+                strcat(piece, pieces[rand() % NUM_PIECES]);
+            gap_insert(&gb, rand() % (len + 1), piece, strlen(piece));
+        }
+
+        // The gap position changes where marks are stored, not what they are
+        if (edit % 7 == 0)
+            gap_move(&gb, rand() % (gap_len(&gb) + 1));
+
+        len = gap_len(&gb);
+        get_text_marks(&gb, text, got);
+        gap_set(&ref, text, len);
+        get_text_marks(&ref, text, want);
+        if (memcmp(got, want, len))
+        {
+            dump_mismatch(edit, text, got, want, len);
+            gap_free(&gb);
+            gap_free(&ref);
+            return 1;
+        }
+    }
+
+    printf("%d random edits, incremental marks equal a full rebuild\n", CHECK_EDITS);
+    gap_free(&gb);
+    gap_free(&ref);
+    return 0;
+}
+
+// Internal function to get the nanoseconds per iteration since start
+static double ns_since(Uint64 start, int iterations)
+{
+    return (SDL_GetPerformanceCounter() - start) * 1e9 / SDL_GetPerformanceFrequency() / iterations;
+}
+
+// Time edits and grapheme motions in the middle of a long cue
+static void time_operations()
+{
+    static char cue[TIME_CUE_LEN + 64];
+    const char *line = "Caf\xc3\xa9 \xe4\xb8\xad\xe6\x96\x87 e\xcc\x81 ";
+    int len = 0;
+    while (len < TIME_CUE_LEN)
+    {
+        memcpy(cue + len, line, strlen(line));
+        len += strlen(line);
+    }
+
+    GapBuffer gb = {0};
+    gap_set(&gb, cue, len);
+    int pos = gap_prev_grapheme(&gb, len / 2);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < TIME_EDITS; i++)
+    {
+        gap_insert(&gb, pos, "\xc3\xa9", 2);
+        gap_delete(&gb, pos, 2);
+    }
+    printf("insert + delete: %.1f ns on a %d byte cue\n", ns_since(start, TIME_EDITS), len);
+
+    start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < TIME_EDITS; i++)
+    {
+        pos = gap_next_grapheme(&gb, pos);
+        pos = gap_prev_grapheme(&gb, pos);
+    }
+    printf("right + left: %.1f ns\n", ns_since(start, TIME_EDITS));
+
+    start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < TIME_EDITS; i++)
+    {
+        pos = gap_next_word(&gb, pos);
+        pos = gap_prev_word(&gb, pos);
+    }
+    printf("next + previous word: %.1f ns\n", ns_since(start, TIME_EDITS));
+
+    // Rebuilding every mark is what each edit would cost without the incremental scan
+    start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < TIME_EDITS / 1000; i++)
+        gap_set(&gb, cue, len);
+    printf("full rebuild: %.1f ns\n", ns_since(start, TIME_EDITS / 1000));
+
+    gap_free(&gb);
+}
+
+// Check the edit buffer's grapheme boundaries and time its operations
+// Return 0 if the boundaries were correct
+int main(int argc, char *argv[])
+{
+    if (check_boundaries())
+        return 1;
+    time_operations();
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL2/SDL.h>
+
+#include <keymap.h>
+
+// Keys fed per timing loop
+#define TIME_KEYS 10000000
+// Builds and loads per timing loop
+#define TIME_LOADS 100
+// Lines of the generated config
+#define CONFIG_LINES 1000
+#define CONFIG_FILE "keymap_bench.rc"
+
+// NORMAL mode keys with counts, prefixes and operators, as typed while editing
+static const char keys[] = "jk3wWBggG2jdd>apyip<3}u.hl";
+
+// Errors in the generated config are printed instead of shown on screen
+void show_text(const char *text, const int duration)
+{
+    fprintf(stderr, "%s\n", text);
+}
+
+// Internal function to get the nanoseconds per iteration since start
+static double ns_since(Uint64 start, int iterations)
+{
+    return (SDL_GetPerformanceCounter() - start) * 1e9 / SDL_GetPerformanceFrequency() / iterations;
+}
+
+// Time each keypress through the trie, as fed by the main loop
+static void time_lookup()
+{
+    KeyState state;
+    KeyAction action;
+    long matches = 0;
+    keymap_reset(&state);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < TIME_KEYS; i++)
+    {
+        char key = keys[i % (sizeof(keys) - 1)];
+        int res = keymap_feed(&state, key, &action);
+        // The key that ended a bound prefix starts the next sequence
+        if (res == KEYMAP_MATCH_AGAIN)
+            res = keymap_feed(&state, key, &action);
+        matches += res == KEYMAP_MATCH;
+    }
+    printf("lookup: %.1f ns per key, %ld matches\n", ns_since(start, TIME_KEYS), matches);
+}
+
+// Internal function to write a config binding three key sequences
+// Return 0 on success
+static int write_config()
+{
+    FILE *fp = fopen(CONFIG_FILE, "w");
+    if (fp == NULL)
+        return 1;
+
+    for (int i = 0; i < CONFIG_LINES; i++)
+        fprintf(fp, "map %c%c%c seek %d %d\n", 'a' + i % 26, 'A' + i / 26 % 26, 'a' + i / 676, i, i);
+    fclose(fp);
+    return 0;
+}
+
+// Time building the default keymap and loading a large config on top of it
+static void time_load()
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < TIME_LOADS; i++)
+        keymap_init();
+    printf("defaults, with any %s: %.1f us\n", KEYMAP_CONFIG, ns_since(start, TIME_LOADS) / 1000);
+
+    if (write_config())
+    {
+        printf("Could not write %s!\n", CONFIG_FILE);
+        return;
+    }
+
+    start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < TIME_LOADS; i++)
+        keymap_load(CONFIG_FILE);
+    printf("%d line config: %.1f us\n", CONFIG_LINES, ns_since(start, TIME_LOADS) / 1000);
+
+    remove(CONFIG_FILE);
+}
+
+// Time key lookups and keymap loading
+int main(int argc, char *argv[])
+{
+    time_load();
+    // Lookups run against the defaults, the generated config has prefixes of its own
+    keymap_init();
+    time_lookup();
+    return 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+
+// Report of an alignment, written next to the subs
+#define ALIGN_REPORT_EXT ".align.txt"
+
+// Cues either side of the diagonal that an alignment may stray from
+#define ALIGN_BAND 256
+
+// Steps kept at once by the smallest parts of the search, larger parts
+// are split in two around the middle row
+#define ALIGN_LEAF_CELLS (1 << 20)
+// Max alignment workers, including the main thread
+#define ALIGN_MAX_THREADS 16
+
+// Costs compare the logs of durations and gaps, as the frame rate scales both
+// Cost of aligning a cue to more than one other
+#define ALIGN_STEP_COST 0.3
+// Durations and gaps are compared up to this many seconds
+#define ALIGN_MAX_TIME 10.0
+// Seconds added to durations and gaps, so that short ones do not dominate the cost
+#define ALIGN_MIN_TIME 0.2
+// Cost at which the confidence of a cue falls to 1/e
+#define ALIGN_COST_SCALE 0.5
+// Cues below this confidence are counted as doubtful
+#define ALIGN_LOW_CONFIDENCE 0.5
+
+void align_report_filename(const char *, char *, size_t);
+
+int align_subs(const char *, const char *, int *);
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Subtitle formats, picked by the extension of a file
+#define CODEC_SRT 0
+#define CODEC_VTT 1
+#define CODEC_ASS 2
+
+#define VTT_HEADER "WEBVTT\n\n"
+
+// ASS files are written with a single default style
+#define ASS_HEADER                                                                                         \
+    "[Script Info]\n"                                                                                      \
+    "ScriptType: v4.00+\n"                                                                                 \
+    "WrapStyle: 0\n"                                                                                       \
+    "ScaledBorderAndShadow: yes\n"                                                                         \
+    "PlayResX: 384\n"                                                                                      \
+    "PlayResY: 288\n"                                                                                      \
+    "\n"                                                                                                   \
+    "[V4+ Styles]\n"                                                                                       \
+    "Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, OutlineColour, BackColour, "        \
+    "Bold, Italic, Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, BorderStyle, Outline, Shadow, "   \
+    "Alignment, MarginL, MarginR, MarginV, Encoding\n"                                                     \
+    "Style: Default,Arial,16,&H00FFFFFF,&H000000FF,&H00000000,&H00000000,0,0,0,0,100,100,0,0,1,1,0,2,"    \
+    "10,10,10,1\n"                                                                                         \
+    "\n"                                                                                                   \
+    "[Events]\n"                                                                                           \
+    "Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text\n"
+
+// Fields of ASS events when there is no format line
+#define ASS_DEFAULT_FIELDS 10
+
+// A cue read from a subtitle file
+typedef struct SubCue
+{
+    double start_ts;
+    double end_ts;
+    // Text with line breaks, not null terminated
+    const char *text;
+    int len;
+    // Set if text points into the file, otherwise it is only valid until the next cue
+    int in_place;
+} SubCue;
+
+// Reads the cues of a whole file in memory one by one
+typedef struct CueReader
+{
+    int format;
+    const char *p;
+    const char *end;
+    // Position of the Start and End fields of ASS events, and the number of fields
+    int ass_start;
+    int ass_end;
+    int ass_fields;
+    int ass_events;
+    // Text of the last cue if it had to be unescaped
+    char *buf;
+    int buf_cap;
+} CueReader;
+
+int codec_from_filename(const char *);
+
+const char *codec_name(int);
+
+void cue_reader_init(CueReader *, int, const char *, size_t);
+
+int cue_reader_next(CueReader *, SubCue *);
+
+void cue_reader_free(CueReader *);
+
+int codec_write_header(FILE *, int);
+
+int codec_write_cue(FILE *, int, int, double, double, const char *, int);
+
+int codec_write_end(FILE *, int, int);
+
+int convert_sub(const char *, const char *);
@@ -15,8 +15,22 @@
 
 #define DEFAULT_COUNT_i 0
 
+// Seconds subs are shifted by > and <
+#define DEFAULT_UNIT_SHIFT 0.1
+
+// A gap of at least this many seconds between subs starts a new paragraph
+#define PARAGRAPH_GAP 1.0
+
+int get_mode();
+
+void set_mode(int);
+
 void handle_text_input(const char *);
 
+void handle_suggestions();
+
+void handle_time_pos(const double);
+
 void handle_escape();
 
 void handle_return();
@@ -31,6 +45,14 @@ void handle_ctrl_backspace();
 
 void handle_ctrl_c();
 
+void handle_ctrl_r();
+
+void handle_tab();
+
+void handle_ctrl_n();
+
+void handle_ctrl_v(const char *);
+
 void handle_ctrl_right();
 
 void handle_right();
@@ -38,3 +60,7 @@ void handle_right();
 void handle_ctrl_left();
 
 void handle_left();
+
+void handle_up();
+
+void handle_down();
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <utils.h>
+
+// Encodings of imported files, which are converted to UTF-8
+#define ENCODING_UTF8 0
+#define ENCODING_UTF16LE 1
+#define ENCODING_UTF16BE 2
+#define ENCODING_CP1252 3
+
+// Bytes looked at for UTF-16 without a BOM
+#define ENCODING_SNIFF_SIZE 512
+
+int utf8_valid(const char *, size_t);
+
+int decode_file(MappedFile *);
+
+const char *encoding_name(int);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+#include <mpv/client.h>
+
+// Messages waiting for the UI thread, a power of two
+// The event thread waits for room when the UI thread falls behind
+#define EVENTS_RING_SIZE 256
+
+// Level of mpv log messages printed, unless set by SBUBBY_LOG_LEVEL
+#define EVENTS_LOG_LEVEL "warn"
+
+// Message types
+#define EVENT_FILE_LOADED 1
+#define EVENT_COMMAND_REPLY 2
+#define EVENT_TIME_POS 3
+#define EVENT_STRING 4
+
+// An mpv event decoded by the event thread
+typedef struct EventMessage
+{
+    int type;
+    // Negative if a command failed
+    int error;
+    uint64_t userdata;
+    double time_pos;
+    // Id of the track added by a command, -1 if none
+    long track_id;
+    // Owned by the queue, valid while the message is handled
+    char *text;
+} EventMessage;
+
+int events_start(mpv_handle *, Uint32);
+
+int events_drain(void (*)(const EventMessage *));
+
+void events_stop();
@@ -0,0 +1,66 @@
+#pragma once
+
+// Smallest gap left after growing a buffer
+#define GAP_MIN_SIZE 64
+
+// Editable text with a gap at the last edit position
+// Edits near the gap only move the bytes between it and the edit
+typedef struct GapBuffer
+{
+    char *data;
+    int cap;
+    // Text is data[0, gap_start) followed by data[gap_end, cap)
+    int gap_start;
+    int gap_end;
+    // Grapheme and word boundary marks of each byte, with the same gap as data
+    unsigned char *marks;
+    // Sorted offsets of the lines after the first
+    int *lines;
+    int num_lines;
+    int lines_cap;
+} GapBuffer;
+
+static inline int gap_len(const GapBuffer *gb)
+{
+    return gb->cap - (gb->gap_end - gb->gap_start);
+}
+
+// Number of lines in the text
+static inline int gap_line_count(const GapBuffer *gb)
+{
+    return gb->num_lines + 1;
+}
+
+void gap_set(GapBuffer *, const char *, int);
+
+void gap_free(GapBuffer *);
+
+char gap_char(const GapBuffer *, int);
+
+void gap_move(GapBuffer *, int);
+
+int gap_insert(GapBuffer *, int, const char *, int);
+
+int gap_delete(GapBuffer *, int, int);
+
+const char *gap_text(GapBuffer *);
+
+void gap_spans(const GapBuffer *, const char **, int *, const char **, int *);
+
+int gap_next_grapheme(const GapBuffer *, int);
+
+int gap_prev_grapheme(const GapBuffer *, int);
+
+int gap_column(const GapBuffer *, int, int);
+
+int gap_advance(const GapBuffer *, int, int, int);
+
+int gap_next_word(const GapBuffer *, int);
+
+int gap_prev_word(const GapBuffer *, int);
+
+int gap_line_of(const GapBuffer *, int);
+
+int gap_line_start(const GapBuffer *, int);
+
+int gap_line_end(const GapBuffer *, int);
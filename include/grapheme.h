@@ -0,0 +1,25 @@
+#pragma once
+
+// Boundary marks of the first byte of a code point
+#define MARK_GRAPHEME 1
+#define MARK_WORD 2
+
+// Longest UTF-8 sequence
+#define UTF8_MAX_LEN 4
+
+// State of a forward scan for boundaries, zeroed at a grapheme boundary
+typedef struct BoundaryState
+{
+    // Grapheme break property of the last code point
+    int prev_prop;
+    // Regional indicators in a row, which pair up into flags
+    int ri_count;
+    // Set after an emoji and its modifiers, which a ZWJ joins to the next emoji
+    int emoji;
+    // Word class of the last grapheme
+    int prev_class;
+} BoundaryState;
+
+int boundary_next(BoundaryState *, unsigned int);
+
+unsigned int utf8_decode(const unsigned char *, int, int *);
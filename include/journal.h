@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Journals are stored next to the exported subs
+#define JOURNAL_EXT ".sbj"
+
+#define JOURNAL_MAGIC "SBBYJRNL"
+#define JOURNAL_VERSION 1
+
+// Fold the journal into a new image once this many bytes are appended
+#define JOURNAL_COMPACT_SIZE (4 << 20)
+
+// Batch changes to more subs than this compact the journal instead of
+// appending a record for each
+#define JOURNAL_MAX_BATCH 4096
+
+// Initial size of the pending record buffer
+#define JOURNAL_BUF_SIZE 4096
+
+// Record types
+#define JOURNAL_INSERT_TEXT 1
+#define JOURNAL_DELETE_TEXT 2
+#define JOURNAL_SET_START 3
+#define JOURNAL_SET_END 4
+#define JOURNAL_NEW_SUB 5
+#define JOURNAL_DELETE_SUB 6
+
+// All fields are stored in native byte order
+// The header is followed by the base filename and the session image,
+// each padded to SESSION_ALIGN, and then by records
+typedef struct JournalHeader
+{
+    char magic[8];
+    uint32_t version;
+    // Length of the base filename, 0 if there is no base file
+    uint32_t base_len;
+    // Base file must be unchanged for the journal to apply
+    int64_t base_size;
+    int64_t base_mtime;
+    // Size of the embedded session image, which replaces the base file
+    uint64_t image_size;
+} JournalHeader;
+
+// Records refer to subs by id
+// Only INSERT_TEXT records are followed by len bytes of text
+typedef struct JournalRecord
+{
+    // FNV-1a of the rest of the record and its data
+    uint32_t checksum;
+    uint8_t op;
+    uint8_t reserved[3];
+    uint32_t id;
+    uint32_t pos;
+    uint32_t len;
+    uint32_t reserved2;
+    double ts;
+} JournalRecord;
+
+void journal_filename(const char *, char *, size_t);
+
+int journal_recover(const char *);
+
+void journal_start(const char *, const char *);
+
+void journal_append(int, uint32_t, uint32_t, uint32_t, double, const char *);
+
+void journal_compact();
+
+int journal_release_base(const char *);
+
+void journal_wait_rewrite(int);
+
+void journal_close(int);
@@ -0,0 +1,107 @@
+#pragma once
+
+// User keymap file, looked up in the home directory then the working directory
+#define KEYMAP_CONFIG ".sbubbyrc"
+
+// Keys are single ASCII chars
+#define KEYMAP_KEYS 128
+
+// Longest key sequence of a binding
+#define KEYMAP_MAX_SEQ 8
+
+// Root nodes of the NORMAL and operator pending tries
+#define KEYMAP_NORMAL 0
+#define KEYMAP_OPERATOR 1
+
+// Feed results
+#define KEYMAP_PENDING 0
+#define KEYMAP_MATCH 1
+// The key did not continue a bound prefix, run the action and feed it again
+#define KEYMAP_MATCH_AGAIN 2
+#define KEYMAP_NONE 3
+
+enum
+{
+    ACTION_NONE,
+    ACTION_FULLSCREEN,
+    ACTION_SEEK,
+    ACTION_FRAME_BACK,
+    ACTION_FRAME_STEP,
+    ACTION_DELETE_SUB,
+    ACTION_SEEK_START,
+    ACTION_SEEK_END,
+    ACTION_INSERT_END,
+    ACTION_INSERT_START,
+    ACTION_APPEND_SUB,
+    ACTION_NEXT_SUB,
+    ACTION_BACK_SUB,
+    ACTION_SEEK_FOCUSED_END,
+    ACTION_FOCUS_NEXT,
+    ACTION_FOCUS_PREV,
+    ACTION_SET_START,
+    ACTION_SET_END,
+    ACTION_RELOAD,
+    ACTION_UNDO,
+    ACTION_FOLLOW,
+    ACTION_PUT,
+    ACTION_REPEAT,
+    ACTION_SEARCH_NEXT,
+    ACTION_SEARCH_PREV,
+    ACTION_REFERENCE,
+    // Operators wait for a motion
+    ACTION_OP_DELETE,
+    ACTION_OP_YANK,
+    ACTION_OP_SHIFT,
+    // Motions and text objects, bound in the operator pending trie
+    ACTION_MOTION_LINES,
+    ACTION_MOTION_NEXT,
+    ACTION_MOTION_BACK,
+    ACTION_MOTION_PARA_NEXT,
+    ACTION_MOTION_PARA_PREV,
+    ACTION_MOTION_FIRST,
+    ACTION_MOTION_LAST,
+    ACTION_OBJECT_PARA,
+    NUM_ACTIONS
+};
+
+static inline int is_operator(int action)
+{
+    return action >= ACTION_OP_DELETE && action <= ACTION_OP_SHIFT;
+}
+
+typedef struct KeyAction
+{
+    int action;
+    // Count typed before the keys, or the default of the binding
+    long count;
+    // Seconds per count for seeks, or to shift by for shifts
+    double unit;
+    // Motion of an operator
+    int motion;
+} KeyAction;
+
+// Progress through a key sequence in NORMAL mode
+typedef struct KeyState
+{
+    int node;
+    // -1 until a digit is typed
+    long count;
+    // Last key walked in the trie
+    char key;
+    // Operator waiting for a motion, ACTION_NONE if none
+    KeyAction op;
+    // Typing the last key of the operator again applies it to whole subs
+    char op_key;
+} KeyState;
+
+void keymap_init();
+
+int keymap_load(const char *);
+
+int keymap_bind(int, const char *, const KeyAction *);
+
+int keymap_unbind(int, const char *);
+
+void keymap_reset(KeyState *);
+
+int keymap_feed(KeyState *, char, KeyAction *);
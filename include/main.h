@@ -3,11 +3,24 @@
 #define WINDOW_WIDTH 640
 #define WINDOW_HEIGHT 360
 
+#define USAGE                                                                             \
+    "Usage: sbubby [--record session.sbr | --replay session.sbr] video.mp4 [sub.srt]\n" \
+    "       sbubby --convert in.srt out.vtt\n"                                          \
+    "       sbubby --build-tm subs_dir memory.sbt"
+
+// Milliseconds to wait for mpv between replayed events
+#define REPLAY_WAIT_MS 100
+// Milliseconds to wait for the video to load before replaying
+#define REPLAY_LOAD_TIMEOUT 30000
+
 #define REPLY_USERDATA_SUB_RELOAD 8000
 #define REPLY_USERDATA_SUB_RELOAD2 8001
 #define REPLY_USERDATA_UPDATE_FILENAME 8002
 #define REPLY_USERDATA_UPDATE_TIMESTAMP 8003
 
+// Replies for reference tracks are offset by the index of the track
+#define REPLY_USERDATA_REF_ADDED 8100
+
 extern double curr_timestamp;
 
 // Prevent writing to file when reloading
@@ -22,6 +35,8 @@ void set_window_title(const char *);
 
 void toggle_fullscreen();
 
+void request_quit();
+
 void toggle_pause();
 
 void frame_step();
@@ -39,3 +54,7 @@ void seek_relative(const double);
 void sub_add(const char *);
 
 void sub_reload();
+
+void sub_add_reference(const char *, int);
+
+void show_reference(long);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdio.h>
+
+// Name of the in-memory preview, also used for the temp file fallback
+#define PREVIEW_NAME "sbubby-preview"
+
+FILE *preview_open();
+
+int preview_commit(FILE *);
+
+const char *preview_path();
+
+void preview_close();
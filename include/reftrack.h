@@ -0,0 +1,33 @@
+#pragma once
+
+#include <utils.h>
+
+// Max reference tracks loaded at once
+#define REF_MAX_TRACKS 8
+
+// A cue of a reference track, with text pointing into the mapped file
+typedef struct RefCue
+{
+    double start_ts;
+    double end_ts;
+    const char *text;
+    int len;
+} RefCue;
+
+int ref_load(const char *);
+
+int ref_count();
+
+const char *ref_filename(int);
+
+void ref_set_track_id(int, long);
+
+long ref_track_id(int);
+
+int ref_active();
+
+void ref_set_active(int);
+
+const RefCue *ref_find_overlap(int, double, double, int *);
+
+void ref_close();
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+// First line of a recorded session
+#define RECORD_MAGIC "SBBYREC 1"
+
+// Longest text of a recorded event, longer pastes are cut
+#define RECORD_MAX_TEXT 65536
+
+// Recorded event types
+#define REPLAY_TEXT 0
+#define REPLAY_KEY 1
+#define REPLAY_PASTE 2
+#define REPLAY_TIME_POS 3
+#define REPLAY_NUM_TYPES 4
+
+// An event read back from a recorded session
+typedef struct ReplayEvent
+{
+    int type;
+    // Milliseconds since recording started
+    Uint32 ms;
+    SDL_Keycode sym;
+    Uint16 mod;
+    double time_pos;
+    // Text typed or pasted, valid until the next event is read
+    const char *text;
+} ReplayEvent;
+
+int record_start(const char *);
+
+void record_text(const char *);
+
+void record_key(SDL_Keycode, Uint16);
+
+void record_paste(const char *);
+
+void record_time_pos(double);
+
+void record_close();
+
+int replay_open(const char *);
+
+int replay_active();
+
+int replay_next(ReplayEvent *);
+
+void replay_add_time(int, Uint64);
+
+void replay_report(long);
+
+void replay_close();
@@ -0,0 +1,13 @@
+#pragma once
+
+// Saves with at least this many subs report progress
+#define SAVE_PROGRESS_MIN 10000
+
+// Progress is reported in steps of this many percent
+#define SAVE_PROGRESS_STEP 10
+
+int save_sub(const char *);
+
+int save_wait();
+
+void save_close();
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <store.h>
+
+// Session files are stored next to the exported subs
+#define SESSION_EXT ".sbs"
+
+#define SESSION_MAGIC "SBBYSESS"
+#define SESSION_VERSION 1
+
+// Section types
+// Unknown sections are skipped when importing
+#define SESSION_SECTION_START_TS 1
+#define SESSION_SECTION_END_TS 2
+#define SESSION_SECTION_TEXT_OFFSETS 3
+#define SESSION_SECTION_TEXT 4
+// Optional, subs are numbered in order without it
+#define SESSION_SECTION_IDS 5
+
+// Sections are aligned to this many bytes
+#define SESSION_ALIGN 8
+
+// All fields are stored in native byte order
+typedef struct SessionHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_subs;
+    int32_t focused_idx;
+    int32_t cursor_pos;
+    int32_t mode;
+    uint32_t num_sections;
+} SessionHeader;
+
+// The section table follows the header
+typedef struct SessionSection
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+} SessionSection;
+
+void session_filename(const char *, char *, size_t);
+
+int session_is_current(const char *, const char *);
+
+int is_session_file(const char *);
+
+int load_session_image(const char *, size_t);
+
+int import_session(const char *);
+
+char *session_image_of(const StoreNode *, int, int, int, size_t *);
+
+char *session_image(size_t *);
+
+int export_session(const char *);
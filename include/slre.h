@@ -38,6 +38,27 @@ struct slre_cap {
 int slre_match(const char *regexp, const char *buf, int buf_len,
                struct slre_cap *caps, int num_caps);
 
+/*
+ * Compiled regex, for matching the same pattern many times.
+ * slre_compile() returns NULL on failure, setting error to a failure code.
+ */
+struct slre_prog;
+
+/* Number of patterns kept by slre_cached() */
+#define SLRE_CACHE_SIZE 16
+
+struct slre_prog *slre_compile(const char *regexp, int *error);
+int slre_exec(const struct slre_prog *prog, const char *buf, int buf_len,
+              struct slre_cap *caps, int num_caps);
+void slre_free(struct slre_prog *prog);
+
+/*
+ * Compile a pattern or reuse a recently compiled one. The program stays
+ * valid until SLRE_CACHE_SIZE other patterns are looked up. Not thread safe,
+ * but the program returned may be executed from any thread.
+ */
+const struct slre_prog *slre_cached(const char *regexp, int *error);
+
 /* slre_match() failure codes */
 #define SLRE_NO_MATCH               -1
 #define SLRE_UNEXPECTED_QUANTIFIER  -2
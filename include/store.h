@@ -0,0 +1,102 @@
+#pragma once
+
+#include <utils.h>
+
+// Max records or children in a node of the version tree
+#define STORE_FANOUT 32
+
+// Max depth of the version tree, enough for STORE_FANOUT^8 records
+#define STORE_MAX_DEPTH 8
+
+// Max versions pinned at once across all threads
+#define STORE_MAX_PINS 16
+
+// An immutable copy of a sub in a published version
+typedef struct SubRecord
+{
+    double start_ts;
+    double end_ts;
+    unsigned int id;
+    int len;
+    // Not null terminated
+    // Points into the sub source unless owned by the store
+    const char *text;
+    int owned;
+} SubRecord;
+
+// Node of a counted B-tree of records
+// Shared nodes are never modified, edits copy the path to the changed
+// record and share the rest
+typedef struct StoreNode
+{
+    // Versions and parents sharing the node, only used by the main thread
+    // Only nodes with a single reference are modified in place
+    int refs;
+    int leaf;
+    // Number of records or children
+    int n;
+    // Number of records below
+    int size;
+} StoreNode;
+
+// Leaves hold the records
+typedef struct StoreLeaf
+{
+    StoreNode node;
+    SubRecord recs[STORE_FANOUT];
+} StoreLeaf;
+
+// Other nodes hold their children, and are allocated smaller than leaves
+typedef struct StoreBranch
+{
+    StoreNode node;
+    StoreNode *children[STORE_FANOUT];
+} StoreBranch;
+
+// Iterates the records of a version in order
+typedef struct StoreIter
+{
+    const StoreNode *path[STORE_MAX_DEPTH];
+    int pos[STORE_MAX_DEPTH];
+    int depth;
+} StoreIter;
+
+void store_clear();
+
+void store_set(int, const SubRecord *, int);
+
+void store_set_parts(int, const SubRecord *, const char *, int);
+
+void store_insert(int, const SubRecord *, int);
+
+void store_erase(int);
+
+void store_publish();
+
+const StoreNode *store_retain();
+
+void store_drop(const StoreNode *);
+
+void store_restore(const StoreNode *);
+
+const StoreNode *store_working();
+
+size_t store_bytes_allocated();
+
+int *store_diff(const StoreNode *, const StoreNode *, int *);
+
+void store_rebase(const StoreNode **, int, const char *, size_t, const char *);
+
+void store_retire_file(MappedFile *);
+
+const StoreNode *store_acquire(int *);
+
+void store_release(int);
+
+int store_count(const StoreNode *);
+
+const SubRecord *store_get(const StoreNode *, int);
+
+void store_iter_init(StoreIter *, const StoreNode *, int);
+
+const SubRecord *store_iter_next(StoreIter *);
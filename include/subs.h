@@ -1,20 +1,68 @@
 #pragma once
 
-#define SUB_FILENAME_TMP "_sbubby_tmp.srt"
+#include <utils.h>
+#include <journal.h>
+#include <store.h>
+
 #define SUB_PLACEHOLDER "1\n00:00:00,000 --> 00:00:00,000\n\n\n"
 
+// Files at least this large are imported lazily
+#define LAZY_IMPORT_MIN_SIZE (1 << 20)
+
+// Seconds around the playhead written to the preview
+#define PREVIEW_WINDOW 300
+// Re-export the preview when the playhead is this close to the edge
+#define PREVIEW_MARGIN 60
+
+// Max subs to walk forward in follow mode before binary searching
+#define FOLLOW_MAX_WALK 8
+
+// Number of subs allocated at once
+#define SUB_BLOCK_SIZE 1024
+
 typedef struct Sub
 {
     double start_ts;
     double end_ts;
-    char text[512];
+    // Stable id used by the journal
+    unsigned int id;
+    // Text owned by the sub, of any length
+    // NULL until the sub is materialized from src, and while it is being edited
+    char *text;
+    // Unmaterialized text, pointing into the sub source
+    const char *src;
+    int src_len;
     struct Sub *next;
 } Sub;
 
+Sub *alloc_sub();
+
+const char *sub_text(const Sub *, int *);
+
+Sub *get_sub_head();
+
+int get_focused_idx();
+
+int get_cursor_pos();
+
+void subs_load(Sub *, int, int);
+
+void subs_restore(const StoreNode *, int);
+
+void apply_journal_record(int, unsigned int, unsigned int, unsigned int, double, const char *);
+
+void subs_set_source(MappedFile *, const char *);
+
+void subs_detach_source(const char *);
+
+void subs_release_source(const char *);
+
 void new_sub(const double);
 
 void sub_insert_text(const char *);
 
+void sub_paste_text(const char *);
+
 void subs_init();
 
 void seek_focused_end();
@@ -37,6 +85,10 @@ void export_sub(const char *, int);
 
 void export_reload_sub();
 
+void export_reload_flush();
+
+int in_preview_window(double);
+
 void sub_delete_char();
 
 void sub_backspace_char();
@@ -51,6 +103,32 @@ void focus_sub_in_frame();
 
 void delete_focused_sub();
 
+int delete_subs(int, int);
+
+int delete_sub_set(const int *, int);
+
+int shift_subs(int, int, double);
+
+int shift_sub_set(const int *, int, double);
+
+int set_sub_texts(const int *, char **, int);
+
+int set_sub_times(const double *, const double *, int);
+
+void subs_renumber();
+
+int focus_sub(int);
+
+int jump_sub(int);
+
+int search_subs(const char *, int, int, int *);
+
+void put_subs(const SubRecord *, int, double);
+
+void toggle_follow();
+
+int follow_playhead(double);
+
 void cursor_prev_word();
 
 void cursor_next_word();
@@ -59,6 +137,10 @@ void cursor_left();
 
 void cursor_right();
 
+void cursor_up();
+
+void cursor_down();
+
 void unset_cursor();
 
 void set_cursor_start();
@@ -0,0 +1,12 @@
+#pragma once
+
+// Subs given to each substitution worker at least, smaller ranges use fewer workers
+#define SUBST_MIN_CHUNK 4096
+
+// Max substitution workers, including the main thread
+#define SUBST_MAX_THREADS 16
+
+// Max capture groups in a pattern, of which \1 to \9 can be replaced
+#define SUBST_MAX_CAPS 32
+
+int substitute(const int *, int, int, const char *, long *, int *);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+// Initial number of slots in the trigram table
+#define SEARCH_TABLE_SIZE 4096
+
+// Literal searches with more candidates than this first scan as many subs
+// from the focused one, as common text is usually found soon
+#define SEARCH_MAX_CANDIDATES 4096
+
+// Deleting more subs than this at once drops the index instead of updating it
+#define SEARCH_MAX_UPDATES 1024
+
+int search_index_ready();
+
+void search_index_clear();
+
+void search_index_add(uint32_t, const char *, int, const char *, int);
+
+void search_index_done();
+
+void search_index_begin(const char *, int, const char *, int);
+
+void search_index_end(uint32_t, const char *, int, const char *, int);
+
+int search_index_query(const char *, int, int, uint32_t **, int *);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <SDL2/SDL.h>
+
+// Trace written by :trace without a filename, and by SBUBBY_TRACE=1
+#define TRACE_FILENAME "sbubby-trace.json"
+
+// Spans kept per thread, later spans are dropped
+#define TRACE_BUFFER_SIZE (1 << 16)
+// Threads that can record spans
+#define TRACE_MAX_THREADS 32
+
+// Set while tracing, read by every thread
+extern int trace_enabled;
+
+// Start and end a span, at the cost of a single check when not tracing
+// Names and categories must be string literals or otherwise outlive the trace
+#define TRACE_BEGIN() (trace_enabled ? SDL_GetPerformanceCounter() : 0)
+#define TRACE_END(start, cat, name)             \
+    do                                          \
+    {                                           \
+        if (start)                              \
+            trace_span((start), (cat), (name)); \
+    } while (0)
+
+int trace_start(const char *);
+
+void trace_span(Uint64, const char *, const char *);
+
+int trace_stop();
+
+const char *trace_filename();
+
+void trace_close();
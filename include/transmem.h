@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+// Translation memories are built with --build-tm from a directory of past subtitles
+#define TM_MAGIC "SBBYTMEM"
+#define TM_VERSION 1
+
+// Section types
+// Offsets of each distinct text, null terminated, and the end of the last
+#define TM_SECTION_TEXT_OFFSETS 1
+#define TM_SECTION_TEXT 2
+// Text of each line, in file order
+#define TM_SECTION_LINE_TEXTS 3
+// A byte per line, set on the last line of each file
+#define TM_SECTION_LAST_LINES 4
+// Start of the lines of each text, and the end of the last
+#define TM_SECTION_TEXT_LINE_STARTS 5
+// Lines of each text, in file order
+#define TM_SECTION_TEXT_LINES 6
+// Start of each bucket in the postings of a band, and the end of the last
+#define TM_SECTION_BUCKETS 7
+// Texts of each band in order of bucket
+#define TM_SECTION_POSTINGS 8
+
+// Sections are aligned to this many bytes
+#define TM_ALIGN 8
+
+// Texts are matched by MinHash signatures of their character trigrams,
+// split in bands of rows. Texts sharing every row of a band are candidates
+#define TM_BANDS 8
+#define TM_BAND_ROWS 2
+
+// Texts looked at per band, so that crowded buckets stay fast
+#define TM_MAX_BAND_CANDIDATES 64
+
+// Lines of a text looked at for the lines that came after it
+#define TM_MAX_FOLLOW_LINES 64
+
+// Bytes of a line or query that are matched
+#define TM_MAX_TEXT 512
+
+// Suggestions offered at once
+#define TM_MAX_SUGGESTIONS 3
+// Percent of trigrams a suggestion has in common with the query at least
+#define TM_MIN_SCORE 50
+
+// Texts hashed by each build worker at least
+#define TM_MIN_CHUNK 16384
+// Max build workers, including the main thread
+#define TM_MAX_THREADS 16
+
+// All fields are stored in native byte order
+typedef struct TmHeader
+{
+    char magic[8];
+    uint32_t version;
+    // Lines repeated in the subtitles share their text
+    uint32_t num_texts;
+    uint32_t num_lines;
+    // Buckets per band, a power of two
+    uint32_t num_buckets;
+    uint32_t num_bands;
+    uint32_t band_rows;
+    uint32_t num_sections;
+    // Keeps the section table aligned
+    uint32_t reserved;
+} TmHeader;
+
+// The section table follows the header
+typedef struct TmSection
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+} TmSection;
+
+// A line of the memory offered for the focused sub
+typedef struct TmSuggestion
+{
+    // Null terminated, pointing into the mapped memory
+    const char *text;
+    int len;
+    // Percent of trigrams in common with the query
+    int score;
+} TmSuggestion;
+
+int tm_build(const char *, const char *);
+
+void tm_set_wakeup(Uint32);
+
+int tm_open(const char *);
+
+int tm_loaded();
+
+uint32_t tm_num_lines();
+
+void tm_request(const char *, int, int);
+
+int tm_results(TmSuggestion *);
+
+void tm_close();
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+
+// Oldest undo points are dropped once history takes more memory than this
+#define UNDO_MAX_BYTES (64 << 20)
+
+void undo_checkpoint(int);
+
+void undo_seal();
+
+void undo_clear();
+
+void undo_rebase(const char *, size_t, const char *);
+
+int undo(int);
+
+int redo(int);
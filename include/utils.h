@@ -1,7 +1,18 @@
 #pragma once
 
+#include <stdio.h>
+
 #include <SDL2/SDL.h>
 
+// A read-only view of a whole file
+// If handle is NULL, data is owned heap memory instead of a mapping
+typedef struct MappedFile
+{
+    const char *data;
+    size_t size;
+    void *handle;
+} MappedFile;
+
 void set_window_icon(SDL_Window *);
 
 int dbl_eq(const double, const double);
@@ -20,4 +31,30 @@ void pop_word(char *);
 
 double str_to_timestamp(const char *);
 
+const char *scan_timestamp(const char *, const char *, double *);
+
+int is_index_line(const char *, const char *);
+
+int scan_timing_line(const char *, const char *, double *, double *);
+
+int format_timestamp(const double, char *, int, char, int);
+
 void timetamp_to_str(const double, char *);
+
+int map_file(const char *, MappedFile *);
+
+void unmap_file(MappedFile *);
+
+int replace_file(const char *, const char *);
+
+int sync_file(FILE *);
+
+FILE *open_file_atomic(const char *, char *, size_t);
+
+int commit_file_atomic(FILE *, int, const char *, const char *);
+
+int write_file_atomic(const char *, const void *, size_t, const void *, size_t);
+
+int write_without_cr(FILE *, const char *, int);
+
+const char *find_bytes(const char *, int, const char *, int);
@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <SDL2/SDL.h>
+
+#include <align.h>
+#include <codec.h>
+#include <encoding.h>
+#include <store.h>
+#include <subs.h>
+#include <utils.h>
+#include <main.h>
+#include <trace.h>
+
+// Steps of a path through the cost matrix
+#define STEP_DIAG 0
+#define STEP_UP 1
+#define STEP_LEFT 2
+
+// Timing of a cue relative to its neighbours, which drifting tracks share
+// Kept as logs, so that tracks at different frame rates compare alike
+typedef struct CueFeatures
+{
+    float duration;
+    float gap_before;
+    float gap_after;
+} CueFeatures;
+
+// Rows are the subs and columns the reference cues
+// Row i may only use columns lo[i] to lo[i] + width - 1, a band around the diagonal
+typedef struct AlignCtx
+{
+    int n;
+    int m;
+    int width;
+    int *lo;
+    const CueFeatures *a;
+    const CueFeatures *b;
+    // Path through each row, written by the part of the search that owns the row
+    int *first_col;
+    int *last_col;
+} AlignCtx;
+
+// Part of the search between two cells known to be on the best path
+typedef struct AlignTask
+{
+    const AlignCtx *ctx;
+    int r0, c0;
+    int r1, c1;
+    int threads;
+} AlignTask;
+
+// A pass over the rows between a corner and the middle row of a task
+typedef struct AlignPass
+{
+    const AlignTask *task;
+    int mid;
+    int backward;
+    // Costs of the middle row from column c0 of the task
+    float *out;
+} AlignPass;
+
+typedef struct RefTimes
+{
+    double start_ts;
+    double end_ts;
+} RefTimes;
+
+// Internal function to get the cost of aligning sub i with reference cue j
+static inline float local_cost(const AlignCtx *ctx, int i, int j)
+{
+    const CueFeatures *a = &ctx->a[i];
+    const CueFeatures *b = &ctx->b[j];
+    return fabsf(a->duration - b->duration) +
+           0.5f * (fabsf(a->gap_before - b->gap_before) + fabsf(a->gap_after - b->gap_after));
+}
+
+// Internal function to get the columns of a row inside both the band and a task
+static inline void row_cols(const AlignTask *t, int i, int *lo, int *hi)
+{
+    *lo = t->ctx->lo[i] > t->c0 ? t->ctx->lo[i] : t->c0;
+    *hi = t->ctx->lo[i] + t->ctx->width - 1 < t->c1 ? t->ctx->lo[i] + t->ctx->width - 1 : t->c1;
+}
+
+static inline float min3(float a, float b, float c)
+{
+    float m = a < b ? a : b;
+    return m < c ? m : c;
+}
+
+// Internal function to fill the costs of the best paths from a corner of a task to
+// each cell of its middle row, keeping two rows at a time
+// Forward paths start at (r0, c0), backward ones end at (r1, c1)
+static int run_pass(void *data)
+{
+    AlignPass *pass = (AlignPass *)data;
+    const AlignTask *t = pass->task;
+    const AlignCtx *ctx = t->ctx;
+    Uint64 span = TRACE_BEGIN();
+
+    int cols = t->c1 - t->c0 + 1;
+    float *prev = (float *)malloc(cols * sizeof(float));
+    float *curr = (float *)malloc(cols * sizeof(float));
+    int prev_lo = 0, prev_hi = -1;
+
+    int dir = pass->backward ? -1 : 1;
+    int first = pass->backward ? t->r1 : t->r0;
+    for (int i = first;; i += dir)
+    {
+        int lo, hi;
+        row_cols(t, i, &lo, &hi);
+
+        // Backward passes walk each row from the right
+        for (int k = 0; k <= hi - lo; k++)
+        {
+            int j = pass->backward ? hi - k : lo + k;
+            float c = local_cost(ctx, i, j);
+            if (i == first && j == (pass->backward ? t->c1 : t->c0))
+            {
+                curr[j - t->c0] = c;
+                continue;
+            }
+
+            int jd = j - dir;
+            float diag = i != first && jd >= prev_lo && jd <= prev_hi ? prev[jd - t->c0] : INFINITY;
+            float up = i != first && j >= prev_lo && j <= prev_hi ? prev[j - t->c0] : INFINITY;
+            float side = k > 0 ? curr[jd - t->c0] : INFINITY;
+            curr[j - t->c0] = c + min3(diag, up + ALIGN_STEP_COST, side + ALIGN_STEP_COST);
+        }
+
+        if (i == pass->mid)
+        {
+            for (int j = t->c0; j <= t->c1; j++)
+                pass->out[j - t->c0] = j >= lo && j <= hi ? curr[j - t->c0] : INFINITY;
+            break;
+        }
+
+        float *tmp = prev;
+        prev = curr;
+        curr = tmp;
+        prev_lo = lo;
+        prev_hi = hi;
+    }
+
+    free(prev);
+    free(curr);
+    TRACE_END(span, "align", "pass");
+    return 0;
+}
+
+// Internal function to find the best path of a small task, keeping every step
+// Tasks share their first and last rows, of which a task only sets the side its
+// part of the path covers
+static void solve_leaf(const AlignTask *t)
+{
+    const AlignCtx *ctx = t->ctx;
+    int rows = t->r1 - t->r0 + 1;
+    int cols = t->c1 - t->c0 + 1;
+    unsigned char *steps = (unsigned char *)malloc((size_t)rows * cols);
+    float *prev = (float *)malloc(cols * sizeof(float));
+    float *curr = (float *)malloc(cols * sizeof(float));
+    int prev_lo = 0, prev_hi = -1;
+
+    for (int i = t->r0; i <= t->r1; i++)
+    {
+        int lo, hi;
+        row_cols(t, i, &lo, &hi);
+        unsigned char *row_steps = steps + (size_t)(i - t->r0) * cols - t->c0;
+
+        for (int j = lo; j <= hi; j++)
+        {
+            float c = local_cost(ctx, i, j);
+            if (i == t->r0 && j == t->c0)
+            {
+                curr[j - t->c0] = c;
+                row_steps[j] = STEP_DIAG;
+                continue;
+            }
+
+            float diag = i > t->r0 && j - 1 >= prev_lo && j - 1 <= prev_hi ? prev[j - 1 - t->c0] : INFINITY;
+            float up = i > t->r0 && j >= prev_lo && j <= prev_hi ? prev[j - t->c0] + ALIGN_STEP_COST : INFINITY;
+            float left = j > lo ? curr[j - 1 - t->c0] + ALIGN_STEP_COST : INFINITY;
+
+            if (diag <= up && diag <= left)
+                row_steps[j] = STEP_DIAG;
+            else if (up <= left)
+                row_steps[j] = STEP_UP;
+            else
+                row_steps[j] = STEP_LEFT;
+            curr[j - t->c0] = c + min3(diag, up, left);
+        }
+
+        float *tmp = prev;
+        prev = curr;
+        curr = tmp;
+        prev_lo = lo;
+        prev_hi = hi;
+    }
+
+    // Walk back from the end corner, noting where the path enters and leaves each row
+    int i = t->r1, j = t->c1;
+    while (i > t->r0 || j > t->c0)
+    {
+        int step = steps[(size_t)(i - t->r0) * cols + j - t->c0];
+        if (step == STEP_LEFT)
+        {
+            j--;
+            continue;
+        }
+
+        ctx->first_col[i] = j;
+        i--;
+        if (step == STEP_DIAG)
+            j--;
+        ctx->last_col[i] = j;
+    }
+
+    // The corners of the whole matrix are not shared with another task
+    if (t->r0 == 0)
+        ctx->first_col[0] = t->c0;
+    if (t->r1 == ctx->n - 1)
+        ctx->last_col[t->r1] = t->c1;
+
+    free(steps);
+    free(prev);
+    free(curr);
+}
+
+// Internal function to find the best path between the corners of a task
+// The path through the middle row splits it into two independent tasks,
+// so that memory stays within a few rows of the band and the tasks run in parallel
+static int solve_task(void *data)
+{
+    const AlignTask *t = (const AlignTask *)data;
+    if (t->r1 - t->r0 < 2 || (long long)(t->r1 - t->r0 + 1) * (t->c1 - t->c0 + 1) <= ALIGN_LEAF_CELLS)
+    {
+        solve_leaf(t);
+        return 0;
+    }
+
+    int mid = (t->r0 + t->r1) / 2;
+    int cols = t->c1 - t->c0 + 1;
+    float *forward = (float *)malloc(cols * sizeof(float));
+    float *backward = (float *)malloc(cols * sizeof(float));
+    AlignPass passes[2] = {
+        {.task = t, .mid = mid, .backward = 0, .out = forward},
+        {.task = t, .mid = mid, .backward = 1, .out = backward},
+    };
+
+    SDL_Thread *thread = t->threads > 1 ? SDL_CreateThread(run_pass, "align", &passes[1]) : NULL;
+    run_pass(&passes[0]);
+    if (thread != NULL)
+        SDL_WaitThread(thread, NULL);
+    else
+        run_pass(&passes[1]);
+
+    // Both passes count the cell of the middle row itself
+    int best = t->c0;
+    float best_cost = INFINITY;
+    for (int j = t->c0; j <= t->c1; j++)
+    {
+        float cost = forward[j - t->c0] + backward[j - t->c0] - local_cost(t->ctx, mid, j);
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best = j;
+        }
+    }
+    free(forward);
+    free(backward);
+
+    AlignTask upper = {.ctx = t->ctx, .r0 = t->r0, .c0 = t->c0, .r1 = mid, .c1 = best, .threads = t->threads / 2};
+    AlignTask lower = {.ctx = t->ctx, .r0 = mid, .c0 = best, .r1 = t->r1, .c1 = t->c1, .threads = t->threads - t->threads / 2};
+    if (upper.threads < 1)
+        upper.threads = 1;
+
+    thread = t->threads > 1 ? SDL_CreateThread(solve_task, "align", &lower) : NULL;
+    solve_task(&upper);
+    if (thread != NULL)
+        SDL_WaitThread(thread, NULL);
+    else
+        solve_task(&lower);
+    return 0;
+}
+
+// Internal function to get the log of a duration or gap for comparing
+static inline float log_time(double secs)
+{
+    if (secs < 0)
+        secs = 0;
+    if (secs > ALIGN_MAX_TIME)
+        secs = ALIGN_MAX_TIME;
+    return logf(secs + ALIGN_MIN_TIME);
+}
+
+// Internal function to get the timing features of cues in order
+static void cue_features(CueFeatures *out, int n, const double *start_ts, const double *end_ts)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i].duration = log_time(end_ts[i] - start_ts[i]);
+        out[i].gap_before = i > 0 ? log_time(start_ts[i] - end_ts[i - 1]) : log_time(0);
+        out[i].gap_after = i + 1 < n ? log_time(start_ts[i + 1] - end_ts[i]) : log_time(0);
+    }
+}
+
+// Internal function to order reference cues by start
+static int compare_times(const void *a, const void *b)
+{
+    const RefTimes *time_a = (const RefTimes *)a;
+    const RefTimes *time_b = (const RefTimes *)b;
+    return time_a->start_ts < time_b->start_ts ? -1 : time_a->start_ts > time_b->start_ts;
+}
+
+// Internal function to read the timing of the cues of a reference file in order
+// Returns the number of cues, or -1 if the file cannot be read
+static int read_ref_times(const char *filename, double **start_ts, double **end_ts)
+{
+    MappedFile map;
+    if (map_file(filename, &map) != 0)
+        return -1;
+    decode_file(&map);
+
+    int len = 0, cap = 1024;
+    RefTimes *times = (RefTimes *)malloc(cap * sizeof(RefTimes));
+    int ordered = 1;
+
+    CueReader reader;
+    cue_reader_init(&reader, codec_from_filename(filename), map.data, map.size);
+    SubCue cue;
+    while (cue_reader_next(&reader, &cue))
+    {
+        if (len == cap)
+        {
+            cap *= 2;
+            times = (RefTimes *)realloc(times, cap * sizeof(RefTimes));
+        }
+        if (len > 0 && cue.start_ts < times[len - 1].start_ts)
+            ordered = 0;
+        times[len++] = (RefTimes){.start_ts = cue.start_ts, .end_ts = cue.end_ts};
+    }
+    cue_reader_free(&reader);
+    unmap_file(&map);
+
+    if (!ordered)
+        qsort(times, len, sizeof(RefTimes), compare_times);
+
+    *start_ts = (double *)malloc((len ? len : 1) * sizeof(double));
+    *end_ts = (double *)malloc((len ? len : 1) * sizeof(double));
+    for (int i = 0; i < len; i++)
+    {
+        (*start_ts)[i] = times[i].start_ts;
+        (*end_ts)[i] = times[i].end_ts;
+    }
+    free(times);
+    return len;
+}
+
+// Internal function to lay the band around the diagonal, wide enough for the path
+// to get from one row to the next however different the number of cues
+static void place_band(AlignCtx *ctx)
+{
+    int slope = ctx->n > 1 ? (ctx->m + ctx->n - 2) / (ctx->n - 1) : ctx->m;
+    ctx->width = 2 * ALIGN_BAND + 1 + slope;
+    if (ctx->width > ctx->m)
+        ctx->width = ctx->m;
+
+    ctx->lo = (int *)malloc(ctx->n * sizeof(int));
+    for (int i = 0; i < ctx->n; i++)
+    {
+        long long center = ctx->n > 1 ? (long long)i * (ctx->m - 1) / (ctx->n - 1) : 0;
+        long long lo = center - ctx->width / 2;
+        if (lo > ctx->m - ctx->width)
+            lo = ctx->m - ctx->width;
+        ctx->lo[i] = lo < 0 ? 0 : lo;
+    }
+}
+
+// Internal function to write the old and new timing and confidence of each sub
+// Return 0 on success
+static int write_report(const char *filename, int n, const double *old_start, const double *old_end,
+                        const double *new_start, const double *new_end, const int *ref, const float *confidence)
+{
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+        return 1;
+
+    fprintf(fp, "# sub\tref\tconfidence\told timing\tnew timing\n");
+    for (int i = 0; i < n; i++)
+    {
+        char ts[4][16];
+        timetamp_to_str(old_start[i], ts[0]);
+        timetamp_to_str(old_end[i], ts[1]);
+        timetamp_to_str(new_start[i], ts[2]);
+        timetamp_to_str(new_end[i], ts[3]);
+        fprintf(fp, "%d\t%d\t%.0f%%%s\t%s --> %s\t%s --> %s\n", i + 1, ref[i] + 1, confidence[i] * 100,
+                confidence[i] < ALIGN_LOW_CONFIDENCE ? " ?" : "", ts[0], ts[1], ts[2], ts[3]);
+    }
+
+    return fclose(fp) != 0;
+}
+
+// Get the filename of the alignment report for a sub file
+void align_report_filename(const char *filename, char *buf, size_t sz)
+{
+    snprintf(buf, sz, "%s%s", filename, ALIGN_REPORT_EXT);
+}
+
+// Retime every sub to a reference track as a single change, by dynamic time
+// warping over the durations of cues and the gaps between them
+// Subs aligned to a run of cues span it, and runs of subs aligned to a cue are
+// scaled to fit it
+// A report with the confidence of each sub is written, low sets how many are doubtful
+// Return 0 on success
+int align_subs(const char *ref_fname, const char *report_fname, int *low)
+{
+    *low = 0;
+
+    double *ref_start, *ref_end;
+    int m = read_ref_times(ref_fname, &ref_start, &ref_end);
+    if (m < 0)
+    {
+        show_text("Failed to load reference!", 1000);
+        return 1;
+    }
+
+    const StoreNode *root = store_working();
+    int n = store_count(root);
+    if (m == 0 || n == 0)
+    {
+        show_text(m == 0 ? "No reference cues!" : "No subs!", 300);
+        free(ref_start);
+        free(ref_end);
+        return 1;
+    }
+
+    double *old_start = (double *)malloc(n * sizeof(double));
+    double *old_end = (double *)malloc(n * sizeof(double));
+    StoreIter it;
+    store_iter_init(&it, root, 0);
+    for (int i = 0; i < n; i++)
+    {
+        const SubRecord *rec = store_iter_next(&it);
+        old_start[i] = rec->start_ts;
+        old_end[i] = rec->end_ts;
+    }
+
+    CueFeatures *a = (CueFeatures *)malloc(n * sizeof(CueFeatures));
+    CueFeatures *b = (CueFeatures *)malloc(m * sizeof(CueFeatures));
+    cue_features(a, n, old_start, old_end);
+    cue_features(b, m, ref_start, ref_end);
+
+    AlignCtx ctx = {.n = n, .m = m, .a = a, .b = b};
+    place_band(&ctx);
+    ctx.first_col = (int *)malloc(n * sizeof(int));
+    ctx.last_col = (int *)malloc(n * sizeof(int));
+
+    int threads = SDL_GetCPUCount();
+    if (threads > ALIGN_MAX_THREADS)
+        threads = ALIGN_MAX_THREADS;
+    Uint64 span = TRACE_BEGIN();
+    AlignTask task = {.ctx = &ctx, .r0 = 0, .c0 = 0, .r1 = n - 1, .c1 = m - 1, .threads = threads};
+    solve_task(&task);
+    TRACE_END(span, "align", "solve");
+
+    double *new_start = (double *)malloc(n * sizeof(double));
+    double *new_end = (double *)malloc(n * sizeof(double));
+    int *ref = (int *)malloc(n * sizeof(int));
+    float *confidence = (float *)malloc(n * sizeof(float));
+
+    // Subs joined by vertical steps share a cue, and form a run with the cues they span
+    for (int first = 0, last; first < n; first = last + 1)
+    {
+        last = first;
+        while (last + 1 < n && ctx.first_col[last + 1] == ctx.last_col[last])
+            last++;
+
+        // Map the run of subs linearly onto the run of cues
+        double src_start = old_start[first];
+        double src_len = old_end[last] - src_start;
+        double dst_start = ref_start[ctx.first_col[first]];
+        double dst_len = ref_end[ctx.last_col[last]] - dst_start;
+        double scale = src_len > 0 ? dst_len / src_len : 0;
+
+        for (int i = first; i <= last; i++)
+        {
+            new_start[i] = dst_start + (old_start[i] - src_start) * scale;
+            new_end[i] = dst_start + (old_end[i] - src_start) * scale;
+            if (first == last)
+            {
+                new_start[i] = dst_start;
+                new_end[i] = dst_start + dst_len;
+            }
+
+            // Confidence of the best match along the path through the row
+            float best = INFINITY;
+            ref[i] = ctx.first_col[i];
+            for (int j = ctx.first_col[i]; j <= ctx.last_col[i]; j++)
+            {
+                float cost = local_cost(&ctx, i, j);
+                if (cost < best)
+                {
+                    best = cost;
+                    ref[i] = j;
+                }
+            }
+            confidence[i] = expf(-best / ALIGN_COST_SCALE);
+            if (confidence[i] < ALIGN_LOW_CONFIDENCE)
+                (*low)++;
+        }
+    }
+
+    int ret = set_sub_times(new_start, new_end, n);
+    if (ret == 0 && write_report(report_fname, n, old_start, old_end, new_start, new_end, ref, confidence) != 0)
+        show_text("Failed to write alignment report!", 1000);
+
+    free(ref_start);
+    free(ref_end);
+    free(old_start);
+    free(old_end);
+    free(a);
+    free(b);
+    free(ctx.lo);
+    free(ctx.first_col);
+    free(ctx.last_col);
+    free(new_start);
+    free(new_end);
+    free(ref);
+    free(confidence);
+    return ret;
+}
@@ -0,0 +1,676 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <SDL2/SDL.h>
+
+#include <codec.h>
+#include <utils.h>
+#include <subs.h>
+#include <encoding.h>
+
+// Entities unescaped in WebVTT text
+static const struct
+{
+    const char *name;
+    const char *text;
+} vtt_entities[] = {
+    {"&amp;", "&"},
+    {"&lt;", "<"},
+    {"&gt;", ">"},
+    {"&nbsp;", "\xC2\xA0"},
+    {"&lrm;", "\xE2\x80\x8E"},
+    {"&rlm;", "\xE2\x80\x8F"},
+};
+
+// Pick the format of a subtitle file by its extension, SRT if unknown
+int codec_from_filename(const char *filename)
+{
+    const char *ext = strrchr(filename, '.');
+    if (ext == NULL || strlen(ext) != 4)
+        return CODEC_SRT;
+
+    char lower[5];
+    for (int i = 0; i < 5; i++)
+        lower[i] = tolower((unsigned char)ext[i]);
+
+    if (strcmp(lower, ".vtt") == 0)
+        return CODEC_VTT;
+    if (strcmp(lower, ".ass") == 0 || strcmp(lower, ".ssa") == 0)
+        return CODEC_ASS;
+    return CODEC_SRT;
+}
+
+const char *codec_name(int format)
+{
+    switch (format)
+    {
+    case CODEC_VTT:
+        return "WebVTT";
+    case CODEC_ASS:
+        return "ASS";
+    default:
+        return "SRT";
+    }
+}
+
+// Start reading the cues of a file in memory
+void cue_reader_init(CueReader *r, int format, const char *data, size_t size)
+{
+    *r = (CueReader){
+        .format = format,
+        .p = data,
+        .end = data + size,
+        .ass_start = 1,
+        .ass_end = 2,
+        .ass_fields = ASS_DEFAULT_FIELDS,
+    };
+
+    // Skip UTF-8 BOM
+    if (size >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0)
+        r->p += 3;
+}
+
+void cue_reader_free(CueReader *r)
+{
+    free(r->buf);
+    r->buf = NULL;
+    r->buf_cap = 0;
+}
+
+// Internal function to get the line starting at p
+// Returns the end of the line without its line break, and sets next to the next line
+static inline const char *next_line(const char *p, const char *end, const char **next)
+{
+    const char *eol = memchr(p, '\n', end - p);
+    if (eol == NULL)
+        eol = end;
+    *next = eol < end ? eol + 1 : end;
+    return eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+}
+
+// Internal function to set the text of a cue to a part of the file,
+// trimming trailing line breaks
+static void set_cue_text(SubCue *cue, const char *start, const char *end)
+{
+    while (end > start && (end[-1] == '\n' || end[-1] == '\r'))
+        end--;
+    cue->text = start;
+    cue->len = end - start;
+    cue->in_place = 1;
+}
+
+// Internal function to make room for unescaped text
+static char *reserve_buf(CueReader *r, int len)
+{
+    if (len > r->buf_cap)
+    {
+        r->buf_cap = len > 2 * r->buf_cap ? len : 2 * r->buf_cap;
+        r->buf = (char *)realloc(r->buf, r->buf_cap);
+    }
+    return r->buf;
+}
+
+// Internal function to read a SRT cue
+// Text runs until the index line before the next timing line
+static int srt_next(CueReader *r, SubCue *cue)
+{
+    const char *p = r->p;
+    const char *end = r->end;
+    const char *next;
+
+    for (;; p = next)
+    {
+        if (p >= end)
+        {
+            r->p = end;
+            return 0;
+        }
+        const char *line_end = next_line(p, end, &next);
+        if (scan_timing_line(p, line_end, &cue->start_ts, &cue->end_ts))
+            break;
+    }
+
+    const char *text = next;
+    // Start of the previous line if it is a sub index
+    const char *index_line = NULL;
+    for (p = text; p < end; p = next)
+    {
+        const char *line_end = next_line(p, end, &next);
+        double start_ts, end_ts;
+        if (scan_timing_line(p, line_end, &start_ts, &end_ts))
+            break;
+        index_line = is_index_line(p, line_end) ? p : NULL;
+    }
+
+    // The next call starts at the timing line
+    r->p = p;
+    set_cue_text(cue, text, p < end && index_line ? index_line : p);
+    return 1;
+}
+
+// Internal function to parse a WebVTT timestamp, whose hours are optional
+// Returns pointer past the timestamp, or NULL if there is none
+static const char *scan_vtt_timestamp(const char *p, const char *end, double *ts)
+{
+    const char *ret = scan_timestamp(p, end, ts);
+    if (ret != NULL)
+        return ret;
+
+    long parts[2] = {0};
+    for (int i = 0; i < 2; i++)
+    {
+        if (p >= end || !isdigit((unsigned char)*p))
+            return NULL;
+        while (p < end && isdigit((unsigned char)*p))
+            parts[i] = parts[i] * 10 + (*p++ - '0');
+
+        if (i == 0)
+        {
+            if (p >= end || *p != ':')
+                return NULL;
+            p++;
+        }
+    }
+
+    double frac = 0;
+    if (p < end && *p == '.')
+    {
+        p++;
+        double unit = 0.1;
+        if (p >= end || !isdigit((unsigned char)*p))
+            return NULL;
+        while (p < end && isdigit((unsigned char)*p))
+        {
+            frac += (*p++ - '0') * unit;
+            unit /= 10;
+        }
+    }
+
+    *ts = parts[0] * 60 + parts[1] + frac;
+    return p;
+}
+
+// Internal function to parse a "start --> end" WebVTT timing line
+// Cue settings after the end are ignored
+// Return 1 if the line is a timing line
+static int scan_vtt_timing_line(const char *line, const char *end, double *start_ts, double *end_ts)
+{
+    line = scan_vtt_timestamp(line, end, start_ts);
+    if (line == NULL)
+        return 0;
+    while (line < end && (*line == ' ' || *line == '\t'))
+        line++;
+    if (end - line < 3 || memcmp(line, "-->", 3) != 0)
+        return 0;
+    line += 3;
+    while (line < end && (*line == ' ' || *line == '\t'))
+        line++;
+    return scan_vtt_timestamp(line, end, end_ts) != NULL;
+}
+
+// Internal function to unescape the entities of WebVTT text
+// Unescaped text is never longer
+static void vtt_unescape(CueReader *r, SubCue *cue)
+{
+    char *out = reserve_buf(r, cue->len);
+    const char *p = cue->text;
+    const char *end = cue->text + cue->len;
+    int len = 0;
+
+    while (p < end)
+    {
+        const char *amp = memchr(p, '&', end - p);
+        if (amp == NULL)
+            amp = end;
+        memcpy(out + len, p, amp - p);
+        len += amp - p;
+        p = amp;
+        if (p == end)
+            break;
+
+        int n = sizeof(vtt_entities) / sizeof(vtt_entities[0]);
+        int k = 0;
+        for (; k < n; k++)
+        {
+            size_t name_len = strlen(vtt_entities[k].name);
+            if ((size_t)(end - p) >= name_len && memcmp(p, vtt_entities[k].name, name_len) == 0)
+            {
+                size_t text_len = strlen(vtt_entities[k].text);
+                memcpy(out + len, vtt_entities[k].text, text_len);
+                len += text_len;
+                p += name_len;
+                break;
+            }
+        }
+        if (k == n)
+            out[len++] = *p++;
+    }
+
+    cue->text = out;
+    cue->len = len;
+    cue->in_place = 0;
+}
+
+// Internal function to read a WebVTT cue
+// Text runs until a blank line, identifiers, notes and styles are skipped
+static int vtt_next(CueReader *r, SubCue *cue)
+{
+    const char *p = r->p;
+    const char *end = r->end;
+    const char *next;
+
+    for (;; p = next)
+    {
+        if (p >= end)
+        {
+            r->p = end;
+            return 0;
+        }
+        const char *line_end = next_line(p, end, &next);
+        if (scan_vtt_timing_line(p, line_end, &cue->start_ts, &cue->end_ts))
+            break;
+    }
+
+    const char *text = next;
+    for (p = text; p < end; p = next)
+    {
+        if (next_line(p, end, &next) == p)
+            break;
+    }
+
+    r->p = p;
+    set_cue_text(cue, text, p);
+    if (memchr(cue->text, '&', cue->len) != NULL)
+        vtt_unescape(r, cue);
+    return 1;
+}
+
+// Internal function to check if a line starts with a prefix
+static inline int starts_with(const char *line, const char *end, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    return (size_t)(end - line) >= len && memcmp(line, prefix, len) == 0;
+}
+
+// Internal function to find the Start and End fields in the format line of ASS events
+static void parse_ass_format(CueReader *r, const char *p, const char *end)
+{
+    int field = 0;
+    while (p <= end)
+    {
+        const char *comma = memchr(p, ',', end - p);
+        if (comma == NULL)
+            comma = end;
+
+        const char *name = p;
+        const char *name_end = comma;
+        while (name < name_end && isspace((unsigned char)*name))
+            name++;
+        while (name_end > name && isspace((unsigned char)name_end[-1]))
+            name_end--;
+
+        if (name_end - name == 5 && memcmp(name, "Start", 5) == 0)
+            r->ass_start = field;
+        else if (name_end - name == 3 && memcmp(name, "End", 3) == 0)
+            r->ass_end = field;
+
+        field++;
+        p = comma + 1;
+    }
+    r->ass_fields = field;
+}
+
+// Internal function to convert ASS override tags to the tags of SRT,
+// keeping italic, bold, underline and strikeout
+// Returns the length written, with out having room for twice the block
+static int ass_override(const char *p, const char *end, char *out)
+{
+    int len = 0;
+    while (p < end)
+    {
+        p = memchr(p, '\\', end - p);
+        if (p == NULL)
+            break;
+        p++;
+
+        // Tags like \bord and \shad only share the first letter
+        if (end - p < 2 || strchr("ibus", *p) == NULL || !isdigit((unsigned char)p[1]))
+            continue;
+
+        char tag = *p;
+        int on = 0;
+        for (p++; p < end && isdigit((unsigned char)*p); p++)
+            on = on || *p != '0';
+
+        out[len++] = '<';
+        if (!on)
+            out[len++] = '/';
+        out[len++] = tag;
+        out[len++] = '>';
+    }
+    return len;
+}
+
+// Internal function to convert the text of an ASS event
+// Line breaks become newlines, and override blocks become tags
+static void ass_unescape(CueReader *r, SubCue *cue)
+{
+    char *out = reserve_buf(r, 2 * cue->len);
+    const char *p = cue->text;
+    const char *end = cue->text + cue->len;
+    int len = 0;
+
+    while (p < end)
+    {
+        if (*p == '\\' && p + 1 < end && (p[1] == 'N' || p[1] == 'n'))
+        {
+            out[len++] = '\n';
+            p += 2;
+        }
+        else if (*p == '\\' && p + 1 < end && p[1] == 'h')
+        {
+            memcpy(out + len, "\xC2\xA0", 2);
+            len += 2;
+            p += 2;
+        }
+        else if (*p == '{' && memchr(p, '}', end - p) != NULL)
+        {
+            const char *close = memchr(p, '}', end - p);
+            len += ass_override(p + 1, close, out + len);
+            p = close + 1;
+        }
+        else
+        {
+            out[len++] = *p++;
+        }
+    }
+
+    cue->text = out;
+    cue->len = len;
+    cue->in_place = 0;
+}
+
+// Internal function to parse the fields of an ASS dialogue line
+// Return 1 if the line has a valid start and end
+static int parse_ass_dialogue(CueReader *r, const char *p, const char *end, SubCue *cue)
+{
+    int have_start = 0, have_end = 0;
+
+    // Text is the last field, and may have commas
+    for (int field = 0; field < r->ass_fields - 1; field++)
+    {
+        const char *comma = memchr(p, ',', end - p);
+        if (comma == NULL)
+            return 0;
+
+        while (p < comma && *p == ' ')
+            p++;
+        if (field == r->ass_start)
+            have_start = scan_timestamp(p, comma, &cue->start_ts) != NULL;
+        else if (field == r->ass_end)
+            have_end = scan_timestamp(p, comma, &cue->end_ts) != NULL;
+
+        p = comma + 1;
+    }
+
+    if (!have_start || !have_end)
+        return 0;
+
+    set_cue_text(cue, p, end);
+    if (memchr(cue->text, '\\', cue->len) != NULL || memchr(cue->text, '{', cue->len) != NULL)
+        ass_unescape(r, cue);
+    return 1;
+}
+
+// Internal function to read an ASS event
+// Only dialogue lines of the events section are cues, styles are dropped
+static int ass_next(CueReader *r, SubCue *cue)
+{
+    const char *p = r->p;
+    const char *end = r->end;
+    const char *next;
+
+    for (; p < end; p = next)
+    {
+        const char *line_end = next_line(p, end, &next);
+        if (*p == '[')
+        {
+            r->ass_events = starts_with(p, line_end, "[Events]");
+        }
+        else if (!r->ass_events)
+        {
+            continue;
+        }
+        else if (starts_with(p, line_end, "Format:"))
+        {
+            parse_ass_format(r, p + 7, line_end);
+        }
+        else if (starts_with(p, line_end, "Dialogue:") && parse_ass_dialogue(r, p + 9, line_end, cue))
+        {
+            r->p = next;
+            return 1;
+        }
+    }
+
+    r->p = end;
+    return 0;
+}
+
+// Read the next cue of a file, in file order
+// Return 0 at the end
+int cue_reader_next(CueReader *r, SubCue *cue)
+{
+    switch (r->format)
+    {
+    case CODEC_VTT:
+        return vtt_next(r, cue);
+    case CODEC_ASS:
+        return ass_next(r, cue);
+    default:
+        return srt_next(r, cue);
+    }
+}
+
+// Write the start of a subtitle file
+// Return 0 on success
+int codec_write_header(FILE *fp, int format)
+{
+    switch (format)
+    {
+    case CODEC_VTT:
+        return fputs(VTT_HEADER, fp) < 0;
+    case CODEC_ASS:
+        return fputs(ASS_HEADER, fp) < 0;
+    default:
+        return 0;
+    }
+}
+
+// Internal function to write text without carriage returns or blank lines,
+// which would end a WebVTT cue early, and with ampersands escaped
+static int write_vtt_text(FILE *fp, const char *text, int len)
+{
+    int err = 0;
+    int line_empty = 1;
+    const char *run = text;
+    const char *end = text + len;
+
+    for (const char *p = text; p < end; p++)
+    {
+        const char *rep;
+        if (*p == '&')
+            rep = "&amp;";
+        else if (*p == '\r' || (*p == '\n' && line_empty))
+            rep = "";
+        else
+        {
+            line_empty = *p == '\n';
+            continue;
+        }
+
+        err = err || fwrite(run, 1, p - run, fp) != (size_t)(p - run) || fputs(rep, fp) < 0;
+        run = p + 1;
+        if (*p == '&')
+            line_empty = 0;
+    }
+    return err || fwrite(run, 1, end - run, fp) != (size_t)(end - run);
+}
+
+// Internal function to write text with line breaks and tags converted for ASS
+// Tags other than italic, bold, underline and strikeout are dropped
+static int write_ass_text(FILE *fp, const char *text, int len)
+{
+    int err = 0;
+    const char *run = text;
+    const char *end = text + len;
+
+    for (const char *p = text; p < end; p++)
+    {
+        char rep[8] = "";
+        const char *skip_to = p + 1;
+
+        if (*p == '\n')
+        {
+            strcpy(rep, "\\N");
+        }
+        else if (*p == '<')
+        {
+            const char *name = p + 1 < end && p[1] == '/' ? p + 2 : p + 1;
+            const char *eol = memchr(p, '\n', end - p);
+            const char *close = memchr(p, '>', (eol ? eol : end) - p);
+            if (close == NULL || name >= close || !isalpha((unsigned char)*name))
+                continue;
+
+            char tag = tolower((unsigned char)*name);
+            if (close - name == 1 && strchr("ibus", tag) != NULL)
+                snprintf(rep, sizeof(rep), "{\\%c%d}", tag, name == p + 1);
+            skip_to = close + 1;
+        }
+        else if (*p != '\r')
+        {
+            continue;
+        }
+
+        err = err || fwrite(run, 1, p - run, fp) != (size_t)(p - run) || fputs(rep, fp) < 0;
+        run = skip_to;
+        p = skip_to - 1;
+    }
+    return err || fwrite(run, 1, end - run, fp) != (size_t)(end - run);
+}
+
+// Write a cue numbered idx from 1
+// Return 0 on success
+int codec_write_cue(FILE *fp, int format, int idx, double start_ts, double end_ts, const char *text, int len)
+{
+    char line[96];
+    int n = 0;
+
+    switch (format)
+    {
+    case CODEC_VTT:
+        n += format_timestamp(start_ts, line + n, 2, '.', 3);
+        memcpy(line + n, " --> ", 5);
+        n += 5;
+        n += format_timestamp(end_ts, line + n, 2, '.', 3);
+        line[n++] = '\n';
+        return fwrite(line, 1, n, fp) != (size_t)n ||
+               write_vtt_text(fp, text, len) != 0 ||
+               fputs("\n\n", fp) < 0;
+
+    case CODEC_ASS:
+        memcpy(line, "Dialogue: 0,", 12);
+        n += 12;
+        n += format_timestamp(start_ts, line + n, 1, '.', 2);
+        line[n++] = ',';
+        n += format_timestamp(end_ts, line + n, 1, '.', 2);
+        memcpy(line + n, ",Default,,0,0,0,,", 17);
+        n += 17;
+        return fwrite(line, 1, n, fp) != (size_t)n ||
+               write_ass_text(fp, text, len) != 0 ||
+               fputc('\n', fp) == EOF;
+
+    default:
+        n += snprintf(line, sizeof(line), "%d\n", idx);
+        n += format_timestamp(start_ts, line + n, 2, ',', 3);
+        memcpy(line + n, " --> ", 5);
+        n += 5;
+        n += format_timestamp(end_ts, line + n, 2, ',', 3);
+        line[n++] = '\n';
+        return fwrite(line, 1, n, fp) != (size_t)n ||
+               write_without_cr(fp, text, len) != 0 ||
+               fputs("\n\n", fp) < 0;
+    }
+}
+
+// Finish a subtitle file after num_cues were written
+// Return 0 on success
+int codec_write_end(FILE *fp, int format, int num_cues)
+{
+    // Write dummy sub for mpv to parse
+    if (format == CODEC_SRT && num_cues == 0)
+        return fputs(SUB_PLACEHOLDER, fp) < 0;
+    return 0;
+}
+
+// Convert a subtitle file to the format of the output filename, cue by cue,
+// and print the throughput for benchmarking the codecs
+// Return 0 on success
+int convert_sub(const char *in_fname, const char *out_fname)
+{
+    MappedFile map;
+    if (map_file(in_fname, &map) != 0)
+    {
+        fprintf(stderr, "failed to read %s\n", in_fname);
+        return 1;
+    }
+
+    int encoding = decode_file(&map);
+    if (encoding > ENCODING_UTF8)
+        printf("Converted from %s\n", encoding_name(encoding));
+
+    char tmp_fname[512];
+    FILE *fp = open_file_atomic(out_fname, tmp_fname, sizeof(tmp_fname));
+    if (fp == NULL)
+    {
+        fprintf(stderr, "failed to write %s\n", out_fname);
+        unmap_file(&map);
+        return 1;
+    }
+
+    int in_format = codec_from_filename(in_fname);
+    int out_format = codec_from_filename(out_fname);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    CueReader reader;
+    cue_reader_init(&reader, in_format, map.data, map.size);
+    int err = codec_write_header(fp, out_format);
+
+    int num_cues = 0;
+    SubCue cue;
+    while (!err && cue_reader_next(&reader, &cue))
+        err = codec_write_cue(fp, out_format, ++num_cues, cue.start_ts, cue.end_ts, cue.text, cue.len);
+    err = err || codec_write_end(fp, out_format, num_cues) != 0 || fflush(fp) != 0;
+
+    Uint64 ticks = SDL_GetPerformanceCounter() - start;
+    cue_reader_free(&reader);
+
+    if (commit_file_atomic(fp, err, tmp_fname, out_fname) != 0)
+    {
+        fprintf(stderr, "failed to write %s\n", out_fname);
+        unmap_file(&map);
+        return 1;
+    }
+
+    double secs = (double)ticks / SDL_GetPerformanceFrequency();
+    if (secs <= 0)
+        secs = 1e-9;
+    double mb = map.size / (1024.0 * 1024.0);
+    printf("%d subs converted from %s to %s\n", num_cues, codec_name(in_format), codec_name(out_format));
+    printf("%.1f MB in %.1f ms, %.1f MB/s, %.0f subs/s\n", mb, secs * 1000, mb / secs, num_cues / secs);
+
+    unmap_file(&map);
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 #include <slre.h>
 
@@ -8,12 +9,50 @@
 #include <utils.h>
 #include <main.h>
 #include <subs.h>
+#include <session.h>
+#include <journal.h>
+#include <save.h>
+#include <undo.h>
+#include <keymap.h>
+#include <subst.h>
+#include <preview.h>
+#include <reftrack.h>
+#include <trace.h>
+#include <align.h>
+#include <transmem.h>
+#include <codec.h>
 
 // Global command buffer
 static char cmd_buf[128];
 
 static int curr_mode = MODE_NORMAL;
 
+// Keys typed so far in NORMAL mode
+static KeyState key_state = {.node = KEYMAP_NORMAL, .count = -1};
+
+// Subs copied by the yank operator, with text owned by the register
+static SubRecord *yank_reg = NULL;
+static int yank_len = 0;
+
+// Last change made in NORMAL mode, repeated by .
+static KeyAction last_change = {.action = ACTION_NONE};
+
+// Ids of the subs marked with :mark, for addresses like 'a
+static unsigned int marks[26];
+static int marks_set = 0;
+
+// Last pattern searched with / or ?, repeated by n and N
+static char search_pattern[sizeof(cmd_buf)];
+static int search_backward = 0;
+
+// Suggestions of the translation memory for the focused sub
+static TmSuggestion suggestions[TM_MAX_SUGGESTIONS];
+static int num_suggestions = 0;
+// Suggestion inserted by Tab
+static int suggestion_sel = 0;
+// Id of the sub suggestions were requested for, or -1
+static long suggest_id = -1;
+
 static void set_title(const char *text)
 {
     char title[256] = {0};
@@ -33,7 +72,94 @@ static void set_title(const char *text)
     set_window_title(title);
 }
 
-static void set_mode(int mode)
+// Internal function to show the suggestions on the OSD in INSERT mode
+// with the one inserted by Tab marked
+static void show_suggestions()
+{
+    if (curr_mode != MODE_INSERT || num_suggestions == 0)
+        return;
+
+    char msg[1024];
+    size_t pos = 0;
+    for (int i = 0; i < num_suggestions && pos < sizeof(msg) - 1; i++)
+    {
+        pos += snprintf(msg + pos, sizeof(msg) - pos, "%s%s %d%% ", i ? "\n" : "", i == suggestion_sel ? ">" : " ",
+                        suggestions[i].score);
+        // snprintf returns the untruncated length
+        if (pos > sizeof(msg) - 1)
+            pos = sizeof(msg) - 1;
+
+        // Line breaks of a suggestion are shown on one line
+        for (int j = 0; j < suggestions[i].len && pos < sizeof(msg) - 4; j++)
+        {
+            if (suggestions[i].text[j] != '\n')
+            {
+                msg[pos++] = suggestions[i].text[j];
+                continue;
+            }
+            memcpy(msg + pos, " / ", 3);
+            pos += 3;
+        }
+        msg[pos] = '\0';
+    }
+    show_text(msg, 3000);
+}
+
+// Internal function to look up suggestions for the sub at idx
+// The cue of the reference track over the sub is matched if there is one,
+// otherwise the previous sub is, to suggest the lines that came after it
+static void request_suggestions(int idx)
+{
+    const SubRecord *rec = store_get(store_working(), idx);
+    int cue_idx;
+    const RefCue *cue = ref_active() >= 0 ? ref_find_overlap(ref_active(), rec->start_ts, rec->end_ts, &cue_idx) : NULL;
+    if (cue != NULL)
+    {
+        tm_request(cue->text, cue->len, 0);
+    }
+    else if (idx > 0)
+    {
+        const SubRecord *prev = store_get(store_working(), idx - 1);
+        tm_request(prev->text, prev->len, 1);
+    }
+}
+
+// Internal function to request suggestions when another sub is focused,
+// and take them once found
+// They are shown as they arrive in INSERT mode, or right away with show set
+static void update_suggestions(int show)
+{
+    if (!tm_loaded())
+        return;
+
+    int idx = get_focused_idx();
+    long id = idx >= 0 ? (long)store_get(store_working(), idx)->id : -1;
+    if (id != suggest_id)
+    {
+        suggest_id = id;
+        num_suggestions = 0;
+        if (idx >= 0)
+            request_suggestions(idx);
+    }
+
+    int n = tm_results(suggestions);
+    if (n >= 0)
+    {
+        num_suggestions = n;
+        suggestion_sel = 0;
+        show = 1;
+    }
+
+    if (show)
+        show_suggestions();
+}
+
+int get_mode()
+{
+    return curr_mode;
+}
+
+void set_mode(int mode)
 {
     curr_mode = mode;
     switch (curr_mode)
@@ -41,9 +167,12 @@ static void set_mode(int mode)
     case MODE_NORMAL:
         // Exit insert mode
         unset_cursor();
+        undo_seal();
         export_reload_sub();
         break;
     case MODE_INSERT:
+        // Suggestions found in NORMAL mode are shown once typing
+        update_suggestions(1);
         break;
     }
     set_title("");
@@ -52,243 +181,975 @@ static void set_mode(int mode)
 static inline void clear_cmd_buf()
 {
     cmd_buf[0] = 0;
+    keymap_reset(&key_state);
 }
 
-// Parse commands starting with :
-static void parse_ex(const char *cmd_raw)
+// Internal function to check if a paragraph starts after the sub at idx
+static int paragraph_break(const StoreNode *root, int idx)
+{
+    if (idx + 1 >= store_count(root))
+        return 1;
+    return store_get(root, idx + 1)->start_ts - store_get(root, idx)->end_ts >= PARAGRAPH_GAP;
+}
+
+// Internal function to find the first sub of the paragraph holding idx
+static int paragraph_start(const StoreNode *root, int idx)
+{
+    while (idx > 0 && !paragraph_break(root, idx - 1))
+        idx--;
+    return idx;
+}
+
+// Internal function to find the last sub of the paragraph holding idx
+static int paragraph_end(const StoreNode *root, int idx)
 {
-    struct slre_cap caps[1];
-    if (slre_match("^:([a-zA-Z_0-9]*)$", cmd_raw, strlen(cmd_raw), caps, 1) > 0)
+    while (!paragraph_break(root, idx))
+        idx++;
+    return idx;
+}
+
+// Internal function to resolve the subs covered by a motion from the focused sub
+// Return 0 if the range holds any subs
+static int resolve_range(const KeyAction *action, int *first, int *last)
+{
+    const StoreNode *root = store_working();
+    int n = store_count(root);
+    int focused = get_focused_idx();
+    if (focused < 0 || n == 0)
+        return 1;
+
+    long count = action->count >= 0 ? action->count : 1;
+    if (count > n)
+        count = n;
+
+    switch (action->motion)
     {
-        const char *cmd = caps[0].ptr;
-        // int cmd_len = caps[0].len;
+    case ACTION_MOTION_LINES:
+    case ACTION_MOTION_NEXT:
+        *first = focused;
+        *last = focused + count - 1;
+        break;
 
-        if (strcmp(cmd, "wq") == 0)
-        {
-            export_sub(export_filename, 0);
-            exit(0);
-        }
-        else if (strcmp(cmd, "w") == 0)
+    case ACTION_MOTION_BACK:
+        *first = focused - count;
+        *last = focused - 1;
+        break;
+
+    case ACTION_MOTION_PARA_NEXT:
+        *first = focused;
+        *last = paragraph_end(root, focused);
+        for (long i = 1; i < count && *last + 1 < n; i++)
+            *last = paragraph_end(root, *last + 1);
+        break;
+
+    case ACTION_MOTION_PARA_PREV:
+        // Up to the sub before the focused one
+        *first = focused;
+        for (long i = 0; i < count && *first > 0; i++)
+            *first = paragraph_start(root, *first - 1);
+        *last = focused - 1;
+        break;
+
+    case ACTION_MOTION_FIRST:
+        *first = 0;
+        *last = focused;
+        break;
+
+    case ACTION_MOTION_LAST:
+        *first = focused;
+        *last = n - 1;
+        break;
+
+    case ACTION_OBJECT_PARA:
+        *first = paragraph_start(root, focused);
+        *last = paragraph_end(root, focused);
+        for (long i = 1; i < count && *last + 1 < n; i++)
+            *last = paragraph_end(root, *last + 1);
+        break;
+
+    default:
+        return 1;
+    }
+
+    if (*first < 0)
+        *first = 0;
+    if (*last >= n)
+        *last = n - 1;
+    return *first > *last;
+}
+
+// Internal function to copy subs into the yank register
+// Copies the set of indices, or the range from first if there is no set
+static void yank_subs(const int *set, int first, int n)
+{
+    for (int i = 0; i < yank_len; i++)
+        free((char *)yank_reg[i].text);
+
+    const StoreNode *root = store_working();
+    yank_len = n;
+    yank_reg = (SubRecord *)realloc(yank_reg, yank_len * sizeof(SubRecord));
+
+    StoreIter it;
+    store_iter_init(&it, root, first);
+    for (int i = 0; i < yank_len; i++)
+    {
+        SubRecord rec = set ? *store_get(root, set[i]) : *store_iter_next(&it);
+        char *text = (char *)malloc(rec.len + 1);
+        memcpy(text, rec.text, rec.len);
+        text[rec.len] = '\0';
+        rec.text = text;
+        rec.owned = 1;
+        yank_reg[i] = rec;
+    }
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%d subs yanked", yank_len);
+    show_text(msg, 500);
+}
+
+// Internal function to apply an operator to the subs covered by its motion
+// The whole range is changed at once and reloaded a single time
+static void apply_operator(const KeyAction *action)
+{
+    int first, last;
+    if (resolve_range(action, &first, &last) != 0)
+    {
+        show_text("No subs in range!", 300);
+        return;
+    }
+
+    switch (action->action)
+    {
+    case ACTION_OP_DELETE:
+        delete_subs(first, last - first + 1);
+        export_reload_sub();
+        break;
+
+    case ACTION_OP_YANK:
+        yank_subs(NULL, first, last - first + 1);
+        break;
+
+    case ACTION_OP_SHIFT:
+        if (shift_subs(first, last - first + 1, action->unit) == 0)
+            export_reload_sub();
+        break;
+    }
+}
+
+// Internal function to find the index of a sub by id, -1 if none
+static int find_sub_idx(unsigned int id)
+{
+    StoreIter it;
+    store_iter_init(&it, store_working(), 0);
+
+    const SubRecord *rec;
+    for (int idx = 0; (rec = store_iter_next(&it)) != NULL; idx++)
+    {
+        if (rec->id == id)
+            return idx;
+    }
+    return -1;
+}
+
+// Internal function to parse an Ex address into a sub index
+// Returns a pointer past the address, p itself if there is none,
+// or NULL if the address is invalid
+static const char *parse_address(const char *p, long *idx)
+{
+    if (isdigit((unsigned char)*p))
+    {
+        // Subs start from 1 to the user
+        *idx = strtol(p, (char **)&p, 10) - 1;
+    }
+    else if (*p == '.')
+    {
+        *idx = get_focused_idx();
+        p++;
+    }
+    else if (*p == '$')
+    {
+        *idx = store_count(store_working()) - 1;
+        p++;
+    }
+    else if (*p == '\'')
+    {
+        int mark = p[1] - 'a';
+        if (mark < 0 || mark >= 26 || !(marks_set & (1 << mark)) || (*idx = find_sub_idx(marks[mark])) < 0)
         {
-            export_sub(export_filename, 0);
+            show_text("Mark not set!", 300);
+            return NULL;
         }
-        else if (strcmp(cmd, "q") == 0)
+        p += 2;
+    }
+    else if (*p == '+' || *p == '-')
+    {
+        *idx = get_focused_idx();
+    }
+    else
+    {
+        return p;
+    }
+
+    // Offsets, a sign alone counts 1
+    while (*p == '+' || *p == '-')
+    {
+        long sign = *p++ == '+' ? 1 : -1;
+        long offset = isdigit((unsigned char)*p) ? strtol(p, (char **)&p, 10) : 1;
+        *idx += sign * offset;
+    }
+    return p;
+}
+
+// Internal function to parse an optional Ex range of sub indices
+// Sets given to the number of addresses, the range is left unset if there are none
+// Returns a pointer past the range, or NULL if it is invalid
+static const char *parse_range(const char *p, long *first, long *last, int *given)
+{
+    *given = 0;
+
+    if (*p == '%')
+    {
+        *first = 0;
+        *last = store_count(store_working()) - 1;
+        *given = 2;
+        return p + 1;
+    }
+
+    const char *end = parse_address(p, first);
+    if (end == NULL || end == p)
+        return end;
+    *last = *first;
+    *given = 1;
+
+    if (*end == ',')
+    {
+        p = end + 1;
+        end = parse_address(p, last);
+        if (end == NULL || end == p)
+            return NULL;
+        *given = 2;
+    }
+    return end;
+}
+
+// Internal function to check if an Ex command name abbreviates a command
+static int is_cmd(const char *name, const char *cmd, size_t min_len)
+{
+    size_t len = strlen(name);
+    return len >= min_len && len <= strlen(cmd) && strncmp(name, cmd, len) == 0;
+}
+
+// Internal function to read the name of an Ex command
+// Returns a pointer to its arguments
+static const char *parse_cmd_name(const char *p, char *name, size_t sz)
+{
+    size_t len = 0;
+    while (isalpha((unsigned char)*p) && len < sz - 1)
+        name[len++] = *p++;
+    name[len] = '\0';
+
+    while (*p == ' ')
+        p++;
+    return p;
+}
+
+// Internal function to run an Ex command over many subs as a single change
+// Runs on the set of indices, or on the range from first if there is no set
+static void run_range_cmd(const char *name, const char *args, const int *set, int first, int n)
+{
+    char msg[96];
+
+    if (is_cmd(name, "delete", 1))
+    {
+        n = set ? delete_sub_set(set, n) : delete_subs(first, n);
+        snprintf(msg, sizeof(msg), "%d subs deleted", n);
+        show_text(msg, 500);
+        export_reload_sub();
+    }
+    else if (is_cmd(name, "yank", 1))
+    {
+        yank_subs(set, first, n);
+    }
+    else if (is_cmd(name, "substitute", 1))
+    {
+        long matches;
+        int changed;
+        Uint64 start = SDL_GetPerformanceCounter();
+        if (substitute(set, first, n, args, &matches, &changed) != 0)
+            return;
+
+        double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+        snprintf(msg, sizeof(msg), "%ld substitutions on %d subs in %.1f ms", matches, changed, ms);
+        show_text(msg, 1000);
+        export_reload_sub();
+    }
+    else if (is_cmd(name, "shift", 5))
+    {
+        char *end;
+        double delta = strtod(args, &end);
+        if (end == args)
         {
-            exit(0);
+            show_text("Shift needs seconds!", 300);
+            return;
         }
+        if ((set ? shift_sub_set(set, n, delta) : shift_subs(first, n, delta)) == 0)
+            export_reload_sub();
+    }
+    else
+    {
+        show_text("Unknown command!", 300);
+    }
+}
+
+// Internal function to run an Ex command on the subs in a range whose text
+// matches a pattern, or does not match if inverted
+static void run_global(const char *args, int invert, int first, int last)
+{
+    // Pattern up to the closing delimiter, which may be escaped inside it
+    char delim = *args;
+    if (delim == '\0' || isalnum((unsigned char)delim) || delim == '\\')
+    {
+        show_text("Invalid pattern!", 300);
+        return;
+    }
+
+    char pattern[256];
+    size_t len = 0;
+    const char *p = args + 1;
+    while (*p && *p != delim && len < sizeof(pattern) - 1)
+    {
+        if (*p == '\\' && p[1] == delim)
+            p++;
+        pattern[len++] = *p++;
+    }
+    pattern[len] = '\0';
+    if (*p == delim)
+        p++;
+
+    const struct slre_prog *re = slre_cached(pattern, NULL);
+    if (re == NULL)
+    {
+        show_text("Invalid pattern!", 300);
+        return;
+    }
+
+    char name[16];
+    args = parse_cmd_name(p, name, sizeof(name));
+
+    // Collect the matching subs first, so the command is a single change
+    int *set = (int *)malloc((last - first + 1) * sizeof(int));
+    int n = 0;
+
+    StoreIter it;
+    store_iter_init(&it, store_working(), first);
+    for (int i = first; i <= last; i++)
+    {
+        const SubRecord *rec = store_iter_next(&it);
+        if ((slre_exec(re, rec->text, rec->len, NULL, 0) >= 0) != invert)
+            set[n++] = i;
+    }
+
+    if (n == 0)
+        show_text("Pattern not found!", 300);
+    else
+        run_range_cmd(name, args, set, 0, n);
+
+    free(set);
+}
+
+// Internal function to show the cue of the active reference track
+// that overlaps the focused sub the most
+static void show_reference_cue()
+{
+    if (ref_active() < 0)
+    {
+        show_text("No reference track!", 300);
+        return;
     }
+
+    int idx = get_focused_idx();
+    if (idx < 0)
+    {
+        show_text("No sub focused!", 100);
+        return;
+    }
+
+    const SubRecord *rec = store_get(store_working(), idx);
+    int cue_idx;
+    const RefCue *cue = ref_find_overlap(ref_active(), rec->start_ts, rec->end_ts, &cue_idx);
+    if (cue == NULL)
+    {
+        show_text("No reference cue here!", 300);
+        return;
+    }
+
+    // Cues start from 1 to the user
+    char msg[512];
+    snprintf(msg, sizeof(msg), "#%d: %.*s", cue_idx + 1, cue->len, cue->text);
+    show_text(msg, 3000);
 }
 
-// Parse a NORMAL mode command
-// Returns 0 if command was parsed successfully
-// Returns 1 if expecting more commands
-static int parse_normal_cmd(const char *cmd)
+// Internal function to run :reference
+// Loads a reference track from a file, switches to a loaded one by number,
+// or shows the reference cue for the focused sub without arguments
+static void run_reference(const char *args)
 {
-    struct slre_cap caps[2];
-    if (slre_match("^([0-9]*)([a-zA-Z]*)$", cmd, strlen(cmd), caps, 2) > 0)
+    if (args[0] == '\0')
     {
-        long count = -1;
-        const char *action = caps[1].ptr;
-        int action_len = caps[1].len;
+        show_reference_cue();
+        return;
+    }
 
-        if (action[0] == '\0')
+    char *end;
+    long num = strtol(args, &end, 10);
+    if (*end == '\0')
+    {
+        // References start from 1 to the user
+        if (num < 1 || num > ref_count())
         {
-            // Empty action, wait for more
-            return 1;
+            show_text("Invalid reference!", 300);
+            return;
         }
+        ref_set_active(num - 1);
+        if (ref_track_id(num - 1) >= 0)
+            show_reference(ref_track_id(num - 1));
+        return;
+    }
+
+    int ref = ref_load(args);
+    if (ref < 0)
+    {
+        show_text("Failed to load reference!", 1000);
+        return;
+    }
+    sub_add_reference(args, ref);
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Reference %d loaded", ref + 1);
+    show_text(msg, 500);
+}
 
-        if (caps[0].len > 0)
+// Internal function to run :trace
+// Starts tracing to a file, or to the default one without arguments,
+// and writes the trace out when run again
+static void run_trace(const char *args)
+{
+    char msg[600];
+    if (!trace_enabled)
+    {
+        if (trace_start(args[0] ? args : TRACE_FILENAME) != 0)
         {
-            // Get count value
-            count = strtol(caps[0].ptr, NULL, 10);
+            show_text("Failed to start tracing!", 1000);
+            return;
         }
+        snprintf(msg, sizeof(msg), "Tracing to %s", trace_filename());
+        show_text(msg, 500);
+    }
+    else if (trace_stop() != 0)
+    {
+        show_text("Failed to write trace!", 1000);
+    }
+    else
+    {
+        snprintf(msg, sizeof(msg), "Trace written to %s", trace_filename());
+        show_text(msg, 1000);
+    }
+}
+
+// Internal function to run :align
+// Retimes every sub to a reference file, with the confidence of each sub
+// written to a report next to the subs
+static void run_align(const char *args)
+{
+    if (args[0] == '\0')
+    {
+        show_text("Align needs a reference!", 300);
+        return;
+    }
+
+    char report_fname[512];
+    align_report_filename(export_filename, report_fname, sizeof(report_fname));
+
+    int low;
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (align_subs(args, report_fname, &low) != 0)
+        return;
+    double ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+    char msg[600];
+    snprintf(msg, sizeof(msg), "%d subs aligned in %.1f ms, %d doubtful, see %s",
+             store_count(store_working()), ms, low, report_fname);
+    show_text(msg, 2000);
+    export_reload_sub();
+}
+
+// Internal function to run :tm
+// Opens a translation memory built with --build-tm, or shows the
+// suggestions for the focused sub again without arguments
+static void run_tm(const char *args)
+{
+    if (args[0] == '\0')
+    {
+        if (!tm_loaded())
+            show_text("No translation memory!", 300);
+        else if (num_suggestions == 0)
+            show_text("No suggestions!", 300);
+        else
+            show_suggestions();
+        return;
+    }
+
+    // Suggestions point into the memory being replaced
+    num_suggestions = 0;
+    suggest_id = -1;
+    if (tm_open(args) != 0)
+    {
+        show_text("Failed to load translation memory!", 1000);
+        return;
+    }
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Translation memory of %u lines loaded", tm_num_lines());
+    show_text(msg, 500);
+}
+
+// Internal function to parse the ! of :w! and :wq!, and pick the file to write
+// Returns NULL if a plain write would replace the ASS file the subs were
+// imported from, as only timing and text were kept
+static const char *write_target(const char *args)
+{
+    int force = args[0] == '!';
+    if (force)
+    {
+        args++;
+        while (*args == ' ')
+            args++;
+    }
+    if (args[0] != '\0')
+        return args;
+    if (force || codec_from_filename(export_filename) != CODEC_ASS)
+        return export_filename;
+
+    FILE *fp = fopen(export_filename, "rb");
+    if (fp == NULL)
+        return export_filename;
+    fclose(fp);
+
+    show_text("Saving would drop the ASS styles, use :w! to overwrite!", 2000);
+    return NULL;
+}
+
+// Parse commands starting with :
+// Commands on subs take a range of addresses before them, like :10,20d
+static void parse_ex(const char *cmd_raw)
+{
+    if (cmd_raw[0] != ':')
+        return;
+
+    long first, last;
+    int given;
+    const char *p = parse_range(cmd_raw + 1, &first, &last, &given);
+    if (p == NULL)
+        return;
+
+    char name[16];
+    const char *args = parse_cmd_name(p, name, sizeof(name));
+
+    int count = store_count(store_working());
+    int global = is_cmd(name, "global", 1) || is_cmd(name, "vglobal", 1);
+
+    if (given == 0)
+    {
+        // Commands on subs default to the focused one, or all subs for :g
+        first = global ? 0 : get_focused_idx();
+        last = global ? count - 1 : first;
+    }
+    else if (first > last)
+    {
+        long tmp = first;
+        first = last;
+        last = tmp;
+    }
+
+    if (given > 0 && (first < 0 || last >= count))
+    {
+        show_text("Invalid range!", 300);
+        return;
+    }
 
-        // Parse first character
-        switch (action[0])
+    if (name[0] == '\0')
+    {
+        // Address alone focuses the sub, like going to a line
+        if (given > 0)
+            jump_sub(last);
+    }
+    else if (strcmp(name, "wq") == 0)
+    {
+        // Only exit once the subs are safely written
+        const char *target = write_target(args);
+        if (target != NULL && save_sub(target) == 0 && save_wait() == 0)
+            request_quit();
+    }
+    else if (strcmp(name, "w") == 0)
+    {
+        // Writing to another file picks the format by its extension,
+        // and keeps editing the current one
+        const char *target = write_target(args);
+        if (target != NULL)
+            save_sub(target);
+    }
+    else if (strcmp(name, "q") == 0)
+    {
+        // A save in progress finishes while shutting down
+        request_quit();
+    }
+    else if (strcmp(name, "mks") == 0)
+    {
+        char session_fname[512];
+        session_filename(export_filename, session_fname, sizeof(session_fname));
+        if (export_session(session_fname) == 0)
+            show_text("Session saved", 500);
+    }
+    else if (is_cmd(name, "renumber", 8))
+    {
+        // Subs are written numbered in order, renumbering resets their ids to match
+        subs_renumber();
+        show_text("Subs renumbered", 500);
+    }
+    else if (is_cmd(name, "reference", 3))
+    {
+        run_reference(args);
+    }
+    else if (is_cmd(name, "trace", 5))
+    {
+        run_trace(args);
+    }
+    else if (strcmp(name, "tm") == 0)
+    {
+        run_tm(args);
+    }
+    else if (first < 0)
+    {
+        show_text("No subs!", 300);
+    }
+    else if (is_cmd(name, "align", 5))
+    {
+        run_align(args);
+    }
+    else if (is_cmd(name, "mark", 2) || strcmp(name, "k") == 0)
+    {
+        int mark = args[0] - 'a';
+        if (mark < 0 || mark >= 26 || args[1] != '\0')
         {
-        case 'f':
-            toggle_fullscreen();
-            return 0;
-
-        case 'j':
-            if (count == -1)
-                count = DEFAULT_COUNT_jk;
-            seek_relative(count * DEFAULT_UNIT_j);
-            return 0;
-
-        case 'k':
-            if (count == -1)
-                count = DEFAULT_COUNT_jk;
-            seek_relative(count * DEFAULT_UNIT_k);
-            return 0;
-
-        case 'J':
-            if (count == -1)
-                count = DEFAULT_COUNT_JK;
-            seek_relative(count * DEFAULT_UNIT_J);
-            return 0;
-
-        case 'K':
-            if (count == -1)
-                count = DEFAULT_COUNT_JK;
-            seek_relative(count * DEFAULT_UNIT_K);
-            return 0;
-
-        case 'N':
-            frame_back_step();
-            return 0;
-
-        case 'n':
-            frame_step();
-            return 0;
-
-        case 'd':
-            // Check bounds
-            if (action_len < 2)
-                return 1;
-
-            switch (action[1])
-            {
-            case 'd':
-                delete_focused_sub();
-                export_reload_sub();
-                return 0;
-            }
-            return 0;
+            show_text("Invalid mark!", 300);
+            return;
+        }
+        marks[mark] = store_get(store_working(), last)->id;
+        marks_set |= 1 << mark;
+    }
+    else if (global)
+    {
+        run_global(args, name[0] == 'v', first, last);
+    }
+    else
+    {
+        run_range_cmd(name, args, NULL, first, last - first + 1);
+    }
+}
 
-        case 'g':
-            // Check bounds
-            if (action_len < 2)
-                return 1;
+// Internal function to focus the next sub matching a pattern
+// An empty pattern repeats the last search
+static void search(const char *pattern, int backward)
+{
+    if (pattern[0] == '\0')
+        pattern = search_pattern;
+    if (pattern[0] == '\0')
+    {
+        show_text("No previous pattern!", 300);
+        return;
+    }
 
-            switch (action[1])
-            {
-            case 'g':
-                seek_start();
-                return 0;
-            }
-            return 0;
-
-        case 'G':
-            seek_end();
-            return 0;
-
-        case 'i':
-            if (count == -1)
-                count = DEFAULT_COUNT_i;
-            // Subs start from 1 to the user
-            // Convert to index starting from 0
-            focus_sub_in_frame(count - 1);
+    int wrapped;
+    int idx = search_subs(pattern, get_focused_idx(), backward, &wrapped);
+    if (idx == -2)
+    {
+        show_text("Invalid pattern!", 300);
+        return;
+    }
+    if (idx < 0)
+    {
+        show_text("Pattern not found!", 300);
+        return;
+    }
+
+    jump_sub(idx);
+    if (wrapped)
+        show_text(backward ? "Search hit TOP, continuing at BOTTOM" : "Search hit BOTTOM, continuing at TOP", 500);
+}
+
+// Parse commands starting with / or ?, searching forward or backward
+static void parse_search(const char *cmd_raw)
+{
+    int backward = cmd_raw[0] == '?';
+    search(cmd_raw + 1, backward);
+
+    // Remember the pattern, the direction is kept for n and N
+    if (cmd_raw[1] != '\0')
+        strcpy(search_pattern, cmd_raw + 1);
+    search_backward = backward;
+}
+
+// Run an action bound in NORMAL mode
+static void run_action(const KeyAction *action)
+{
+    // Changes to subs can be repeated
+    if ((is_operator(action->action) && action->action != ACTION_OP_YANK) ||
+        action->action == ACTION_DELETE_SUB || action->action == ACTION_PUT)
+        last_change = *action;
+
+    // Actions without a default count repeat once
+    long count = action->count >= 0 ? action->count : 1;
+
+    switch (action->action)
+    {
+    case ACTION_FULLSCREEN:
+        toggle_fullscreen();
+        break;
+
+    case ACTION_SEEK:
+        seek_relative(count * action->unit);
+        break;
+
+    case ACTION_FRAME_BACK:
+        frame_back_step();
+        break;
+
+    case ACTION_FRAME_STEP:
+        frame_step();
+        break;
+
+    case ACTION_DELETE_SUB:
+        delete_focused_sub();
+        export_reload_sub();
+        break;
+
+    case ACTION_SEEK_START:
+        seek_start();
+        break;
+
+    case ACTION_SEEK_END:
+        seek_end();
+        break;
+
+    case ACTION_INSERT_END:
+    case ACTION_INSERT_START:
+        // Subs start from 1 to the user
+        // Convert to index starting from 0
+        focus_sub_in_frame(action->count >= 0 ? action->count - 1 : -1);
+        if (action->action == ACTION_INSERT_END)
             set_cursor_end();
-            export_reload_sub();
-            set_mode(MODE_INSERT);
-            return 0;
-
-        case 'I':
-            if (count == -1)
-                count = DEFAULT_COUNT_i;
-            // Subs start from 1 to the user
-            // Convert to index starting from 0
-            focus_sub_in_frame(count - 1);
+        else
             set_cursor_start();
+        export_reload_sub();
+        set_mode(MODE_INSERT);
+        break;
+
+    case ACTION_APPEND_SUB:
+        // New sub at current time
+        new_sub(curr_timestamp);
+        set_cursor_end();
+        export_reload_sub();
+        set_mode(MODE_INSERT);
+        break;
+
+    case ACTION_NEXT_SUB:
+        next_sub(count);
+        break;
+
+    case ACTION_BACK_SUB:
+        back_sub(count);
+        break;
+
+    case ACTION_SEEK_FOCUSED_END:
+        seek_focused_end();
+        break;
+
+    case ACTION_FOCUS_NEXT:
+        if (focus_next_sub(count) == 0)
             export_reload_sub();
-            set_mode(MODE_INSERT);
-            return 0;
+        break;
 
-        case 'a':
-            // New sub at current time
-            new_sub(curr_timestamp);
-            set_cursor_end();
+    case ACTION_FOCUS_PREV:
+        if (focus_prev_sub(count) == 0)
             export_reload_sub();
-            set_mode(MODE_INSERT);
-            return 0;
-
-        case 'w':
-            if (count == -1)
-                count = DEFAULT_COUNT_WB;
-            next_sub(count);
-            return 0;
-
-        case 'b':
-            if (count == -1)
-                count = DEFAULT_COUNT_WB;
-            back_sub(count);
-            return 0;
-
-        case 'e':
-            seek_focused_end();
-            return 0;
-
-        case 'W':
-            if (count == -1)
-                count = DEFAULT_COUNT_WB;
-            if (focus_next_sub(count) == 0)
-                export_reload_sub();
-            return 0;
-
-        case 'B':
-            if (count == -1)
-                count = DEFAULT_COUNT_WB;
-            if (focus_prev_sub(count) == 0)
-                export_reload_sub();
-            return 0;
-
-        case 'h':
-            set_focused_start_ts(curr_timestamp);
-            return 0;
-
-        case 'l':
-            set_focused_end_ts(curr_timestamp);
-            return 0;
-
-        case 'r':
-            sub_reload();
-            return 0;
+        break;
+
+    case ACTION_SET_START:
+        set_focused_start_ts(curr_timestamp);
+        break;
+
+    case ACTION_SET_END:
+        set_focused_end_ts(curr_timestamp);
+        break;
+
+    case ACTION_RELOAD:
+        sub_reload();
+        break;
+
+    case ACTION_UNDO:
+        undo(count);
+        break;
+
+    case ACTION_FOLLOW:
+        toggle_follow();
+        follow_playhead(curr_timestamp);
+        export_reload_sub();
+        break;
+
+    case ACTION_OP_DELETE:
+    case ACTION_OP_YANK:
+    case ACTION_OP_SHIFT:
+        apply_operator(action);
+        break;
+
+    case ACTION_PUT:
+        if (yank_len == 0)
+        {
+            show_text("Nothing to put!", 300);
+            break;
         }
+        put_subs(yank_reg, yank_len, curr_timestamp);
+        export_reload_sub();
+        break;
+
+    case ACTION_SEARCH_NEXT:
+    case ACTION_SEARCH_PREV:
+        for (long i = 0; i < count; i++)
+            search("", search_backward ^ (action->action == ACTION_SEARCH_PREV));
+        break;
+
+    case ACTION_REFERENCE:
+        show_reference_cue();
+        break;
+
+    case ACTION_REPEAT:
+    {
+        if (last_change.action == ACTION_NONE)
+            break;
+        KeyAction change = last_change;
+        // Count typed before . replaces the count of the change
+        if (action->count >= 0)
+            change.count = action->count;
+        run_action(&change);
+        break;
+    }
+    }
+}
+
+// Advance the keys typed in NORMAL mode by one key
+// Returns 0 if the keys were parsed
+// Returns 1 if expecting more keys
+static int parse_normal_key(char key)
+{
+    KeyAction action;
+    switch (keymap_feed(&key_state, key, &action))
+    {
+    case KEYMAP_PENDING:
+        return 1;
+
+    case KEYMAP_MATCH:
+        run_action(&action);
+        return 0;
+
+    case KEYMAP_MATCH_AGAIN:
+        // Key starts a new sequence after the bound prefix
+        run_action(&action);
+        clear_cmd_buf();
+        strncat(cmd_buf, &key, 1);
+        return parse_normal_key(key);
     }
 
-    // Invalid action, clear buffer
+    // Invalid keys, clear buffer
     return 0;
 }
 
+// Internal function to process a single keypress in NORMAL mode
+static void normal_input(const char *text)
+{
+    // Concat input text to command buffer and parse
+    strncat(cmd_buf, text, sizeof(cmd_buf) - strlen(cmd_buf) - 1);
+
+    // Do not automatically parse in Ex mode or searches
+    if (cmd_buf[0] == ':' || cmd_buf[0] == '/' || cmd_buf[0] == '?')
+    {
+        goto end;
+    }
+
+    // Pausing takes precedence over other commands
+    if (text[0] == ' ')
+    {
+        toggle_pause();
+        goto clear;
+    }
+
+    // Parse the new key
+    if (parse_normal_key(text[0]) == 0)
+    {
+    clear:
+        clear_cmd_buf();
+    }
+
+end:
+    set_title(cmd_buf);
+}
+
 // Process keypresses based on mode
+// Text may hold a burst of keypresses drained from the event queue at once
 void handle_text_input(const char *text)
 {
-    switch (curr_mode)
+    // Commands are parsed a keypress at a time until one enters INSERT mode
+    while (*text && curr_mode == MODE_NORMAL)
     {
-    case MODE_NORMAL:
-        // Concat input text to command buffer and parse
-        strncat(cmd_buf, text, sizeof(cmd_buf) - strlen(cmd_buf) - 1);
+        // Keep UTF-8 sequences whole
+        char key[8] = {0};
+        int len = 1;
+        while (len < (int)sizeof(key) - 1 && (text[len] & 0xC0) == 0x80)
+            len++;
+        memcpy(key, text, len);
 
-        // Do not automatically parse in Ex mode
-        if (cmd_buf[0] == ':')
-        {
-            goto end;
-        }
+        Uint64 span = TRACE_BEGIN();
+        normal_input(key);
+        TRACE_END(span, "command", "normal_input");
+        text += len;
+    }
 
-        // Pausing takes precedence over other commands
-        if (text[0] == ' ')
-        {
-            toggle_pause();
-            goto clear;
-        }
+    // Rest of the burst is inserted at once
+    if (*text && curr_mode == MODE_INSERT)
+        sub_insert_text(text);
+}
 
-        // Parse the command buffer
-        if (parse_normal_cmd(cmd_buf) == 0)
-        {
-        clear:
-            clear_cmd_buf();
-        }
+// Request suggestions for the focused sub when it changes, and show them
+// once the translation memory thread has found them
+// Called after every event, lookups never wait on the UI thread
+void handle_suggestions()
+{
+    update_suggestions(0);
+}
 
-    end:
-        set_title(cmd_buf);
-        break;
+// Handle playhead position updates
+void handle_time_pos(const double ts)
+{
+    curr_timestamp = ts;
 
-    case MODE_INSERT:
-        // Edit sub text
-        sub_insert_text(text);
-        break;
-    }
+    // Playhead is leaving the subs written to the preview
+    int reload = !in_preview_window(ts);
+
+    // Do not move focus away from the sub being edited
+    if (curr_mode == MODE_NORMAL && follow_playhead(ts) == 0)
+        reload = 1;
+
+    if (reload)
+        export_reload_sub();
 }
 
 // Handle escape keypress
@@ -313,11 +1174,18 @@ void handle_return()
     switch (curr_mode)
     {
     case MODE_NORMAL:
-        // Parse command buffer as Ex command
-        parse_ex(cmd_buf);
+    {
+        // Parse command buffer as Ex command or search
+        Uint64 span = TRACE_BEGIN();
+        if (cmd_buf[0] == '/' || cmd_buf[0] == '?')
+            parse_search(cmd_buf);
+        else
+            parse_ex(cmd_buf);
+        TRACE_END(span, "command", cmd_buf[0] == ':' ? "ex" : "search");
         clear_cmd_buf();
         set_title("");
         break;
+    }
 
     case MODE_INSERT:
         // Newline
@@ -400,6 +1268,78 @@ void handle_ctrl_c()
     }
 }
 
+void handle_ctrl_r()
+{
+    switch (curr_mode)
+    {
+    case MODE_NORMAL:
+        clear_cmd_buf();
+        set_title("");
+        redo(1);
+        break;
+    case MODE_INSERT:
+        break;
+    }
+}
+
+// Insert the marked suggestion at the cursor
+void handle_tab()
+{
+    switch (curr_mode)
+    {
+    case MODE_NORMAL:
+        break;
+    case MODE_INSERT:
+        if (num_suggestions == 0)
+        {
+            show_text("No suggestions!", 300);
+            break;
+        }
+        sub_insert_text(suggestions[suggestion_sel].text);
+        break;
+    }
+}
+
+// Mark the next suggestion to be inserted by Tab
+void handle_ctrl_n()
+{
+    switch (curr_mode)
+    {
+    case MODE_NORMAL:
+        break;
+    case MODE_INSERT:
+        if (num_suggestions == 0)
+            break;
+        suggestion_sel = (suggestion_sel + 1) % num_suggestions;
+        show_suggestions();
+        break;
+    }
+}
+
+// Paste clipboard text, starting a new sub in NORMAL mode
+void handle_ctrl_v(const char *text)
+{
+    if (text == NULL || text[0] == '\0')
+    {
+        show_text("Clipboard is empty!", 300);
+        return;
+    }
+
+    switch (curr_mode)
+    {
+    case MODE_NORMAL:
+        clear_cmd_buf();
+        new_sub(curr_timestamp);
+        set_cursor_end();
+        set_mode(MODE_INSERT);
+        sub_paste_text(text);
+        break;
+    case MODE_INSERT:
+        sub_paste_text(text);
+        break;
+    }
+}
+
 void handle_ctrl_left()
 {
     switch (curr_mode)
@@ -447,3 +1387,27 @@ void handle_right()
         break;
     }
 }
+
+void handle_up()
+{
+    switch (curr_mode)
+    {
+    case MODE_NORMAL:
+        break;
+    case MODE_INSERT:
+        cursor_up();
+        break;
+    }
+}
+
+void handle_down()
+{
+    switch (curr_mode)
+    {
+    case MODE_NORMAL:
+        break;
+    case MODE_INSERT:
+        cursor_down();
+        break;
+    }
+}
@@ -0,0 +1,414 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+// Vector kernels are built for the target at hand and picked at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ENCODING_X86
+#include <immintrin.h>
+#endif
+
+#include <encoding.h>
+
+static const char *encoding_names[] = {
+    [ENCODING_UTF8] = "UTF-8",
+    [ENCODING_UTF16LE] = "UTF-16LE",
+    [ENCODING_UTF16BE] = "UTF-16BE",
+    [ENCODING_CP1252] = "Windows-1252",
+};
+
+// Code points of Windows-1252 bytes 0x80 to 0x9F, the rest match Latin-1
+// Unassigned bytes map to the C1 controls like browsers do
+static const unsigned short cp1252_high[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178};
+
+// Internal function to check the UTF-8 sequence at s[i]
+// Returns its length, or 0 if it is invalid
+static int utf8_seq_len(const unsigned char *s, size_t i, size_t n)
+{
+    unsigned char c = s[i];
+    if (c < 0x80)
+        return 1;
+
+    // Continuation bytes and overlong 2 byte sequences
+    if (c < 0xC2)
+        return 0;
+
+    if (c < 0xE0)
+        return i + 1 < n && (s[i + 1] & 0xC0) == 0x80 ? 2 : 0;
+
+    if (c < 0xF0)
+    {
+        if (i + 2 >= n || (s[i + 1] & 0xC0) != 0x80 || (s[i + 2] & 0xC0) != 0x80)
+            return 0;
+        // Overlong, or a surrogate
+        if ((c == 0xE0 && s[i + 1] < 0xA0) || (c == 0xED && s[i + 1] >= 0xA0))
+            return 0;
+        return 3;
+    }
+
+    if (c < 0xF5)
+    {
+        if (i + 3 >= n || (s[i + 1] & 0xC0) != 0x80 || (s[i + 2] & 0xC0) != 0x80 || (s[i + 3] & 0xC0) != 0x80)
+            return 0;
+        // Overlong, or past U+10FFFF
+        if ((c == 0xF0 && s[i + 1] < 0x90) || (c == 0xF4 && s[i + 1] >= 0x90))
+            return 0;
+        return 4;
+    }
+
+    return 0;
+}
+
+static int valid_scalar(const unsigned char *s, size_t n)
+{
+    size_t i = 0;
+    while (i < n)
+    {
+        int len = utf8_seq_len(s, i, n);
+        if (len == 0)
+            return 0;
+        i += len;
+    }
+    return 1;
+}
+
+#ifdef ENCODING_X86
+
+// Skips ASCII 16 bytes at a time, and checks other characters one by one
+__attribute__((target("sse2"))) static int valid_sse2(const unsigned char *s, size_t n)
+{
+    size_t i = 0;
+    while (i < n)
+    {
+        if (i + 16 <= n)
+        {
+            int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+            if (mask == 0)
+            {
+                i += 16;
+                continue;
+            }
+            i += __builtin_ctz(mask);
+        }
+
+        // Check characters until back to ASCII
+        do
+        {
+            int len = utf8_seq_len(s, i, n);
+            if (len == 0)
+                return 0;
+            i += len;
+        } while (i < n && s[i] >= 0x80);
+    }
+    return 1;
+}
+
+// Errors flagged by the lookup tables of the AVX2 kernel, from
+// "Validating UTF-8 In Less Than One Instruction Per Byte" by Keiser and Lemire
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// Looked up by the high nibble of the previous byte
+static const uint8_t byte_1_high_table[16] = {
+    // ASCII
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    // Continuation
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    // 2 byte leads
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    // 3 byte leads
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    // 4 byte leads
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4};
+
+// Looked up by the low nibble of the previous byte
+static const uint8_t byte_1_low_table[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000};
+
+// Looked up by the high nibble of the current byte
+static const uint8_t byte_2_high_table[16] = {
+    // ASCII
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    // Continuation
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    // Leads
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT};
+
+// Bytes of the block ending n bytes before the current one, continued by it
+#define PREV_BYTES(input, prev_input, n) \
+    _mm256_alignr_epi8((input), _mm256_permute2x128_si256((prev_input), (input), 0x21), 16 - (n))
+
+__attribute__((target("avx2"))) static inline __m256i lookup_table(const uint8_t *table, __m256i nibbles)
+{
+    return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table)), nibbles);
+}
+
+// Internal function to flag the errors in a block of 32 bytes
+// Sequences continued from the previous block are checked too
+__attribute__((target("avx2"))) static inline __m256i check_block(__m256i input, __m256i prev_input)
+{
+    __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i prev1 = PREV_BYTES(input, prev_input, 1);
+
+    __m256i byte_1_high = lookup_table(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    __m256i byte_1_low = lookup_table(byte_1_low_table, _mm256_and_si256(prev1, nibble));
+    __m256i byte_2_high = lookup_table(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // Third and fourth bytes must be continuations, and are the only ones
+    // flagged as two continuations in a row
+    __m256i prev2 = PREV_BYTES(input, prev_input, 2);
+    __m256i prev3 = PREV_BYTES(input, prev_input, 3);
+    __m256i is_third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i is_fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must_continue = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth), _mm256_set1_epi8((char)0x80));
+
+    return _mm256_xor_si256(must_continue, special);
+}
+
+// Validates whole blocks of 32 bytes with table lookups
+__attribute__((target("avx2"))) static int valid_avx2(const unsigned char *s, size_t n)
+{
+    // Leads in the last 3 bytes of a block that need the next block
+    __m256i max_complete = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+
+    size_t i = 0;
+    while (i < n)
+    {
+        __m256i input;
+        if (i + 32 <= n)
+        {
+            input = _mm256_loadu_si256((const __m256i *)(s + i));
+        }
+        else
+        {
+            // The tail is padded with ASCII
+            unsigned char tail[32] = {0};
+            memcpy(tail, s + i, n - i);
+            input = _mm256_loadu_si256((const __m256i *)tail);
+        }
+
+        if (_mm256_movemask_epi8(input) == 0)
+        {
+            // ASCII cannot complete a sequence from the previous block
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_incomplete = _mm256_setzero_si256();
+        }
+        else
+        {
+            error = _mm256_or_si256(error, check_block(input, prev_input));
+            prev_incomplete = _mm256_subs_epu8(input, max_complete);
+        }
+        prev_input = input;
+        i += 32;
+    }
+
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error);
+}
+
+#endif
+
+// Check if a text is valid UTF-8
+int utf8_valid(const char *data, size_t n)
+{
+    const unsigned char *s = (const unsigned char *)data;
+#ifdef ENCODING_X86
+    if (SDL_HasAVX2())
+        return valid_avx2(s, n);
+    if (SDL_HasSSE2())
+        return valid_sse2(s, n);
+#endif
+    return valid_scalar(s, n);
+}
+
+// Internal function to write a code point as UTF-8
+// Returns a pointer past it
+static char *put_utf8(char *out, unsigned int cp)
+{
+    if (cp < 0x80)
+    {
+        *out++ = cp;
+    }
+    else if (cp < 0x800)
+    {
+        *out++ = 0xC0 | cp >> 6;
+        *out++ = 0x80 | (cp & 0x3F);
+    }
+    else if (cp < 0x10000)
+    {
+        *out++ = 0xE0 | cp >> 12;
+        *out++ = 0x80 | (cp >> 6 & 0x3F);
+        *out++ = 0x80 | (cp & 0x3F);
+    }
+    else
+    {
+        *out++ = 0xF0 | cp >> 18;
+        *out++ = 0x80 | (cp >> 12 & 0x3F);
+        *out++ = 0x80 | (cp >> 6 & 0x3F);
+        *out++ = 0x80 | (cp & 0x3F);
+    }
+    return out;
+}
+
+// Internal function to convert UTF-16 to UTF-8
+// Unpaired surrogates and a trailing odd byte are replaced with U+FFFD
+// Returns the length written
+static size_t from_utf16(const unsigned char *s, size_t n, int big_endian, char *out)
+{
+    char *start = out;
+    size_t i = 0;
+    while (i + 1 < n)
+    {
+        unsigned int unit = big_endian ? s[i] << 8 | s[i + 1] : s[i + 1] << 8 | s[i];
+        i += 2;
+
+        if (unit >= 0xD800 && unit < 0xDC00 && i + 1 < n)
+        {
+            unsigned int low = big_endian ? s[i] << 8 | s[i + 1] : s[i + 1] << 8 | s[i];
+            if (low >= 0xDC00 && low < 0xE000)
+            {
+                unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+        }
+
+        if (unit >= 0xD800 && unit < 0xE000)
+            unit = 0xFFFD;
+        out = put_utf8(out, unit);
+    }
+
+    if (i < n)
+        out = put_utf8(out, 0xFFFD);
+    return out - start;
+}
+
+// Internal function to convert Windows-1252 to UTF-8
+// Returns the length written
+static size_t from_cp1252(const unsigned char *s, size_t n, char *out)
+{
+    char *start = out;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (s[i] < 0x80)
+            *out++ = s[i];
+        else
+            out = put_utf8(out, s[i] < 0xA0 ? cp1252_high[s[i] - 0x80] : s[i]);
+    }
+    return out - start;
+}
+
+// Internal function to detect the encoding of a file from its BOM,
+// or from its first bytes for UTF-16 without one
+// Files that are not valid UTF-8 are taken as Windows-1252
+// The length of a UTF-16 BOM is set, as it is dropped when converting
+static int detect_encoding(const unsigned char *s, size_t n, size_t *bom_len)
+{
+    *bom_len = 0;
+
+    // A UTF-8 BOM is trusted, and skipped by the parsers
+    if (n >= 3 && memcmp(s, "\xEF\xBB\xBF", 3) == 0)
+        return ENCODING_UTF8;
+
+    if (n >= 2 && s[0] == 0xFF && s[1] == 0xFE)
+    {
+        *bom_len = 2;
+        return ENCODING_UTF16LE;
+    }
+    if (n >= 2 && s[0] == 0xFE && s[1] == 0xFF)
+    {
+        *bom_len = 2;
+        return ENCODING_UTF16BE;
+    }
+
+    // Mostly ASCII text in UTF-16 has every other byte zero
+    size_t sniff = n < ENCODING_SNIFF_SIZE ? n & ~(size_t)1 : ENCODING_SNIFF_SIZE;
+    size_t zero_even = 0, zero_odd = 0;
+    for (size_t i = 0; i < sniff; i += 2)
+    {
+        zero_even += s[i] == 0;
+        zero_odd += s[i + 1] == 0;
+    }
+    if (sniff > 0 && zero_even == 0 && zero_odd * 4 > sniff / 2)
+        return ENCODING_UTF16LE;
+    if (sniff > 0 && zero_odd == 0 && zero_even * 4 > sniff / 2)
+        return ENCODING_UTF16BE;
+
+    return utf8_valid((const char *)s, n) ? ENCODING_UTF8 : ENCODING_CP1252;
+}
+
+// Convert a mapped file to UTF-8, which is left mapped as is
+// Converted text replaces the mapping with heap memory
+// Returns the encoding converted from, or -1 if out of memory
+int decode_file(MappedFile *map)
+{
+    const unsigned char *s = (const unsigned char *)map->data;
+    size_t bom_len;
+    int encoding = detect_encoding(s, map->size, &bom_len);
+    if (encoding == ENCODING_UTF8)
+        return encoding;
+
+    s += bom_len;
+    size_t n = map->size - bom_len;
+
+    // Every unit or byte becomes at most 3 bytes
+    size_t cap = encoding == ENCODING_CP1252 ? n * 3 : n / 2 * 3 + 3;
+    char *out = (char *)malloc(cap + 1);
+    if (out == NULL)
+        return -1;
+
+    size_t len;
+    if (encoding == ENCODING_CP1252)
+        len = from_cp1252(s, n, out);
+    else
+        len = from_utf16(s, n, encoding == ENCODING_UTF16BE, out);
+
+    unmap_file(map);
+    *map = (MappedFile){.data = out, .size = len};
+    return encoding;
+}
+
+const char *encoding_name(int encoding)
+{
+    return encoding_names[encoding];
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+#include <mpv/client.h>
+
+#include <events.h>
+#include <trace.h>
+
+static SDL_Thread *events_thread = NULL;
+static mpv_handle *events_mpv = NULL;
+// Pushed to wake the UI thread when there are messages
+static Uint32 events_wakeup;
+static SDL_atomic_t events_stop_flag;
+
+// Single producer single consumer ring
+// The event thread only writes head, the UI thread only writes tail
+static EventMessage events_ring[EVENTS_RING_SIZE];
+static SDL_atomic_t events_head;
+static SDL_atomic_t events_tail;
+// Set once a wakeup is pushed, until the UI thread starts draining
+static SDL_atomic_t events_wake_pending;
+
+// Internal function to decode the events the UI thread needs
+// Log messages are printed here, off the UI thread
+// Return 0 if there is a message for the UI thread
+static int decode_event(const mpv_event *event, EventMessage *msg)
+{
+    switch (event->event_id)
+    {
+    case MPV_EVENT_FILE_LOADED:
+        msg->type = EVENT_FILE_LOADED;
+        return 0;
+
+    case MPV_EVENT_COMMAND_REPLY:
+    {
+        // Commands adding a track reply with its id
+        const mpv_event_command *cmd = (const mpv_event_command *)event->data;
+        msg->type = EVENT_COMMAND_REPLY;
+        msg->error = event->error;
+        msg->userdata = event->reply_userdata;
+        msg->track_id = -1;
+        if (event->error >= 0 && cmd != NULL && cmd->result.format == MPV_FORMAT_NODE_MAP)
+        {
+            const mpv_node_list *result = cmd->result.u.list;
+            for (int i = 0; i < result->num; i++)
+            {
+                if (strcmp(result->keys[i], "id") == 0 && result->values[i].format == MPV_FORMAT_INT64)
+                    msg->track_id = (long)result->values[i].u.int64;
+            }
+        }
+        return 0;
+    }
+
+    case MPV_EVENT_GET_PROPERTY_REPLY:
+    {
+        // Failed replies carry no data
+        const mpv_event_property *prop = (const mpv_event_property *)event->data;
+        msg->userdata = event->reply_userdata;
+        if (prop->format == MPV_FORMAT_DOUBLE)
+        {
+            msg->type = EVENT_TIME_POS;
+            msg->time_pos = *(double *)prop->data;
+            return 0;
+        }
+        if (prop->format == MPV_FORMAT_STRING)
+        {
+            msg->type = EVENT_STRING;
+            msg->text = strdup(*(char **)prop->data);
+            return 0;
+        }
+        return 1;
+    }
+
+    case MPV_EVENT_LOG_MESSAGE:
+    {
+        const mpv_event_log_message *log = (const mpv_event_log_message *)event->data;
+        fprintf(stderr, "[%s] %s: %s", log->prefix, log->level, log->text);
+        return 1;
+    }
+
+    default:
+        return 1;
+    }
+}
+
+// Internal function to queue a message for the UI thread
+static void push_message(const EventMessage *msg)
+{
+    unsigned int head = (unsigned int)SDL_AtomicGet(&events_head);
+
+    // Wait for the UI thread to make room rather than lose replies
+    while (head - (unsigned int)SDL_AtomicGet(&events_tail) == EVENTS_RING_SIZE)
+    {
+        if (SDL_AtomicGet(&events_stop_flag))
+        {
+            free(msg->text);
+            return;
+        }
+        SDL_Delay(1);
+    }
+
+    events_ring[head & (EVENTS_RING_SIZE - 1)] = *msg;
+    SDL_AtomicSet(&events_head, (int)(head + 1));
+
+    // One wakeup is enough for everything queued before the UI thread drains
+    if (SDL_AtomicSet(&events_wake_pending, 1) == 0)
+    {
+        SDL_Event event = {.type = events_wakeup};
+        SDL_PushEvent(&event);
+    }
+}
+
+// Internal function to wait for mpv events until stopped
+static int events_loop(void *data)
+{
+    while (!SDL_AtomicGet(&events_stop_flag))
+    {
+        mpv_event *event = mpv_wait_event(events_mpv, -1);
+        if (event->event_id == MPV_EVENT_SHUTDOWN)
+            break;
+
+        Uint64 span = TRACE_BEGIN();
+        EventMessage msg = {0};
+        if (decode_event(event, &msg) == 0)
+            push_message(&msg);
+        TRACE_END(span, "events", mpv_event_name(event->event_id));
+    }
+    return 0;
+}
+
+// Start handling mpv events on their own thread
+// The wakeup event is pushed to the UI thread when there are messages to drain
+// Return 0 on success
+int events_start(mpv_handle *mpv, Uint32 wakeup)
+{
+    events_mpv = mpv;
+    events_wakeup = wakeup;
+    SDL_AtomicSet(&events_stop_flag, 0);
+
+    events_thread = SDL_CreateThread(events_loop, "events", NULL);
+    return events_thread == NULL;
+}
+
+// Handle the messages queued by the event thread, on the UI thread
+// Messages are only freed if there is no handler
+// Returns the number of messages handled
+int events_drain(void (*handle)(const EventMessage *))
+{
+    // Messages queued from now on push another wakeup, unless drained below
+    SDL_AtomicSet(&events_wake_pending, 0);
+
+    int n = 0;
+    unsigned int tail = (unsigned int)SDL_AtomicGet(&events_tail);
+    while (tail != (unsigned int)SDL_AtomicGet(&events_head))
+    {
+        EventMessage *msg = &events_ring[tail & (EVENTS_RING_SIZE - 1)];
+        if (handle)
+            handle(msg);
+        free(msg->text);
+        SDL_AtomicSet(&events_tail, (int)++tail);
+        n++;
+    }
+    return n;
+}
+
+// Stop the event thread, before mpv is destroyed
+void events_stop()
+{
+    if (events_thread == NULL)
+        return;
+
+    SDL_AtomicSet(&events_stop_flag, 1);
+    mpv_wakeup(events_mpv);
+    SDL_WaitThread(events_thread, NULL);
+    events_thread = NULL;
+
+    // Free the messages never handled
+    events_drain(NULL);
+}
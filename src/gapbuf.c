@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <gapbuf.h>
+#include <grapheme.h>
+
+// Move the gap to pos, so that the text is split there
+void gap_move(GapBuffer *gb, int pos)
+{
+    if (pos < 0)
+        pos = 0;
+    if (pos > gap_len(gb))
+        pos = gap_len(gb);
+
+    if (pos < gb->gap_start)
+    {
+        int n = gb->gap_start - pos;
+        memmove(gb->data + gb->gap_end - n, gb->data + pos, n);
+        memmove(gb->marks + gb->gap_end - n, gb->marks + pos, n);
+        gb->gap_start -= n;
+        gb->gap_end -= n;
+    }
+    else if (pos > gb->gap_start)
+    {
+        int n = pos - gb->gap_start;
+        memmove(gb->data + gb->gap_start, gb->data + gb->gap_end, n);
+        memmove(gb->marks + gb->gap_start, gb->marks + gb->gap_end, n);
+        gb->gap_start += n;
+        gb->gap_end += n;
+    }
+}
+
+// Internal function to make the gap at least size bytes
+static void gap_reserve(GapBuffer *gb, int size)
+{
+    if (gb->gap_end - gb->gap_start >= size)
+        return;
+
+    int len = gap_len(gb);
+    int cap = gb->cap * 2;
+    if (cap < len + size + GAP_MIN_SIZE)
+        cap = len + size + GAP_MIN_SIZE;
+
+    // Text after the gap moves to the end of the new buffer
+    int tail = gb->cap - gb->gap_end;
+    gb->data = (char *)realloc(gb->data, cap);
+    gb->marks = (unsigned char *)realloc(gb->marks, cap);
+    memmove(gb->data + cap - tail, gb->data + gb->gap_end, tail);
+    memmove(gb->marks + cap - tail, gb->marks + gb->gap_end, tail);
+    gb->gap_end = cap - tail;
+    gb->cap = cap;
+}
+
+// Internal function to find the first line starting after pos
+static int upper_bound_line(const GapBuffer *gb, int pos)
+{
+    int lo = 0;
+    int hi = gb->num_lines;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (gb->lines[mid] <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Internal function to record lines started by newlines in text inserted at pos
+static void add_lines(GapBuffer *gb, int pos, const char *text, int len)
+{
+    int idx = upper_bound_line(gb, pos);
+    for (const char *nl = memchr(text, '\n', len); nl; nl = memchr(nl + 1, '\n', text + len - nl - 1))
+    {
+        if (gb->num_lines >= gb->lines_cap)
+        {
+            gb->lines_cap = gb->lines_cap ? gb->lines_cap * 2 : 8;
+            gb->lines = (int *)realloc(gb->lines, gb->lines_cap * sizeof(int));
+        }
+        memmove(&gb->lines[idx + 1], &gb->lines[idx], (gb->num_lines - idx) * sizeof(int));
+        gb->lines[idx++] = pos + (nl - text) + 1;
+        gb->num_lines++;
+    }
+}
+
+// Internal function to get the boundary marks of the byte at pos
+static inline int mark_of(const GapBuffer *gb, int pos)
+{
+    return gb->marks[pos < gb->gap_start ? pos : pos + gb->gap_end - gb->gap_start];
+}
+
+static inline void set_mark(GapBuffer *gb, int pos, int marks)
+{
+    gb->marks[pos < gb->gap_start ? pos : pos + gb->gap_end - gb->gap_start] = marks;
+}
+
+// Internal function to decode the code point at pos, setting its length
+static unsigned int char_at(const GapBuffer *gb, int pos, int *n)
+{
+    unsigned char bytes[4];
+    int len = gap_len(gb) - pos < 4 ? gap_len(gb) - pos : 4;
+    for (int i = 0; i < len; i++)
+        bytes[i] = gap_char(gb, pos + i);
+    return utf8_decode(bytes, len, n);
+}
+
+// Internal function to update the boundary marks after the text from pos to end changed
+// Scanning restarts at the grapheme before the change, and stops at the first
+// boundary after it that was already marked, so only the edited span is redone
+static void mark_boundaries(GapBuffer *gb, int pos, int end)
+{
+    int len = gap_len(gb);
+
+    // Broken UTF-8 before pos may join the changed text, so the scan starts
+    // at a grapheme whose code point ends before any text that could change
+    int start = pos > UTF8_MAX_LEN ? pos - UTF8_MAX_LEN : 0;
+    while (start > 0 && !(mark_of(gb, start) & MARK_GRAPHEME))
+        start--;
+
+    // Marks at the start stay, its code point only sets the scan state
+    int keep = start > 0;
+
+    BoundaryState state = {0};
+    int p = start;
+    while (p < len)
+    {
+        int n;
+        unsigned int cp = char_at(gb, p, &n);
+        int marks = boundary_next(&state, cp);
+        if (p == start && keep)
+            marks = mark_of(gb, p);
+
+        // Boundaries after the change only depend on the text after them,
+        // though a word start depends on the grapheme before it
+        if (p >= end && p > start && (marks & MARK_GRAPHEME) && (mark_of(gb, p) & MARK_GRAPHEME))
+        {
+            set_mark(gb, p, marks);
+            break;
+        }
+
+        set_mark(gb, p, marks);
+        for (int i = 1; i < n; i++)
+            set_mark(gb, p + i, 0);
+        p += n;
+    }
+}
+
+// Replace the text of a buffer
+void gap_set(GapBuffer *gb, const char *text, int len)
+{
+    gb->gap_start = 0;
+    gb->gap_end = gb->cap;
+    gb->num_lines = 0;
+    gap_insert(gb, 0, text, len);
+}
+
+void gap_free(GapBuffer *gb)
+{
+    free(gb->data);
+    free(gb->marks);
+    free(gb->lines);
+    memset(gb, 0, sizeof(GapBuffer));
+}
+
+// Get the char at pos, 0 if out of range
+char gap_char(const GapBuffer *gb, int pos)
+{
+    if (pos < 0 || pos >= gap_len(gb))
+        return '\0';
+    return pos < gb->gap_start ? gb->data[pos] : gb->data[pos + gb->gap_end - gb->gap_start];
+}
+
+// Insert len bytes of text at pos
+// Return 0 on success
+int gap_insert(GapBuffer *gb, int pos, const char *text, int len)
+{
+    if (pos < 0 || pos > gap_len(gb) || len <= 0)
+        return 1;
+
+    // Keep a byte free to null terminate in gap_text
+    gap_reserve(gb, len + 1);
+    gap_move(gb, pos);
+    memcpy(gb->data + gb->gap_start, text, len);
+    gb->gap_start += len;
+
+    // Lines starting after pos move with the text
+    for (int i = upper_bound_line(gb, pos); i < gb->num_lines; i++)
+        gb->lines[i] += len;
+    add_lines(gb, pos, text, len);
+    mark_boundaries(gb, pos, pos + len);
+    return 0;
+}
+
+// Delete len bytes at pos
+// Return 0 on success
+int gap_delete(GapBuffer *gb, int pos, int len)
+{
+    if (pos < 0 || len <= 0 || pos + len > gap_len(gb))
+        return 1;
+
+    gap_move(gb, pos);
+    gb->gap_end += len;
+
+    // Drop lines started by deleted newlines
+    int first = upper_bound_line(gb, pos);
+    int last = upper_bound_line(gb, pos + len);
+    if (last > first)
+    {
+        memmove(&gb->lines[first], &gb->lines[last], (gb->num_lines - last) * sizeof(int));
+        gb->num_lines -= last - first;
+    }
+
+    for (int i = first; i < gb->num_lines; i++)
+        gb->lines[i] -= len;
+    mark_boundaries(gb, pos, pos);
+    return 0;
+}
+
+// Get the text as a null terminated string
+// Moves the gap to the end, so only use when the text is needed in one piece
+const char *gap_text(GapBuffer *gb)
+{
+    if (gb->data == NULL)
+        return "";
+
+    int len = gap_len(gb);
+    gap_move(gb, len);
+    gb->data[len] = '\0';
+    return gb->data;
+}
+
+// Get the text before and after the gap without moving it
+void gap_spans(const GapBuffer *gb, const char **head, int *head_len, const char **tail, int *tail_len)
+{
+    *head = gb->data ? gb->data : "";
+    *head_len = gb->gap_start;
+    *tail = gb->data ? gb->data + gb->gap_end : "";
+    *tail_len = gb->cap - gb->gap_end;
+}
+
+// Get the position of the grapheme after the one at pos
+int gap_next_grapheme(const GapBuffer *gb, int pos)
+{
+    int len = gap_len(gb);
+    if (pos >= len)
+        return len;
+
+    pos++;
+    while (pos < len && !(mark_of(gb, pos) & MARK_GRAPHEME))
+        pos++;
+    return pos;
+}
+
+// Get the position of the grapheme before pos
+int gap_prev_grapheme(const GapBuffer *gb, int pos)
+{
+    if (pos <= 0)
+        return 0;
+
+    pos--;
+    while (pos > 0 && !(mark_of(gb, pos) & MARK_GRAPHEME))
+        pos--;
+    return pos;
+}
+
+// Count the graphemes from start to pos
+int gap_column(const GapBuffer *gb, int start, int pos)
+{
+    int col = 0;
+    for (int i = start; i < pos; i++)
+        col += mark_of(gb, i) & MARK_GRAPHEME;
+    return col;
+}
+
+// Get the position n graphemes after pos, stopping at end
+int gap_advance(const GapBuffer *gb, int pos, int n, int end)
+{
+    while (n-- > 0 && pos < end)
+        pos = gap_next_grapheme(gb, pos);
+    return pos < end ? pos : end;
+}
+
+// Get the position of the start of the next word after pos
+int gap_next_word(const GapBuffer *gb, int pos)
+{
+    int len = gap_len(gb);
+    pos++;
+    while (pos < len && !(mark_of(gb, pos) & MARK_WORD))
+        pos++;
+    return pos < len ? pos : len;
+}
+
+// Get the position of the start of the word before pos
+int gap_prev_word(const GapBuffer *gb, int pos)
+{
+    pos--;
+    while (pos > 0 && !(mark_of(gb, pos) & MARK_WORD))
+        pos--;
+    return pos > 0 ? pos : 0;
+}
+
+// Get the line of the text at pos, starting from 0
+int gap_line_of(const GapBuffer *gb, int pos)
+{
+    return upper_bound_line(gb, pos);
+}
+
+// Get the position a line starts at
+int gap_line_start(const GapBuffer *gb, int line)
+{
+    if (line <= 0)
+        return 0;
+    if (line > gb->num_lines)
+        line = gb->num_lines;
+    return gb->lines[line - 1];
+}
+
+// Get the position of the end of a line, excluding the newline
+int gap_line_end(const GapBuffer *gb, int line)
+{
+    if (line < 0)
+        line = 0;
+    if (line >= gb->num_lines)
+        return gap_len(gb);
+    return gb->lines[line] - 1;
+}
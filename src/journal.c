@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <SDL2/SDL.h>
+
+#include <journal.h>
+#include <session.h>
+#include <utils.h>
+#include <main.h>
+#include <subs.h>
+#include <undo.h>
+#include <store.h>
+#include <command.h>
+
+// A rewrite of the whole journal file
+typedef struct JournalRewrite
+{
+    char *head;
+    size_t head_size;
+    // Embedded image, built by the journal thread from the pinned version
+    // if there is a pin
+    char *image;
+    size_t image_size;
+    const StoreNode *root;
+    int pin;
+    // Editing state saved with the image
+    int focused_idx;
+    int cursor_pos;
+    int mode;
+    // Pending records before the rewrite, which are already in the image
+    size_t split;
+    int ticket;
+} JournalRewrite;
+
+static SDL_Thread *journal_thread = NULL;
+static SDL_mutex *journal_mutex = NULL;
+// Signalled when there is work for the journal thread
+static SDL_cond *journal_work_cond = NULL;
+// Signalled when the journal thread is idle or finished a rewrite
+static SDL_cond *journal_idle_cond = NULL;
+
+static char *journal_fname = NULL;
+
+// Base file of the journal, NULL once an image is embedded
+// Only used by the main thread
+static char *journal_base = NULL;
+
+// Bytes appended since the journal was last rewritten
+// Only used by the main thread
+static size_t journal_bytes = 0;
+
+// Below are guarded by journal_mutex
+
+// Records waiting to be written
+static char *pending_buf = NULL;
+static size_t pending_len = 0;
+static size_t pending_cap = 0;
+
+// Pending rewrite of the journal file, replaced by a newer one until taken
+static JournalRewrite *rewrite_pending = NULL;
+// Tickets of the last queued and the last written rewrite
+static int rewrite_queued = 0;
+static int rewrite_done = 0;
+
+static int journal_busy = 0;
+static int journal_stop = 0;
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline uint64_t align_up(uint64_t off)
+{
+    return (off + SESSION_ALIGN - 1) & ~(uint64_t)(SESSION_ALIGN - 1);
+}
+
+// Internal function to get the size of the data following a record
+static inline uint32_t record_data_len(const JournalRecord *rec)
+{
+    return rec->op == JOURNAL_INSERT_TEXT ? rec->len : 0;
+}
+
+// Internal function to checksum a record and its data
+static uint32_t record_checksum(const JournalRecord *rec, const char *data)
+{
+    uint32_t hash = fnv1a(2166136261u, (const char *)rec + sizeof(rec->checksum), sizeof(JournalRecord) - sizeof(rec->checksum));
+    return fnv1a(hash, data, record_data_len(rec));
+}
+
+static void free_rewrite(JournalRewrite *rw)
+{
+    if (rw == NULL)
+        return;
+    store_release(rw->pin);
+    free(rw->head);
+    free(rw->image);
+    free(rw);
+}
+
+// Internal function to write the head and image of a rewrite
+// Return the journal opened for appending, NULL on failure
+static FILE *write_rewrite(JournalRewrite *rw)
+{
+    if (rw->pin != -1)
+    {
+        rw->image = session_image_of(rw->root, rw->focused_idx, rw->cursor_pos, rw->mode, &rw->image_size);
+        ((JournalHeader *)rw->head)->image_size = rw->image_size;
+
+        // Everything needed is copied into the image
+        store_release(rw->pin);
+        rw->pin = -1;
+    }
+
+    if (write_file_atomic(journal_fname, rw->head, rw->head_size, rw->image, rw->image_size) != 0)
+        return NULL;
+    return fopen(journal_fname, "ab");
+}
+
+// Writes records and rewrites the journal file in the background
+// Records that arrive while syncing are committed together by the next sync
+static int journal_thread_fn(void *data)
+{
+    FILE *fp = NULL;
+    char *buf = NULL;
+    size_t buf_cap = 0;
+
+    SDL_LockMutex(journal_mutex);
+    while (1)
+    {
+        while (!journal_stop && pending_len == 0 && rewrite_pending == NULL)
+        {
+            journal_busy = 0;
+            SDL_CondBroadcast(journal_idle_cond);
+            SDL_CondWait(journal_work_cond, journal_mutex);
+        }
+
+        if (pending_len == 0 && rewrite_pending == NULL)
+            break;
+
+        journal_busy = 1;
+
+        // Take the pending rewrite
+        JournalRewrite *rw = rewrite_pending;
+        size_t skip = rw ? rw->split : 0;
+        rewrite_pending = NULL;
+
+        // Swap buffers so that appending does not wait for the disk
+        char *tmp = pending_buf;
+        size_t tmp_cap = pending_cap;
+        size_t len = pending_len;
+        pending_buf = buf;
+        pending_cap = buf_cap;
+        pending_len = 0;
+        buf = tmp;
+        buf_cap = tmp_cap;
+
+        SDL_UnlockMutex(journal_mutex);
+
+        if (rw)
+        {
+            if (fp)
+                fclose(fp);
+
+            fp = write_rewrite(rw);
+            if (fp == NULL)
+                show_text("Failed to write journal!", 1000);
+        }
+
+        if (fp && len > skip)
+        {
+            fwrite(buf + skip, 1, len - skip, fp);
+            sync_file(fp);
+        }
+
+        SDL_LockMutex(journal_mutex);
+
+        if (rw)
+        {
+            // Saves waiting for the base to be released may go on
+            rewrite_done = rw->ticket;
+            SDL_CondBroadcast(journal_idle_cond);
+            free_rewrite(rw);
+        }
+    }
+
+    journal_busy = 0;
+    SDL_CondBroadcast(journal_idle_cond);
+    SDL_UnlockMutex(journal_mutex);
+
+    if (fp)
+        fclose(fp);
+    free(buf);
+    return 0;
+}
+
+// Internal function to queue a rewrite of the journal file
+// Pending records are dropped as they are already in the image
+// Return the ticket of the rewrite
+static int queue_rewrite(JournalRewrite *rw)
+{
+    SDL_LockMutex(journal_mutex);
+
+    // Replace a rewrite that has not been taken yet
+    free_rewrite(rewrite_pending);
+
+    rw->split = pending_len;
+    rw->ticket = ++rewrite_queued;
+    rewrite_pending = rw;
+    int ticket = rw->ticket;
+
+    SDL_CondSignal(journal_work_cond);
+    SDL_UnlockMutex(journal_mutex);
+
+    journal_bytes = 0;
+    return ticket;
+}
+
+// Internal function to start the journal thread
+static int journal_init(const char *filename)
+{
+    if (journal_thread != NULL)
+        return 0;
+
+    journal_mutex = SDL_CreateMutex();
+    journal_work_cond = SDL_CreateCond();
+    journal_idle_cond = SDL_CreateCond();
+    journal_fname = strdup(filename);
+    journal_stop = 0;
+
+    journal_thread = SDL_CreateThread(journal_thread_fn, "journal", NULL);
+    if (journal_thread == NULL)
+    {
+        show_text("Failed to start journal!", 1000);
+        return 1;
+    }
+    return 0;
+}
+
+// Get the journal filename for a sub filename
+void journal_filename(const char *filename, char *buf, size_t sz)
+{
+    snprintf(buf, sz, "%s%s", filename, JOURNAL_EXT);
+}
+
+// Start a new journal on top of the base file that was just loaded
+void journal_start(const char *filename, const char *base_fname)
+{
+    if (journal_init(filename) != 0)
+        return;
+
+    JournalHeader header = {0};
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+
+    struct stat st;
+    if (base_fname != NULL && stat(base_fname, &st) == 0)
+    {
+        header.base_len = strlen(base_fname);
+        header.base_size = st.st_size;
+        header.base_mtime = st.st_mtime;
+        journal_base = strdup(base_fname);
+    }
+
+    JournalRewrite *rw = (JournalRewrite *)calloc(1, sizeof(JournalRewrite));
+    rw->pin = -1;
+    rw->head_size = align_up(sizeof(header) + header.base_len);
+    rw->head = (char *)calloc(rw->head_size, 1);
+    memcpy(rw->head, &header, sizeof(header));
+    memcpy(rw->head + sizeof(header), base_fname ? base_fname : "", header.base_len);
+
+    queue_rewrite(rw);
+}
+
+// Append a mutation to the journal
+// Only copies into a buffer, the journal thread writes it
+void journal_append(int op, uint32_t id, uint32_t pos, uint32_t len, double ts, const char *data)
+{
+    if (journal_thread == NULL)
+        return;
+
+    JournalRecord rec = {.op = op, .id = id, .pos = pos, .len = len, .ts = ts};
+    rec.checksum = record_checksum(&rec, data);
+    uint32_t data_len = record_data_len(&rec);
+    size_t size = sizeof(rec) + data_len;
+
+    SDL_LockMutex(journal_mutex);
+
+    if (pending_len + size > pending_cap)
+    {
+        while (pending_len + size > pending_cap)
+            pending_cap = pending_cap ? pending_cap * 2 : JOURNAL_BUF_SIZE;
+        pending_buf = (char *)realloc(pending_buf, pending_cap);
+    }
+
+    memcpy(pending_buf + pending_len, &rec, sizeof(rec));
+    if (data_len)
+        memcpy(pending_buf + pending_len + sizeof(rec), data, data_len);
+    pending_len += size;
+
+    SDL_CondSignal(journal_work_cond);
+    SDL_UnlockMutex(journal_mutex);
+
+    journal_bytes += size;
+    if (journal_bytes >= JOURNAL_COMPACT_SIZE)
+        journal_compact();
+}
+
+// Internal function to queue folding the journal into an image of the current subs
+// Return the ticket of the rewrite, 0 if there is no journal
+static int compact()
+{
+    if (journal_thread == NULL)
+        return 0;
+
+    // The journal being replaced may be mapped
+    subs_release_source(journal_fname);
+
+    JournalRewrite *rw = (JournalRewrite *)calloc(1, sizeof(JournalRewrite));
+    rw->head_size = sizeof(JournalHeader);
+    rw->head = (char *)calloc(1, sizeof(JournalHeader));
+
+    JournalHeader *header = (JournalHeader *)rw->head;
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->version = JOURNAL_VERSION;
+
+    // Records appended so far must be in the pinned version
+    store_publish();
+    rw->root = store_acquire(&rw->pin);
+    rw->focused_idx = get_focused_idx();
+    rw->cursor_pos = get_cursor_pos();
+    rw->mode = get_mode();
+
+    // No pin left, build the image here instead
+    if (rw->pin == -1)
+    {
+        rw->image = session_image(&rw->image_size);
+        header->image_size = rw->image_size;
+    }
+
+    free(journal_base);
+    journal_base = NULL;
+
+    return queue_rewrite(rw);
+}
+
+// Fold the journal into an embedded image of the current subs
+// The image is built and written by the journal thread
+void journal_compact()
+{
+    compact();
+}
+
+// Wait until the rewrite with the ticket is written, callable from any thread
+void journal_wait_rewrite(int ticket)
+{
+    if (ticket == 0)
+        return;
+
+    SDL_LockMutex(journal_mutex);
+    while (rewrite_done < ticket)
+        SDL_CondWait(journal_idle_cond, journal_mutex);
+    SDL_UnlockMutex(journal_mutex);
+}
+
+// Make sure the journal does not depend on a file about to be overwritten
+// Only queues the rewrite, the file must not be replaced before waiting
+// on the returned ticket, 0 if nothing has to be waited for
+int journal_release_base(const char *filename)
+{
+    if (journal_base == NULL || strcmp(journal_base, filename) != 0)
+        return 0;
+
+    return compact();
+}
+
+// Load the base of a journal left behind by a crash and replay it
+// Return 0 if subs were recovered
+int journal_recover(const char *filename)
+{
+    MappedFile map;
+    if (map_file(filename, &map) != 0)
+        return 1;
+
+    const JournalHeader *header = (const JournalHeader *)map.data;
+    if (map.size < sizeof(JournalHeader) ||
+        memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != JOURNAL_VERSION ||
+        header->base_len > map.size - sizeof(JournalHeader))
+        goto invalid;
+
+    uint64_t image_off = align_up(sizeof(JournalHeader) + header->base_len);
+    if (image_off > map.size || header->image_size > map.size - image_off)
+        goto invalid;
+    uint64_t off = image_off + align_up(header->image_size);
+
+    if (header->image_size > 0)
+    {
+        if (load_session_image(map.data + image_off, header->image_size) != 0)
+            goto invalid;
+    }
+    else if (header->base_len > 0)
+    {
+        char base_fname[512];
+        snprintf(base_fname, sizeof(base_fname), "%.*s", (int)header->base_len, map.data + sizeof(JournalHeader));
+
+        // Base was changed since the journal was started
+        struct stat st;
+        if (stat(base_fname, &st) != 0 || st.st_size != header->base_size || st.st_mtime != header->base_mtime)
+            goto invalid;
+
+        if (is_session_file(base_fname))
+        {
+            if (import_session(base_fname) != 0)
+                goto invalid;
+        }
+        else
+        {
+            import_sub(base_fname);
+        }
+    }
+    else
+    {
+        subs_load(NULL, 0, -1);
+    }
+
+    // Replay up to the first torn or corrupt record
+    int count = 0;
+    while (off + sizeof(JournalRecord) <= map.size)
+    {
+        JournalRecord rec;
+        memcpy(&rec, map.data + off, sizeof(rec));
+        const char *data = map.data + off + sizeof(rec);
+
+        uint32_t data_len = record_data_len(&rec);
+        if (data_len > map.size - off - sizeof(rec) || record_checksum(&rec, data) != rec.checksum)
+            break;
+
+        apply_journal_record(rec.op, rec.id, rec.pos, rec.len, rec.ts, data);
+        off += sizeof(rec) + data_len;
+        count++;
+    }
+
+    // Replayed edits are not undone one by one
+    undo_clear();
+
+    if (header->image_size > 0)
+        subs_set_source(&map, filename);
+    else
+        unmap_file(&map);
+
+    if (journal_init(filename) != 0)
+        return 0;
+
+    // Drop any torn tail and fold the recovered edits
+    journal_compact();
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Recovered %d unsaved changes", count);
+    show_text(msg, 2000);
+    return 0;
+
+invalid:
+    unmap_file(&map);
+    return 1;
+}
+
+// Stop the journal thread after writing everything queued
+// Removes the journal on a clean exit
+void journal_close(int remove_file)
+{
+    if (journal_thread == NULL)
+        return;
+
+    SDL_LockMutex(journal_mutex);
+    journal_stop = 1;
+    SDL_CondSignal(journal_work_cond);
+    SDL_UnlockMutex(journal_mutex);
+
+    SDL_WaitThread(journal_thread, NULL);
+    journal_thread = NULL;
+
+    if (remove_file)
+        remove(journal_fname);
+}
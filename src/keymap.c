@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <keymap.h>
+#include <command.h>
+#include <main.h>
+
+// Node of the key trie, one per bound prefix
+// Children are indexed by key, so each keypress is a single lookup
+typedef struct KeyNode
+{
+    short next[KEYMAP_KEYS];
+    int num_children;
+    int bound;
+    KeyAction action;
+} KeyNode;
+
+typedef struct KeyBinding
+{
+    int mode;
+    const char *keys;
+    KeyAction action;
+} KeyBinding;
+
+static const KeyBinding default_bindings[] = {
+    {KEYMAP_NORMAL, "f", {ACTION_FULLSCREEN, -1, 0}},
+    {KEYMAP_NORMAL, "j", {ACTION_SEEK, DEFAULT_COUNT_jk, DEFAULT_UNIT_j}},
+    {KEYMAP_NORMAL, "k", {ACTION_SEEK, DEFAULT_COUNT_jk, DEFAULT_UNIT_k}},
+    {KEYMAP_NORMAL, "J", {ACTION_SEEK, DEFAULT_COUNT_JK, DEFAULT_UNIT_J}},
+    {KEYMAP_NORMAL, "K", {ACTION_SEEK, DEFAULT_COUNT_JK, DEFAULT_UNIT_K}},
+    {KEYMAP_NORMAL, "[", {ACTION_FRAME_BACK, -1, 0}},
+    {KEYMAP_NORMAL, "]", {ACTION_FRAME_STEP, -1, 0}},
+    {KEYMAP_NORMAL, "n", {ACTION_SEARCH_NEXT, -1, 0}},
+    {KEYMAP_NORMAL, "N", {ACTION_SEARCH_PREV, -1, 0}},
+    {KEYMAP_NORMAL, "gg", {ACTION_SEEK_START, -1, 0}},
+    {KEYMAP_NORMAL, "gr", {ACTION_REFERENCE, -1, 0}},
+    {KEYMAP_NORMAL, "G", {ACTION_SEEK_END, -1, 0}},
+    {KEYMAP_NORMAL, "i", {ACTION_INSERT_END, DEFAULT_COUNT_i, 0}},
+    {KEYMAP_NORMAL, "I", {ACTION_INSERT_START, DEFAULT_COUNT_i, 0}},
+    {KEYMAP_NORMAL, "a", {ACTION_APPEND_SUB, -1, 0}},
+    {KEYMAP_NORMAL, "w", {ACTION_NEXT_SUB, DEFAULT_COUNT_WB, 0}},
+    {KEYMAP_NORMAL, "b", {ACTION_BACK_SUB, DEFAULT_COUNT_WB, 0}},
+    {KEYMAP_NORMAL, "e", {ACTION_SEEK_FOCUSED_END, -1, 0}},
+    {KEYMAP_NORMAL, "W", {ACTION_FOCUS_NEXT, DEFAULT_COUNT_WB, 0}},
+    {KEYMAP_NORMAL, "B", {ACTION_FOCUS_PREV, DEFAULT_COUNT_WB, 0}},
+    {KEYMAP_NORMAL, "h", {ACTION_SET_START, -1, 0}},
+    {KEYMAP_NORMAL, "l", {ACTION_SET_END, -1, 0}},
+    {KEYMAP_NORMAL, "r", {ACTION_RELOAD, -1, 0}},
+    {KEYMAP_NORMAL, "u", {ACTION_UNDO, 1, 0}},
+    {KEYMAP_NORMAL, "F", {ACTION_FOLLOW, -1, 0}},
+    {KEYMAP_NORMAL, "p", {ACTION_PUT, -1, 0}},
+    {KEYMAP_NORMAL, ".", {ACTION_REPEAT, -1, 0}},
+    {KEYMAP_NORMAL, "d", {ACTION_OP_DELETE, -1, 0}},
+    {KEYMAP_NORMAL, "y", {ACTION_OP_YANK, -1, 0}},
+    {KEYMAP_NORMAL, ">", {ACTION_OP_SHIFT, -1, DEFAULT_UNIT_SHIFT}},
+    {KEYMAP_NORMAL, "<", {ACTION_OP_SHIFT, -1, -DEFAULT_UNIT_SHIFT}},
+    {KEYMAP_OPERATOR, "w", {ACTION_MOTION_NEXT, -1, 0}},
+    {KEYMAP_OPERATOR, "b", {ACTION_MOTION_BACK, -1, 0}},
+    {KEYMAP_OPERATOR, "}", {ACTION_MOTION_PARA_NEXT, -1, 0}},
+    {KEYMAP_OPERATOR, "{", {ACTION_MOTION_PARA_PREV, -1, 0}},
+    {KEYMAP_OPERATOR, "gg", {ACTION_MOTION_FIRST, -1, 0}},
+    {KEYMAP_OPERATOR, "G", {ACTION_MOTION_LAST, -1, 0}},
+    {KEYMAP_OPERATOR, "ap", {ACTION_OBJECT_PARA, -1, 0}},
+    {KEYMAP_OPERATOR, "ip", {ACTION_OBJECT_PARA, -1, 0}},
+};
+
+// Names used in the config file, indexed by action
+static const char *action_names[NUM_ACTIONS] = {
+    [ACTION_NONE] = "nop",
+    [ACTION_FULLSCREEN] = "fullscreen",
+    [ACTION_SEEK] = "seek",
+    [ACTION_FRAME_BACK] = "frame_back",
+    [ACTION_FRAME_STEP] = "frame_step",
+    [ACTION_DELETE_SUB] = "delete_sub",
+    [ACTION_SEEK_START] = "seek_start",
+    [ACTION_SEEK_END] = "seek_end",
+    [ACTION_INSERT_END] = "insert_end",
+    [ACTION_INSERT_START] = "insert_start",
+    [ACTION_APPEND_SUB] = "append_sub",
+    [ACTION_NEXT_SUB] = "next_sub",
+    [ACTION_BACK_SUB] = "back_sub",
+    [ACTION_SEEK_FOCUSED_END] = "seek_sub_end",
+    [ACTION_FOCUS_NEXT] = "focus_next",
+    [ACTION_FOCUS_PREV] = "focus_prev",
+    [ACTION_SET_START] = "set_start",
+    [ACTION_SET_END] = "set_end",
+    [ACTION_RELOAD] = "reload",
+    [ACTION_UNDO] = "undo",
+    [ACTION_FOLLOW] = "follow",
+    [ACTION_PUT] = "put",
+    [ACTION_REPEAT] = "repeat",
+    [ACTION_SEARCH_NEXT] = "search_next",
+    [ACTION_SEARCH_PREV] = "search_prev",
+    [ACTION_REFERENCE] = "reference",
+    [ACTION_OP_DELETE] = "delete",
+    [ACTION_OP_YANK] = "yank",
+    [ACTION_OP_SHIFT] = "shift",
+    [ACTION_MOTION_LINES] = "lines",
+    [ACTION_MOTION_NEXT] = "next",
+    [ACTION_MOTION_BACK] = "back",
+    [ACTION_MOTION_PARA_NEXT] = "paragraph_next",
+    [ACTION_MOTION_PARA_PREV] = "paragraph_prev",
+    [ACTION_MOTION_FIRST] = "first",
+    [ACTION_MOTION_LAST] = "last",
+    [ACTION_OBJECT_PARA] = "paragraph",
+};
+
+// Node 0 is the root
+static KeyNode *key_nodes = NULL;
+static int num_key_nodes = 0;
+static int key_nodes_cap = 0;
+
+// Internal function to append an empty node
+static int new_node()
+{
+    if (num_key_nodes >= key_nodes_cap)
+    {
+        key_nodes_cap = key_nodes_cap ? key_nodes_cap * 2 : 64;
+        key_nodes = (KeyNode *)realloc(key_nodes, key_nodes_cap * sizeof(KeyNode));
+    }
+    memset(&key_nodes[num_key_nodes], 0, sizeof(KeyNode));
+    return num_key_nodes++;
+}
+
+// Internal function to check if a key can be part of a binding
+// Digits only start a count
+static inline int valid_key(char key)
+{
+    unsigned char c = key;
+    return c > ' ' && c < KEYMAP_KEYS && !isdigit(c);
+}
+
+// Bind a key sequence to an action in a mode, replacing any existing binding
+// Return 0 on success
+int keymap_bind(int mode, const char *keys, const KeyAction *action)
+{
+    int len = strlen(keys);
+    if (len == 0 || len > KEYMAP_MAX_SEQ || key_nodes == NULL)
+        return 1;
+    for (int i = 0; i < len; i++)
+    {
+        if (!valid_key(keys[i]))
+            return 1;
+    }
+
+    int node = mode;
+    for (int i = 0; i < len; i++)
+    {
+        int key = keys[i];
+        if (key_nodes[node].next[key] == 0)
+        {
+            // Nodes may move when growing
+            int child = new_node();
+            key_nodes[node].next[key] = child;
+            key_nodes[node].num_children++;
+        }
+        node = key_nodes[node].next[key];
+    }
+
+    key_nodes[node].bound = 1;
+    key_nodes[node].action = *action;
+    return 0;
+}
+
+// Remove the binding of a key sequence
+// Its node is kept, as longer bindings may pass through it
+// Return 0 on success
+int keymap_unbind(int mode, const char *keys)
+{
+    if (key_nodes == NULL)
+        return 1;
+
+    int node = mode;
+    for (; *keys; keys++)
+    {
+        if (!valid_key(*keys) || key_nodes[node].next[(int)*keys] == 0)
+            return 1;
+        node = key_nodes[node].next[(int)*keys];
+    }
+
+    if (!key_nodes[node].bound)
+        return 1;
+    key_nodes[node].bound = 0;
+    return 0;
+}
+
+// Internal function to find an action by its config name
+static int find_action(const char *name)
+{
+    for (int i = 0; i < NUM_ACTIONS; i++)
+    {
+        if (strcmp(action_names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Load bindings from a config file on top of the current ones
+// Lines are "map <keys> <action> [count] [unit]" or "unmap <keys>",
+// or omap and ounmap for motions after an operator
+// Return 0 on success, 1 if the file could not be read
+// Invalid lines are reported and skipped
+int keymap_load(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+        return 1;
+
+    char line[256];
+    int line_num = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line_num++;
+
+        char cmd[16], keys[16], name[32];
+        KeyAction action = {.count = -1};
+        int n = sscanf(line, "%15s %15s %31s %ld %lf", cmd, keys, name, &action.count, &action.unit);
+
+        // Blank lines and comments
+        if (n <= 0 || cmd[0] == '#')
+            continue;
+
+        // Motions are bound after an operator
+        int mode = cmd[0] == 'o' ? KEYMAP_OPERATOR : KEYMAP_NORMAL;
+        const char *verb = mode == KEYMAP_OPERATOR ? cmd + 1 : cmd;
+
+        int ok = 0;
+        if (strcmp(verb, "map") == 0 && n >= 3)
+        {
+            action.action = find_action(name);
+            ok = action.action >= 0 && keymap_bind(mode, keys, &action) == 0;
+        }
+        else if (strcmp(verb, "unmap") == 0 && n == 2)
+        {
+            ok = keymap_unbind(mode, keys) == 0;
+        }
+
+        if (!ok)
+        {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Invalid keymap on line %d!", line_num);
+            show_text(msg, 2000);
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+// Build the keymap from the defaults and the user config
+void keymap_init()
+{
+    // Roots of both modes
+    num_key_nodes = 0;
+    new_node();
+    new_node();
+
+    for (size_t i = 0; i < sizeof(default_bindings) / sizeof(default_bindings[0]); i++)
+        keymap_bind(default_bindings[i].mode, default_bindings[i].keys, &default_bindings[i].action);
+
+    // Config in the home directory takes precedence
+    const char *home = getenv("HOME");
+    if (home == NULL)
+        home = getenv("USERPROFILE");
+
+    char path[512];
+    if (home != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/%s", home, KEYMAP_CONFIG);
+        if (keymap_load(path) == 0)
+            return;
+    }
+    keymap_load(KEYMAP_CONFIG);
+}
+
+void keymap_reset(KeyState *state)
+{
+    state->node = KEYMAP_NORMAL;
+    state->count = -1;
+    state->op.action = ACTION_NONE;
+}
+
+// Internal function to finish a key sequence bound to an action
+// Operators wait for a motion, which completes them
+static int complete(KeyState *state, const KeyAction *action, KeyAction *out)
+{
+    if (state->op.action != ACTION_NONE)
+    {
+        // Counts before the operator and the motion multiply
+        long op_count = state->op.count;
+        *out = state->op;
+        out->motion = action->action;
+        if (op_count >= 0 || state->count >= 0)
+            out->count = (op_count >= 0 ? op_count : 1) * (state->count >= 0 ? state->count : 1);
+        keymap_reset(state);
+        return KEYMAP_MATCH;
+    }
+
+    *out = *action;
+    out->motion = ACTION_NONE;
+    if (state->count != -1)
+        out->count = state->count;
+
+    if (is_operator(action->action))
+    {
+        state->op = *out;
+        state->op_key = state->key;
+        state->node = KEYMAP_OPERATOR;
+        state->count = -1;
+        return KEYMAP_PENDING;
+    }
+
+    keymap_reset(state);
+    return KEYMAP_MATCH;
+}
+
+// Advance a key sequence by one key
+// On a match, the action is filled in with the count typed before it
+// The state is reset unless more keys are expected
+int keymap_feed(KeyState *state, char key, KeyAction *out)
+{
+    int root = state->op.action != ACTION_NONE ? KEYMAP_OPERATOR : KEYMAP_NORMAL;
+
+    // Counts are typed before the keys
+    if (state->node == root && isdigit((unsigned char)key))
+    {
+        if (state->count < 100000000)
+            state->count = (state->count == -1 ? 0 : state->count * 10) + (key - '0');
+        return KEYMAP_PENDING;
+    }
+
+    // Doubled operator applies to whole subs from the focused one
+    if (root == KEYMAP_OPERATOR && state->node == root && key == state->op_key)
+    {
+        KeyAction lines = {.action = ACTION_MOTION_LINES, .count = -1};
+        return complete(state, &lines, out);
+    }
+
+    const KeyNode *curr = &key_nodes[state->node];
+    int next = valid_key(key) ? curr->next[(int)key] : 0;
+
+    if (next != 0)
+    {
+        state->key = key;
+
+        // Wait in case a longer binding follows
+        if (key_nodes[next].num_children > 0)
+        {
+            state->node = next;
+            return KEYMAP_PENDING;
+        }
+        if (key_nodes[next].bound)
+            return complete(state, &key_nodes[next].action, out);
+    }
+
+    // Key does not continue the sequence, fall back to the prefix if bound
+    if (state->node != root && curr->bound)
+    {
+        // Key starts the motion of an operator bound to the prefix
+        if (complete(state, &curr->action, out) == KEYMAP_PENDING)
+            return keymap_feed(state, key, out);
+        return KEYMAP_MATCH_AGAIN;
+    }
+
+    keymap_reset(state);
+    return KEYMAP_NONE;
+}
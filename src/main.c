@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <SDL2/SDL.h>
 #include <mpv/client.h>
@@ -8,6 +10,17 @@
 #include <command.h>
 #include <utils.h>
 #include <subs.h>
+#include <session.h>
+#include <journal.h>
+#include <save.h>
+#include <keymap.h>
+#include <events.h>
+#include <preview.h>
+#include <reftrack.h>
+#include <replay.h>
+#include <trace.h>
+#include <codec.h>
+#include <transmem.h>
 
 // Extern globals
 
@@ -15,10 +28,27 @@ double curr_timestamp;
 int sub_reload_semaphore = 0;
 char *export_filename = NULL;
 
-static Uint32 wakeup_on_mpv_render_update, wakeup_on_mpv_events;
+static Uint32 wakeup_on_mpv_render_update, wakeup_on_mpv_events, wakeup_on_suggestions;
 static SDL_Window *window = NULL;
 static mpv_handle *mpv = NULL;
 
+// UI thread time spent on mpv messages, reported on exit
+static Uint64 mpv_message_ticks = 0;
+static long mpv_message_count = 0;
+
+// Set by :q and :wq, also ends a replay
+static int quit_requested = 0;
+
+// Preview reloads requested, reported by replays
+static long reload_count = 0;
+
+// Set once the subs to edit are loaded
+static int subs_loaded = 0;
+
+// Text of the input events handled in one go
+static char *text_batch = NULL;
+static size_t text_batch_cap = 0;
+
 static void die(const char *msg)
 {
     fprintf(stderr, "%s\n", msg);
@@ -30,16 +60,100 @@ static void *get_proc_address_mpv(void *fn_ctx, const char *name)
     return SDL_GL_GetProcAddress(name);
 }
 
-static void on_mpv_events(void *ctx)
+static void on_mpv_render_update(void *ctx)
 {
-    SDL_Event event = {.type = wakeup_on_mpv_events};
+    SDL_Event event = {.type = wakeup_on_mpv_render_update};
     SDL_PushEvent(&event);
 }
 
-static void on_mpv_render_update(void *ctx)
+// Internal function to submit an mpv command, traced by its name
+static void command_async(uint64_t userdata, const char **cmd)
 {
-    SDL_Event event = {.type = wakeup_on_mpv_render_update};
-    SDL_PushEvent(&event);
+    Uint64 span = TRACE_BEGIN();
+    mpv_command_async(mpv, userdata, cmd);
+    TRACE_END(span, "mpv", cmd[0]);
+}
+
+// Internal function to request an mpv property, replied to as a message
+static void get_property_async(uint64_t userdata, const char *name, mpv_format format)
+{
+    Uint64 span = TRACE_BEGIN();
+    mpv_get_property_async(mpv, userdata, name, format);
+    TRACE_END(span, "mpv", "get_property");
+}
+
+// Internal function to check if a keypress only types a character,
+// which the text input event after it carries
+static int is_typing_key(const SDL_KeyboardEvent *key)
+{
+    return key->keysym.sym >= SDLK_SPACE && key->keysym.sym < SDLK_DELETE &&
+           !(key->keysym.mod & (KMOD_CTRL | KMOD_ALT | KMOD_GUI));
+}
+
+// Collect the text of an input event and the text input events queued
+// behind it, so that pasting or fast typing is handled at once
+// Key releases, and in INSERT mode the keypresses typing the text, do
+// nothing and are skipped over
+// Stops at any other event to keep keypresses in order
+static const char *drain_text_input(SDL_Event *event)
+{
+    size_t len = 0;
+    while (1)
+    {
+        if (event->type == SDL_TEXTINPUT)
+        {
+            size_t n = strlen(event->text.text);
+            if (len + n + 1 > text_batch_cap)
+            {
+                text_batch_cap = text_batch_cap ? text_batch_cap * 2 : 256;
+                if (text_batch_cap < len + n + 1)
+                    text_batch_cap = len + n + 1;
+                text_batch = (char *)realloc(text_batch, text_batch_cap);
+            }
+            memcpy(text_batch + len, event->text.text, n + 1);
+            len += n;
+        }
+
+        if (SDL_PeepEvents(event, 1, SDL_PEEKEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT) != 1)
+            break;
+        int skip = event->type == SDL_TEXTINPUT || event->type == SDL_KEYUP ||
+                   (event->type == SDL_KEYDOWN && get_mode() == MODE_INSERT && is_typing_key(&event->key));
+        if (!skip || SDL_PeepEvents(event, 1, SDL_GETEVENT, event->type, event->type) != 1)
+            break;
+    }
+
+    return text_batch;
+}
+
+// Load subs to edit once the export filename is known
+// Unsaved changes left in the journal by a crash take precedence
+static void load_subs(int import)
+{
+    subs_loaded = 1;
+
+    char journal_fname[512];
+    journal_filename(export_filename, journal_fname, sizeof(journal_fname));
+    if (journal_recover(journal_fname) == 0)
+        return;
+
+    char session_fname[512];
+    session_filename(export_filename, session_fname, sizeof(session_fname));
+
+    // Reopen the saved session unless the sub was changed since
+    if (session_is_current(session_fname, export_filename) && import_session(session_fname) == 0)
+    {
+        journal_start(journal_fname, session_fname);
+    }
+    else if (import)
+    {
+        // Attempt to import specified sub for editing
+        import_sub(export_filename);
+        journal_start(journal_fname, export_filename);
+    }
+    else
+    {
+        journal_start(journal_fname, NULL);
+    }
 }
 
 // Function to be called when file is loaded
@@ -47,14 +161,13 @@ static inline void main_init()
 {
     if (export_filename != NULL)
     {
-        // Attempt to import specified sub for editing
-        import_sub(export_filename);
+        load_subs(1);
     }
     else
     {
         // Fetch the current video filename and set it as the default export filename
         export_filename = (char *)malloc(256 * sizeof(char));
-        mpv_get_property_async(mpv, REPLY_USERDATA_UPDATE_FILENAME, "filename", MPV_FORMAT_STRING);
+        get_property_async(REPLY_USERDATA_UPDATE_FILENAME, "filename", MPV_FORMAT_STRING);
     }
 
     subs_init();
@@ -67,7 +180,7 @@ void show_text(const char *text, const int duration)
     char duration_str[32];
     snprintf(duration_str, 32, "%d", duration);
     const char *cmd[] = {"show-text", text, duration_str, NULL};
-    mpv_command_async(mpv, 0, cmd);
+    command_async(0, cmd);
 }
 
 void set_window_title(const char *title)
@@ -85,36 +198,44 @@ void toggle_fullscreen()
     isFullscreen ^= 1;
 }
 
+// Leave the main loop, which stops everything in order
+void request_quit()
+{
+    quit_requested = 1;
+    SDL_Event event = {.type = SDL_QUIT};
+    SDL_PushEvent(&event);
+}
+
 // Playback
 
 void toggle_pause()
 {
     const char *cmd[] = {"cycle", "pause", NULL};
-    mpv_command_async(mpv, 0, cmd);
+    command_async(0, cmd);
 }
 
 void frame_step()
 {
     const char *cmd[] = {"frame-step", NULL};
-    mpv_command_async(mpv, 0, cmd);
+    command_async(0, cmd);
 }
 
 void frame_back_step()
 {
     const char *cmd[] = {"frame-back-step", NULL};
-    mpv_command_async(mpv, 0, cmd);
+    command_async(0, cmd);
 }
 
 void seek_start()
 {
     const char *cmd[] = {"seek", "0", "absolute-percent", "exact", NULL};
-    mpv_command_async(mpv, 0, cmd);
+    command_async(0, cmd);
 }
 
 void seek_end()
 {
     const char *cmd[] = {"seek", "100", "absolute-percent", "exact", NULL};
-    mpv_command_async(mpv, 0, cmd);
+    command_async(0, cmd);
 }
 
 void seek_absolute(const double value)
@@ -122,7 +243,7 @@ void seek_absolute(const double value)
     char value_str[32];
     snprintf(value_str, 32, "%f", value);
     const char *cmd[] = {"seek", value_str, "absolute", "exact", NULL};
-    mpv_command_async(mpv, 0, cmd);
+    command_async(0, cmd);
 }
 
 // Seek relative seconds from current position
@@ -131,7 +252,7 @@ void seek_relative(const double value)
     char value_str[32];
     snprintf(value_str, 32, "%f", value);
     const char *cmd[] = {"seek", value_str, "relative", "exact", NULL};
-    mpv_command_async(mpv, 0, cmd);
+    command_async(0, cmd);
 }
 
 // Subtitling
@@ -139,7 +260,7 @@ void seek_relative(const double value)
 void sub_add(const char *filename)
 {
     const char *cmd[] = {"sub-add", filename, NULL};
-    mpv_command_async(mpv, 0, cmd);
+    command_async(0, cmd);
 }
 
 // Internal function to call reload a second time
@@ -147,41 +268,198 @@ static void sub_reload2()
 {
     sub_reload_semaphore++;
     const char *cmd[] = {"sub-reload", NULL};
-    mpv_command_async(mpv, REPLY_USERDATA_SUB_RELOAD2, cmd);
+    command_async(REPLY_USERDATA_SUB_RELOAD2, cmd);
+}
+
+// Add a reference track without selecting it
+// Its id comes with the reply, to show it as the secondary sub
+void sub_add_reference(const char *filename, int ref)
+{
+    const char *cmd[] = {"sub-add", filename, "auto", "Reference", NULL};
+    command_async(REPLY_USERDATA_REF_ADDED + ref, cmd);
+}
+
+// Show a reference track below the subs being edited
+// Only the primary sub is reloaded on edits, so references cost nothing to keep
+void show_reference(long track_id)
+{
+    char id_str[32];
+    snprintf(id_str, sizeof(id_str), "%ld", track_id);
+    const char *cmd[] = {"set", "secondary-sid", id_str, NULL};
+    command_async(0, cmd);
 }
 
 void sub_reload()
 {
+    reload_count++;
     sub_reload_semaphore++;
     const char *cmd[] = {"sub-reload", NULL};
-    mpv_command_async(mpv, REPLY_USERDATA_SUB_RELOAD, cmd);
+    command_async(REPLY_USERDATA_SUB_RELOAD, cmd);
 }
 
-int main(int argc, char *argv[])
+// Handle an mpv event decoded by the event thread
+static void handle_mpv_message(const EventMessage *msg)
 {
-    if (argc < 2)
-        die("Usage: sbubby video.mp4 [sub.srt]");
-    if (argc > 2)
-        export_filename = argv[2];
+    switch (msg->type)
+    {
+    case EVENT_FILE_LOADED:
+        main_init();
+        break;
 
-    const char *video_fname = argv[1];
+    case EVENT_COMMAND_REPLY:
+        if (msg->userdata == REPLY_USERDATA_SUB_RELOAD)
+        {
+            sub_reload2();
+            sub_reload_semaphore--;
+        }
+        else if (msg->userdata == REPLY_USERDATA_SUB_RELOAD2)
+        {
+            sub_reload_semaphore--;
+        }
+        else if (msg->userdata >= REPLY_USERDATA_REF_ADDED && msg->userdata < REPLY_USERDATA_REF_ADDED + REF_MAX_TRACKS)
+        {
+            if (msg->error < 0 || msg->track_id < 0)
+            {
+                show_text("Failed to show reference!", 1000);
+                break;
+            }
 
-    mpv = mpv_create();
-    if (!mpv)
-        die("context init failed");
+            // Reloads of the subs being edited reorder the track list,
+            // so the id comes from the reply rather than the list
+            int ref = msg->userdata - REPLY_USERDATA_REF_ADDED;
+            ref_set_track_id(ref, msg->track_id);
+            if (ref == ref_active())
+                show_reference(ref_track_id(ref));
+        }
+        break;
 
-    // Some minor options can only be set before mpv_initialize().
-    if (mpv_initialize(mpv) < 0)
-        die("mpv init failed");
+    case EVENT_TIME_POS:
+        // Replays take the playhead from the session
+        if (msg->userdata == REPLY_USERDATA_UPDATE_TIMESTAMP && !replay_active())
+        {
+            record_time_pos(msg->time_pos);
+            handle_time_pos(msg->time_pos);
+        }
+        break;
 
-    mpv_request_log_messages(mpv, "debug");
+    case EVENT_STRING:
+        if (msg->userdata == REPLY_USERDATA_UPDATE_FILENAME)
+        {
+            snprintf(export_filename, 256, "%s.srt", msg->text);
 
-    // Jesus Christ SDL, you suck!
-    SDL_SetHint(SDL_HINT_NO_SIGNAL_HANDLERS, "no");
+            // Only the session or journal of the default sub is reopened
+            load_subs(0);
+            export_reload_sub();
+        }
+        break;
+    }
+}
 
-    if (SDL_Init(SDL_INIT_VIDEO) < 0)
-        die("SDL init failed");
+// Internal function to handle an mpv message, traced by its type
+static void dispatch_mpv_message(const EventMessage *msg)
+{
+    static const char *names[] = {
+        [EVENT_FILE_LOADED] = "file-loaded",
+        [EVENT_COMMAND_REPLY] = "command-reply",
+        [EVENT_TIME_POS] = "time-pos",
+        [EVENT_STRING] = "property-reply",
+    };
+
+    Uint64 span = TRACE_BEGIN();
+    handle_mpv_message(msg);
+    TRACE_END(span, "reply", names[msg->type]);
+}
+
+// Handle a single keypress, live or replayed
+static void handle_key(SDL_Keycode sym, Uint16 mod)
+{
+    switch (sym)
+    {
+    case SDLK_ESCAPE:
+        handle_escape();
+        break;
+    case SDLK_w:
+        if (mod & KMOD_CTRL)
+            handle_ctrl_backspace();
+        break;
+    case SDLK_BACKSPACE:
+        if (mod & KMOD_CTRL)
+        {
+            handle_ctrl_backspace();
+            break;
+        }
+        handle_backspace();
+        break;
+    case SDLK_DELETE:
+        if (mod & KMOD_CTRL)
+        {
+            handle_ctrl_delete();
+            break;
+        }
+        handle_delete();
+        break;
+    case SDLK_RETURN:
+        handle_return();
+        break;
+    case SDLK_LEFT:
+        if (mod & KMOD_CTRL)
+        {
+            handle_ctrl_left();
+            break;
+        }
+        handle_left();
+        break;
+    case SDLK_RIGHT:
+        if (mod & KMOD_CTRL)
+        {
+            handle_ctrl_right();
+            break;
+        }
+        handle_right();
+        break;
+    case SDLK_UP:
+        handle_up();
+        break;
+    case SDLK_DOWN:
+        handle_down();
+        break;
+    case SDLK_HOME:
+        set_cursor_start();
+        export_reload_sub();
+        break;
+    case SDLK_END:
+        set_cursor_end();
+        export_reload_sub();
+        break;
+    case SDLK_p:
+        // Universal pause shortcut
+        if (mod & KMOD_CTRL)
+            toggle_pause();
+        break;
+    case SDLK_c:
+        if (mod & KMOD_CTRL)
+            handle_ctrl_c();
+        break;
+    case SDLK_r:
+        if (mod & KMOD_CTRL)
+            handle_ctrl_r();
+        break;
+    case SDLK_n:
+        if (mod & KMOD_CTRL)
+            handle_ctrl_n();
+        break;
+    case SDLK_TAB:
+        handle_tab();
+        break;
+
+    default:
+        break;
+    }
+}
 
+// Create the window and the mpv renderer drawing into it
+static mpv_render_context *create_renderer()
+{
     window =
         SDL_CreateWindow("Sbubby", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
                          WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
@@ -217,6 +495,155 @@ int main(int argc, char *argv[])
     if (mpv_render_context_create(&mpv_gl, mpv, params) < 0)
         die("failed to initialize mpv GL context");
 
+    return mpv_gl;
+}
+
+// Internal function to handle the mpv messages queued by the event thread
+// Time spent is measured, live and when replaying
+static void drain_mpv_messages()
+{
+    Uint64 start = SDL_GetPerformanceCounter();
+    mpv_message_count += events_drain(dispatch_mpv_message);
+    mpv_message_ticks += SDL_GetPerformanceCounter() - start;
+}
+
+// Internal function to wait for and handle mpv messages while replaying
+static void pump_mpv_events()
+{
+    SDL_Event event;
+    if (SDL_WaitEventTimeout(&event, REPLAY_WAIT_MS) == 1 && event.type == wakeup_on_mpv_events)
+        drain_mpv_messages();
+    export_reload_flush();
+}
+
+// Feed a recorded session through the handlers as fast as they take it
+// Each event waits for the preview reloads it caused, so every change
+// is exported like when typing slowly
+static void run_replay()
+{
+    Uint32 start = SDL_GetTicks();
+    while (!subs_loaded)
+    {
+        if (SDL_GetTicks() - start > REPLAY_LOAD_TIMEOUT)
+            die("video did not load for replay");
+        pump_mpv_events();
+    }
+
+    ReplayEvent event;
+    while (!quit_requested && replay_next(&event) == 0)
+    {
+        Uint64 ticks = SDL_GetPerformanceCounter();
+        Uint64 span = TRACE_BEGIN();
+        switch (event.type)
+        {
+        case REPLAY_TEXT:
+            handle_text_input(event.text);
+            break;
+        case REPLAY_KEY:
+            handle_key(event.sym, event.mod);
+            break;
+        case REPLAY_PASTE:
+            handle_ctrl_v(event.text);
+            break;
+        case REPLAY_TIME_POS:
+            handle_time_pos(event.time_pos);
+            break;
+        }
+        handle_suggestions();
+        export_reload_flush();
+        TRACE_END(span, "replay", "dispatch");
+        replay_add_time(event.type, SDL_GetPerformanceCounter() - ticks);
+
+        while (sub_reload_semaphore != 0)
+            pump_mpv_events();
+    }
+
+    replay_report(reload_count);
+}
+
+int main(int argc, char *argv[])
+{
+    // Batch conversion needs neither a video nor a window
+    if (argc > 1 && strcmp(argv[1], "--convert") == 0)
+    {
+        if (argc != 4)
+            die(USAGE);
+        return convert_sub(argv[2], argv[3]) != 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--build-tm") == 0)
+    {
+        if (argc != 4)
+            die(USAGE);
+        return tm_build(argv[2], argv[3]) != 0;
+    }
+
+    // Options come before the video
+    const char *record_fname = NULL;
+    const char *replay_fname = NULL;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        if (strcmp(argv[arg], "--record") == 0)
+            record_fname = argv[arg + 1];
+        else if (strcmp(argv[arg], "--replay") == 0)
+            replay_fname = argv[arg + 1];
+        else
+            die(USAGE);
+    }
+
+    if (arg >= argc)
+        die(USAGE);
+    if (argc > arg + 1)
+        export_filename = argv[arg + 1];
+
+    const char *video_fname = argv[arg];
+
+    if (record_fname != NULL && record_start(record_fname) != 0)
+        die("failed to open recording");
+    if (replay_fname != NULL && replay_open(replay_fname) != 0)
+        die("failed to open recorded session");
+
+    mpv = mpv_create();
+    if (!mpv)
+        die("context init failed");
+
+    // Replays run headless and paused, with the playhead taken from the session
+    if (replay_fname != NULL)
+    {
+        mpv_set_option_string(mpv, "vo", "null");
+        mpv_set_option_string(mpv, "ao", "null");
+        mpv_set_option_string(mpv, "pause", "yes");
+    }
+
+    // Some minor options can only be set before mpv_initialize().
+    if (mpv_initialize(mpv) < 0)
+        die("mpv init failed");
+
+    // Log messages are printed by the event thread
+    const char *log_level = getenv("SBUBBY_LOG_LEVEL");
+    mpv_request_log_messages(mpv, log_level ? log_level : EVENTS_LOG_LEVEL);
+
+    // Tracing from startup, to the file SBUBBY_TRACE names or the default for 1
+    const char *trace_env = getenv("SBUBBY_TRACE");
+    if (trace_env != NULL && trace_start(strcmp(trace_env, "1") == 0 ? TRACE_FILENAME : trace_env) != 0)
+        die("failed to start tracing");
+
+    // Invalid bindings are reported once mpv is up
+    keymap_init();
+
+    // Jesus Christ SDL, you suck!
+    SDL_SetHint(SDL_HINT_NO_SIGNAL_HANDLERS, "no");
+    if (replay_fname != NULL)
+        SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+
+    if (SDL_Init(SDL_INIT_VIDEO) < 0)
+        die("SDL init failed");
+
+    // Replays have no window to render to
+    mpv_render_context *mpv_gl = NULL;
+    if (replay_fname == NULL)
+        mpv_gl = create_renderer();
+
     // We use events for thread-safe notification of the SDL main loop.
     // Generally, the wakeup callbacks (set further below) should do as least
     // work as possible, and merely wake up another thread to do actual work.
@@ -224,26 +651,44 @@ int main(int argc, char *argv[])
     // SDL_PushEvent() is thread-safe, so we use that.
     wakeup_on_mpv_render_update = SDL_RegisterEvents(1);
     wakeup_on_mpv_events = SDL_RegisterEvents(1);
+    wakeup_on_suggestions = SDL_RegisterEvents(1);
     if (wakeup_on_mpv_render_update == (Uint32)-1 ||
-        wakeup_on_mpv_events == (Uint32)-1)
+        wakeup_on_mpv_events == (Uint32)-1 ||
+        wakeup_on_suggestions == (Uint32)-1)
         die("could not register events");
 
-    // When normal mpv events are available.
-    mpv_set_wakeup_callback(mpv, on_mpv_events, NULL);
+    // Suggestions are looked up on their own thread, which wakes the main
+    // loop once they are found. SBUBBY_TM opens a memory from startup
+    tm_set_wakeup(wakeup_on_suggestions);
+    const char *tm_env = getenv("SBUBBY_TM");
+    if (tm_env != NULL && tm_open(tm_env) != 0)
+        die("failed to open translation memory");
+
+    // mpv events are decoded on their own thread, which wakes the main
+    // loop only with the messages it needs.
+    if (events_start(mpv, wakeup_on_mpv_events) != 0)
+        die("could not start event thread");
 
     // When there is a need to call mpv_render_context_update(), which can
     // request a new frame to be rendered.
     // (Separate from the normal event handling mechanism for the sake of
     //  users which run OpenGL on a different thread.)
-    mpv_render_context_set_update_callback(mpv_gl, on_mpv_render_update, NULL);
+    if (mpv_gl != NULL)
+        mpv_render_context_set_update_callback(mpv_gl, on_mpv_render_update, NULL);
 
     // Loop the video
     const char *cmd_loop[] = {"set", "loop", "inf", NULL};
-    mpv_command_async(mpv, 0, cmd_loop);
+    command_async(0, cmd_loop);
 
     // Play this file.
     const char *cmd[] = {"loadfile", video_fname, NULL};
-    mpv_command_async(mpv, 0, cmd);
+    command_async(0, cmd);
+
+    if (replay_fname != NULL)
+    {
+        run_replay();
+        goto done;
+    }
 
     while (1)
     {
@@ -251,153 +696,68 @@ int main(int argc, char *argv[])
         if (SDL_WaitEvent(&event) != 1)
             die("event loop error");
         int redraw = 0;
-        switch (event.type)
+        Uint64 span = TRACE_BEGIN();
+
+        // Every queued event is handled before the preview is reloaded once
+        do
         {
-        case SDL_QUIT:
-            goto done;
-        case SDL_WINDOWEVENT:
-            if (event.window.event == SDL_WINDOWEVENT_EXPOSED)
-                redraw = 1;
-            break;
-        case SDL_TEXTINPUT:
-            // Continuous text input
-            handle_text_input(event.text.text);
-            break;
-        case SDL_KEYDOWN:
-            // Single keypresses
-            switch (event.key.keysym.sym)
+            switch (event.type)
             {
-            case SDLK_ESCAPE:
-                handle_escape();
-                break;
-            case SDLK_w:
-                if (SDL_GetModState() & KMOD_CTRL)
-                    handle_ctrl_backspace();
-                break;
-            case SDLK_BACKSPACE:
-                if (SDL_GetModState() & KMOD_CTRL)
-                {
-                    handle_ctrl_backspace();
-                    break;
-                }
-                handle_backspace();
-                break;
-            case SDLK_DELETE:
-                if (SDL_GetModState() & KMOD_CTRL)
-                {
-                    handle_ctrl_delete();
-                    break;
-                }
-                handle_delete();
-                break;
-            case SDLK_RETURN:
-                handle_return();
+            case SDL_QUIT:
+                goto done;
+            case SDL_WINDOWEVENT:
+                if (event.window.event == SDL_WINDOWEVENT_EXPOSED)
+                    redraw = 1;
                 break;
-            case SDLK_LEFT:
-                if (SDL_GetModState() & KMOD_CTRL)
-                {
-                    handle_ctrl_left();
-                    break;
-                }
-                handle_left();
+            case SDL_TEXTINPUT:
+            {
+                // Continuous text input
+                const char *text = drain_text_input(&event);
+                record_text(text);
+                handle_text_input(text);
                 break;
-            case SDLK_RIGHT:
-                if (SDL_GetModState() & KMOD_CTRL)
+            }
+            case SDL_KEYDOWN:
+            {
+                // Single keypresses
+                SDL_Keycode sym = event.key.keysym.sym;
+                Uint16 mod = SDL_GetModState();
+                if (sym == SDLK_v && (mod & KMOD_CTRL))
                 {
-                    handle_ctrl_right();
+                    char *text = SDL_GetClipboardText();
+                    record_paste(text);
+                    handle_ctrl_v(text);
+                    SDL_free(text);
                     break;
                 }
-                handle_right();
-                break;
-            case SDLK_HOME:
-                set_cursor_start();
-                export_reload_sub();
-                break;
-            case SDLK_END:
-                set_cursor_end();
-                export_reload_sub();
+                record_key(sym, mod);
+                handle_key(sym, mod);
                 break;
-            case SDLK_p:
-                // Universal pause shortcut
-                if (SDL_GetModState() & KMOD_CTRL)
-                    toggle_pause();
-                break;
-            case SDLK_c:
-                if (SDL_GetModState() & KMOD_CTRL)
-                    handle_ctrl_c();
-                break;
-
-            default:
-                break;
-            }
-            break;
-        default:
-            // Happens when there is new work for the render thread (such as
-            // rendering a new video frame or redrawing it).
-            if (event.type == wakeup_on_mpv_render_update)
-            {
-                uint64_t flags = mpv_render_context_update(mpv_gl);
-                if (flags & MPV_RENDER_UPDATE_FRAME)
-                    redraw = 1;
             }
-            // Happens when at least 1 new event is in the mpv event queue.
-            if (event.type == wakeup_on_mpv_events)
-            {
-                // Handle all remaining mpv events.
-                while (1)
+            default:
+                // Happens when there is new work for the render thread (such as
+                // rendering a new video frame or redrawing it).
+                if (event.type == wakeup_on_mpv_render_update)
                 {
-                    mpv_event *mp_event = mpv_wait_event(mpv, 0);
-                    if (mp_event->event_id == MPV_EVENT_FILE_LOADED)
-                    {
-                        main_init();
-                    }
-                    if (mp_event->event_id == MPV_EVENT_COMMAND_REPLY)
-                    {
-                        if (mp_event->reply_userdata == REPLY_USERDATA_SUB_RELOAD)
-                        {
-                            sub_reload2();
-                            sub_reload_semaphore--;
-                        }
-                        else if (mp_event->reply_userdata == REPLY_USERDATA_SUB_RELOAD2)
-                        {
-                            sub_reload_semaphore--;
-                        }
-                    }
-                    if (mp_event->event_id == MPV_EVENT_GET_PROPERTY_REPLY)
-                    {
-                        mpv_event_property *evp = (mpv_event_property *)(mp_event->data);
-
-                        if (mp_event->reply_userdata == REPLY_USERDATA_UPDATE_TIMESTAMP)
-                        {
-                            curr_timestamp = *(double *)(evp->data);
-                        }
-                        else if (mp_event->reply_userdata == REPLY_USERDATA_UPDATE_FILENAME)
-                        {
-                            snprintf(export_filename, 256, "%s.srt", *(char **)(evp->data));
-                        }
-                    }
-                    if (mp_event->event_id == MPV_EVENT_NONE)
-                        break;
-                    if (mp_event->event_id == MPV_EVENT_LOG_MESSAGE)
-                    {
-                        // mpv_event_log_message *msg = mp_event->data;
-                        // Print log messages about DR allocations, just to
-                        // test whether it works. If there is more than 1 of
-                        // these, it works. (The log message can actually change
-                        // any time, so it's possible this logging stops working
-                        // in the future.)
-                        // if (strstr(msg->text, "DR image"))
-                        // printf("log: %s", msg->text);
-                        continue;
-                    }
-                    // printf("event: %s\n", mpv_event_name(mp_event->event_id));
+                    uint64_t flags = mpv_render_context_update(mpv_gl);
+                    if (flags & MPV_RENDER_UPDATE_FRAME)
+                        redraw = 1;
                 }
+                // Happens when the event thread queued at least 1 message.
+                if (event.type == wakeup_on_mpv_events)
+                    drain_mpv_messages();
             }
-        }
+        } while (SDL_PollEvent(&event) == 1);
+
+        // Also takes the suggestions woken up for
+        handle_suggestions();
+        export_reload_flush();
+        TRACE_END(span, "sdl", "dispatch");
+
         if (redraw)
         {
             // Get timestamp every frame
-            mpv_get_property_async(mpv, REPLY_USERDATA_UPDATE_TIMESTAMP, "time-pos", MPV_FORMAT_DOUBLE);
+            get_property_async(REPLY_USERDATA_UPDATE_TIMESTAMP, "time-pos", MPV_FORMAT_DOUBLE);
 
             int w, h;
             SDL_GetWindowSize(window, &w, &h);
@@ -416,15 +776,34 @@ int main(int argc, char *argv[])
                 {0}};
             // See render_gl.h on what OpenGL environment mpv expects, and
             // other API details.
+            span = TRACE_BEGIN();
             mpv_render_context_render(mpv_gl, params);
+            TRACE_END(span, "render", "mpv_render_context_render");
+
+            span = TRACE_BEGIN();
             SDL_GL_SwapWindow(window);
+            TRACE_END(span, "render", "SDL_GL_SwapWindow");
         }
     }
 done:
+    events_stop();
+    tm_close();
+    save_close();
+    journal_close(1);
+    preview_close();
+    ref_close();
+    record_close();
+    replay_close();
+    // Threads above trace until they are stopped
+    trace_close();
+
+    printf("%ld mpv messages took %.1f ms on the UI thread\n", mpv_message_count,
+           mpv_message_ticks * 1000.0 / SDL_GetPerformanceFrequency());
 
     // Destroy the GL renderer and all of the GL objects it allocated. If video
     // is still running, the video track will be deselected.
-    mpv_render_context_free(mpv_gl);
+    if (mpv_gl != NULL)
+        mpv_render_context_free(mpv_gl);
 
     mpv_destroy(mpv);
 
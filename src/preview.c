@@ -0,0 +1,115 @@
+// memfd_create
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include <preview.h>
+
+// Temp files are kept in memory by Windows until closed
+#ifdef _WIN32
+#define PREVIEW_MODE "wT"
+#define getpid _getpid
+#else
+#define PREVIEW_MODE "w"
+#endif
+
+// Stream the preview is rewritten through, kept open for mpv to reread
+static FILE *preview_fp = NULL;
+static char preview_fname[512];
+// Set if the preview is a temp file to remove when closed
+static int preview_is_file = 0;
+
+// Internal function to create the preview in memory, or else as a temp file
+// in a memory backed directory, never next to the subs being edited
+// Return 0 on success
+static int preview_create()
+{
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    // mpv runs in this process, so it can open the file through our fd
+    int fd = memfd_create(PREVIEW_NAME, MFD_CLOEXEC);
+    if (fd != -1)
+    {
+        preview_fp = fdopen(fd, PREVIEW_MODE);
+        if (preview_fp != NULL)
+        {
+            snprintf(preview_fname, sizeof(preview_fname), "/proc/self/fd/%d", fd);
+            return 0;
+        }
+        close(fd);
+    }
+#endif
+
+    // tmpfs first, then wherever the system keeps temp files
+    const char *dirs[] = {getenv("XDG_RUNTIME_DIR"), "/dev/shm", getenv("TMPDIR"), getenv("TEMP"), getenv("TMP"), "/tmp"};
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++)
+    {
+        if (dirs[i] == NULL || dirs[i][0] == '\0')
+            continue;
+
+        snprintf(preview_fname, sizeof(preview_fname), "%s/%s-%d.srt", dirs[i], PREVIEW_NAME, (int)getpid());
+        preview_fp = fopen(preview_fname, PREVIEW_MODE);
+        if (preview_fp != NULL)
+        {
+            preview_is_file = 1;
+            return 0;
+        }
+    }
+
+    preview_fname[0] = '\0';
+    return 1;
+}
+
+// Get the preview emptied for writing
+// Returns NULL if the preview could not be created
+FILE *preview_open()
+{
+    if (preview_fp == NULL)
+        return preview_create() == 0 ? preview_fp : NULL;
+
+    fflush(preview_fp);
+#ifdef _WIN32
+    _chsize(_fileno(preview_fp), 0);
+#else
+    if (ftruncate(fileno(preview_fp), 0) != 0)
+        return NULL;
+#endif
+    rewind(preview_fp);
+    return preview_fp;
+}
+
+// Make the written preview visible to mpv
+// Return 0 on success
+int preview_commit(FILE *fp)
+{
+    return fflush(fp) != 0 || ferror(fp);
+}
+
+// Path mpv reads the preview from
+const char *preview_path()
+{
+    if (preview_fp == NULL)
+        preview_create();
+    return preview_fname;
+}
+
+void preview_close()
+{
+    if (preview_fp == NULL)
+        return;
+
+    fclose(preview_fp);
+    preview_fp = NULL;
+    if (preview_is_file)
+        remove(preview_fname);
+    preview_is_file = 0;
+}
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <reftrack.h>
+#include <utils.h>
+#include <encoding.h>
+
+// A read-only track of cues shown beside the subs being edited
+typedef struct RefTrack
+{
+    char *filename;
+    MappedFile map;
+    // Track id given by mpv once added, or -1
+    long track_id;
+    // Cues in order of start, NULL until first looked up
+    RefCue *cues;
+    int num_cues;
+    // Longest cue, bounding how far back an overlapping cue can start
+    double max_duration;
+} RefTrack;
+
+static RefTrack ref_tracks[REF_MAX_TRACKS];
+static int num_ref_tracks = 0;
+// Track shown by mpv and looked up, or -1
+static int ref_active_idx = -1;
+
+// Internal function to order cues by start, keeping file order for ties
+static int compare_cues(const void *a, const void *b)
+{
+    const RefCue *cue_a = (const RefCue *)a;
+    const RefCue *cue_b = (const RefCue *)b;
+    if (cue_a->start_ts != cue_b->start_ts)
+        return cue_a->start_ts < cue_b->start_ts ? -1 : 1;
+    return cue_a->text < cue_b->text ? -1 : cue_a->text > cue_b->text;
+}
+
+// Internal function to set the text of a cue, ending at the next index
+// line if there is one and trimming trailing line breaks
+static void set_cue_text(RefCue *cue, const char *start, const char *end)
+{
+    while (end > start && (end[-1] == '\n' || end[-1] == '\r'))
+        end--;
+    cue->text = start;
+    cue->len = end - start;
+}
+
+// Internal function to index the cues of a track the first time it is looked up
+// Only timing lines are parsed, text stays in the mapped file
+static void parse_track(RefTrack *track)
+{
+    if (track->cues != NULL)
+        return;
+
+    const char *p = track->map.data;
+    const char *end = track->map.data + track->map.size;
+
+    // Skip UTF-8 BOM
+    if (end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0)
+        p += 3;
+
+    int cap = 1024;
+    track->cues = (RefCue *)malloc(cap * sizeof(RefCue));
+    track->num_cues = 0;
+    track->max_duration = 0;
+
+    int ordered = 1;
+    const char *text_start = NULL;
+    // Start of the previous line if it is a cue index
+    const char *index_line = NULL;
+
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        const char *line_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+
+        double start_ts, end_ts;
+        if (scan_timing_line(p, line_end, &start_ts, &end_ts))
+        {
+            if (track->num_cues > 0)
+                set_cue_text(&track->cues[track->num_cues - 1], text_start, index_line ? index_line : p);
+
+            if (track->num_cues == cap)
+            {
+                cap *= 2;
+                track->cues = (RefCue *)realloc(track->cues, cap * sizeof(RefCue));
+            }
+
+            RefCue *cue = &track->cues[track->num_cues++];
+            cue->start_ts = start_ts;
+            cue->end_ts = end_ts;
+            cue->text = NULL;
+            cue->len = 0;
+
+            if (track->num_cues > 1 && start_ts < cue[-1].start_ts)
+                ordered = 0;
+            if (end_ts - start_ts > track->max_duration)
+                track->max_duration = end_ts - start_ts;
+
+            text_start = eol < end ? eol + 1 : end;
+            index_line = NULL;
+        }
+        else
+        {
+            index_line = is_index_line(p, line_end) ? p : NULL;
+        }
+
+        p = eol + 1;
+    }
+
+    if (track->num_cues > 0)
+        set_cue_text(&track->cues[track->num_cues - 1], text_start, end);
+
+    if (!ordered)
+        qsort(track->cues, track->num_cues, sizeof(RefCue), compare_cues);
+}
+
+// Map a srt file as a reference track and make it the active one
+// Cues are only parsed once looked up
+// Returns the index of the track, or -1 on failure
+int ref_load(const char *filename)
+{
+    if (num_ref_tracks >= REF_MAX_TRACKS)
+        return -1;
+
+    RefTrack *track = &ref_tracks[num_ref_tracks];
+    memset(track, 0, sizeof(RefTrack));
+    if (map_file(filename, &track->map) != 0)
+        return -1;
+    decode_file(&track->map);
+
+    track->filename = strdup(filename);
+    track->track_id = -1;
+    ref_active_idx = num_ref_tracks;
+    return num_ref_tracks++;
+}
+
+int ref_count()
+{
+    return num_ref_tracks;
+}
+
+const char *ref_filename(int ref)
+{
+    return ref >= 0 && ref < num_ref_tracks ? ref_tracks[ref].filename : NULL;
+}
+
+// Remember the mpv track showing a reference track
+void ref_set_track_id(int ref, long track_id)
+{
+    if (ref >= 0 && ref < num_ref_tracks)
+        ref_tracks[ref].track_id = track_id;
+}
+
+long ref_track_id(int ref)
+{
+    return ref >= 0 && ref < num_ref_tracks ? ref_tracks[ref].track_id : -1;
+}
+
+int ref_active()
+{
+    return ref_active_idx;
+}
+
+void ref_set_active(int ref)
+{
+    if (ref >= 0 && ref < num_ref_tracks)
+        ref_active_idx = ref;
+}
+
+// Find the cue of a reference track overlapping an interval the most
+// Cues starting too early to reach the interval are skipped by binary search,
+// like the subs in a frame
+// Returns NULL if no cue overlaps, idx is set to the index of the cue
+const RefCue *ref_find_overlap(int ref, double start_ts, double end_ts, int *idx)
+{
+    if (ref < 0 || ref >= num_ref_tracks)
+        return NULL;
+
+    RefTrack *track = &ref_tracks[ref];
+    parse_track(track);
+
+    // Empty subs look up the cue at their start
+    if (end_ts <= start_ts)
+        end_ts = start_ts + 0.001;
+
+    // First cue starting after the interval ends
+    int lo = 0;
+    int hi = track->num_cues;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (track->cues[mid].start_ts < end_ts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    const RefCue *best = NULL;
+    double best_overlap = -1;
+    for (int i = lo - 1; i >= 0 && track->cues[i].start_ts >= start_ts - track->max_duration; i--)
+    {
+        const RefCue *cue = &track->cues[i];
+        double overlap = (cue->end_ts < end_ts ? cue->end_ts : end_ts) - (cue->start_ts > start_ts ? cue->start_ts : start_ts);
+        if (overlap > 0 && overlap >= best_overlap)
+        {
+            best = cue;
+            best_overlap = overlap;
+            *idx = i;
+        }
+    }
+    return best;
+}
+
+void ref_close()
+{
+    for (int i = 0; i < num_ref_tracks; i++)
+    {
+        free(ref_tracks[i].filename);
+        free(ref_tracks[i].cues);
+        unmap_file(&ref_tracks[i].map);
+    }
+    num_ref_tracks = 0;
+    ref_active_idx = -1;
+}
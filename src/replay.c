@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <SDL2/SDL.h>
+
+#include <replay.h>
+#include <store.h>
+
+static FILE *record_fp = NULL;
+static Uint32 record_start_ms = 0;
+
+// Escaping at most doubles the text of a line
+#define REPLAY_LINE_SIZE (2 * RECORD_MAX_TEXT + 64)
+
+static FILE *replay_fp = NULL;
+static char *replay_line = NULL;
+static char *replay_text = NULL;
+
+// Handling time of each replayed event, in ticks, by type
+static Uint64 *replay_ticks[REPLAY_NUM_TYPES];
+static int replay_ticks_len[REPLAY_NUM_TYPES];
+static int replay_ticks_cap[REPLAY_NUM_TYPES];
+
+static const char *replay_type_names[REPLAY_NUM_TYPES] = {
+    [REPLAY_TEXT] = "text",
+    [REPLAY_KEY] = "key",
+    [REPLAY_PASTE] = "paste",
+    [REPLAY_TIME_POS] = "time-pos",
+};
+
+// Record every key, text and playhead event handled to a file
+// Return 0 on success
+int record_start(const char *filename)
+{
+    record_fp = fopen(filename, "w");
+    if (record_fp == NULL)
+        return 1;
+
+    fprintf(record_fp, "%s\n", RECORD_MAGIC);
+    record_start_ms = SDL_GetTicks();
+    return 0;
+}
+
+// Internal function to write a text with line breaks and backslashes escaped
+static void write_escaped(const char *text)
+{
+    for (int n = 0; *text && n < RECORD_MAX_TEXT; text++, n++)
+    {
+        if (*text == '\\')
+            fputs("\\\\", record_fp);
+        else if (*text == '\n')
+            fputs("\\n", record_fp);
+        else if (*text == '\r')
+            fputs("\\r", record_fp);
+        else
+            fputc(*text, record_fp);
+    }
+    fputc('\n', record_fp);
+}
+
+void record_text(const char *text)
+{
+    if (record_fp == NULL)
+        return;
+    fprintf(record_fp, "%u t ", SDL_GetTicks() - record_start_ms);
+    write_escaped(text);
+}
+
+void record_key(SDL_Keycode sym, Uint16 mod)
+{
+    if (record_fp == NULL)
+        return;
+    fprintf(record_fp, "%u k %d %u\n", SDL_GetTicks() - record_start_ms, (int)sym, (unsigned int)mod);
+}
+
+// Clipboard text is recorded rather than the key, so the same text is pasted
+void record_paste(const char *text)
+{
+    if (record_fp == NULL || text == NULL)
+        return;
+    fprintf(record_fp, "%u v ", SDL_GetTicks() - record_start_ms);
+    write_escaped(text);
+}
+
+// The playhead is recorded as it moves focus and reloads the preview
+void record_time_pos(double ts)
+{
+    if (record_fp == NULL)
+        return;
+    fprintf(record_fp, "%u p %.6f\n", SDL_GetTicks() - record_start_ms, ts);
+}
+
+void record_close()
+{
+    if (record_fp == NULL)
+        return;
+    fclose(record_fp);
+    record_fp = NULL;
+}
+
+// Open a recorded session to replay
+// Return 0 on success
+int replay_open(const char *filename)
+{
+    replay_fp = fopen(filename, "r");
+    if (replay_fp == NULL)
+        return 1;
+
+    replay_line = (char *)malloc(REPLAY_LINE_SIZE);
+    replay_text = (char *)malloc(RECORD_MAX_TEXT + 1);
+
+    if (fgets(replay_line, REPLAY_LINE_SIZE, replay_fp) == NULL ||
+        strncmp(replay_line, RECORD_MAGIC, strlen(RECORD_MAGIC)) != 0)
+    {
+        replay_close();
+        return 1;
+    }
+    return 0;
+}
+
+int replay_active()
+{
+    return replay_fp != NULL;
+}
+
+// Internal function to unescape recorded text into the event text buffer
+static void read_escaped(const char *src)
+{
+    char *out = replay_text;
+    for (; *src && *src != '\n' && out < replay_text + RECORD_MAX_TEXT; src++)
+    {
+        if (*src == '\\' && src[1] != '\0')
+        {
+            src++;
+            *out++ = *src == 'n' ? '\n' : *src == 'r' ? '\r' : *src;
+        }
+        else
+        {
+            *out++ = *src;
+        }
+    }
+    *out = '\0';
+}
+
+// Read the next recorded event
+// Return 0 on success, 1 at the end of the session
+// Malformed lines are skipped
+int replay_next(ReplayEvent *event)
+{
+    while (fgets(replay_line, REPLAY_LINE_SIZE, replay_fp) != NULL)
+    {
+        unsigned int ms;
+        char type;
+        int pos;
+        if (sscanf(replay_line, "%u %c%n", &ms, &type, &pos) < 2 || replay_line[pos] != ' ')
+            continue;
+
+        memset(event, 0, sizeof(ReplayEvent));
+        event->ms = ms;
+        const char *args = replay_line + pos + 1;
+
+        switch (type)
+        {
+        case 't':
+        case 'v':
+            // Text may begin with spaces of its own
+            read_escaped(args);
+            event->type = type == 't' ? REPLAY_TEXT : REPLAY_PASTE;
+            event->text = replay_text;
+            return 0;
+
+        case 'k':
+        {
+            int sym;
+            unsigned int mod;
+            if (sscanf(args, "%d %u", &sym, &mod) != 2)
+                continue;
+            event->type = REPLAY_KEY;
+            event->sym = sym;
+            event->mod = mod;
+            return 0;
+        }
+
+        case 'p':
+            if (sscanf(args, "%lf", &event->time_pos) != 1)
+                continue;
+            event->type = REPLAY_TIME_POS;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Note how long handling a replayed event took
+void replay_add_time(int type, Uint64 ticks)
+{
+    if (replay_ticks_len[type] == replay_ticks_cap[type])
+    {
+        replay_ticks_cap[type] = replay_ticks_cap[type] ? replay_ticks_cap[type] * 2 : 256;
+        replay_ticks[type] = (Uint64 *)realloc(replay_ticks[type], replay_ticks_cap[type] * sizeof(Uint64));
+    }
+    replay_ticks[type][replay_ticks_len[type]++] = ticks;
+}
+
+static int compare_ticks(const void *a, const void *b)
+{
+    Uint64 ticks_a = *(const Uint64 *)a;
+    Uint64 ticks_b = *(const Uint64 *)b;
+    return ticks_a < ticks_b ? -1 : ticks_a > ticks_b;
+}
+
+// Internal function to hash the subs, to compare the end state of replays
+// Timestamps are hashed in whole milliseconds
+static uint64_t subs_checksum()
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    StoreIter it;
+    store_iter_init(&it, store_working(), 0);
+    const SubRecord *rec;
+    while ((rec = store_iter_next(&it)) != NULL)
+    {
+        long long parts[2] = {llround(rec->start_ts * 1000), llround(rec->end_ts * 1000)};
+        const unsigned char *bytes = (const unsigned char *)parts;
+        for (size_t i = 0; i < sizeof(parts); i++)
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        for (int i = 0; i < rec->len; i++)
+            hash = (hash ^ (unsigned char)rec->text[i]) * 1099511628211ULL;
+        hash = (hash ^ 0xFF) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Print the handling time of the replayed events by type,
+// the preview reloads and a checksum of the subs
+void replay_report(long reloads)
+{
+    double ms_per_tick = 1000.0 / SDL_GetPerformanceFrequency();
+    Uint64 total = 0;
+    int count = 0;
+
+    printf("%-9s %8s %10s %10s %10s %10s\n", "event", "count", "mean ms", "p50 ms", "p99 ms", "max ms");
+    for (int type = 0; type < REPLAY_NUM_TYPES; type++)
+    {
+        int n = replay_ticks_len[type];
+        if (n == 0)
+            continue;
+
+        Uint64 *ticks = replay_ticks[type];
+        qsort(ticks, n, sizeof(Uint64), compare_ticks);
+
+        Uint64 sum = 0;
+        for (int i = 0; i < n; i++)
+            sum += ticks[i];
+        total += sum;
+        count += n;
+
+        printf("%-9s %8d %10.3f %10.3f %10.3f %10.3f\n", replay_type_names[type], n,
+               sum * ms_per_tick / n, ticks[n / 2] * ms_per_tick, ticks[(int)(n * 0.99)] * ms_per_tick,
+               ticks[n - 1] * ms_per_tick);
+    }
+
+    printf("%d events handled in %.1f ms\n", count, total * ms_per_tick);
+    printf("%ld preview reloads\n", reloads);
+    printf("checksum %016llx\n", (unsigned long long)subs_checksum());
+}
+
+void replay_close()
+{
+    if (replay_fp != NULL)
+        fclose(replay_fp);
+    replay_fp = NULL;
+
+    free(replay_line);
+    free(replay_text);
+    replay_line = NULL;
+    replay_text = NULL;
+
+    for (int type = 0; type < REPLAY_NUM_TYPES; type++)
+    {
+        free(replay_ticks[type]);
+        replay_ticks[type] = NULL;
+        replay_ticks_len[type] = 0;
+        replay_ticks_cap[type] = 0;
+    }
+}
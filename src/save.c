@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include <save.h>
+#include <store.h>
+#include <utils.h>
+#include <main.h>
+#include <subs.h>
+#include <journal.h>
+#include <codec.h>
+
+// A pinned version of the subs to be written to a file
+typedef struct SaveJob
+{
+    char *filename;
+    // Format picked by the extension of the filename
+    int format;
+    const StoreNode *root;
+    int pin;
+    // Journal rewrite that must be written before the file is replaced
+    int journal_ticket;
+    struct SaveJob *next;
+} SaveJob;
+
+static SDL_Thread *save_thread = NULL;
+static SDL_mutex *save_mutex = NULL;
+// Signalled when there is a job for the save thread
+static SDL_cond *save_work_cond = NULL;
+// Signalled when the save thread is idle
+static SDL_cond *save_idle_cond = NULL;
+
+// Below are guarded by save_mutex
+
+// Jobs waiting to be written in order, a newer save to the same file replaces its job
+static SaveJob *save_pending = NULL;
+static int save_busy = 0;
+static int save_stop = 0;
+// Result of the last finished save
+static int save_result = 0;
+
+static void free_job(SaveJob *job)
+{
+    if (job == NULL)
+        return;
+    store_release(job->pin);
+    free(job->filename);
+    free(job);
+}
+
+// Internal function to write a snapshot to a temp file and replace the target
+// Return 0 on success
+static int write_job(const SaveJob *job)
+{
+    char tmp_fname[512];
+    FILE *fp = open_file_atomic(job->filename, tmp_fname, sizeof(tmp_fname));
+    if (fp == NULL)
+        return 1;
+
+    int num_subs = store_count(job->root);
+    int report = num_subs >= SAVE_PROGRESS_MIN;
+    int next_percent = SAVE_PROGRESS_STEP;
+
+    StoreIter it;
+    store_iter_init(&it, job->root, 0);
+
+    int err = codec_write_header(fp, job->format);
+
+    const SubRecord *rec;
+    for (int i = 0; !err && (rec = store_iter_next(&it)) != NULL; i++)
+    {
+        err = codec_write_cue(fp, job->format, i + 1, rec->start_ts, rec->end_ts, rec->text, rec->len);
+
+        int percent = (long long)(i + 1) * 100 / num_subs;
+        if (report && percent >= next_percent && percent < 100)
+        {
+            char msg[32];
+            snprintf(msg, sizeof(msg), "Saving %d%%", percent);
+            show_text(msg, 1000);
+            next_percent = percent + SAVE_PROGRESS_STEP;
+        }
+    }
+
+    err = err || codec_write_end(fp, job->format, num_subs) != 0;
+
+    return commit_file_atomic(fp, err, tmp_fname, job->filename);
+}
+
+// Writes saves in the background so that editing and playback continue
+static int save_thread_fn(void *data)
+{
+    SDL_LockMutex(save_mutex);
+    while (1)
+    {
+        while (!save_stop && save_pending == NULL)
+        {
+            save_busy = 0;
+            SDL_CondBroadcast(save_idle_cond);
+            SDL_CondWait(save_work_cond, save_mutex);
+        }
+
+        if (save_pending == NULL)
+            break;
+
+        SaveJob *job = save_pending;
+        save_pending = job->next;
+        save_busy = 1;
+
+        SDL_UnlockMutex(save_mutex);
+
+        journal_wait_rewrite(job->journal_ticket);
+        int ret = write_job(job);
+        if (ret != 0)
+            show_text("Failed to write subs!", 1000);
+        else
+            show_text("Saved", 500);
+        free_job(job);
+
+        SDL_LockMutex(save_mutex);
+        save_result = ret;
+    }
+
+    save_busy = 0;
+    SDL_CondBroadcast(save_idle_cond);
+    SDL_UnlockMutex(save_mutex);
+    return 0;
+}
+
+// Internal function to start the save thread
+static int save_init()
+{
+    if (save_thread != NULL)
+        return 0;
+
+    save_mutex = SDL_CreateMutex();
+    save_work_cond = SDL_CreateCond();
+    save_idle_cond = SDL_CreateCond();
+    save_stop = 0;
+
+    save_thread = SDL_CreateThread(save_thread_fn, "save", NULL);
+    if (save_thread == NULL)
+    {
+        show_text("Failed to start saving!", 1000);
+        return 1;
+    }
+    return 0;
+}
+
+// Write the latest version of the subs to a file in the background,
+// in the format of its extension
+// The file is replaced atomically once fully written
+// Return 0 if the save was queued
+int save_sub(const char *filename)
+{
+    if (save_init() != 0)
+        return 1;
+
+    // The file being overwritten may be the mapped sub source
+    subs_release_source(filename);
+
+    // Edits made from now on do not change the pinned version
+    SaveJob *job = (SaveJob *)calloc(1, sizeof(SaveJob));
+    job->root = store_acquire(&job->pin);
+    if (job->pin == -1)
+    {
+        free(job);
+        show_text("Failed to snapshot subs!", 1000);
+        return 1;
+    }
+    job->filename = strdup(filename);
+    job->format = codec_from_filename(filename);
+
+    // The file may be the base of the journal, which is folded into an
+    // image by the journal thread before the save replaces it
+    job->journal_ticket = journal_release_base(filename);
+
+    SDL_LockMutex(save_mutex);
+    // Only the latest snapshot of a file is worth writing, saves to
+    // other files are kept
+    SaveJob **link = &save_pending;
+    while (*link != NULL && strcmp((*link)->filename, filename) != 0)
+        link = &(*link)->next;
+    if (*link != NULL)
+    {
+        // The journal was released for the replaced job only
+        if ((*link)->journal_ticket > job->journal_ticket)
+            job->journal_ticket = (*link)->journal_ticket;
+        job->next = (*link)->next;
+        free_job(*link);
+    }
+    *link = job;
+    SDL_CondSignal(save_work_cond);
+    SDL_UnlockMutex(save_mutex);
+
+    return 0;
+}
+
+// Wait until queued saves are written
+// Return 0 if the last save succeeded
+int save_wait()
+{
+    if (save_thread == NULL)
+        return 0;
+
+    SDL_LockMutex(save_mutex);
+    while (save_busy || save_pending != NULL)
+        SDL_CondWait(save_idle_cond, save_mutex);
+    int ret = save_result;
+    SDL_UnlockMutex(save_mutex);
+    return ret;
+}
+
+// Stop the save thread after writing queued saves
+void save_close()
+{
+    if (save_thread == NULL)
+        return;
+
+    SDL_LockMutex(save_mutex);
+    save_stop = 1;
+    SDL_CondSignal(save_work_cond);
+    SDL_UnlockMutex(save_mutex);
+
+    SDL_WaitThread(save_thread, NULL);
+    save_thread = NULL;
+}
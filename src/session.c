@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <session.h>
+#include <command.h>
+#include <utils.h>
+#include <main.h>
+#include <subs.h>
+#include <journal.h>
+#include <store.h>
+
+static inline uint64_t align_up(uint64_t off)
+{
+    return (off + SESSION_ALIGN - 1) & ~(uint64_t)(SESSION_ALIGN - 1);
+}
+
+// Get the session filename for a sub filename
+void session_filename(const char *filename, char *buf, size_t sz)
+{
+    snprintf(buf, sz, "%s%s", filename, SESSION_EXT);
+}
+
+// Check if a session exists and is not older than its sub file
+// Returns 1 if the session should be imported
+int session_is_current(const char *session_fname, const char *sub_fname)
+{
+    struct stat session_st, sub_st;
+    if (stat(session_fname, &session_st) != 0)
+        return 0;
+    if (sub_fname == NULL || stat(sub_fname, &sub_st) != 0)
+        return 1;
+    return session_st.st_mtime >= sub_st.st_mtime;
+}
+
+// Check if a file starts with the session magic
+int is_session_file(const char *filename)
+{
+    char magic[sizeof(((SessionHeader *)0)->magic)];
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+        return 0;
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+
+    return n == sizeof(magic) && memcmp(magic, SESSION_MAGIC, sizeof(magic)) == 0;
+}
+
+// Internal function to find a section of the given type
+// Returns NULL if missing or out of bounds
+static const SessionSection *find_section(const char *data, size_t data_size, uint32_t type, uint64_t size)
+{
+    const SessionHeader *header = (const SessionHeader *)data;
+    const SessionSection *sections = (const SessionSection *)(data + sizeof(SessionHeader));
+
+    for (uint32_t i = 0; i < header->num_sections; i++)
+    {
+        if (sections[i].type != type)
+            continue;
+        if (sections[i].size < size || sections[i].offset % SESSION_ALIGN != 0 ||
+            sections[i].offset > data_size || sections[i].size > data_size - sections[i].offset)
+            return NULL;
+        return &sections[i];
+    }
+    return NULL;
+}
+
+// Populate the sub list from a session image
+// Sub text is left unmaterialized in the image, which must outlive the subs
+// Return 0 on success
+int load_session_image(const char *data, size_t size)
+{
+    const SessionHeader *header = (const SessionHeader *)data;
+    if (size < sizeof(SessionHeader) ||
+        memcmp(header->magic, SESSION_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SESSION_VERSION ||
+        header->num_sections > (size - sizeof(SessionHeader)) / sizeof(SessionSection))
+        return 1;
+
+    uint64_t n = header->num_subs;
+    const SessionSection *start_sec = find_section(data, size, SESSION_SECTION_START_TS, n * sizeof(double));
+    const SessionSection *end_sec = find_section(data, size, SESSION_SECTION_END_TS, n * sizeof(double));
+    const SessionSection *off_sec = find_section(data, size, SESSION_SECTION_TEXT_OFFSETS, (n + 1) * sizeof(uint64_t));
+    const SessionSection *text_sec = find_section(data, size, SESSION_SECTION_TEXT, 0);
+    const SessionSection *id_sec = find_section(data, size, SESSION_SECTION_IDS, n * sizeof(uint32_t));
+    if (!start_sec || !end_sec || !off_sec || !text_sec)
+        return 1;
+
+    const double *start_ts = (const double *)(data + start_sec->offset);
+    const double *end_ts = (const double *)(data + end_sec->offset);
+    const uint64_t *text_off = (const uint64_t *)(data + off_sec->offset);
+    const char *text = data + text_sec->offset;
+    const uint32_t *ids = id_sec ? (const uint32_t *)(data + id_sec->offset) : NULL;
+
+    // Every text must be in bounds
+    // Only the offsets are read so that text pages are not touched
+    for (uint64_t i = 0; i < n; i++)
+    {
+        if (text_off[i] >= text_off[i + 1] || text_off[i + 1] > text_sec->size)
+            return 1;
+    }
+
+    Sub *head = NULL;
+    Sub *tail = NULL;
+
+    for (uint64_t i = 0; i < n; i++)
+    {
+        Sub *sub = alloc_sub();
+        sub->id = ids ? ids[i] : i;
+        sub->start_ts = start_ts[i];
+        sub->end_ts = end_ts[i];
+        sub->src = text + text_off[i];
+        sub->src_len = text_off[i + 1] - text_off[i] - 1;
+
+        if (tail)
+            tail->next = sub;
+        else
+            head = sub;
+        tail = sub;
+    }
+
+    subs_load(head, header->focused_idx, header->cursor_pos);
+
+    // Cursor is only kept in INSERT mode
+    if (header->mode == MODE_INSERT && get_cursor_pos() != -1)
+        set_mode(MODE_INSERT);
+
+    return 0;
+}
+
+// Map a session file and populate the sub list from it
+// Sub text is left unmaterialized in the mapping
+// Return 0 on success
+int import_session(const char *filename)
+{
+    MappedFile map;
+    if (map_file(filename, &map) != 0)
+        return 1;
+
+    if (load_session_image(map.data, map.size) != 0)
+    {
+        show_text("Invalid session file!", 1000);
+        unmap_file(&map);
+        return 1;
+    }
+
+    subs_set_source(&map, filename);
+    return 0;
+}
+
+// Internal function to place a section at the next aligned offset
+static void layout_section(SessionSection *sec, uint64_t *off)
+{
+    sec->offset = *off;
+    *off = align_up(*off + sec->size);
+}
+
+// Serialize a version of the subs and the given editing state into a session image
+// Only reads the version, so it can be built by any thread holding it
+// Returns a malloc'd buffer
+char *session_image_of(const StoreNode *root, int focused_idx, int cursor_pos, int mode, size_t *size)
+{
+    uint64_t num_subs = store_count(root);
+    uint64_t text_size = 0;
+
+    StoreIter it;
+    const SubRecord *rec;
+    store_iter_init(&it, root, 0);
+    while ((rec = store_iter_next(&it)) != NULL)
+        text_size += rec->len + 1;
+
+    SessionHeader header = {0};
+    memcpy(header.magic, SESSION_MAGIC, sizeof(header.magic));
+    header.version = SESSION_VERSION;
+    header.num_subs = num_subs;
+    header.focused_idx = focused_idx;
+    header.cursor_pos = cursor_pos;
+    header.mode = mode;
+    header.num_sections = 5;
+
+    SessionSection sections[5] = {
+        {.type = SESSION_SECTION_START_TS, .size = num_subs * sizeof(double)},
+        {.type = SESSION_SECTION_END_TS, .size = num_subs * sizeof(double)},
+        {.type = SESSION_SECTION_TEXT_OFFSETS, .size = (num_subs + 1) * sizeof(uint64_t)},
+        {.type = SESSION_SECTION_TEXT, .size = text_size},
+        {.type = SESSION_SECTION_IDS, .size = num_subs * sizeof(uint32_t)},
+    };
+
+    uint64_t off = align_up(sizeof(header) + sizeof(sections));
+    for (int i = 0; i < 5; i++)
+        layout_section(&sections[i], &off);
+
+    // Padding is left zeroed
+    char *image = (char *)calloc(off, 1);
+    *size = off;
+
+    memcpy(image, &header, sizeof(header));
+    memcpy(image + sizeof(header), sections, sizeof(sections));
+
+    // Timing arrays are written one after another
+    double *start_ts = (double *)(image + sections[0].offset);
+    double *end_ts = (double *)(image + sections[1].offset);
+    uint64_t *text_off = (uint64_t *)(image + sections[2].offset);
+    char *text = image + sections[3].offset;
+    uint32_t *ids = (uint32_t *)(image + sections[4].offset);
+
+    uint64_t i = 0;
+    uint64_t pos = 0;
+    store_iter_init(&it, root, 0);
+    for (; (rec = store_iter_next(&it)) != NULL; i++)
+    {
+        start_ts[i] = rec->start_ts;
+        end_ts[i] = rec->end_ts;
+        ids[i] = rec->id;
+        text_off[i] = pos;
+
+        memcpy(text + pos, rec->text, rec->len);
+        pos += rec->len + 1;
+    }
+    text_off[i] = pos;
+
+    return image;
+}
+
+// Serialize the current subs and editing state into a session image
+// Returns a malloc'd buffer
+char *session_image(size_t *size)
+{
+    return session_image_of(store_working(), get_focused_idx(), get_cursor_pos(), get_mode(), size);
+}
+
+// Write the current subs and editing state to a session file
+// Return 0 on success
+int export_session(const char *filename)
+{
+    size_t size;
+    char *image = session_image(&size);
+
+    // The session being replaced may still be mapped
+    subs_release_source(filename);
+    journal_wait_rewrite(journal_release_base(filename));
+
+    int ret = write_file_atomic(filename, NULL, 0, image, size);
+    free(image);
+
+    if (ret != 0)
+        show_text("Failed to write session!", 1000);
+    return ret;
+}
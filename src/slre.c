@@ -18,6 +18,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
 
@@ -47,7 +48,8 @@ struct branch {
   const char *schlong;  /* points to the '|' character in the regex */
 };
 
-struct regex_info {
+/* Regex with its brackets and branches scanned, reusable across matches */
+struct slre_prog {
   /*
    * Describes all bracket pairs in the regular expression.
    * First entry is always present, and grabs the whole regex.
@@ -62,6 +64,16 @@ struct regex_info {
   struct branch branches[MAX_BRANCHES];
   int num_branches;
 
+  /* E.g. IGNORE_CASE. See enum below */
+  int flags;
+
+  /* Copy of the regex including flags, owned by compiled programs */
+  char *source;
+};
+
+struct regex_info {
+  const struct slre_prog *prog;
+
   /* Array of captures provided by the user */
   struct slre_cap *caps;
   int num_caps;
@@ -71,6 +83,13 @@ struct regex_info {
 };
 enum { IGNORE_CASE = 1 };
 
+/* Cache of compiled user patterns, least recently used evicted first */
+static struct {
+  struct slre_prog *prog;
+  unsigned long used;
+} cache[SLRE_CACHE_SIZE];
+static unsigned long cache_clock = 0;
+
 static int is_metacharacter(const unsigned char *s) {
   static const char *metacharacters = "^$().[]*+?|\\Ssd";
   return strchr(metacharacters, *s) != NULL;
@@ -191,7 +210,7 @@ static int bar(const char *re, int re_len, const char *s, int s_len,
   for (i = j = 0; i < re_len && j <= s_len; i += step) {
 
     /* Handle quantifiers. Get the length of the chunk. */
-    step = re[i] == '(' ? info->brackets[bi + 1].len + 2 :
+    step = re[i] == '(' ? info->prog->brackets[bi + 1].len + 2 :
       get_op_len(re + i, re_len - i);
 
     DBG(("%s [%.*s] [%.*s] re_len=%d step=%d i=%d j=%d\n", __func__,
@@ -259,7 +278,7 @@ static int bar(const char *re, int re_len, const char *s, int s_len,
       j += n;
     } else if (re[i] == '(') {
       bi++;
-      FAIL_IF(bi >= info->num_brackets, SLRE_INTERNAL_ERROR);
+      FAIL_IF(bi >= info->prog->num_brackets, SLRE_INTERNAL_ERROR);
       DBG(("CAPTURING [%.*s] [%.*s] [%s]\n",
            step, re + i, s_len - j, s + j, re + i + step));
 
@@ -299,15 +318,15 @@ static int bar(const char *re, int re_len, const char *s, int s_len,
 
 /* Process branch points */
 static int doh(const char *s, int s_len, struct regex_info *info, int bi) {
-  const struct bracket_pair *b = &info->brackets[bi];
+  const struct bracket_pair *b = &info->prog->brackets[bi];
   int i = 0, len, result;
   const char *p;
 
   do {
-    p = i == 0 ? b->ptr : info->branches[b->branches + i - 1].schlong + 1;
+    p = i == 0 ? b->ptr : info->prog->branches[b->branches + i - 1].schlong + 1;
     len = b->num_branches == 0 ? b->len :
       i == b->num_branches ? b->ptr + b->len - p :
-      info->branches[b->branches + i].schlong - p;
+      info->prog->branches[b->branches + i].schlong - p;
     DBG(("%s %d %d [%.*s] [%.*s]\n", __func__, bi, i, len, p, s_len, s));
     result = bar(p, len, s, s_len, info, bi);
     DBG(("%s <- %d\n", __func__, result));
@@ -317,7 +336,7 @@ static int doh(const char *s, int s_len, struct regex_info *info, int bi) {
 }
 
 static int baz(const char *s, int s_len, struct regex_info *info) {
-  int i, result = -1, is_anchored = info->brackets[0].ptr[0] == '^';
+  int i, result = -1, is_anchored = info->prog->brackets[0].ptr[0] == '^';
 
   for (i = 0; i <= s_len; i++) {
     result = doh(s + i, s_len - i, info, 0);
@@ -331,7 +350,7 @@ static int baz(const char *s, int s_len, struct regex_info *info) {
   return result;
 }
 
-static void setup_branch_points(struct regex_info *info) {
+static void setup_branch_points(struct slre_prog *info) {
   int i, j;
   struct branch tmp;
 
@@ -360,8 +379,8 @@ static void setup_branch_points(struct regex_info *info) {
   }
 }
 
-static int foo(const char *re, int re_len, const char *s, int s_len,
-               struct regex_info *info) {
+/* Scan the brackets and branches of a regex, without matching */
+static int foo(const char *re, int re_len, struct slre_prog *info) {
   int i, step, depth = 0;
 
   /* First bracket captures everything */
@@ -400,8 +419,6 @@ static int foo(const char *re, int re_len, const char *s, int s_len,
       info->brackets[info->num_brackets].ptr = re + i + 1;
       info->brackets[info->num_brackets].len = -1;
       info->num_brackets++;
-      FAIL_IF(info->num_caps > 0 && info->num_brackets - 1 > info->num_caps,
-              SLRE_CAPS_ARRAY_TOO_SMALL);
     } else if (re[i] == ')') {
       int ind = info->brackets[info->num_brackets - 1].len == -1 ?
         info->num_brackets - 1 : depth;
@@ -417,25 +434,95 @@ static int foo(const char *re, int re_len, const char *s, int s_len,
   FAIL_IF(depth != 0, SLRE_UNBALANCED_BRACKETS);
   setup_branch_points(info);
 
-  return baz(s, s_len, info);
+  return 0;
 }
 
-int slre_match(const char *regexp, const char *s, int s_len,
-               struct slre_cap *caps, int num_caps) {
+/* Initialize a program pointing into regexp */
+static int setup_prog(const char *regexp, struct slre_prog *prog) {
+  prog->flags = prog->num_brackets = prog->num_branches = 0;
+  prog->source = NULL;
+
+  /* Handle regexp flags. At the moment, only 'i' is supported */
+  if (strncmp(regexp, "(?i)", 4) == 0) {
+    prog->flags |= IGNORE_CASE;
+    regexp += 4;
+  }
+
+  return foo(regexp, strlen(regexp), prog);
+}
+
+struct slre_prog *slre_compile(const char *regexp, int *error) {
+  size_t len = strlen(regexp);
+  struct slre_prog *prog = (struct slre_prog *) malloc(sizeof(*prog) + len + 1);
+  int result;
+
+  if (prog == NULL) {
+    if (error != NULL) *error = SLRE_INTERNAL_ERROR;
+    return NULL;
+  }
+
+  /* Brackets and branches point into the program's own copy */
+  memcpy(prog + 1, regexp, len + 1);
+  result = setup_prog((char *) (prog + 1), prog);
+  prog->source = (char *) (prog + 1);
+
+  if (result < 0) {
+    if (error != NULL) *error = result;
+    free(prog);
+    return NULL;
+  }
+  return prog;
+}
+
+int slre_exec(const struct slre_prog *prog, const char *s, int s_len,
+              struct slre_cap *caps, int num_caps) {
   struct regex_info info;
 
-  /* Initialize info structure */
-  info.flags = info.num_brackets = info.num_branches = 0;
+  info.prog = prog;
+  info.flags = prog->flags;
   info.num_caps = num_caps;
   info.caps = caps;
 
-  DBG(("========================> [%s] [%.*s]\n", regexp, s_len, s));
+  DBG(("========================> [%.*s] [%.*s]\n",
+       prog->brackets[0].len, prog->brackets[0].ptr, s_len, s));
 
-  /* Handle regexp flags. At the moment, only 'i' is supported */
-  if (memcmp(regexp, "(?i)", 4) == 0) {
-    info.flags |= IGNORE_CASE;
-    regexp += 4;
+  FAIL_IF(num_caps > 0 && prog->num_brackets - 1 > num_caps,
+          SLRE_CAPS_ARRAY_TOO_SMALL);
+
+  return baz(s, s_len, &info);
+}
+
+void slre_free(struct slre_prog *prog) {
+  free(prog);
+}
+
+const struct slre_prog *slre_cached(const char *regexp, int *error) {
+  int i, victim = 0;
+  struct slre_prog *prog;
+
+  for (i = 0; i < SLRE_CACHE_SIZE; i++) {
+    if (cache[i].prog != NULL && strcmp(cache[i].prog->source, regexp) == 0) {
+      cache[i].used = ++cache_clock;
+      return cache[i].prog;
+    }
+    if (cache[i].used < cache[victim].used) victim = i;
   }
 
-  return foo(regexp, strlen(regexp), s, s_len, &info);
+  /* Empty slots are never used, so they are picked first */
+  prog = slre_compile(regexp, error);
+  if (prog == NULL) return NULL;
+
+  slre_free(cache[victim].prog);
+  cache[victim].prog = prog;
+  cache[victim].used = ++cache_clock;
+  return prog;
+}
+
+int slre_match(const char *regexp, const char *s, int s_len,
+               struct slre_cap *caps, int num_caps) {
+  struct slre_prog prog;
+  int result = setup_prog(regexp, &prog);
+
+  FAIL_IF(result < 0, result);
+  return slre_exec(&prog, s, s_len, caps, num_caps);
 }
@@ -0,0 +1,784 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include <SDL2/SDL.h>
+
+#include <store.h>
+#include <utils.h>
+
+#define RETIRED_NODE 0
+#define RETIRED_TEXT 1
+#define RETIRED_FILE 2
+
+// Text owned by the store, shared by copies of its record
+typedef struct StoreText
+{
+    int refs;
+    char data[];
+} StoreText;
+
+// Memory that may still be read through an older version
+typedef struct Retired
+{
+    int kind;
+    void *ptr;
+    // Freed once no pin is older than this epoch
+    int epoch;
+} Retired;
+
+// Below are only used by the main thread
+
+// Root of the working version
+static StoreNode *store_root = NULL;
+static int store_dirty = 0;
+
+// Bytes allocated for nodes and text since startup
+static size_t store_allocated = 0;
+
+// Retired memory in order of epoch
+static Retired *retired = NULL;
+static int retired_len = 0;
+static int retired_cap = 0;
+
+// Below are shared with readers
+
+// Root of the latest published version, which holds a reference
+static void *store_published = NULL;
+// Incremented on every publish
+static SDL_atomic_t store_epoch = {1};
+// Epoch at which each pin was taken, 0 if unused
+static SDL_atomic_t store_pins[STORE_MAX_PINS];
+
+static inline size_t node_size(int leaf)
+{
+    return leaf ? sizeof(StoreLeaf) : sizeof(StoreBranch);
+}
+
+// Records of a leaf
+static inline SubRecord *leaf_recs(const StoreNode *node)
+{
+    return ((StoreLeaf *)node)->recs;
+}
+
+// Children of a node that is not a leaf
+static inline StoreNode **branch_children(const StoreNode *node)
+{
+    return ((StoreBranch *)node)->children;
+}
+
+// Internal function to free memory once it cannot be read anymore
+static void retire(int kind, void *ptr)
+{
+    if (retired_len >= retired_cap)
+    {
+        retired_cap = retired_cap ? retired_cap * 2 : 64;
+        retired = (Retired *)realloc(retired, retired_cap * sizeof(Retired));
+    }
+
+    // Readers pinned before the next publish may still see it
+    retired[retired_len++] = (Retired){kind, ptr, SDL_AtomicGet(&store_epoch) + 1};
+}
+
+static void free_retired(Retired *r)
+{
+    switch (r->kind)
+    {
+    case RETIRED_NODE:
+    case RETIRED_TEXT:
+        free(r->ptr);
+        break;
+    case RETIRED_FILE:
+        unmap_file((MappedFile *)r->ptr);
+        free(r->ptr);
+        break;
+    }
+}
+
+// Internal function to free retired memory no pinned version can reach
+static void reclaim()
+{
+    int min_epoch = INT_MAX;
+    for (int i = 0; i < STORE_MAX_PINS; i++)
+    {
+        int epoch = SDL_AtomicGet(&store_pins[i]);
+        if (epoch != 0 && epoch < min_epoch)
+            min_epoch = epoch;
+    }
+
+    int i = 0;
+    while (i < retired_len && retired[i].epoch <= min_epoch)
+        free_retired(&retired[i++]);
+
+    if (i > 0)
+    {
+        memmove(retired, retired + i, (retired_len - i) * sizeof(Retired));
+        retired_len -= i;
+    }
+}
+
+static inline StoreText *record_text(const SubRecord *rec)
+{
+    return (StoreText *)(rec->text - offsetof(StoreText, data));
+}
+
+// Internal function to drop a reference to the text of a record
+static inline void drop_record(SubRecord *rec)
+{
+    if (rec->owned && --record_text(rec)->refs == 0)
+        retire(RETIRED_TEXT, record_text(rec));
+}
+
+static StoreNode *new_node(int leaf)
+{
+    StoreNode *node = (StoreNode *)malloc(node_size(leaf));
+    node->refs = 1;
+    node->leaf = leaf;
+    node->n = 0;
+    node->size = 0;
+    store_allocated += node_size(leaf);
+    return node;
+}
+
+// Internal function to drop a reference to a node
+// Nodes no longer in any version are freed once readers are done
+static void release_node(StoreNode *node)
+{
+    if (--node->refs > 0)
+        return;
+
+    for (int i = 0; i < node->n; i++)
+    {
+        if (node->leaf)
+            drop_record(&leaf_recs(node)[i]);
+        else
+            release_node(branch_children(node)[i]);
+    }
+    retire(RETIRED_NODE, node);
+}
+
+// Internal function to get a node of the working version for modifying,
+// copying it if it is shared with another version
+static StoreNode *writable(StoreNode **link)
+{
+    StoreNode *node = *link;
+    if (node->refs == 1)
+        return node;
+
+    StoreNode *copy = (StoreNode *)malloc(node_size(node->leaf));
+    memcpy(copy, node, node_size(node->leaf));
+    copy->refs = 1;
+    store_allocated += node_size(node->leaf);
+
+    // Everything below is now shared by the copy
+    for (int i = 0; i < copy->n; i++)
+    {
+        if (!copy->leaf)
+            branch_children(copy)[i]->refs++;
+        else if (leaf_recs(copy)[i].owned)
+            record_text(&leaf_recs(copy)[i])->refs++;
+    }
+
+    node->refs--;
+    *link = copy;
+    return copy;
+}
+
+// Internal function to prepare a record owning a copy of its text
+// followed by tail
+static SubRecord copy_record(const SubRecord *rec, const char *tail, int tail_len)
+{
+    SubRecord r = *rec;
+    r.len = rec->len + tail_len;
+    r.owned = 0;
+    if (r.len > 0)
+    {
+        StoreText *text = (StoreText *)malloc(sizeof(StoreText) + r.len);
+        text->refs = 1;
+        memcpy(text->data, rec->text, rec->len);
+        if (tail_len > 0)
+            memcpy(text->data + rec->len, tail, tail_len);
+        store_allocated += sizeof(StoreText) + r.len;
+
+        r.text = text->data;
+        r.owned = 1;
+    }
+    return r;
+}
+
+// Internal function to prepare a record, copying its text if requested
+static SubRecord make_record(const SubRecord *rec, int copy)
+{
+    if (copy)
+        return copy_record(rec, NULL, 0);
+
+    SubRecord r = *rec;
+    r.owned = 0;
+    return r;
+}
+
+// Internal function to find the child holding a record
+// Adjusts idx to be relative to the child
+// When inserting, idx may be one past the end of the child
+static int find_child(const StoreNode *node, int *idx, int insert)
+{
+    int i = 0;
+    for (; i < node->n - 1; i++)
+    {
+        int size = branch_children(node)[i]->size;
+        if (*idx < size || (insert && *idx == size))
+            break;
+        *idx -= size;
+    }
+    return i;
+}
+
+// Internal function to count the records below a node
+static int count_records(const StoreNode *node)
+{
+    if (node->leaf)
+        return node->n;
+
+    int size = 0;
+    for (int i = 0; i < node->n; i++)
+        size += branch_children(node)[i]->size;
+    return size;
+}
+
+// Internal function to insert a record or child into a node
+// Returns the new right sibling if the node was split
+static StoreNode *insert_item(StoreNode *node, int pos, const void *item)
+{
+    size_t item_size = node->leaf ? sizeof(SubRecord) : sizeof(StoreNode *);
+    char *items = node->leaf ? (char *)leaf_recs(node) : (char *)branch_children(node);
+
+    if (node->n < STORE_FANOUT)
+    {
+        memmove(items + (pos + 1) * item_size, items + pos * item_size, (node->n - pos) * item_size);
+        memcpy(items + pos * item_size, item, item_size);
+        node->n++;
+        return NULL;
+    }
+
+    char tmp[(STORE_FANOUT + 1) * sizeof(SubRecord)];
+    memcpy(tmp, items, pos * item_size);
+    memcpy(tmp + pos * item_size, item, item_size);
+    memcpy(tmp + (pos + 1) * item_size, items + pos * item_size, (node->n - pos) * item_size);
+
+    // Appending keeps the left node full so that loading packs nodes
+    int split = pos == STORE_FANOUT ? STORE_FANOUT : STORE_FANOUT / 2;
+
+    StoreNode *right = new_node(node->leaf);
+    char *right_items = node->leaf ? (char *)leaf_recs(right) : (char *)branch_children(right);
+
+    memcpy(items, tmp, split * item_size);
+    memcpy(right_items, tmp + split * item_size, (STORE_FANOUT + 1 - split) * item_size);
+    node->n = split;
+    right->n = STORE_FANOUT + 1 - split;
+
+    node->size = count_records(node);
+    right->size = count_records(right);
+    return right;
+}
+
+static StoreNode *insert_rec(StoreNode **link, int idx, const SubRecord *rec)
+{
+    StoreNode *node = writable(link);
+    node->size++;
+
+    if (node->leaf)
+        return insert_item(node, idx, rec);
+
+    int i = find_child(node, &idx, 1);
+    StoreNode *right = insert_rec(&branch_children(node)[i], idx, rec);
+    if (right == NULL)
+        return NULL;
+    return insert_item(node, i + 1, &right);
+}
+
+static void erase_rec(StoreNode **link, int idx)
+{
+    StoreNode *node = writable(link);
+    node->size--;
+
+    if (node->leaf)
+    {
+        drop_record(&leaf_recs(node)[idx]);
+        memmove(&leaf_recs(node)[idx], &leaf_recs(node)[idx + 1], (node->n - idx - 1) * sizeof(SubRecord));
+        node->n--;
+        return;
+    }
+
+    int i = find_child(node, &idx, 0);
+    erase_rec(&branch_children(node)[i], idx);
+
+    // Empty nodes are removed, partly filled nodes are not merged
+    if (branch_children(node)[i]->n == 0)
+    {
+        release_node(branch_children(node)[i]);
+        memmove(&branch_children(node)[i], &branch_children(node)[i + 1], (node->n - i - 1) * sizeof(StoreNode *));
+        node->n--;
+    }
+}
+
+// Remove every record from the working version
+void store_clear()
+{
+    if (store_root)
+        release_node(store_root);
+    store_root = NULL;
+    store_dirty = 1;
+}
+
+// Internal function to replace the record at idx in the working version
+static void replace_rec(int idx, SubRecord rec)
+{
+    StoreNode **link = &store_root;
+    while (1)
+    {
+        StoreNode *node = writable(link);
+        if (node->leaf)
+        {
+            drop_record(&leaf_recs(node)[idx]);
+            leaf_recs(node)[idx] = rec;
+            break;
+        }
+        link = &branch_children(node)[find_child(node, &idx, 0)];
+    }
+    store_dirty = 1;
+}
+
+// Replace the record at idx in the working version
+// Text is copied if copy is set, otherwise it must outlive every version
+void store_set(int idx, const SubRecord *rec, int copy)
+{
+    if (idx < 0 || idx >= store_count(store_root))
+        return;
+    replace_rec(idx, make_record(rec, copy));
+}
+
+// Replace the record at idx with text split in two parts, such as
+// the halves of a gap buffer
+// Both parts are copied
+void store_set_parts(int idx, const SubRecord *rec, const char *tail, int tail_len)
+{
+    if (idx < 0 || idx >= store_count(store_root))
+        return;
+    replace_rec(idx, copy_record(rec, tail, tail_len));
+}
+
+// Insert a record before idx in the working version
+void store_insert(int idx, const SubRecord *rec, int copy)
+{
+    if (idx < 0 || idx > store_count(store_root))
+        return;
+
+    SubRecord r = make_record(rec, copy);
+
+    if (store_root == NULL)
+        store_root = new_node(1);
+
+    StoreNode *right = insert_rec(&store_root, idx, &r);
+    if (right)
+    {
+        // Grow a new root
+        StoreNode *root = new_node(0);
+        branch_children(root)[0] = store_root;
+        branch_children(root)[1] = right;
+        root->n = 2;
+        root->size = store_root->size + right->size;
+        store_root = root;
+    }
+    store_dirty = 1;
+}
+
+// Remove the record at idx from the working version
+void store_erase(int idx)
+{
+    if (idx < 0 || idx >= store_count(store_root))
+        return;
+
+    erase_rec(&store_root, idx);
+
+    // Shrink the root
+    while (store_root && !store_root->leaf && store_root->n == 1)
+    {
+        StoreNode *root = store_root;
+        store_root = branch_children(root)[0];
+        store_root->refs++;
+        release_node(root);
+    }
+    if (store_root && store_root->n == 0)
+    {
+        release_node(store_root);
+        store_root = NULL;
+    }
+    store_dirty = 1;
+}
+
+// Make the working version visible to readers
+// Only costs a pointer swap, later edits copy the nodes they change
+void store_publish()
+{
+    if (!store_dirty)
+        return;
+
+    // Published nodes are shared, so they are copied before being changed
+    if (store_root)
+        store_root->refs++;
+
+    StoreNode *old = (StoreNode *)SDL_AtomicSetPtr(&store_published, store_root);
+    if (old)
+        release_node(old);
+
+    SDL_AtomicAdd(&store_epoch, 1);
+    store_dirty = 0;
+
+    reclaim();
+}
+
+// Take a reference to the working version, which stays unchanged
+// Only used by the main thread
+const StoreNode *store_retain()
+{
+    if (store_root)
+        store_root->refs++;
+    return store_root;
+}
+
+// Drop a reference taken by store_retain
+void store_drop(const StoreNode *root)
+{
+    if (root)
+        release_node((StoreNode *)root);
+}
+
+// Make a retained version the working version
+void store_restore(const StoreNode *root)
+{
+    if (store_root)
+        release_node(store_root);
+
+    store_root = (StoreNode *)root;
+    if (store_root)
+        store_root->refs++;
+    store_dirty = 1;
+}
+
+// Get the working version, only valid until it is changed
+const StoreNode *store_working()
+{
+    return store_root;
+}
+
+// Get the bytes allocated for nodes and text so far
+// The difference between two points is the cost of keeping the older version
+size_t store_bytes_allocated()
+{
+    return store_allocated;
+}
+
+// Internal function to check if two records are the same
+static int record_eq(const SubRecord *a, const SubRecord *b)
+{
+    return a->start_ts == b->start_ts && a->end_ts == b->end_ts && a->id == b->id && a->len == b->len &&
+           (a->text == b->text || memcmp(a->text, b->text, a->len) == 0);
+}
+
+static void diff_rec(const StoreNode *a, const StoreNode *b, int base, int **out, int *len, int *cap)
+{
+    if (a == b)
+        return;
+
+    // Same shape, only differing children need comparing
+    int same_shape = a->leaf == b->leaf && a->n == b->n;
+    for (int i = 0; i < a->n && same_shape && !a->leaf; i++)
+        same_shape = branch_children(a)[i]->size == branch_children(b)[i]->size;
+
+    if (same_shape && !a->leaf)
+    {
+        for (int i = 0; i < a->n; i++)
+        {
+            diff_rec(branch_children(a)[i], branch_children(b)[i], base, out, len, cap);
+            base += branch_children(a)[i]->size;
+        }
+        return;
+    }
+
+    StoreIter it_a, it_b;
+    store_iter_init(&it_a, a, 0);
+    store_iter_init(&it_b, b, 0);
+
+    for (int i = 0; i < a->size; i++)
+    {
+        if (record_eq(store_iter_next(&it_a), store_iter_next(&it_b)))
+            continue;
+
+        if (*len >= *cap)
+        {
+            *cap = *cap ? *cap * 2 : 16;
+            *out = (int *)realloc(*out, *cap * sizeof(int));
+        }
+        (*out)[(*len)++] = base + i;
+    }
+}
+
+// Find the indices of records that differ between two versions
+// of the same length, skipping subtrees they share
+// Returns a malloc'd array
+int *store_diff(const StoreNode *a, const StoreNode *b, int *len)
+{
+    int *out = NULL;
+    int cap = 0;
+    *len = 0;
+
+    if (a && b && a->size == b->size)
+        diff_rec(a, b, 0, &out, len, &cap);
+    return out;
+}
+
+// Nodes already rebased, so that nodes shared between versions stay shared
+typedef struct RebaseMemo
+{
+    // Open addressing by the address of the old node
+    const StoreNode **keys;
+    StoreNode **values;
+    size_t cap;
+    size_t len;
+    const char *from;
+    size_t size;
+    const char *to;
+} RebaseMemo;
+
+static inline size_t hash_node(const StoreNode *node, size_t cap)
+{
+    return ((uintptr_t)node >> 4) * 0x9E3779B97F4A7C15ull >> 7 & (cap - 1);
+}
+
+static StoreNode *memo_find(const RebaseMemo *memo, const StoreNode *node)
+{
+    if (memo->cap == 0)
+        return NULL;
+    for (size_t i = hash_node(node, memo->cap); memo->keys[i] != NULL; i = (i + 1) & (memo->cap - 1))
+    {
+        if (memo->keys[i] == node)
+            return memo->values[i];
+    }
+    return NULL;
+}
+
+static void memo_add(RebaseMemo *memo, const StoreNode *node, StoreNode *value)
+{
+    if ((memo->len + 1) * 2 > memo->cap)
+    {
+        RebaseMemo old = *memo;
+        memo->cap = old.cap ? old.cap * 2 : 256;
+        memo->keys = (const StoreNode **)calloc(memo->cap, sizeof(StoreNode *));
+        memo->values = (StoreNode **)malloc(memo->cap * sizeof(StoreNode *));
+        memo->len = 0;
+        for (size_t i = 0; i < old.cap; i++)
+        {
+            if (old.keys[i] != NULL)
+                memo_add(memo, old.keys[i], old.values[i]);
+        }
+        free(old.keys);
+        free(old.values);
+    }
+
+    size_t i = hash_node(node, memo->cap);
+    while (memo->keys[i] != NULL)
+        i = (i + 1) & (memo->cap - 1);
+    memo->keys[i] = node;
+    memo->values[i] = value;
+    memo->len++;
+}
+
+// Internal function to check if a record points into the memory being rebased
+static inline int in_rebase(const RebaseMemo *memo, const SubRecord *rec)
+{
+    uintptr_t text = (uintptr_t)rec->text;
+    return !rec->owned && text >= (uintptr_t)memo->from && text < (uintptr_t)memo->from + memo->size;
+}
+
+// Internal function to rebase the records below a node
+// Returns a reference to the node, or to a copy if any record was rebased
+static StoreNode *rebase_node(RebaseMemo *memo, StoreNode *node)
+{
+    StoreNode *done = memo_find(memo, node);
+    if (done != NULL)
+    {
+        done->refs++;
+        return done;
+    }
+
+    int changed = 0;
+    StoreNode *children[STORE_FANOUT];
+    for (int i = 0; i < node->n; i++)
+    {
+        if (node->leaf)
+            changed |= in_rebase(memo, &leaf_recs(node)[i]);
+        else
+        {
+            children[i] = rebase_node(memo, branch_children(node)[i]);
+            changed |= children[i] != branch_children(node)[i];
+        }
+    }
+
+    StoreNode *result = node;
+    if (!changed)
+    {
+        for (int i = 0; i < node->n && !node->leaf; i++)
+            children[i]->refs--;
+        node->refs++;
+    }
+    else
+    {
+        result = (StoreNode *)malloc(node_size(node->leaf));
+        memcpy(result, node, node_size(node->leaf));
+        result->refs = 1;
+        store_allocated += node_size(node->leaf);
+
+        for (int i = 0; i < result->n; i++)
+        {
+            if (!result->leaf)
+            {
+                branch_children(result)[i] = children[i];
+                continue;
+            }
+
+            SubRecord *rec = &leaf_recs(result)[i];
+            if (rec->owned)
+                record_text(rec)->refs++;
+            else if (in_rebase(memo, rec))
+                rec->text = memo->to + (rec->text - memo->from);
+        }
+    }
+
+    memo_add(memo, node, result);
+    return result;
+}
+
+// Point the text of retained versions that lies in one block of memory at
+// the same offsets of another, such as a copy of a file about to be unmapped
+// Each root is replaced by its rebased version, nodes without such text
+// are kept, and nodes shared between the versions stay shared
+void store_rebase(const StoreNode **roots, int n, const char *from, size_t size, const char *to)
+{
+    RebaseMemo memo = {.from = from, .size = size, .to = to};
+    for (int i = 0; i < n; i++)
+    {
+        if (roots[i] == NULL)
+            continue;
+        StoreNode *old = (StoreNode *)roots[i];
+        roots[i] = rebase_node(&memo, old);
+        release_node(old);
+    }
+    free(memo.keys);
+    free(memo.values);
+}
+
+// Unmap a file once no version can point into it
+void store_retire_file(MappedFile *map)
+{
+    if (map->data == NULL)
+        return;
+
+    MappedFile *copy = (MappedFile *)malloc(sizeof(MappedFile));
+    *copy = *map;
+    retire(RETIRED_FILE, copy);
+
+    map->data = NULL;
+    map->size = 0;
+    map->handle = NULL;
+}
+
+// Pin the latest published version, callable from any thread
+// The version stays valid until released, pin is set to -1 if none is free
+const StoreNode *store_acquire(int *pin)
+{
+    for (int i = 0; i < STORE_MAX_PINS; i++)
+    {
+        // The pin must be visible before the root is read
+        if (SDL_AtomicCAS(&store_pins[i], 0, SDL_AtomicGet(&store_epoch)))
+        {
+            *pin = i;
+            return (const StoreNode *)SDL_AtomicGetPtr(&store_published);
+        }
+    }
+    *pin = -1;
+    return NULL;
+}
+
+// Release a pinned version, callable from any thread
+void store_release(int pin)
+{
+    if (pin >= 0)
+        SDL_AtomicSet(&store_pins[pin], 0);
+}
+
+int store_count(const StoreNode *root)
+{
+    return root ? root->size : 0;
+}
+
+// Get the record at idx of a version
+const SubRecord *store_get(const StoreNode *root, int idx)
+{
+    if (idx < 0 || idx >= store_count(root))
+        return NULL;
+
+    const StoreNode *node = root;
+    while (!node->leaf)
+        node = branch_children(node)[find_child(node, &idx, 0)];
+    return &leaf_recs(node)[idx];
+}
+
+// Start iterating a version from the record at first
+void store_iter_init(StoreIter *it, const StoreNode *root, int first)
+{
+    it->depth = 0;
+    if (first < 0 || first >= store_count(root))
+        return;
+
+    const StoreNode *node = root;
+    while (1)
+    {
+        int pos = node->leaf ? first : find_child(node, &first, 0);
+        it->path[it->depth] = node;
+        it->pos[it->depth] = pos;
+        it->depth++;
+
+        if (node->leaf)
+            break;
+        node = branch_children(node)[pos];
+    }
+}
+
+// Get the next record, NULL at the end
+const SubRecord *store_iter_next(StoreIter *it)
+{
+    if (it->depth == 0)
+        return NULL;
+
+    int d = it->depth - 1;
+    const SubRecord *rec = &leaf_recs(it->path[d])[it->pos[d]];
+
+    // Move up past finished nodes
+    while (d >= 0 && ++it->pos[d] >= it->path[d]->n)
+        d--;
+
+    if (d < 0)
+    {
+        it->depth = 0;
+        return rec;
+    }
+
+    // Move down to the first record of the next leaf
+    for (; d + 1 < it->depth; d++)
+    {
+        it->path[d + 1] = branch_children(it->path[d])[it->pos[d]];
+        it->pos[d + 1] = 0;
+    }
+    return rec;
+}
@@ -1,34 +1,315 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 
 #include <subs.h>
 #include <utils.h>
 #include <main.h>
+#include <save.h>
+#include <store.h>
+#include <undo.h>
+#include <gapbuf.h>
+#include <textindex.h>
+#include <preview.h>
 #include <slre.h>
+#include <trace.h>
+#include <encoding.h>
+#include <codec.h>
 
 static Sub *sub_head = NULL;
 static Sub *sub_focused = NULL;
 static int cursor_pos = -1;
 
-// Internal function to allocate and prepare a sub node
-static inline Sub *alloc_sub()
+// Array of subs in list order for binary searching by start time
+// Rebuilt lazily after the list changes
+static Sub **sub_index = NULL;
+static int sub_index_len = 0;
+static int sub_index_cap = 0;
+static int sub_index_dirty = 1;
+// Position of each sub in the index by id, rebuilt with it
+// Deleted ids keep stale positions
+static int *id_pos = NULL;
+static int id_pos_cap = 0;
+// Longest sub duration, bounds how far back a sub in frame can start
+static double sub_max_duration = 0;
+
+// Time range covered by the last preview export
+static double preview_start = 0;
+static double preview_end = -1;
+// Set when the preview needs writing and reloading
+static int reload_pending = 0;
+
+// Follow mode moves focus along with the playhead
+static int follow_enabled = 0;
+static double follow_last_ts = -1;
+
+// Subs are allocated in blocks and recycled through a free list
+static Sub *sub_free_list = NULL;
+
+// Id of the next sub to be created
+static unsigned int next_sub_id = 0;
+
+// Position of a sub in the list, cached for focused sub edits
+// Reset when the list changes
+static Sub *idx_cache_sub = NULL;
+static int idx_cache_idx = -1;
+
+// Mapped file that unmaterialized sub text points into
+static MappedFile sub_source = {0};
+static char *sub_source_path = NULL;
+
+// Text of the sub being edited, kept in a gap buffer until another sub is edited
+// The text field of the sub is NULL while it is bound
+static GapBuffer edit_buf = {0};
+static Sub *edit_sub = NULL;
+
+// Allocate and prepare a sub node with empty text
+Sub *alloc_sub()
 {
-    Sub *sub = (Sub *)malloc(sizeof(Sub));
-    // Clear text buffer
-    sub->text[0] = '\0';
+    if (sub_free_list == NULL)
+    {
+        Sub *block = (Sub *)malloc(SUB_BLOCK_SIZE * sizeof(Sub));
+        for (int i = 0; i < SUB_BLOCK_SIZE - 1; i++)
+            block[i].next = &block[i + 1];
+        block[SUB_BLOCK_SIZE - 1].next = NULL;
+        sub_free_list = block;
+    }
+
+    Sub *sub = sub_free_list;
+    sub_free_list = sub->next;
+
+    sub->id = next_sub_id++;
+    sub->text = NULL;
+    sub->src = "";
+    sub->src_len = 0;
+    sub->next = NULL;
     return sub;
 }
 
+// Internal function to get the text of a sub in two parts without moving the gap
+static void sub_spans(const Sub *sub, const char **head, int *head_len, const char **tail, int *tail_len)
+{
+    if (sub == edit_sub)
+    {
+        gap_spans(&edit_buf, head, head_len, tail, tail_len);
+        return;
+    }
+    *head = sub_text(sub, head_len);
+    *tail = NULL;
+    *tail_len = 0;
+}
+
+// Internal function to note the text of a sub before it changes, for the search index
+// Subs that are not indexed yet have no text
+static void index_begin(const Sub *sub)
+{
+    if (!search_index_ready())
+        return;
+
+    const char *head = NULL, *tail = NULL;
+    int head_len = 0, tail_len = 0;
+    if (sub)
+        sub_spans(sub, &head, &head_len, &tail, &tail_len);
+    search_index_begin(head, head_len, tail, tail_len);
+}
+
+// Internal function to update the search index after the text of a sub changed
+// The sub is removed from the index if text is not set
+static void index_end(const Sub *sub, int text)
+{
+    if (!search_index_ready())
+        return;
+
+    const char *head = NULL, *tail = NULL;
+    int head_len = 0, tail_len = 0;
+    if (text)
+        sub_spans(sub, &head, &head_len, &tail, &tail_len);
+    search_index_end(sub->id, head, head_len, tail, tail_len);
+}
+
+// Internal function to return a sub node to the free list
+static void free_sub(Sub *sub)
+{
+    index_begin(sub);
+    index_end(sub, 0);
+
+    if (sub == edit_sub)
+        edit_sub = NULL;
+    free(sub->text);
+    sub->next = sub_free_list;
+    sub_free_list = sub;
+}
+
+// Internal function to check if the text of a sub is owned rather than
+// pointing into the sub source
+static inline int is_materialized(const Sub *sub)
+{
+    return sub->text != NULL || sub == edit_sub;
+}
+
+// Internal function to copy unmaterialized text onto the heap
+static void materialize_sub(Sub *sub)
+{
+    if (is_materialized(sub))
+        return;
+
+    sub->text = (char *)malloc(sub->src_len + 1);
+    memcpy(sub->text, sub->src, sub->src_len);
+    sub->text[sub->src_len] = '\0';
+}
+
+// Internal function to move the text being edited back into its sub
+static void commit_edit()
+{
+    if (edit_sub == NULL)
+        return;
+
+    int len = gap_len(&edit_buf);
+    edit_sub->text = (char *)malloc(len + 1);
+    memcpy(edit_sub->text, gap_text(&edit_buf), len + 1);
+    edit_sub = NULL;
+}
+
+// Internal function to get the gap buffer holding the text of a sub,
+// moving the text of the previously edited sub back first
+static GapBuffer *edit_text(Sub *sub)
+{
+    if (sub == edit_sub)
+        return &edit_buf;
+
+    commit_edit();
+
+    int len;
+    const char *text = sub_text(sub, &len);
+    gap_set(&edit_buf, text, len);
+
+    free(sub->text);
+    sub->text = NULL;
+    edit_sub = sub;
+    return &edit_buf;
+}
+
+// Internal function to insert into the text of a sub, keeping the search index in step
+// Return 0 on success
+static int edit_insert(Sub *sub, int pos, const char *text, int len)
+{
+    GapBuffer *buf = edit_text(sub);
+    index_begin(sub);
+    int ret = gap_insert(buf, pos, text, len);
+    index_end(sub, 1);
+    return ret;
+}
+
+// Internal function to delete from the text of a sub, keeping the search index in step
+// Return 0 on success
+static int edit_delete(Sub *sub, int pos, int len)
+{
+    GapBuffer *buf = edit_text(sub);
+    index_begin(sub);
+    int ret = gap_delete(buf, pos, len);
+    index_end(sub, 1);
+    return ret;
+}
+
+// Get the text of a sub without materializing it
+// Text is not null terminated unless materialized
+const char *sub_text(const Sub *sub, int *len)
+{
+    if (sub == edit_sub)
+    {
+        *len = gap_len(&edit_buf);
+        return gap_text(&edit_buf);
+    }
+    if (sub->text != NULL)
+    {
+        *len = strlen(sub->text);
+        return sub->text;
+    }
+    *len = sub->src_len;
+    return sub->src;
+}
+
+// Internal function to rebuild the sub index if the list has changed
+static void update_sub_index()
+{
+    if (!sub_index_dirty)
+        return;
+
+    if (next_sub_id > (unsigned int)id_pos_cap)
+    {
+        id_pos_cap = next_sub_id * 2;
+        id_pos = (int *)realloc(id_pos, id_pos_cap * sizeof(int));
+    }
+
+    int len = 0;
+    double max_duration = 0;
+    for (Sub *sub_curr = sub_head; sub_curr; sub_curr = sub_curr->next)
+    {
+        if (len >= sub_index_cap)
+        {
+            sub_index_cap = sub_index_cap ? sub_index_cap * 2 : 64;
+            sub_index = (Sub **)realloc(sub_index, sub_index_cap * sizeof(Sub *));
+        }
+        if (sub_curr->id < (unsigned int)id_pos_cap)
+            id_pos[sub_curr->id] = len;
+        sub_index[len++] = sub_curr;
+
+        if (sub_curr->end_ts - sub_curr->start_ts > max_duration)
+            max_duration = sub_curr->end_ts - sub_curr->start_ts;
+    }
+
+    sub_index_len = len;
+    sub_max_duration = max_duration;
+    sub_index_dirty = 0;
+}
+
+// Internal function to find the index of the first sub starting after timestamp
+// Every change to a start time must keep the list sorted for this
+static int upper_bound_sub(double ts)
+{
+    update_sub_index();
+
+    int lo = 0;
+    int hi = sub_index_len;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (sub_index[mid]->start_ts <= ts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Internal function to find the last sub starting at or before timestamp
+// Returns the first sub if timestamp is before all subs
+static Sub *bsearch_sub(double ts)
+{
+    int idx = upper_bound_sub(ts);
+
+    if (sub_index_len == 0)
+        return NULL;
+
+    return sub_index[idx > 0 ? idx - 1 : 0];
+}
+
 // Internal function to insert into linked list in order
-static void insert_ordered(Sub *sub_new)
+// Returns the index of the inserted sub
+static int insert_ordered(Sub *sub_new)
 {
+    sub_index_dirty = 1;
+    idx_cache_sub = NULL;
+
     if (sub_head == NULL)
     {
         // First node
         sub_head = sub_new;
         sub_head->next = NULL;
-        return;
+        return 0;
     }
 
     // Timestamp is earlier than head
@@ -37,198 +318,362 @@ static void insert_ordered(Sub *sub_new)
         // Insert at beginning (new head)
         sub_new->next = sub_head;
         sub_head = sub_new;
+        return 0;
     }
-    else
+
+    // Ordered insert
+    int idx = 1;
+    Sub *sub_curr = sub_head;
+    while (sub_curr->next && sub_curr->next->start_ts <= sub_new->start_ts)
     {
-        // Ordered insert
-        Sub *sub_curr = sub_head;
-        while (sub_curr)
-        {
-            if (!sub_curr->next || sub_curr->next->start_ts > sub_new->start_ts)
-            {
-                sub_new->next = sub_curr->next;
-                sub_curr->next = sub_new;
-                return;
-            }
-            sub_curr = sub_curr->next;
-        }
+        sub_curr = sub_curr->next;
+        idx++;
     }
+    sub_new->next = sub_curr->next;
+    sub_curr->next = sub_new;
+    return idx;
 }
 
-// Parse a srt file and populate the current sub linked list
-void import_sub(const char *filename)
+// Internal function to get the published record of a sub
+static SubRecord sub_record(const Sub *sub)
 {
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL)
+    SubRecord rec = {.start_ts = sub->start_ts, .end_ts = sub->end_ts, .id = sub->id};
+    rec.text = sub_text(sub, &rec.len);
+    return rec;
+}
+
+// Internal function to update the record of a sub at idx in the working version
+// Editable text is copied, as it keeps changing in place
+static void store_sub(int idx, const Sub *sub)
+{
+    if (sub == edit_sub)
     {
-        // File does not exist, will be created later when exporting
-        return;
+        // Copy both sides of the gap rather than moving it
+        SubRecord rec = {.start_ts = sub->start_ts, .end_ts = sub->end_ts, .id = sub->id};
+        const char *tail;
+        int tail_len;
+        gap_spans(&edit_buf, &rec.text, &rec.len, &tail, &tail_len);
+        store_set_parts(idx, &rec, tail, tail_len);
+    }
+    else
+    {
+        SubRecord rec = sub_record(sub);
+        store_set(idx, &rec, is_materialized(sub));
     }
+}
+
+// Internal function to publish a change to the focused sub
+static void publish_focused()
+{
+    store_sub(get_focused_idx(), sub_focused);
+    store_publish();
+}
 
-    char buf[256] = {0};
-    char pend_buf[256] = {0};
+// Internal function to move the focused sub back into order after its start changed
+// Lookups binary search the list by start time, so it must stay sorted
+// Return 1 if the sub was moved
+static int reorder_focused()
+{
+    update_sub_index();
+    int idx = get_focused_idx();
+    if (idx < 0 ||
+        ((idx == 0 || sub_index[idx - 1]->start_ts <= sub_focused->start_ts) &&
+         (idx + 1 == sub_index_len || sub_focused->start_ts <= sub_index[idx + 1]->start_ts)))
+        return 0;
 
-    Sub *curr_sub = NULL;
+    // Unlink and insert again in order, the record is set by publishing
+    if (idx == 0)
+        sub_head = sub_focused->next;
+    else
+        sub_index[idx - 1]->next = sub_focused->next;
+    store_erase(idx);
+
+    SubRecord rec = {0};
+    idx = insert_ordered(sub_focused);
+    store_insert(idx, &rec, 0);
+    idx_cache_sub = sub_focused;
+    idx_cache_idx = idx;
+    return 1;
+}
 
-    while (fgets(buf, sizeof(buf), fp) != NULL)
-    {
-        struct slre_cap caps[2];
+// Internal function to publish the whole list after it was replaced
+static void publish_all()
+{
+    store_clear();
 
-        // Match index
-        if (slre_match("^([0-9]+)\n$", buf, strlen(buf), caps, 1) > 0)
-        {
-            if (caps[0].len > 0)
-            {
-                if (pend_buf[0] && curr_sub != NULL)
-                {
-                    strcat(curr_sub->text, pend_buf);
-                }
-                strncpy(pend_buf, caps[0].ptr, caps[0].len);
-            }
-        }
-        else if (slre_match("^([0-9]+:[0-9]+:[0-9]+[,|\\.][0-9]+) --> ([0-9]+:[0-9]+:[0-9]+[,|\\.][0-9]+)\n$", buf, strlen(buf), caps, 2) > 0)
-        {
-            if (caps[0].len && caps[1].len)
-            {
-                if (curr_sub)
-                {
-                    size_t len = strlen(curr_sub->text);
-                    if (len > 0 && curr_sub->text[len - 1] == '\n')
-                    {
-                        curr_sub->text[len - 1] = '\0';
-                    }
-                    insert_ordered(curr_sub);
-                }
+    int idx = 0;
+    for (Sub *sub_curr = sub_head; sub_curr; sub_curr = sub_curr->next, idx++)
+    {
+        SubRecord rec = sub_record(sub_curr);
+        store_insert(idx, &rec, is_materialized(sub_curr));
+    }
+    store_publish();
+}
 
-                curr_sub = alloc_sub();
+// Internal function to assign ids in list order, so that journals
+// started on an imported file replay the same
+static void renumber_subs()
+{
+    // Index is keyed by id
+    search_index_clear();
+    sub_index_dirty = 1;
+
+    next_sub_id = 0;
+    for (Sub *sub_curr = sub_head; sub_curr; sub_curr = sub_curr->next)
+        sub_curr->id = next_sub_id++;
+    publish_all();
+}
 
-                char start[256] = {0};
-                char end[256] = {0};
+// Internal function to read the cues of a file into an ordered list
+// Lazily imported subs keep their text in the file unless it had to be unescaped,
+// and are numbered in file order so that journals replay the same
+static Sub *read_cues(const MappedFile *map, int format, int lazy)
+{
+    CueReader reader;
+    cue_reader_init(&reader, format, map->data, map->size);
 
-                strncpy(start, caps[0].ptr, caps[0].len);
-                strncpy(end, caps[1].ptr, caps[1].len);
+    Sub *head = NULL;
+    Sub *tail = NULL;
+    unsigned int id = 0;
 
-                curr_sub->start_ts = str_to_timestamp(start);
-                curr_sub->end_ts = str_to_timestamp(end);
+    SubCue cue;
+    while (cue_reader_next(&reader, &cue))
+    {
+        Sub *sub = alloc_sub();
+        sub->id = id++;
+        sub->start_ts = cue.start_ts;
+        sub->end_ts = cue.end_ts;
+        sub->src = cue.text;
+        sub->src_len = cue.len;
+        if (!lazy || !cue.in_place)
+        {
+            // Nothing may point into the text once the next cue is read
+            materialize_sub(sub);
+            sub->src = "";
+            sub->src_len = 0;
+        }
 
-                if (pend_buf[0])
-                    pend_buf[0] = 0;
-            }
+        if (tail == NULL)
+        {
+            head = tail = sub;
         }
-        else if (slre_match("^([^\n].+)", buf, strlen(buf), caps, 1) > 0)
+        else if (cue.start_ts >= tail->start_ts)
         {
-            if (pend_buf[0])
-            {
-                if (curr_sub != NULL)
-                {
-                    strcat(curr_sub->text, pend_buf);
-                }
-                pend_buf[0] = 0;
-            }
-
-            if (curr_sub != NULL && caps[0].len > 0)
-            {
-                strncat(curr_sub->text, caps[0].ptr, caps[0].len);
-            }
+            tail->next = sub;
+            tail = sub;
         }
-    }
-
-    if (curr_sub)
-    {
-        size_t len = strlen(curr_sub->text);
-        if (len > 0 && curr_sub->text[len - 1] == '\n')
+        else
         {
-            curr_sub->text[len - 1] = '\0';
+            // Out of order, fall back to an ordered insert
+            Sub **link = &head;
+            while ((*link)->start_ts <= cue.start_ts)
+                link = &(*link)->next;
+            sub->next = *link;
+            *link = sub;
         }
-        insert_ordered(curr_sub);
     }
+    cue_reader_free(&reader);
 
-    // Set focus to the first sub
-    sub_focused = sub_head;
-
-    fclose(fp);
+    if (!lazy)
+    {
+        // Eagerly imported subs are numbered in list order
+        id = 0;
+        for (Sub *sub_curr = head; sub_curr; sub_curr = sub_curr->next)
+            sub_curr->id = id++;
+    }
+    return head;
 }
-// Export the current subtitles to a file
-void export_sub(const char *filename, int highlight)
+
+// Parse a subtitle file in the format of its extension and replace the sub list
+// Large files are indexed lazily, and the mapping becomes the sub source
+void import_sub(const char *filename)
 {
-    // Sub is reloading
-    if (sub_reload_semaphore != 0)
+    MappedFile map;
+    if (map_file(filename, &map) != 0)
+    {
+        // File does not exist, will be created later when exporting
         return;
+    }
 
-    if (sub_head == NULL)
+    // Files in other encodings are converted, and saved as UTF-8
+    int encoding = decode_file(&map);
+    if (encoding > ENCODING_UTF8)
     {
-        // Write dummy sub for mpv to parse
-        FILE *fp = fopen(filename, "w");
-        fprintf(fp, SUB_PLACEHOLDER);
-        fclose(fp);
-        return;
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Converted from %s", encoding_name(encoding));
+        show_text(msg, 1000);
     }
 
-    int idx = 1;
-    Sub *sub_curr = sub_head;
+    int lazy = map.size >= LAZY_IMPORT_MIN_SIZE;
+    Sub *head = read_cues(&map, codec_from_filename(filename), lazy);
+    subs_load(head, 0, -1);
 
-    FILE *fp = fopen(filename, "w");
+    if (lazy)
+        subs_set_source(&map, filename);
+    else
+        unmap_file(&map);
+}
+
+// Internal function to write the subs in a format
+// The preview only has the subs around the playhead, with the focused one highlighted,
+// and is always SRT
+static int write_subs(FILE *fp, int format, int highlight)
+{
+    update_sub_index();
+
+    int first = 0;
+    int last = sub_index_len;
 
-    // Traverse the linked list and write one by one
-    while (sub_curr)
+    if (highlight)
     {
-        char start_ts_str[16];
-        char end_ts_str[16];
+        preview_start = curr_timestamp - PREVIEW_WINDOW;
+        preview_end = curr_timestamp + PREVIEW_WINDOW;
+        first = upper_bound_sub(preview_start - sub_max_duration - 1);
+        last = upper_bound_sub(preview_end);
+    }
+
+    int written = 0;
+    int err = codec_write_header(fp, format);
 
-        timetamp_to_str(sub_curr->start_ts, start_ts_str);
-        timetamp_to_str(sub_curr->end_ts, end_ts_str);
+    // Traverse the index and write one by one
+    for (int i = first; i < last && !err; i++)
+    {
+        Sub *sub_curr = sub_index[i];
 
-        fprintf(fp, "%d\n", idx);
-        fprintf(fp, "%s --> %s\n", start_ts_str, end_ts_str);
+        // Ended before the preview window
+        if (highlight && sub_curr->end_ts < preview_start)
+            continue;
 
         if (highlight && sub_curr == sub_focused)
         {
+            char start_ts_str[16];
+            char end_ts_str[16];
+
+            timetamp_to_str(sub_curr->start_ts, start_ts_str);
+            timetamp_to_str(sub_curr->end_ts, end_ts_str);
+
+            fprintf(fp, "%d\n", i + 1);
+            fprintf(fp, "%s --> %s\n", start_ts_str, end_ts_str);
+
             if (cursor_pos != -1)
             {
-                // Insert cursor
-                fprintf(fp, "<font color=lightgreen>%.*s<font color=yellow>|</font>%s</font>\n\n", cursor_pos, sub_curr->text, &sub_curr->text[cursor_pos]);
+                // Insert cursor between the sides of the gap
+                // Edits happen at the cursor, so the gap rarely moves
+                GapBuffer *buf = edit_text(sub_focused);
+                gap_move(buf, cursor_pos);
+
+                const char *head, *tail;
+                int head_len, tail_len;
+                gap_spans(buf, &head, &head_len, &tail, &tail_len);
+
+                fprintf(fp, "<font color=lightgreen>");
+                write_without_cr(fp, head, head_len);
+                fprintf(fp, "<font color=yellow>|</font>");
+                write_without_cr(fp, tail, tail_len);
+                fprintf(fp, "</font>\n\n");
             }
             else
             { // Highlight focused sub when editing
-                fprintf(fp, "<font color=lightgreen>%s</font>\n\n", sub_curr->text);
+                int len;
+                const char *text = sub_text(sub_curr, &len);
+                fprintf(fp, "<font color=lightgreen>");
+                write_without_cr(fp, text, len);
+                fprintf(fp, "</font>\n\n");
             }
         }
         else
         {
-            fprintf(fp, "%s\n\n", sub_curr->text);
+            int len;
+            const char *text = sub_text(sub_curr, &len);
+            err = codec_write_cue(fp, format, i + 1, sub_curr->start_ts, sub_curr->end_ts, text, len);
         }
+        written++;
+    }
 
-        sub_curr = sub_curr->next;
-        idx++;
+    return err || codec_write_end(fp, format, written) != 0;
+}
+
+// Export the current subtitles to a file, in the format of its extension
+void export_sub(const char *filename, int highlight)
+{
+    // Sub is reloading
+    if (sub_reload_semaphore != 0)
+        return;
+
+    // The file being overwritten may be the mapped sub source
+    // or the base of the journal
+    subs_detach_source(filename);
+    if (!highlight)
+        journal_wait_rewrite(journal_release_base(filename));
+
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+    {
+        show_text("Failed to write subs!", 1000);
+        return;
+    }
+
+    Uint64 span = TRACE_BEGIN();
+    int err = write_subs(fp, highlight ? CODEC_SRT : codec_from_filename(filename), highlight);
+    if (fclose(fp) != 0 || err)
+        show_text("Failed to write subs!", 1000);
+    TRACE_END(span, "subs", "export_sub");
+}
+
+// Internal function to write the preview shown by mpv, which is kept in memory
+// Return 0 on success
+static int export_preview()
+{
+    // Sub is reloading
+    if (sub_reload_semaphore != 0)
+        return 1;
+
+    FILE *fp = preview_open();
+    if (fp == NULL)
+    {
+        show_text("Failed to write preview!", 1000);
+        return 1;
     }
 
-    fclose(fp);
+    Uint64 span = TRACE_BEGIN();
+    write_subs(fp, CODEC_SRT, 1);
+    int ret = preview_commit(fp);
+    TRACE_END(span, "subs", "export_preview");
+    return ret;
+}
+
+// Check if the last preview export still covers a timestamp
+int in_preview_window(double ts)
+{
+    return ts >= preview_start + PREVIEW_MARGIN && ts <= preview_end - PREVIEW_MARGIN;
 }
 
 static inline int sub_in_frame(const Sub *sub, double timestamp)
 {
-    return sub->start_ts <= timestamp && sub->end_ts > curr_timestamp;
+    return sub->start_ts <= timestamp && sub->end_ts > timestamp;
 }
 
 // Fill an array with subs in the given timestamp
 static int get_subs_in_frame(Sub *sub_arr[], int sz, double timestamp)
 {
     int idx = 0;
-    Sub *curr_sub = sub_head;
 
-    while (curr_sub)
+    // Only subs starting within the longest duration before timestamp can be in frame
+    int hi = upper_bound_sub(timestamp);
+    int lo = upper_bound_sub(timestamp - sub_max_duration - 1);
+
+    for (int i = lo; i < hi; i++)
     {
-        if (sub_in_frame(curr_sub, timestamp))
+        if (sub_in_frame(sub_index[i], timestamp))
         {
             if (idx >= sz)
             {
                 // Not enough space in array
                 break;
             }
-            sub_arr[idx] = curr_sub;
+            sub_arr[idx] = sub_index[i];
             idx++;
         }
-        curr_sub = curr_sub->next;
     }
 
     // Return number of matches
@@ -248,18 +693,17 @@ void focus_sub_in_frame(int idx)
     if (sub_focused == NULL)
         return;
 
+    // Do not change focus if focused sub is in frame
+    // Checked before scanning so that follow mode makes this O(1)
+    if (idx == -1 && sub_in_frame(sub_focused, curr_timestamp))
+        return;
+
     Sub *sub_arr[32];
     int sz = get_subs_in_frame(sub_arr, 32, curr_timestamp);
 
     // Handle default behaviour
     if (idx == -1)
     {
-        if (sub_in_frame(sub_focused, curr_timestamp))
-        {
-            // Do not change focus if focused sub is in frame
-            return;
-        }
-
         if (sz > 0)
         {
             // Focus first sub by default
@@ -288,7 +732,16 @@ void set_focused_start_ts(double ts)
         show_text("Start cannot be after end!", 300);
         return;
     }
+    undo_checkpoint(0);
     sub_focused->start_ts = ts;
+    sub_index_dirty = 1;
+    int moved = reorder_focused();
+    publish_focused();
+    journal_append(JOURNAL_SET_START, sub_focused->id, 0, 0, ts, NULL);
+
+    // Timing records do not reorder subs when replayed
+    if (moved)
+        journal_compact();
     export_reload_sub();
 }
 
@@ -301,7 +754,11 @@ void set_focused_end_ts(double ts)
         show_text("End cannot be before start!", 300);
         return;
     }
+    undo_checkpoint(0);
     sub_focused->end_ts = ts;
+    sub_index_dirty = 1;
+    publish_focused();
+    journal_append(JOURNAL_SET_END, sub_focused->id, 0, 0, ts, NULL);
     export_reload_sub();
 }
 
@@ -406,22 +863,92 @@ int focus_prev_sub(int count)
     return sub_focused == old;
 }
 
+void toggle_follow()
+{
+    follow_enabled ^= 1;
+    // Force a binary search on the next playhead update
+    follow_last_ts = -1;
+    show_text(follow_enabled ? "Follow on" : "Follow off", 500);
+}
+
+// Move focus to the sub under the playhead in follow mode
+// Walks forward from the focused sub during playback and
+// falls back to a binary search after a jump
+// Returns 0 if focus was changed
+int follow_playhead(double ts)
+{
+    if (!follow_enabled || sub_head == NULL)
+        return 1;
+
+    // Playhead has not moved, keep any manual focus change
+    if (ts == follow_last_ts)
+        return 1;
+
+    Sub *old = sub_focused;
+
+    if (sub_focused == NULL || ts < follow_last_ts || ts < sub_focused->start_ts)
+    {
+        // Jumped backwards
+        sub_focused = bsearch_sub(ts);
+    }
+    else
+    {
+        int steps = 0;
+        while (sub_focused->next && sub_focused->next->start_ts <= ts)
+        {
+            // Jumped too far forward to walk
+            if (++steps > FOLLOW_MAX_WALK)
+            {
+                sub_focused = bsearch_sub(ts);
+                break;
+            }
+            sub_focused = sub_focused->next;
+        }
+    }
+
+    follow_last_ts = ts;
+    return sub_focused == old;
+}
+
 // Helper function to export temp sub and reload
+// Only marks the preview, it is written once the queued events are handled
 void export_reload_sub()
 {
-    export_sub(SUB_FILENAME_TMP, 1);
+    reload_pending = 1;
+}
+
+// Export temp sub and reload if an edit asked for it since the last time
+// Called once the event queue is drained, so a burst of edits reloads once
+void export_reload_flush()
+{
+    // Edits made while reloading are exported once the reload is done
+    if (!reload_pending || sub_reload_semaphore != 0)
+        return;
+    reload_pending = 0;
+    export_preview();
     sub_reload();
 }
 
 // Create a new sub at timestamp
 void new_sub(const double ts)
 {
+    // Text typed into the new sub is undone with it
+    undo_checkpoint(1);
+
     Sub *sub = alloc_sub();
     sub->start_ts = ts;
     sub->end_ts = ts + 30;
 
-    insert_ordered(sub);
+    int idx = insert_ordered(sub);
     sub_focused = sub;
+    idx_cache_sub = sub;
+    idx_cache_idx = idx;
+
+    SubRecord rec = sub_record(sub);
+    store_insert(idx, &rec, 0);
+    store_publish();
+
+    journal_append(JOURNAL_NEW_SUB, sub->id, 0, 0, ts, NULL);
 }
 
 // Delete and free currently focused sub and focus nearest sub
@@ -434,6 +961,11 @@ void delete_focused_sub()
 
     Sub *prev_sub = NULL;
     Sub *curr_sub = sub_head;
+    int idx = 0;
+
+    undo_checkpoint(0);
+    sub_index_dirty = 1;
+    journal_append(JOURNAL_DELETE_SUB, sub_focused->id, 0, 0, 0, NULL);
 
     while (curr_sub)
     {
@@ -455,16 +987,555 @@ void delete_focused_sub()
         // Iterate while tracking current and previous nodes
         prev_sub = curr_sub;
         curr_sub = curr_sub->next;
+        idx++;
     }
 
-    free(curr_sub);
+    if (curr_sub)
+    {
+        free_sub(curr_sub);
+        store_erase(idx);
+        store_publish();
+
+        idx_cache_sub = sub_focused;
+        idx_cache_idx = prev_sub ? idx - 1 : 0;
+    }
 }
 
-// Initialize and load temp sub for displaying
-void subs_init()
+// Internal function to merge two ordered lists
+// Subs of the first list go before subs of the second starting at the same time
+static Sub *merge_lists(Sub *a, Sub *b)
 {
-    export_sub(SUB_FILENAME_TMP, 1);
-    sub_add(SUB_FILENAME_TMP);
+    Sub head = {0};
+    Sub *tail = &head;
+    while (a && b)
+    {
+        if (a->start_ts <= b->start_ts)
+        {
+            tail->next = a;
+            a = a->next;
+        }
+        else
+        {
+            tail->next = b;
+            b = b->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = a ? a : b;
+    return head.next;
+}
+
+// Internal function to sort the list by start time, keeping the order of
+// subs starting at the same time
+static Sub *sort_list(Sub *head, int len)
+{
+    if (len < 2)
+        return head;
+
+    Sub *mid = head;
+    for (int i = 1; i < len / 2; i++)
+        mid = mid->next;
+    Sub *right = mid->next;
+    mid->next = NULL;
+
+    return merge_lists(sort_list(head, len / 2), sort_list(right, len - len / 2));
+}
+
+// Index of the k-th sub of a set, or of a range from first if there is no set
+#define SET_IDX(set, first, k) ((set) ? (set)[k] : (first) + (k))
+
+// Internal function to delete a set of subs as a single change
+// The set is in ascending order
+// Focuses the sub after the first one deleted, or the one before it
+static void delete_indices(const int *set, int first, int n)
+{
+    undo_checkpoint(0);
+
+    // Cheaper to build the search index again than to update it this many times
+    if (n > SEARCH_MAX_UPDATES)
+        search_index_clear();
+
+    // Later indices move down as earlier subs are erased
+    for (int k = 0; k < n; k++)
+    {
+        int idx = SET_IDX(set, first, k);
+        journal_append(JOURNAL_DELETE_SUB, sub_index[idx]->id, 0, 0, 0, NULL);
+        store_erase(idx - k);
+    }
+    store_publish();
+
+    // Relink the subs left, then free the rest
+    int start = SET_IDX(set, first, 0);
+    Sub *prev = start > 0 ? sub_index[start - 1] : NULL;
+    Sub **link = prev ? &prev->next : &sub_head;
+    int k = 0;
+    int rest_linked = 0;
+    for (int i = start; i < sub_index_len; i++)
+    {
+        if (k < n && SET_IDX(set, first, k) == i)
+        {
+            k++;
+            continue;
+        }
+        *link = sub_index[i];
+        link = &sub_index[i]->next;
+
+        // Subs after the last one deleted are still linked
+        if (k == n)
+        {
+            rest_linked = 1;
+            break;
+        }
+    }
+    if (!rest_linked)
+        *link = NULL;
+
+    Sub *after = prev ? prev->next : sub_head;
+    for (k = 0; k < n; k++)
+        free_sub(sub_index[SET_IDX(set, first, k)]);
+
+    sub_focused = after ? after : prev;
+    idx_cache_sub = sub_focused;
+    idx_cache_idx = after ? start : start - 1;
+    sub_index_dirty = 1;
+}
+
+// Delete count subs starting at index first as a single change
+// Returns the number of subs deleted
+int delete_subs(int first, int count)
+{
+    update_sub_index();
+    if (first < 0 || first >= sub_index_len || count <= 0)
+        return 0;
+    if (count > sub_index_len - first)
+        count = sub_index_len - first;
+
+    delete_indices(NULL, first, count);
+    return count;
+}
+
+// Delete subs at ascending indices as a single change
+// Returns the number of subs deleted
+int delete_sub_set(const int *set, int n)
+{
+    update_sub_index();
+    if (n <= 0 || set[0] < 0 || set[n - 1] >= sub_index_len)
+        return 0;
+
+    delete_indices(set, 0, n);
+    return n;
+}
+
+// Internal function to shift the timing of a set of subs as a single change
+// The set is in ascending order
+// Return 0 on success
+static int shift_indices(const int *set, int first, int n, double delta)
+{
+    // Subs are in order, so the first one starts earliest
+    Sub *earliest = sub_index[SET_IDX(set, first, 0)];
+    if (earliest->start_ts + delta < 0)
+        delta = -earliest->start_ts;
+    if (delta == 0)
+    {
+        show_text("At start of video!", 300);
+        return 1;
+    }
+
+    undo_checkpoint(0);
+
+    for (int k = 0; k < n; k++)
+    {
+        int idx = SET_IDX(set, first, k);
+        Sub *sub = sub_index[idx];
+        sub->start_ts += delta;
+        sub->end_ts += delta;
+        store_sub(idx, sub);
+        journal_append(JOURNAL_SET_START, sub->id, 0, 0, sub->start_ts, NULL);
+        journal_append(JOURNAL_SET_END, sub->id, 0, 0, sub->end_ts, NULL);
+    }
+
+    // Check the shifted subs against their neighbours
+    int ordered = 1;
+    for (int k = 0; k < n && ordered; k++)
+    {
+        int idx = SET_IDX(set, first, k);
+        if (idx > 0 && sub_index[idx - 1]->start_ts > sub_index[idx]->start_ts)
+            ordered = 0;
+        if (idx + 1 < sub_index_len && sub_index[idx]->start_ts > sub_index[idx + 1]->start_ts)
+            ordered = 0;
+    }
+    sub_index_dirty = 1;
+
+    // Shifted past a neighbour, move the subs back into order
+    if (!ordered)
+    {
+        sub_head = sort_list(sub_head, sub_index_len);
+        idx_cache_sub = NULL;
+        publish_all();
+
+        // Timing records do not reorder subs when replayed
+        journal_compact();
+        return 0;
+    }
+
+    store_publish();
+    return 0;
+}
+
+// Shift the timing of count subs starting at index first as a single change
+// Subs are kept from starting before 0
+// Return 0 on success
+int shift_subs(int first, int count, double delta)
+{
+    update_sub_index();
+    if (first < 0 || first >= sub_index_len || count <= 0)
+        return 1;
+    if (count > sub_index_len - first)
+        count = sub_index_len - first;
+
+    return shift_indices(NULL, first, count, delta);
+}
+
+// Shift the timing of subs at ascending indices as a single change
+// Return 0 on success
+int shift_sub_set(const int *set, int n, double delta)
+{
+    update_sub_index();
+    if (n <= 0 || set[0] < 0 || set[n - 1] >= sub_index_len)
+        return 1;
+
+    return shift_indices(set, 0, n, delta);
+}
+
+// Replace the text of subs at ascending indices as a single change
+// Takes ownership of the texts, which are null terminated
+// Return 0 on success
+int set_sub_texts(const int *set, char **texts, int n)
+{
+    update_sub_index();
+    if (n <= 0 || set[0] < 0 || set[n - 1] >= sub_index_len)
+        return 1;
+
+    undo_checkpoint(0);
+
+    // Cheaper to build the search index again than to update it this many times
+    if (n > SEARCH_MAX_UPDATES)
+        search_index_clear();
+
+    int journaled = n <= JOURNAL_MAX_BATCH;
+    for (int k = 0; k < n; k++)
+    {
+        Sub *sub = sub_index[set[k]];
+        int old_len;
+        sub_text(sub, &old_len);
+        index_begin(sub);
+
+        if (sub == edit_sub)
+            edit_sub = NULL;
+        free(sub->text);
+        sub->text = texts[k];
+        index_end(sub, 1);
+        store_sub(set[k], sub);
+
+        if (journaled)
+        {
+            int len = strlen(sub->text);
+            journal_append(JOURNAL_DELETE_TEXT, sub->id, 0, old_len, 0, NULL);
+            journal_append(JOURNAL_INSERT_TEXT, sub->id, 0, len, 0, sub->text);
+        }
+    }
+    store_publish();
+
+    // A record per sub would take longer to replay than the image
+    if (!journaled)
+        journal_compact();
+
+    // Keep the cursor inside the new text of the focused sub
+    if (sub_focused && cursor_pos > 0)
+    {
+        int len;
+        sub_text(sub_focused, &len);
+        if (cursor_pos > len)
+            cursor_pos = len;
+    }
+    return 0;
+}
+
+// Set the timing of every sub in order as a single change
+// Return 0 on success
+int set_sub_times(const double *start_ts, const double *end_ts, int n)
+{
+    update_sub_index();
+    if (n <= 0 || n != sub_index_len)
+        return 1;
+
+    undo_checkpoint(0);
+
+    int journaled = 2 * n <= JOURNAL_MAX_BATCH;
+    int ordered = 1;
+    for (int idx = 0; idx < n; idx++)
+    {
+        Sub *sub = sub_index[idx];
+        sub->start_ts = start_ts[idx] < 0 ? 0 : start_ts[idx];
+        sub->end_ts = end_ts[idx] < sub->start_ts ? sub->start_ts : end_ts[idx];
+        store_sub(idx, sub);
+
+        if (idx > 0 && sub_index[idx - 1]->start_ts > sub->start_ts)
+            ordered = 0;
+
+        if (journaled)
+        {
+            journal_append(JOURNAL_SET_START, sub->id, 0, 0, sub->start_ts, NULL);
+            journal_append(JOURNAL_SET_END, sub->id, 0, 0, sub->end_ts, NULL);
+        }
+    }
+    sub_index_dirty = 1;
+
+    if (!ordered)
+    {
+        sub_head = sort_list(sub_head, n);
+        idx_cache_sub = NULL;
+        publish_all();
+    }
+    else
+    {
+        store_publish();
+    }
+
+    // Timing records do not reorder subs when replayed,
+    // and a record per sub would take longer to replay than the image
+    if (!ordered || !journaled)
+        journal_compact();
+    return 0;
+}
+
+// Assign ids in list order as a single change
+// The journal is compacted, as its records refer to the old ids
+void subs_renumber()
+{
+    undo_checkpoint(0);
+    renumber_subs();
+    journal_compact();
+}
+
+// Focus the sub at index
+// Return 0 on success
+int focus_sub(int idx)
+{
+    update_sub_index();
+    if (idx < 0 || idx >= sub_index_len)
+        return 1;
+
+    sub_focused = sub_index[idx];
+    idx_cache_sub = sub_focused;
+    idx_cache_idx = idx;
+    return 0;
+}
+
+// Focus and seek to the sub at index, like next_sub
+// Return 0 on success
+int jump_sub(int idx)
+{
+    if (focus_sub(idx) != 0)
+        return 1;
+
+    seek_focused_start();
+    export_reload_sub();
+    return 0;
+}
+
+// Internal function to index the text of every sub for searching
+static void build_search_index()
+{
+    for (Sub *sub_curr = sub_head; sub_curr; sub_curr = sub_curr->next)
+    {
+        const char *head, *tail;
+        int head_len, tail_len;
+        sub_spans(sub_curr, &head, &head_len, &tail, &tail_len);
+        search_index_add(sub_curr->id, head, head_len, tail, tail_len);
+    }
+    search_index_done();
+}
+
+// Internal function to check if the text of a sub matches a literal or a pattern
+static int sub_matches(Sub *sub, const char *literal, int literal_len, const struct slre_prog *re)
+{
+    int len;
+    const char *text = sub_text(sub, &len);
+    if (re)
+        return slre_exec(re, text, len, NULL, 0) >= 0;
+    return find_bytes(text, len, literal, literal_len) != NULL;
+}
+
+// Internal function to search for literal text with the search index
+// Return 1 if the index cannot narrow the search to max candidates
+static int search_indexed(const char *literal, int len, int from, int backward, int max, int *idx, int *wrapped)
+{
+    if (!search_index_ready())
+        build_search_index();
+
+    uint32_t *ids;
+    int num_ids;
+    if (search_index_query(literal, len, max, &ids, &num_ids) != 0)
+        return 1;
+
+    // Closest match in the search direction, or the furthest one to wrap around to
+    int next = -1;
+    int wrap = -1;
+    for (int i = 0; i < num_ids; i++)
+    {
+        if (ids[i] >= (uint32_t)id_pos_cap)
+            continue;
+        int pos = id_pos[ids[i]];
+        if (pos >= sub_index_len || sub_index[pos]->id != ids[i] ||
+            !sub_matches(sub_index[pos], literal, len, NULL))
+            continue;
+
+        if (backward)
+        {
+            if (pos < from && pos > next)
+                next = pos;
+            if (pos > wrap)
+                wrap = pos;
+        }
+        else
+        {
+            if (pos > from && (next < 0 || pos < next))
+                next = pos;
+            if (wrap < 0 || pos < wrap)
+                wrap = pos;
+        }
+    }
+    free(ids);
+
+    *wrapped = next < 0 && wrap >= 0;
+    *idx = next >= 0 ? next : wrap;
+    return 0;
+}
+
+// Internal function to check up to max subs in order after index from
+// Returns the index of the first match, -1 if none
+static int search_scan(const char *literal, int len, const struct slre_prog *re, int from, int backward, int max, int *wrapped)
+{
+    if (max > sub_index_len)
+        max = sub_index_len;
+
+    for (int i = 1; i <= max; i++)
+    {
+        int pos = backward ? from - i : from + i;
+        *wrapped = pos < 0 || pos >= sub_index_len;
+        pos = (pos % sub_index_len + sub_index_len) % sub_index_len;
+
+        if (sub_matches(sub_index[pos], literal, len, re))
+            return pos;
+    }
+    *wrapped = 0;
+    return -1;
+}
+
+// Find the next sub after index from whose text matches a pattern, wrapping around
+// Patterns without special characters are literal and looked up in the search index
+// Searches backwards if backward is set
+// Returns the index of the sub, -1 if none matches or -2 if the pattern is invalid
+int search_subs(const char *pattern, int from, int backward, int *wrapped)
+{
+    update_sub_index();
+    *wrapped = 0;
+    if (sub_index_len == 0)
+        return -1;
+
+    // Backward searches without a focused sub start from the last sub
+    if (from < 0 && backward)
+        from = sub_index_len;
+
+    int len = strlen(pattern);
+    int idx;
+
+    if (strpbrk(pattern, "\\^$.[]()*+?|") != NULL)
+    {
+        const struct slre_prog *re = slre_cached(pattern, NULL);
+        if (re == NULL)
+            return -2;
+        return search_scan(NULL, 0, re, from, backward, sub_index_len, wrapped);
+    }
+
+    // Text too short for the index
+    if (len < 3)
+        return search_scan(pattern, len, NULL, from, backward, sub_index_len, wrapped);
+
+    // Rare text is found through the index, common text by scanning
+    if (search_indexed(pattern, len, from, backward, SEARCH_MAX_CANDIDATES, &idx, wrapped) == 0)
+        return idx;
+    if ((idx = search_scan(pattern, len, NULL, from, backward, SEARCH_MAX_CANDIDATES, wrapped)) >= 0)
+        return idx;
+
+    search_indexed(pattern, len, from, backward, INT_MAX, &idx, wrapped);
+    return idx;
+}
+
+// Insert copies of records as a single change, with the first one at timestamp
+// and the rest keeping their timing relative to it
+// Focuses the first inserted sub
+void put_subs(const SubRecord *recs, int n, double ts)
+{
+    if (n <= 0)
+        return;
+
+    undo_checkpoint(0);
+
+    double offset = ts - recs[0].start_ts;
+    unsigned int first_id = next_sub_id;
+
+    // Build the new subs as an ordered list and merge it in
+    Sub head = {0};
+    Sub *tail = &head;
+    for (int i = 0; i < n; i++)
+    {
+        Sub *sub = alloc_sub();
+        sub->start_ts = recs[i].start_ts + offset;
+        sub->end_ts = recs[i].end_ts + offset;
+        sub->text = (char *)malloc(recs[i].len + 1);
+        memcpy(sub->text, recs[i].text, recs[i].len);
+        sub->text[recs[i].len] = '\0';
+        tail->next = sub;
+        tail = sub;
+
+        index_begin(NULL);
+        index_end(sub, 1);
+
+        journal_append(JOURNAL_NEW_SUB, sub->id, 0, 0, sub->start_ts, NULL);
+        journal_append(JOURNAL_SET_END, sub->id, 0, 0, sub->end_ts, NULL);
+        if (recs[i].len > 0)
+            journal_append(JOURNAL_INSERT_TEXT, sub->id, 0, recs[i].len, 0, recs[i].text);
+    }
+    Sub *put_first = head.next;
+    sub_head = merge_lists(sub_head, put_first);
+
+    // New subs have the highest ids
+    int idx = 0;
+    int put_idx = -1;
+    for (Sub *sub_curr = sub_head; sub_curr; sub_curr = sub_curr->next, idx++)
+    {
+        if (sub_curr->id < first_id)
+            continue;
+        if (sub_curr == put_first)
+            put_idx = idx;
+        SubRecord rec = sub_record(sub_curr);
+        store_insert(idx, &rec, 1);
+    }
+    store_publish();
+
+    sub_focused = put_first;
+    idx_cache_sub = put_first;
+    idx_cache_idx = put_idx;
+    sub_index_dirty = 1;
+}
+
+// Initialize and load temp sub for displaying
+void subs_init()
+{
+    export_preview();
+    sub_add(preview_path());
 }
 
 // Pop the char after the cursor
@@ -473,8 +1544,15 @@ void sub_delete_char()
     if (sub_focused == NULL)
         return;
 
-    if (pop_char_at_idx(sub_focused->text, cursor_pos) == 0)
+    // Edits are undone together until leaving INSERT mode
+    undo_checkpoint(1);
+
+    GapBuffer *buf = edit_text(sub_focused);
+    int sz = gap_next_grapheme(buf, cursor_pos) - cursor_pos;
+    if (edit_delete(sub_focused, cursor_pos, sz) == 0)
     {
+        publish_focused();
+        journal_append(JOURNAL_DELETE_TEXT, sub_focused->id, cursor_pos, sz, 0, NULL);
         // Cursor position does not move
         export_reload_sub();
     }
@@ -486,9 +1564,16 @@ void sub_backspace_char()
     if (sub_focused == NULL)
         return;
 
-    if (pop_char_at_idx(sub_focused->text, cursor_pos - 1) == 0)
+    // Edits are undone together until leaving INSERT mode
+    undo_checkpoint(1);
+
+    GapBuffer *buf = edit_text(sub_focused);
+    int sz = cursor_pos - gap_prev_grapheme(buf, cursor_pos);
+    if (edit_delete(sub_focused, cursor_pos - sz, sz) == 0)
     {
-        cursor_pos--;
+        cursor_pos -= sz;
+        publish_focused();
+        journal_append(JOURNAL_DELETE_TEXT, sub_focused->id, cursor_pos, sz, 0, NULL);
         export_reload_sub();
     }
 }
@@ -498,10 +1583,15 @@ void sub_delete_word()
     if (sub_focused == NULL)
         return;
 
-    char *end = get_next_word(sub_focused->text, cursor_pos);
-    size_t sz = end - sub_focused->text - cursor_pos;
-    if (pop_range(sub_focused->text + cursor_pos, sz) == 0)
+    // Edits are undone together until leaving INSERT mode
+    undo_checkpoint(1);
+
+    GapBuffer *buf = edit_text(sub_focused);
+    int sz = gap_next_word(buf, cursor_pos) - cursor_pos;
+    if (edit_delete(sub_focused, cursor_pos, sz) == 0)
     {
+        publish_focused();
+        journal_append(JOURNAL_DELETE_TEXT, sub_focused->id, cursor_pos, sz, 0, NULL);
         // Cursor position does not change
         export_reload_sub();
     }
@@ -512,15 +1602,44 @@ void sub_backspace_word()
     if (sub_focused == NULL)
         return;
 
-    char *start = get_prev_word(sub_focused->text, cursor_pos - 1);
-    size_t sz = cursor_pos - (start - sub_focused->text);
-    if (pop_range(start, sz) == 0)
+    // Edits are undone together until leaving INSERT mode
+    undo_checkpoint(1);
+
+    GapBuffer *buf = edit_text(sub_focused);
+    int sz = cursor_pos - gap_prev_word(buf, cursor_pos);
+    if (edit_delete(sub_focused, cursor_pos - sz, sz) == 0)
     {
         cursor_pos -= sz;
+        publish_focused();
+        journal_append(JOURNAL_DELETE_TEXT, sub_focused->id, cursor_pos, sz, 0, NULL);
         export_reload_sub();
     }
 }
 
+// Internal function to insert len bytes of text at the cursor of the focused sub
+// Return 0 on success
+static int insert_text(const char *text, int len)
+{
+    GapBuffer *buf = edit_text(sub_focused);
+
+    // Cursor outside of the text
+    if (cursor_pos < 0 || cursor_pos > gap_len(buf))
+        return 1;
+
+    undo_checkpoint(1);
+
+    // Insert text at cursor position
+    if (edit_insert(sub_focused, cursor_pos, text, len) != 0)
+        return 1;
+
+    publish_focused();
+    journal_append(JOURNAL_INSERT_TEXT, sub_focused->id, cursor_pos, len, 0, text);
+
+    // Shift cursor position with text
+    cursor_pos += len;
+    return 0;
+}
+
 // Concat text onto the currently focused sub
 void sub_insert_text(const char *text)
 {
@@ -530,28 +1649,53 @@ void sub_insert_text(const char *text)
         return;
     }
 
-    size_t len_text = strlen(text);
-    size_t len_sub = strlen(sub_focused->text);
+    if (insert_text(text, strlen(text)) == 0)
+        export_reload_sub();
+}
 
-    // Not enough space
-    if (len_text + len_sub >= sizeof(sub_focused->text))
+// Paste text at the cursor of the focused sub
+// Paragraphs after the first, separated by blank lines, become new subs
+// each starting where the previous one ends
+void sub_paste_text(const char *text)
+{
+    if (sub_focused == NULL)
+    {
+        show_text("No sub focused!", 100);
         return;
+    }
 
-    // Bytes to copy, including null terminator
-    size_t sz = len_sub - cursor_pos + 1;
+    // Clipboard text may have CRLF line breaks
+    char *buf = (char *)malloc(strlen(text) + 1);
+    char *out = buf;
+    for (; *text; text++)
+    {
+        if (*text != '\r')
+            *out++ = *text;
+    }
+    *out = '\0';
 
-    // Shift current string at cursor position strlen(text) characters forward
-    memmove(sub_focused->text + cursor_pos + len_text, sub_focused->text + cursor_pos, sz);
+    char *p = buf;
+    for (int first = 1; *p; first = 0)
+    {
+        char *end = strstr(p, "\n\n");
+        if (end == NULL)
+            end = p + strlen(p);
 
-    // Insert text at cursor position
-    strncpy(sub_focused->text + cursor_pos, text, len_text);
+        if (!first)
+        {
+            new_sub(sub_focused->end_ts);
+            cursor_pos = 0;
+        }
+        insert_text(p, end - p);
+
+        // Skip the blank lines
+        for (p = end; *p == '\n'; p++)
+            ;
+    }
 
-    // char tmp[sizeof(sub_focused->text)];
-    // sprintf(tmp, "%.*s%s%s", cursor_pos, sub_focused->text, text, &sub_focused->text[cursor_pos]);
-    // strncpy(sub_focused->text, tmp, sizeof(sub_focused->text));
+    free(buf);
 
-    // Shift cursor position with text
-    cursor_pos += len_text;
+    // Preview once for the whole paste
     export_reload_sub();
 }
 
@@ -561,8 +1705,7 @@ void cursor_prev_word()
         return;
     if (cursor_pos == 0)
         return;
-    char *start = get_prev_word(sub_focused->text, cursor_pos - 1);
-    cursor_pos = start - sub_focused->text;
+    cursor_pos = gap_prev_word(edit_text(sub_focused), cursor_pos);
     export_reload_sub();
 }
 
@@ -570,18 +1713,19 @@ void cursor_next_word()
 {
     if (sub_focused == NULL)
         return;
-    if (cursor_pos == strlen(sub_focused->text))
+    GapBuffer *buf = edit_text(sub_focused);
+    if (cursor_pos == gap_len(buf))
         return;
-    char *end = get_next_word(sub_focused->text, cursor_pos);
-    cursor_pos = end - sub_focused->text;
+    cursor_pos = gap_next_word(buf, cursor_pos);
     export_reload_sub();
 }
 
+// Cursor moves by whole graphemes, so accents and emoji are never split
 void cursor_left()
 {
-    if (cursor_pos == 0)
+    if (sub_focused == NULL || cursor_pos <= 0)
         return;
-    cursor_pos--;
+    cursor_pos = gap_prev_grapheme(edit_text(sub_focused), cursor_pos);
     export_reload_sub();
 }
 
@@ -589,10 +1733,47 @@ void cursor_right()
 {
     if (sub_focused == NULL)
         return;
-    if (cursor_pos == strlen(sub_focused->text))
+    GapBuffer *buf = edit_text(sub_focused);
+    if (cursor_pos == gap_len(buf))
         return;
 
-    cursor_pos++;
+    cursor_pos = gap_next_grapheme(buf, cursor_pos);
+    export_reload_sub();
+}
+
+// Move the cursor to the same column of the previous line
+void cursor_up()
+{
+    if (sub_focused == NULL || cursor_pos < 0)
+        return;
+
+    GapBuffer *buf = edit_text(sub_focused);
+    int line = gap_line_of(buf, cursor_pos);
+    if (line == 0)
+        return;
+
+    int col = gap_column(buf, gap_line_start(buf, line), cursor_pos);
+    int start = gap_line_start(buf, line - 1);
+    int end = gap_line_end(buf, line - 1);
+    cursor_pos = gap_advance(buf, start, col, end);
+    export_reload_sub();
+}
+
+// Move the cursor to the same column of the next line
+void cursor_down()
+{
+    if (sub_focused == NULL || cursor_pos < 0)
+        return;
+
+    GapBuffer *buf = edit_text(sub_focused);
+    int line = gap_line_of(buf, cursor_pos);
+    if (line + 1 >= gap_line_count(buf))
+        return;
+
+    int col = gap_column(buf, gap_line_start(buf, line), cursor_pos);
+    int start = gap_line_start(buf, line + 1);
+    int end = gap_line_end(buf, line + 1);
+    cursor_pos = gap_advance(buf, start, col, end);
     export_reload_sub();
 }
 
@@ -610,5 +1791,322 @@ void set_cursor_end()
 {
     if (sub_focused == NULL)
         return;
-    cursor_pos = strlen(sub_focused->text);
+    cursor_pos = gap_len(edit_text(sub_focused));
+}
+
+Sub *get_sub_head()
+{
+    return sub_head;
+}
+
+// Get the index of the focused sub, -1 if none
+int get_focused_idx()
+{
+    if (sub_focused == NULL)
+        return -1;
+    if (idx_cache_sub == sub_focused)
+        return idx_cache_idx;
+
+    int idx = 0;
+    for (Sub *sub_curr = sub_head; sub_curr; sub_curr = sub_curr->next, idx++)
+    {
+        if (sub_curr == sub_focused)
+        {
+            idx_cache_sub = sub_curr;
+            idx_cache_idx = idx;
+            return idx;
+        }
+    }
+    return -1;
+}
+
+int get_cursor_pos()
+{
+    return cursor_pos;
+}
+
+// Internal function to replace the sub list without publishing it
+static void replace_list(Sub *head, int focused_idx, int cursor)
+{
+    search_index_clear();
+
+    while (sub_head)
+    {
+        Sub *next = sub_head->next;
+        free_sub(sub_head);
+        sub_head = next;
+    }
+
+    sub_head = head;
+    sub_focused = head;
+    for (int i = 0; i < focused_idx && sub_focused && sub_focused->next; i++)
+        sub_focused = sub_focused->next;
+
+    cursor_pos = sub_focused ? cursor : -1;
+    sub_index_dirty = 1;
+    idx_cache_sub = NULL;
+    follow_last_ts = -1;
+
+    // Ids are kept, new subs are numbered after them
+    next_sub_id = 0;
+    for (Sub *sub_curr = sub_head; sub_curr; sub_curr = sub_curr->next)
+    {
+        if (sub_curr->id >= next_sub_id)
+            next_sub_id = sub_curr->id + 1;
+    }
+}
+
+// Replace the current sub list with an ordered list of a loaded file
+void subs_load(Sub *head, int focused_idx, int cursor)
+{
+    replace_list(head, focused_idx, cursor);
+    publish_all();
+    undo_clear();
+}
+
+// Internal function to set a sub to a record of another version
+static void set_sub_record(Sub *sub, const SubRecord *rec)
+{
+    // Index is keyed by id, and ids of other subs may be swapped too
+    if (sub->id != rec->id)
+        search_index_clear();
+    index_begin(sub);
+
+    sub->start_ts = rec->start_ts;
+    sub->end_ts = rec->end_ts;
+    sub->id = rec->id;
+
+    // Versions from before :renumber have higher ids
+    if (rec->id >= next_sub_id)
+        next_sub_id = rec->id + 1;
+
+    if (sub == edit_sub)
+        edit_sub = NULL;
+    free(sub->text);
+    sub->text = NULL;
+    sub->src = rec->text;
+    sub->src_len = rec->len;
+
+    // Text owned by the store may be freed with the version
+    if (rec->owned)
+        materialize_sub(sub);
+
+    index_end(sub, 1);
+}
+
+// Replace the subs with a version kept for undo
+// Only subs that differ are changed if no sub was added or deleted
+void subs_restore(const StoreNode *root, int focused_idx)
+{
+    // Journal records cannot express renumbered or reordered subs
+    int compact = 0;
+
+    if (store_count(store_working()) == store_count(root))
+    {
+        update_sub_index();
+
+        int len;
+        int *diff = store_diff(store_working(), root, &len);
+
+        // Cheaper to build the search index and compact the journal again
+        // than to update them for this many subs
+        if (len > SEARCH_MAX_UPDATES)
+            search_index_clear();
+        if (len > JOURNAL_MAX_BATCH)
+            compact = 1;
+
+        for (int i = 0; i < len; i++)
+        {
+            Sub *sub = sub_index[diff[i]];
+            const SubRecord *rec = store_get(root, diff[i]);
+
+            if (sub->id != rec->id || len > JOURNAL_MAX_BATCH)
+            {
+                compact = 1;
+            }
+            else
+            {
+                int old_len;
+                sub_text(sub, &old_len);
+                journal_append(JOURNAL_DELETE_TEXT, sub->id, 0, old_len, 0, NULL);
+                journal_append(JOURNAL_INSERT_TEXT, sub->id, 0, rec->len, 0, rec->text);
+                journal_append(JOURNAL_SET_START, sub->id, 0, 0, rec->start_ts, NULL);
+                journal_append(JOURNAL_SET_END, sub->id, 0, 0, rec->end_ts, NULL);
+            }
+            set_sub_record(sub, rec);
+        }
+        free(diff);
+
+        sub_index_dirty = 1;
+        sub_focused = focused_idx >= 0 && focused_idx < sub_index_len ? sub_index[focused_idx] : sub_head;
+        cursor_pos = -1;
+    }
+    else
+    {
+        // Built again on the next search
+        search_index_clear();
+
+        Sub *head = NULL;
+        Sub *tail = NULL;
+
+        StoreIter it;
+        store_iter_init(&it, root, 0);
+        const SubRecord *rec;
+        while ((rec = store_iter_next(&it)) != NULL)
+        {
+            Sub *sub = alloc_sub();
+            set_sub_record(sub, rec);
+            if (tail)
+                tail->next = sub;
+            else
+                head = sub;
+            tail = sub;
+        }
+
+        replace_list(head, focused_idx, -1);
+        compact = 1;
+    }
+
+    // The version is shared rather than rebuilt from the list
+    store_restore(root);
+    store_publish();
+
+    if (compact)
+        journal_compact();
+
+    export_reload_sub();
+}
+
+
+// Internal function to find a sub by id
+// Consecutive records usually target the focused sub
+static Sub *find_sub(unsigned int id)
+{
+    if (sub_focused && sub_focused->id == id)
+        return sub_focused;
+
+    for (Sub *sub_curr = sub_head; sub_curr; sub_curr = sub_curr->next)
+    {
+        if (sub_curr->id == id)
+            return sub_curr;
+    }
+    return NULL;
+}
+
+// Apply a journal record when recovering
+// Not journaled again, as the journal is started after recovery
+void apply_journal_record(int op, unsigned int id, unsigned int pos, unsigned int len, double ts, const char *data)
+{
+    if (op == JOURNAL_NEW_SUB)
+    {
+        new_sub(ts);
+        sub_focused->id = id;
+        if (id >= next_sub_id)
+            next_sub_id = id + 1;
+        publish_focused();
+        return;
+    }
+
+    Sub *sub = find_sub(id);
+    if (sub == NULL)
+        return;
+    sub_focused = sub;
+
+    switch (op)
+    {
+    case JOURNAL_INSERT_TEXT:
+        if (edit_insert(sub, pos, data, len) != 0)
+            return;
+        break;
+
+    case JOURNAL_DELETE_TEXT:
+        if (edit_delete(sub, pos, len) != 0)
+            return;
+        break;
+
+    case JOURNAL_SET_START:
+        sub->start_ts = ts;
+        sub_index_dirty = 1;
+        // A crash may have hit before the compaction that followed a move
+        reorder_focused();
+        break;
+
+    case JOURNAL_SET_END:
+        sub->end_ts = ts;
+        sub_index_dirty = 1;
+        break;
+
+    case JOURNAL_DELETE_SUB:
+        delete_focused_sub();
+        return;
+    }
+
+    publish_focused();
+}
+
+// Take ownership of the file that unmaterialized text points into
+void subs_set_source(MappedFile *map, const char *filename)
+{
+    // Older versions may still point into the old source
+    store_retire_file(&sub_source);
+    free(sub_source_path);
+
+    sub_source = *map;
+    sub_source_path = strdup(filename);
+}
+
+// Release the mapping of the sub source if it is the given file,
+// so that the file can be replaced
+void subs_detach_source(const char *filename)
+{
+    if (sub_source_path == NULL || strcmp(sub_source_path, filename) != 0 ||
+        sub_source.handle == NULL)
+        return;
+
+    // A save in progress pins a version pointing into the mapping
+    save_wait();
+
+    MappedFile old = sub_source;
+    char *data = (char *)malloc(old.size);
+
+    if (data == NULL)
+    {
+        // Fall back to materializing every sub, undo points have no copy
+        // to point into
+        for (Sub *sub_curr = sub_head; sub_curr; sub_curr = sub_curr->next)
+            materialize_sub(sub_curr);
+        sub_source = (MappedFile){0};
+        undo_clear();
+        show_text("Undo history dropped to release the file!", 1000);
+    }
+    else
+    {
+        memcpy(data, old.data, old.size);
+        sub_source = (MappedFile){.data = data, .size = old.size};
+
+        // Rebase unmaterialized text onto the heap copy
+        for (Sub *sub_curr = sub_head; sub_curr; sub_curr = sub_curr->next)
+        {
+            uintptr_t src = (uintptr_t)sub_curr->src;
+            if (src >= (uintptr_t)old.data && src < (uintptr_t)old.data + old.size)
+                sub_curr->src = data + (src - (uintptr_t)old.data);
+        }
+
+        // Undo points are kept, pointing into the copy too
+        undo_rebase(old.data, old.size, data);
+    }
+
+    // Unmapped by publishing once nothing points into it
+    store_retire_file(&old);
+    publish_all();
+}
+
+// Release the sub source before the given file is atomically replaced
+// Only Windows refuses to replace a mapped file, elsewhere the mapping
+// stays valid after the rename and is kept
+void subs_release_source(const char *filename)
+{
+#ifdef _WIN32
+    subs_detach_source(filename);
+#endif
 }
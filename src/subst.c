@@ -0,0 +1,370 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <SDL2/SDL.h>
+
+#include <subst.h>
+#include <slre.h>
+#include <store.h>
+#include <subs.h>
+#include <utils.h>
+#include <main.h>
+#include <trace.h>
+
+// A parsed :s command, shared read-only by the workers
+typedef struct SubstSpec
+{
+    // Literal text to find, if there is no pattern
+    char literal[256];
+    int literal_len;
+    const struct slre_prog *re;
+    // Anchored patterns only match once
+    int anchored;
+    char replacement[256];
+    int global;
+} SubstSpec;
+
+// Subs for a worker to substitute in, and the texts it changed
+typedef struct SubstJob
+{
+    const SubstSpec *spec;
+    const StoreNode *root;
+    const int *set;
+    int first;
+    int n;
+    int *changed_idx;
+    char **changed_texts;
+    int num_changed;
+    long matches;
+} SubstJob;
+
+// A growing output text
+typedef struct SubstBuf
+{
+    char *data;
+    int len;
+    int cap;
+} SubstBuf;
+
+// Internal function to append bytes to an output text
+static void buf_append(SubstBuf *buf, const char *src, int len)
+{
+    if (len <= 0)
+        return;
+    if (buf->len + len + 1 > buf->cap)
+    {
+        buf->cap = (buf->len + len + 1) * 2;
+        buf->data = (char *)realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, src, len);
+    buf->len += len;
+}
+
+// Internal function to append the replacement for a match
+// & is the whole match and \1 to \9 are the groups of a pattern
+static void append_replacement(SubstBuf *buf, const SubstSpec *spec, const char *match, int match_len, const struct slre_cap *caps)
+{
+    for (const char *p = spec->replacement; *p; p++)
+    {
+        if (*p == '&')
+        {
+            buf_append(buf, match, match_len);
+        }
+        else if (*p == '\\' && p[1] >= '1' && p[1] <= '9')
+        {
+            // The whole match is the first capture, the groups follow it
+            int group = *++p - '0';
+            if (spec->re && caps[group].ptr)
+                buf_append(buf, caps[group].ptr, caps[group].len);
+        }
+        else if (*p == '\\' && p[1] == 'n')
+        {
+            buf_append(buf, "\n", 1);
+            p++;
+        }
+        else if (*p == '\\' && p[1] != '\0')
+        {
+            buf_append(buf, ++p, 1);
+        }
+        else
+        {
+            buf_append(buf, p, 1);
+        }
+    }
+}
+
+// Internal function to substitute the matches in a text
+// Returns the new text, or NULL if nothing matched
+static char *substitute_text(const SubstSpec *spec, const char *text, int len, long *matches)
+{
+    SubstBuf buf = {0};
+    struct slre_cap caps[SUBST_MAX_CAPS];
+    int count = 0;
+    int pos = 0;
+    // End of the last match, where an empty match is not replaced again
+    int last_end = -1;
+
+    while (pos <= len)
+    {
+        int start, end;
+        if (spec->re)
+        {
+            memset(caps, 0, sizeof(caps));
+            if (slre_exec(spec->re, text + pos, len - pos, caps, SUBST_MAX_CAPS) < 0)
+                break;
+            start = caps[0].ptr - text;
+            end = start + caps[0].len;
+        }
+        else
+        {
+            const char *found = find_bytes(text + pos, len - pos, spec->literal, spec->literal_len);
+            if (found == NULL)
+                break;
+            start = found - text;
+            end = start + spec->literal_len;
+        }
+
+        buf_append(&buf, text + pos, start - pos);
+        if (end > start || start != last_end)
+        {
+            append_replacement(&buf, spec, text + start, end - start, caps);
+            count++;
+        }
+        last_end = end;
+        pos = end;
+
+        if (!spec->global || spec->anchored)
+            break;
+
+        // Step over a whole character after an empty match
+        if (end == start)
+        {
+            if (pos == len)
+            {
+                pos++;
+                break;
+            }
+            int step = 1;
+            while (pos + step < len && ((unsigned char)text[pos + step] & 0xC0) == 0x80)
+                step++;
+            buf_append(&buf, text + pos, step);
+            pos += step;
+        }
+    }
+
+    if (count == 0)
+    {
+        free(buf.data);
+        return NULL;
+    }
+
+    if (pos < len)
+        buf_append(&buf, text + pos, len - pos);
+    if (buf.data == NULL)
+        buf.data = (char *)malloc(1);
+    buf.data[buf.len] = '\0';
+
+    *matches += count;
+    return buf.data;
+}
+
+// Internal function to substitute in a chunk of subs, run by the workers
+static int subst_worker(void *data)
+{
+    SubstJob *job = (SubstJob *)data;
+    Uint64 span = TRACE_BEGIN();
+
+    StoreIter it;
+    if (job->set == NULL)
+        store_iter_init(&it, job->root, job->first);
+
+    for (int k = 0; k < job->n; k++)
+    {
+        int idx = job->set ? job->set[k] : job->first + k;
+        const SubRecord *rec = job->set ? store_get(job->root, idx) : store_iter_next(&it);
+
+        char *text = substitute_text(job->spec, rec->text, rec->len, &job->matches);
+        if (text == NULL)
+            continue;
+
+        if (job->changed_idx == NULL)
+        {
+            job->changed_idx = (int *)malloc(job->n * sizeof(int));
+            job->changed_texts = (char **)malloc(job->n * sizeof(char *));
+        }
+        job->changed_idx[job->num_changed] = idx;
+        job->changed_texts[job->num_changed++] = text;
+    }
+
+    TRACE_END(span, "subst", "subst_worker");
+    return 0;
+}
+
+// Internal function to read a delimited part of a :s command
+// Escaped delimiters are unescaped, other escapes are kept
+// Returns a pointer past the closing delimiter
+static const char *parse_part(const char *p, char delim, char *out, size_t sz)
+{
+    size_t len = 0;
+    while (*p && *p != delim && len < sz - 1)
+    {
+        if (*p == '\\' && p[1] == delim)
+            p++;
+        else if (*p == '\\' && p[1] != '\0' && len < sz - 2)
+            out[len++] = *p++;
+        out[len++] = *p++;
+    }
+    out[len] = '\0';
+    return *p == delim ? p + 1 : p;
+}
+
+// Internal function to check if a pattern has no regex metacharacters
+static int is_literal(const char *pattern)
+{
+    return strpbrk(pattern, "\\^$.[]()*+?|") == NULL;
+}
+
+// Internal function to parse /pattern/replacement/flags into a spec
+// Return 0 on success
+static int parse_subst(const char *args, SubstSpec *spec)
+{
+    char delim = *args;
+    if (delim == '\0' || isalnum((unsigned char)delim) || delim == '\\')
+        return 1;
+
+    char pattern[256];
+    const char *p = parse_part(args + 1, delim, pattern, sizeof(pattern));
+    p = parse_part(p, delim, spec->replacement, sizeof(spec->replacement));
+    if (pattern[0] == '\0')
+        return 1;
+
+    int ignore_case = 0;
+    for (; *p; p++)
+    {
+        if (*p == 'g')
+            spec->global = 1;
+        else if (*p == 'i')
+            ignore_case = 1;
+        else if (*p == 'I')
+            ignore_case = 0;
+        else if (*p != ' ')
+            return 1;
+    }
+
+    char *body = pattern;
+    if (strncmp(body, "(?i)", 4) == 0)
+    {
+        ignore_case = 1;
+        body += 4;
+    }
+
+    // Literals are found without the regex engine
+    if (!ignore_case && is_literal(body))
+    {
+        spec->literal_len = strlen(body);
+        memcpy(spec->literal, body, spec->literal_len + 1);
+        return 0;
+    }
+
+    // The pattern is wrapped in a group to capture the whole match,
+    // with anchors kept outside as slre only honours them there
+    int anchored = body[0] == '^';
+    if (anchored)
+        body++;
+    size_t len = strlen(body);
+    int at_end = len > 0 && body[len - 1] == '$' && (len < 2 || body[len - 2] != '\\');
+    if (at_end)
+        body[--len] = '\0';
+
+    char wrapped[sizeof(pattern) + 16];
+    snprintf(wrapped, sizeof(wrapped), "%s%s(%s)%s", ignore_case ? "(?i)" : "", anchored ? "^" : "", body, at_end ? "$" : "");
+    spec->re = slre_cached(wrapped, NULL);
+    spec->anchored = anchored;
+    return spec->re == NULL;
+}
+
+// Substitute a pattern in the text of subs as a single change
+// Runs on the set of indices, or on the range of n subs from first if there is no set
+// Matching is split between worker threads for large ranges
+// Return 0 on success, the number of matches and of subs changed are set
+int substitute(const int *set, int first, int n, const char *args, long *matches, int *changed)
+{
+    *matches = 0;
+    *changed = 0;
+
+    SubstSpec spec = {0};
+    if (parse_subst(args, &spec) != 0)
+    {
+        show_text("Invalid pattern!", 300);
+        return 1;
+    }
+
+    int workers = SDL_GetCPUCount();
+    if (workers > SUBST_MAX_THREADS)
+        workers = SUBST_MAX_THREADS;
+    if (workers > n / SUBST_MIN_CHUNK)
+        workers = n / SUBST_MIN_CHUNK;
+    if (workers < 1)
+        workers = 1;
+
+    // The working version does not change while the main thread waits
+    SubstJob jobs[SUBST_MAX_THREADS];
+    SDL_Thread *threads[SUBST_MAX_THREADS];
+    int start = 0;
+    for (int w = 0; w < workers; w++)
+    {
+        int len = n / workers + (w < n % workers);
+        jobs[w] = (SubstJob){.spec = &spec, .root = store_working(), .set = set ? set + start : NULL, .first = first + start, .n = len};
+        start += len;
+    }
+
+    // The main thread takes the first chunk
+    for (int w = 1; w < workers; w++)
+        threads[w] = SDL_CreateThread(subst_worker, "subst", &jobs[w]);
+    subst_worker(&jobs[0]);
+    for (int w = 1; w < workers; w++)
+        SDL_WaitThread(threads[w], NULL);
+
+    // Chunks are in order, so the changed subs are too
+    int total = 0;
+    for (int w = 0; w < workers; w++)
+        total += jobs[w].num_changed;
+
+    int *idx = (int *)malloc((total ? total : 1) * sizeof(int));
+    char **texts = (char **)malloc((total ? total : 1) * sizeof(char *));
+    int k = 0;
+    for (int w = 0; w < workers; w++)
+    {
+        *matches += jobs[w].matches;
+        if (jobs[w].num_changed == 0)
+            continue;
+
+        memcpy(idx + k, jobs[w].changed_idx, jobs[w].num_changed * sizeof(int));
+        memcpy(texts + k, jobs[w].changed_texts, jobs[w].num_changed * sizeof(char *));
+        k += jobs[w].num_changed;
+        free(jobs[w].changed_idx);
+        free(jobs[w].changed_texts);
+    }
+
+    int ret = 0;
+    if (total == 0)
+    {
+        show_text("Pattern not found!", 300);
+        ret = 1;
+    }
+    else if (set_sub_texts(idx, texts, total) != 0)
+    {
+        for (k = 0; k < total; k++)
+            free(texts[k]);
+        ret = 1;
+    }
+    else
+    {
+        *changed = total;
+    }
+
+    free(idx);
+    free(texts);
+    return ret;
+}
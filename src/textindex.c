@@ -0,0 +1,368 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <textindex.h>
+
+// Slot key of an unused slot, trigrams only take 24 bits
+#define EMPTY_KEY 0xFFFFFFFF
+
+// Sorted ids of the subs whose text holds a trigram
+typedef struct Posting
+{
+    uint32_t key;
+    int len;
+    int cap;
+    uint32_t *ids;
+} Posting;
+
+// Open addressed table of postings by trigram
+static Posting *table = NULL;
+static int table_cap = 0;
+static int table_used = 0;
+
+// Index is built on the first search and kept up to date after
+static int index_ready = 0;
+
+// Trigrams of the text before an edit, and scratch for the text after it
+static uint32_t *old_grams = NULL;
+static int old_len = 0;
+static int old_cap = 0;
+static uint32_t *new_grams = NULL;
+static int new_cap = 0;
+
+static inline uint32_t hash_key(uint32_t key)
+{
+    key ^= key >> 16;
+    key *= 0x45d9f3b;
+    key ^= key >> 16;
+    return key;
+}
+
+// Internal function to find the slot of a trigram, or the empty slot it would take
+static Posting *find_slot(Posting *slots, int cap, uint32_t key)
+{
+    uint32_t mask = cap - 1;
+    uint32_t i = hash_key(key) & mask;
+    while (slots[i].key != EMPTY_KEY && slots[i].key != key)
+        i = (i + 1) & mask;
+    return &slots[i];
+}
+
+// Internal function to double the table once it is 70% full
+static void grow_table()
+{
+    int cap = table_cap ? table_cap * 2 : SEARCH_TABLE_SIZE;
+    Posting *slots = (Posting *)malloc(cap * sizeof(Posting));
+    for (int i = 0; i < cap; i++)
+        slots[i].key = EMPTY_KEY;
+
+    for (int i = 0; i < table_cap; i++)
+    {
+        if (table[i].key != EMPTY_KEY)
+            *find_slot(slots, cap, table[i].key) = table[i];
+    }
+
+    free(table);
+    table = slots;
+    table_cap = cap;
+}
+
+// Internal function to get the posting of a trigram, adding it if new
+static Posting *get_posting(uint32_t key)
+{
+    if ((table_used + 1) * 10 > table_cap * 7)
+        grow_table();
+
+    Posting *p = find_slot(table, table_cap, key);
+    if (p->key == EMPTY_KEY)
+    {
+        p->key = key;
+        p->len = 0;
+        p->cap = 0;
+        p->ids = NULL;
+        table_used++;
+    }
+    return p;
+}
+
+// Internal function to get the posting of a trigram, NULL if none
+static Posting *lookup_posting(uint32_t key)
+{
+    if (table_cap == 0)
+        return NULL;
+
+    Posting *p = find_slot(table, table_cap, key);
+    return p->key == EMPTY_KEY ? NULL : p;
+}
+
+// Internal function to find the position of the first id not below id
+static int lower_bound(const uint32_t *ids, int len, uint32_t id)
+{
+    int lo = 0;
+    int hi = len;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void reserve_ids(Posting *p, int len)
+{
+    if (len <= p->cap)
+        return;
+    p->cap = p->cap ? p->cap * 2 : 4;
+    if (p->cap < len)
+        p->cap = len;
+    p->ids = (uint32_t *)realloc(p->ids, p->cap * sizeof(uint32_t));
+}
+
+// Internal function to add an id to a posting, keeping it sorted
+static void insert_id(Posting *p, uint32_t id)
+{
+    int pos = lower_bound(p->ids, p->len, id);
+    if (pos < p->len && p->ids[pos] == id)
+        return;
+
+    reserve_ids(p, p->len + 1);
+    memmove(p->ids + pos + 1, p->ids + pos, (p->len - pos) * sizeof(uint32_t));
+    p->ids[pos] = id;
+    p->len++;
+}
+
+// Internal function to remove an id from a posting
+static void remove_id(Posting *p, uint32_t id)
+{
+    int pos = lower_bound(p->ids, p->len, id);
+    if (pos == p->len || p->ids[pos] != id)
+        return;
+
+    memmove(p->ids + pos, p->ids + pos + 1, (p->len - pos - 1) * sizeof(uint32_t));
+    p->len--;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Internal function to sort and drop repeated values
+// Returns the new length
+static int sort_unique(uint32_t *vals, int len)
+{
+    if (len < 2)
+        return len;
+
+    qsort(vals, len, sizeof(uint32_t), compare_u32);
+
+    int n = 1;
+    for (int i = 1; i < len; i++)
+    {
+        if (vals[i] != vals[n - 1])
+            vals[n++] = vals[i];
+    }
+    return n;
+}
+
+// Internal function to collect the trigrams of text split in two parts,
+// such as the halves of a gap buffer
+// Returns the number of trigrams, which may repeat
+static int collect_trigrams(const char *head, int head_len, const char *tail, int tail_len, uint32_t **grams, int *cap)
+{
+    int len = head_len + tail_len;
+    if (len - 2 > *cap)
+    {
+        *cap = len - 2;
+        *grams = (uint32_t *)realloc(*grams, *cap * sizeof(uint32_t));
+    }
+
+    int n = 0;
+    uint32_t gram = 0;
+    for (int i = 0; i < len; i++)
+    {
+        unsigned char c = i < head_len ? head[i] : tail[i - head_len];
+        gram = ((gram << 8) | c) & 0xFFFFFF;
+        if (i >= 2)
+            (*grams)[n++] = gram;
+    }
+    return n;
+}
+
+int search_index_ready()
+{
+    return index_ready;
+}
+
+// Drop the index, it is built again on the next search
+void search_index_clear()
+{
+    for (int i = 0; i < table_cap; i++)
+    {
+        if (table[i].key != EMPTY_KEY)
+            free(table[i].ids);
+    }
+    free(table);
+    table = NULL;
+    table_cap = 0;
+    table_used = 0;
+    index_ready = 0;
+}
+
+// Add the text of a sub while building the index
+// Ids are only sorted by search_index_done
+void search_index_add(uint32_t id, const char *head, int head_len, const char *tail, int tail_len)
+{
+    int n = collect_trigrams(head, head_len, tail, tail_len, &new_grams, &new_cap);
+    for (int i = 0; i < n; i++)
+    {
+        Posting *p = get_posting(new_grams[i]);
+
+        // Trigrams repeated in the same text
+        if (p->len > 0 && p->ids[p->len - 1] == id)
+            continue;
+
+        reserve_ids(p, p->len + 1);
+        p->ids[p->len++] = id;
+    }
+}
+
+// Finish building the index
+void search_index_done()
+{
+    for (int i = 0; i < table_cap; i++)
+    {
+        Posting *p = &table[i];
+        if (p->key == EMPTY_KEY)
+            continue;
+
+        // Subs are usually added in id order
+        for (int j = 1; j < p->len; j++)
+        {
+            if (p->ids[j] <= p->ids[j - 1])
+            {
+                p->len = sort_unique(p->ids, p->len);
+                break;
+            }
+        }
+    }
+    index_ready = 1;
+}
+
+// Note the text of a sub before it changes
+// Text that does not exist yet is empty
+void search_index_begin(const char *head, int head_len, const char *tail, int tail_len)
+{
+    if (!index_ready)
+        return;
+
+    old_len = collect_trigrams(head, head_len, tail, tail_len, &old_grams, &old_cap);
+    old_len = sort_unique(old_grams, old_len);
+}
+
+// Update the index once the text of a sub changed since search_index_begin
+// Only trigrams that were added or removed are touched
+// Text of a deleted sub is empty
+void search_index_end(uint32_t id, const char *head, int head_len, const char *tail, int tail_len)
+{
+    if (!index_ready)
+        return;
+
+    int new_len = collect_trigrams(head, head_len, tail, tail_len, &new_grams, &new_cap);
+    new_len = sort_unique(new_grams, new_len);
+
+    int i = 0;
+    int j = 0;
+    while (i < old_len || j < new_len)
+    {
+        if (j == new_len || (i < old_len && old_grams[i] < new_grams[j]))
+        {
+            Posting *p = lookup_posting(old_grams[i++]);
+            if (p)
+                remove_id(p, id);
+        }
+        else if (i == old_len || new_grams[j] < old_grams[i])
+        {
+            insert_id(get_posting(new_grams[j++]), id);
+        }
+        else
+        {
+            i++;
+            j++;
+        }
+    }
+    old_len = 0;
+}
+
+static int compare_posting_len(const void *a, const void *b)
+{
+    return (*(Posting *const *)a)->len - (*(Posting *const *)b)->len;
+}
+
+// Find the ids of subs that may hold literal text, by the trigrams they share with it
+// Candidates still have to be checked against their text
+// Return 0 on success, with ids to be freed
+// Return 1 if the index cannot narrow the search to at most max candidates
+int search_index_query(const char *text, int len, int max, uint32_t **ids, int *num_ids)
+{
+    if (!index_ready || len < 3)
+        return 1;
+
+    uint32_t *grams = NULL;
+    int cap = 0;
+    int n = collect_trigrams(text, len, NULL, 0, &grams, &cap);
+    n = sort_unique(grams, n);
+
+    Posting **lists = (Posting **)malloc(n * sizeof(Posting *));
+    int found = 1;
+    for (int i = 0; i < n && found; i++)
+    {
+        lists[i] = lookup_posting(grams[i]);
+        found = lists[i] != NULL && lists[i]->len > 0;
+    }
+    free(grams);
+
+    *ids = NULL;
+    *num_ids = 0;
+    if (!found)
+    {
+        free(lists);
+        return 0;
+    }
+
+    // Intersect from the rarest trigram
+    qsort(lists, n, sizeof(Posting *), compare_posting_len);
+    if (lists[0]->len > max)
+    {
+        free(lists);
+        return 1;
+    }
+
+    uint32_t *result = (uint32_t *)malloc(lists[0]->len * sizeof(uint32_t));
+    memcpy(result, lists[0]->ids, lists[0]->len * sizeof(uint32_t));
+    int result_len = lists[0]->len;
+
+    for (int i = 1; i < n && result_len > 0; i++)
+    {
+        int kept = 0;
+        int pos = 0;
+        for (int j = 0; j < result_len; j++)
+        {
+            // Results are sorted, so later ones are searched after earlier ones
+            pos += lower_bound(lists[i]->ids + pos, lists[i]->len - pos, result[j]);
+            if (pos < lists[i]->len && lists[i]->ids[pos] == result[j])
+                result[kept++] = result[j];
+        }
+        result_len = kept;
+    }
+    free(lists);
+
+    *ids = result;
+    *num_ids = result_len;
+    return 0;
+}
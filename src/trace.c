@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include <trace.h>
+
+typedef struct TraceSpan
+{
+    const char *cat;
+    const char *name;
+    Uint64 start;
+    Uint64 end;
+    SDL_threadID tid;
+} TraceSpan;
+
+// Spans of one thread at a time, only ever appended to by that thread
+// Buffers of exited threads are taken over by new ones, so short lived
+// workers do not use up every buffer
+typedef struct TraceBuffer
+{
+    // Set once the owner has exited
+    SDL_atomic_t free;
+    // Trace the spans belong to, the owner empties the buffer when it changes
+    SDL_atomic_t generation;
+    // Published after each span is written, so it can be read while tracing
+    SDL_atomic_t len;
+    int dropped;
+    TraceSpan spans[TRACE_BUFFER_SIZE];
+} TraceBuffer;
+
+int trace_enabled = 0;
+
+static SDL_TLSID trace_tls = 0;
+static TraceBuffer *trace_buffers[TRACE_MAX_THREADS];
+static SDL_atomic_t trace_num_buffers;
+static SDL_atomic_t trace_generation;
+// Spans of threads that found no buffer
+static SDL_atomic_t trace_dropped;
+static Uint64 trace_origin = 0;
+static char trace_fname[512];
+
+// Start recording spans, to be written to a file when stopped
+// Return 0 on success
+int trace_start(const char *filename)
+{
+    if (trace_enabled)
+        return 1;
+
+    if (trace_tls == 0)
+        trace_tls = SDL_TLSCreate();
+    if (trace_tls == 0)
+        return 1;
+
+    snprintf(trace_fname, sizeof(trace_fname), "%s", filename);
+    trace_origin = SDL_GetPerformanceCounter();
+    SDL_AtomicAdd(&trace_generation, 1);
+    SDL_AtomicSet(&trace_dropped, 0);
+    trace_enabled = 1;
+    return 0;
+}
+
+// Internal function to give up the buffer of a thread as it exits
+static void release_buffer(void *data)
+{
+    TraceBuffer *buf = (TraceBuffer *)data;
+    SDL_AtomicSet(&buf->free, 1);
+}
+
+// Internal function to get the buffer of the calling thread,
+// taking over the buffer of an exited thread if there is one
+// Returns NULL if too many threads are tracing
+static TraceBuffer *thread_buffer()
+{
+    TraceBuffer *buf = (TraceBuffer *)SDL_TLSGet(trace_tls);
+    if (buf != NULL)
+        return buf;
+
+    int num_buffers = SDL_AtomicGet(&trace_num_buffers);
+    if (num_buffers > TRACE_MAX_THREADS)
+        num_buffers = TRACE_MAX_THREADS;
+    for (int i = 0; i < num_buffers && buf == NULL; i++)
+    {
+        TraceBuffer *other = (TraceBuffer *)SDL_AtomicGetPtr((void **)&trace_buffers[i]);
+        if (other != NULL && SDL_AtomicCAS(&other->free, 1, 0))
+            buf = other;
+    }
+
+    if (buf == NULL)
+    {
+        if (num_buffers >= TRACE_MAX_THREADS)
+            return NULL;
+        int slot = SDL_AtomicAdd(&trace_num_buffers, 1);
+        if (slot >= TRACE_MAX_THREADS)
+            return NULL;
+
+        buf = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+        if (buf == NULL)
+            return NULL;
+        SDL_AtomicSetPtr((void **)&trace_buffers[slot], buf);
+    }
+    SDL_TLSSet(trace_tls, buf, release_buffer);
+    return buf;
+}
+
+// Record a span from start until now on the calling thread
+void trace_span(Uint64 start, const char *cat, const char *name)
+{
+    if (!trace_enabled || start < trace_origin)
+        return;
+
+    Uint64 end = SDL_GetPerformanceCounter();
+    TraceBuffer *buf = thread_buffer();
+    if (buf == NULL)
+    {
+        SDL_AtomicAdd(&trace_dropped, 1);
+        return;
+    }
+
+    // Spans of an earlier trace were already written
+    int generation = SDL_AtomicGet(&trace_generation);
+    if (SDL_AtomicGet(&buf->generation) != generation)
+    {
+        SDL_AtomicSet(&buf->len, 0);
+        buf->dropped = 0;
+        SDL_AtomicSet(&buf->generation, generation);
+    }
+
+    int len = SDL_AtomicGet(&buf->len);
+    if (len == TRACE_BUFFER_SIZE)
+    {
+        buf->dropped++;
+        return;
+    }
+    buf->spans[len] = (TraceSpan){.cat = cat, .name = name, .start = start, .end = end, .tid = SDL_ThreadID()};
+    SDL_AtomicSet(&buf->len, len + 1);
+}
+
+// Stop recording and write the spans as Chrome trace JSON,
+// which chrome://tracing and Perfetto open
+// Return 0 on success
+int trace_stop()
+{
+    if (!trace_enabled)
+        return 1;
+    trace_enabled = 0;
+
+    FILE *fp = fopen(trace_fname, "w");
+    if (fp == NULL)
+        return 1;
+
+    double us_per_tick = 1000000.0 / SDL_GetPerformanceFrequency();
+    int generation = SDL_AtomicGet(&trace_generation);
+    int num_buffers = SDL_AtomicGet(&trace_num_buffers);
+    if (num_buffers > TRACE_MAX_THREADS)
+        num_buffers = TRACE_MAX_THREADS;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"sbubby\"}}");
+    for (int i = 0; i < num_buffers; i++)
+    {
+        TraceBuffer *buf = (TraceBuffer *)SDL_AtomicGetPtr((void **)&trace_buffers[i]);
+        if (buf == NULL || SDL_AtomicGet(&buf->generation) != generation)
+            continue;
+
+        int len = SDL_AtomicGet(&buf->len);
+        for (int k = 0; k < len; k++)
+        {
+            const TraceSpan *span = &buf->spans[k];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%lu}",
+                    span->name, span->cat, (span->start - trace_origin) * us_per_tick,
+                    (span->end - span->start) * us_per_tick, (unsigned long)span->tid);
+        }
+        if (buf->dropped > 0)
+            fprintf(stderr, "trace: dropped %d spans of a full buffer\n", buf->dropped);
+    }
+    if (SDL_AtomicGet(&trace_dropped) > 0)
+        fprintf(stderr, "trace: dropped %d spans of threads past %d\n", SDL_AtomicGet(&trace_dropped),
+                TRACE_MAX_THREADS);
+    fprintf(fp, "\n]}\n");
+
+    return fclose(fp) != 0;
+}
+
+const char *trace_filename()
+{
+    return trace_fname;
+}
+
+// Write any trace in progress and free the buffers
+// Only called once the other threads are done
+void trace_close()
+{
+    trace_stop();
+
+    int num_buffers = SDL_AtomicGet(&trace_num_buffers);
+    if (num_buffers > TRACE_MAX_THREADS)
+        num_buffers = TRACE_MAX_THREADS;
+    for (int i = 0; i < num_buffers; i++)
+    {
+        free(trace_buffers[i]);
+        trace_buffers[i] = NULL;
+    }
+    SDL_AtomicSet(&trace_num_buffers, 0);
+    if (trace_tls != 0)
+        SDL_TLSSet(trace_tls, NULL, NULL);
+}
@@ -0,0 +1,1078 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#include <transmem.h>
+#include <utils.h>
+#include <codec.h>
+#include <encoding.h>
+#include <trace.h>
+
+// Lines read from past subtitles while building a memory
+typedef struct TmBuild
+{
+    // Distinct texts, null terminated one after another
+    char *text;
+    uint64_t text_len;
+    uint64_t text_cap;
+    uint64_t *text_offsets;
+    uint32_t *text_hashes;
+    uint32_t num_texts;
+    uint32_t texts_cap;
+    // Open addressing table of text ids plus one by hash, to find repeated lines
+    uint32_t *table;
+    uint32_t table_size;
+    // Text of each line in file order, and whether it ends its file
+    uint32_t *line_texts;
+    uint8_t *last;
+    uint32_t num_lines;
+    uint32_t lines_cap;
+} TmBuild;
+
+// Texts hashed by a build worker, keys are stored band after band
+typedef struct TmHashJob
+{
+    const TmBuild *build;
+    uint32_t first;
+    uint32_t n;
+    uint32_t *keys;
+} TmHashJob;
+
+// Sections of the mapped memory, checked only as far as tm_open needs
+// Indices and offsets are bounds checked as they are looked up
+typedef struct TmIndex
+{
+    MappedFile map;
+    uint32_t num_texts;
+    uint32_t num_lines;
+    uint32_t num_buckets;
+    const uint64_t *text_offsets;
+    const char *text;
+    uint64_t text_size;
+    const uint32_t *line_texts;
+    const uint8_t *last;
+    const uint32_t *text_line_starts;
+    const uint32_t *text_lines;
+    const uint32_t *buckets;
+    const uint32_t *postings;
+} TmIndex;
+
+static TmIndex tm_index = {0};
+
+static SDL_Thread *tm_thread = NULL;
+static SDL_mutex *tm_mutex = NULL;
+// Signalled when there is a request for the lookup thread
+static SDL_cond *tm_cond = NULL;
+// Pushed to wake the UI thread when there are results
+static Uint32 tm_wakeup = 0;
+
+// Below are guarded by tm_mutex
+
+// Latest request, older ones are dropped
+static char tm_query[TM_MAX_TEXT];
+static int tm_query_len = 0;
+static int tm_query_follow = 0;
+static unsigned int tm_requested = 0;
+static unsigned int tm_taken = 0;
+// Results of the latest request, until taken by the UI thread
+static TmSuggestion tm_found[TM_MAX_SUGGESTIONS];
+static int tm_num_found = 0;
+static int tm_fresh = 0;
+static int tm_stop = 0;
+
+// Written between sections
+static const char tm_padding[TM_ALIGN] = {0};
+
+static inline uint64_t align_up(uint64_t off)
+{
+    return (off + TM_ALIGN - 1) & ~(uint64_t)(TM_ALIGN - 1);
+}
+
+// Internal function to scramble the bits of a hash
+static inline uint32_t mix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Internal function to sort a few numbers, which most lines have
+static void sort_u32(uint32_t *a, int n)
+{
+    if (n > 32)
+    {
+        qsort(a, n, sizeof(uint32_t), compare_u32);
+        return;
+    }
+    for (int i = 1; i < n; i++)
+    {
+        uint32_t x = a[i];
+        int j = i;
+        for (; j > 0 && a[j - 1] > x; j--)
+            a[j] = a[j - 1];
+        a[j] = x;
+    }
+}
+
+// Internal function to gather the trigrams of a text, in order and with repeats
+// Text is lowercased with tags dropped and punctuation turned into spaces,
+// so that lines differing only by those still match
+// Returns the number of trigrams, 0 if the text has no words
+static int text_trigrams(const char *text, int len, uint32_t *grams)
+{
+    if (len > TM_MAX_TEXT)
+        len = TM_MAX_TEXT;
+
+    // Spaces around words make short words count
+    unsigned char norm[TM_MAX_TEXT + 2];
+    int n = 0;
+    norm[n++] = ' ';
+
+    char close = 0;
+    for (int i = 0; i < len; i++)
+    {
+        unsigned char c = text[i];
+        if (close)
+        {
+            if (c == close)
+                close = 0;
+            continue;
+        }
+
+        if (c == '<')
+            close = '>';
+        else if (c == '{')
+            close = '}';
+        else if (c >= 0x80 || isalnum(c))
+            norm[n++] = c < 0x80 ? tolower(c) : c;
+        else if (norm[n - 1] != ' ')
+            norm[n++] = ' ';
+    }
+    if (n == 1)
+        return 0;
+    if (norm[n - 1] != ' ')
+        norm[n++] = ' ';
+
+    int num = 0;
+    for (int i = 0; i + 3 <= n; i++)
+        grams[num++] = (uint32_t)norm[i] << 16 | (uint32_t)norm[i + 1] << 8 | norm[i + 2];
+    return num;
+}
+
+// Internal function to gather the trigrams of a text into a sorted set
+// Returns the number of trigrams, 0 if the text has no words
+static int trigram_set(const char *text, int len, uint32_t *grams)
+{
+    int num = text_trigrams(text, len, grams);
+    if (num == 0)
+        return 0;
+
+    sort_u32(grams, num);
+    int unique = 1;
+    for (int i = 1; i < num; i++)
+    {
+        if (grams[i] != grams[unique - 1])
+            grams[unique++] = grams[i];
+    }
+    return unique;
+}
+
+// Internal function to hash a trigram set, equal for texts differing
+// only by case, tags and punctuation
+static uint32_t set_hash(const uint32_t *grams, int n)
+{
+    uint32_t h = n;
+    for (int i = 0; i < n; i++)
+        h = mix32(h ^ grams[i]);
+    return h;
+}
+
+// Internal function to hash the MinHash signature of some trigrams, band by band
+// Repeated trigrams do not change the signature
+static void band_keys(const uint32_t *grams, int n, uint32_t *keys)
+{
+    uint32_t mins[TM_BANDS * TM_BAND_ROWS];
+    for (int k = 0; k < TM_BANDS * TM_BAND_ROWS; k++)
+        mins[k] = UINT32_MAX;
+
+    // Each row is the least trigram under its own permutation
+    for (int i = 0; i < n; i++)
+    {
+        for (int k = 0; k < TM_BANDS * TM_BAND_ROWS; k++)
+        {
+            uint32_t h = mix32(grams[i] + (k + 1) * 0x9E3779B9u);
+            if (h < mins[k])
+                mins[k] = h;
+        }
+    }
+
+    for (int b = 0; b < TM_BANDS; b++)
+    {
+        uint32_t key = 0;
+        for (int r = 0; r < TM_BAND_ROWS; r++)
+            key = mix32(key ^ mins[b * TM_BAND_ROWS + r]);
+        keys[b] = key;
+    }
+}
+
+// Internal function to count the trigrams two sets have in common,
+// in percent of both
+static int dice_score(const uint32_t *a, int na, const uint32_t *b, int nb)
+{
+    int common = 0;
+    int i = 0;
+    int j = 0;
+    while (i < na && j < nb)
+    {
+        if (a[i] < b[j])
+            i++;
+        else if (a[i] > b[j])
+            j++;
+        else
+        {
+            common++;
+            i++;
+            j++;
+        }
+    }
+    return 200 * common / (na + nb);
+}
+
+// Internal function to check if a file is a subtitle file by its extension
+static int is_subtitle_file(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (ext == NULL || strlen(ext) != 4)
+        return 0;
+
+    char lower[5];
+    for (int i = 0; i < 5; i++)
+        lower[i] = tolower((unsigned char)ext[i]);
+    return strcmp(lower, ".srt") == 0 || strcmp(lower, ".vtt") == 0 ||
+           strcmp(lower, ".ass") == 0 || strcmp(lower, ".ssa") == 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Internal function to list the subtitle files of a directory, sorted by name
+// Returns a malloc'd array of malloc'd paths, or NULL if the directory cannot be read
+static char **list_subtitles(const char *dir, int *num)
+{
+    int cap = 64;
+    char **paths = (char **)malloc(cap * sizeof(char *));
+    *num = 0;
+
+#ifdef _WIN32
+    char pattern[512];
+    snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA(pattern, &entry);
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        free(paths);
+        return NULL;
+    }
+    do
+    {
+        const char *name = entry.cFileName;
+        if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+#else
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        free(paths);
+        return NULL;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        const char *name = entry->d_name;
+#endif
+        if (!is_subtitle_file(name))
+            continue;
+
+        if (*num == cap)
+        {
+            cap *= 2;
+            paths = (char **)realloc(paths, cap * sizeof(char *));
+        }
+        size_t size = strlen(dir) + strlen(name) + 2;
+        paths[*num] = (char *)malloc(size);
+        snprintf(paths[*num], size, "%s/%s", dir, name);
+        (*num)++;
+#ifdef _WIN32
+    } while (FindNextFileA(find, &entry));
+    FindClose(find);
+#else
+    }
+    closedir(d);
+#endif
+
+    qsort(paths, *num, sizeof(char *), compare_names);
+    return paths;
+}
+
+// Internal function to hash the bytes of a text
+static uint32_t bytes_hash(const char *text, uint64_t len)
+{
+    uint32_t h = 2166136261u;
+    for (uint64_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)text[i]) * 16777619u;
+    return h;
+}
+
+// Internal function to double the table of texts, placing them again
+static void grow_table(TmBuild *build)
+{
+    free(build->table);
+    build->table_size = build->table_size ? build->table_size * 2 : 1 << 16;
+    build->table = (uint32_t *)calloc(build->table_size, sizeof(uint32_t));
+
+    uint32_t mask = build->table_size - 1;
+    for (uint32_t id = 0; id < build->num_texts; id++)
+    {
+        uint32_t slot = build->text_hashes[id] & mask;
+        while (build->table[slot] != 0)
+            slot = (slot + 1) & mask;
+        build->table[slot] = id + 1;
+    }
+}
+
+// Internal function to add the text of a cue as a line of the memory
+// Carriage returns and blank lines are dropped, and cues without words are skipped
+// Lines repeating an earlier text share it
+static void add_line(TmBuild *build, const char *text, int len)
+{
+    while (len > 0 && isspace((unsigned char)text[len - 1]))
+        len--;
+    while (len > 0 && isspace((unsigned char)*text))
+    {
+        text++;
+        len--;
+    }
+
+    uint32_t grams[TM_MAX_TEXT];
+    if (len == 0 || text_trigrams(text, len, grams) == 0 || build->num_lines == UINT32_MAX - 1)
+        return;
+
+    if (build->text_len + len + 1 > build->text_cap)
+    {
+        build->text_cap = build->text_cap ? build->text_cap * 2 : 1 << 20;
+        if (build->text_cap < build->text_len + len + 1)
+            build->text_cap = build->text_len + len + 1;
+        build->text = (char *)realloc(build->text, build->text_cap);
+    }
+
+    // Text is written after the others, and dropped again if it is a repeat
+    char *start = build->text + build->text_len;
+    char *out = start;
+    for (int i = 0; i < len; i++)
+    {
+        if (text[i] == '\r' || (text[i] == '\n' && out[-1] == '\n'))
+            continue;
+        *out++ = text[i];
+    }
+    *out = '\0';
+    uint64_t text_len = out - start;
+    uint32_t hash = bytes_hash(start, text_len);
+
+    if ((uint64_t)(build->num_texts + 1) * 2 > build->table_size)
+        grow_table(build);
+
+    uint32_t mask = build->table_size - 1;
+    uint32_t slot = hash & mask;
+    uint32_t id = UINT32_MAX;
+    for (; build->table[slot] != 0; slot = (slot + 1) & mask)
+    {
+        uint32_t other = build->table[slot] - 1;
+        uint64_t other_off = build->text_offsets[other];
+        if (build->text_hashes[other] == hash && strcmp(build->text + other_off, start) == 0)
+        {
+            id = other;
+            break;
+        }
+    }
+
+    if (id == UINT32_MAX)
+    {
+        if (build->num_texts == build->texts_cap)
+        {
+            build->texts_cap = build->texts_cap ? build->texts_cap * 2 : 4096;
+            build->text_offsets = (uint64_t *)realloc(build->text_offsets, (build->texts_cap + 1) * sizeof(uint64_t));
+            build->text_hashes = (uint32_t *)realloc(build->text_hashes, build->texts_cap * sizeof(uint32_t));
+        }
+        id = build->num_texts++;
+        build->text_offsets[id] = build->text_len;
+        build->text_hashes[id] = hash;
+        build->table[slot] = id + 1;
+        build->text_len += text_len + 1;
+    }
+
+    if (build->num_lines == build->lines_cap)
+    {
+        build->lines_cap = build->lines_cap ? build->lines_cap * 2 : 4096;
+        build->line_texts = (uint32_t *)realloc(build->line_texts, build->lines_cap * sizeof(uint32_t));
+        build->last = (uint8_t *)realloc(build->last, build->lines_cap);
+    }
+    build->line_texts[build->num_lines] = id;
+    build->last[build->num_lines] = 0;
+    build->num_lines++;
+}
+
+// Internal function to add the cues of a subtitle file as lines, in file order
+// Return 0 on success
+static int read_file_lines(const char *filename, TmBuild *build)
+{
+    MappedFile map;
+    if (map_file(filename, &map) != 0)
+        return 1;
+    decode_file(&map);
+
+    CueReader reader;
+    cue_reader_init(&reader, codec_from_filename(filename), map.data, map.size);
+
+    uint32_t first = build->num_lines;
+    SubCue cue;
+    while (cue_reader_next(&reader, &cue))
+        add_line(build, cue.text, cue.len);
+
+    // Lines only follow each other within a file
+    if (build->num_lines > first)
+        build->last[build->num_lines - 1] = 1;
+
+    cue_reader_free(&reader);
+    unmap_file(&map);
+    return 0;
+}
+
+static void free_build(TmBuild *build)
+{
+    free(build->text);
+    free(build->text_offsets);
+    free(build->text_hashes);
+    free(build->table);
+    free(build->line_texts);
+    free(build->last);
+}
+
+// Internal function to hash the texts of a chunk, run by the build workers
+static int hash_worker(void *data)
+{
+    TmHashJob *job = (TmHashJob *)data;
+    const TmBuild *build = job->build;
+
+    uint32_t grams[TM_MAX_TEXT];
+    uint32_t keys[TM_BANDS];
+    for (uint32_t i = job->first; i < job->first + job->n; i++)
+    {
+        int len = build->text_offsets[i + 1] - build->text_offsets[i] - 1;
+        int n = text_trigrams(build->text + build->text_offsets[i], len, grams);
+        band_keys(grams, n, keys);
+        for (int b = 0; b < TM_BANDS; b++)
+            job->keys[(uint64_t)b * build->num_texts + i] = keys[b];
+    }
+    return 0;
+}
+
+// Internal function to write a section and the padding up to the next one
+// Return 0 on success
+static int write_section(FILE *fp, const void *data, uint64_t size)
+{
+    return fwrite(data, 1, size, fp) != size ||
+           fwrite(tm_padding, 1, align_up(size) - size, fp) != align_up(size) - size;
+}
+
+// Internal function to write the lines of each text, in file order
+// Return 0 on success
+static int write_text_lines(FILE *fp, const TmBuild *build)
+{
+    uint32_t *starts = (uint32_t *)calloc((uint64_t)build->num_texts + 1, sizeof(uint32_t));
+    uint32_t *lines = (uint32_t *)malloc((uint64_t)build->num_lines * sizeof(uint32_t));
+
+    // Lines are counted after their text, then summed into starts
+    for (uint32_t i = 0; i < build->num_lines; i++)
+        starts[build->line_texts[i] + 1]++;
+    for (uint32_t t = 0; t < build->num_texts; t++)
+        starts[t + 1] += starts[t];
+
+    // Filling moves each start to the next text, so it is written first
+    int err = write_section(fp, starts, ((uint64_t)build->num_texts + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < build->num_lines; i++)
+        lines[starts[build->line_texts[i]]++] = i;
+    err = err || write_section(fp, lines, (uint64_t)build->num_lines * sizeof(uint32_t));
+
+    free(starts);
+    free(lines);
+    return err;
+}
+
+// Internal function to write the buckets of every band, then the texts
+// of every band in order of bucket
+// Return 0 on success
+static int write_bands(FILE *fp, const uint32_t *keys, uint32_t num_texts, uint32_t num_buckets)
+{
+    uint64_t num_starts = (uint64_t)TM_BANDS * (num_buckets + 1);
+    uint32_t *starts = (uint32_t *)calloc(num_starts, sizeof(uint32_t));
+    uint32_t *postings = (uint32_t *)malloc(num_texts * sizeof(uint32_t));
+    uint32_t *fill = (uint32_t *)malloc(num_buckets * sizeof(uint32_t));
+
+    // Texts are counted into the bucket after theirs, then summed into starts
+    for (int b = 0; b < TM_BANDS; b++)
+    {
+        uint32_t *band_starts = starts + (uint64_t)b * (num_buckets + 1);
+        const uint32_t *band_keys = keys + (uint64_t)b * num_texts;
+        for (uint32_t i = 0; i < num_texts; i++)
+            band_starts[(band_keys[i] & (num_buckets - 1)) + 1]++;
+        for (uint32_t k = 0; k < num_buckets; k++)
+            band_starts[k + 1] += band_starts[k];
+    }
+    int err = write_section(fp, starts, num_starts * sizeof(uint32_t));
+
+    // Texts of a bucket stay in order, so those of earlier files are looked at first
+    for (int b = 0; !err && b < TM_BANDS; b++)
+    {
+        const uint32_t *band_starts = starts + (uint64_t)b * (num_buckets + 1);
+        const uint32_t *band_keys = keys + (uint64_t)b * num_texts;
+        memcpy(fill, band_starts, num_buckets * sizeof(uint32_t));
+        for (uint32_t i = 0; i < num_texts; i++)
+            postings[fill[band_keys[i] & (num_buckets - 1)]++] = i;
+        err = fwrite(postings, sizeof(uint32_t), num_texts, fp) != num_texts;
+    }
+
+    // Postings of every band form a single section
+    uint64_t size = (uint64_t)TM_BANDS * num_texts * sizeof(uint32_t);
+    err = err || fwrite(tm_padding, 1, align_up(size) - size, fp) != align_up(size) - size;
+
+    free(starts);
+    free(postings);
+    free(fill);
+    return err;
+}
+
+// Build a translation memory from the subtitle files of a directory
+// Every cue is a line, and the distinct texts of lines are looked up by
+// the MinHash bands of their trigrams
+// The rate is printed for benchmarking
+// Return 0 on success
+int tm_build(const char *dir, const char *out_fname)
+{
+    int num_files;
+    char **files = list_subtitles(dir, &num_files);
+    if (files == NULL)
+    {
+        fprintf(stderr, "failed to read %s\n", dir);
+        return 1;
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    TmBuild build = {0};
+    int num_read = 0;
+    for (int f = 0; f < num_files; f++)
+    {
+        if (read_file_lines(files[f], &build) != 0)
+            fprintf(stderr, "failed to read %s\n", files[f]);
+        else
+            num_read++;
+        free(files[f]);
+    }
+    free(files);
+
+    if (build.num_lines == 0)
+    {
+        fprintf(stderr, "no subtitles found in %s\n", dir);
+        free_build(&build);
+        return 1;
+    }
+    build.text_offsets[build.num_texts] = build.text_len;
+
+    // Buckets hold two texts of a band on average
+    uint32_t num_buckets = 1;
+    while (num_buckets < build.num_texts / 2)
+        num_buckets <<= 1;
+
+    int workers = SDL_GetCPUCount();
+    if (workers > TM_MAX_THREADS)
+        workers = TM_MAX_THREADS;
+    if (workers > (int)(build.num_texts / TM_MIN_CHUNK))
+        workers = build.num_texts / TM_MIN_CHUNK;
+    if (workers < 1)
+        workers = 1;
+
+    uint32_t *keys = (uint32_t *)malloc((uint64_t)TM_BANDS * build.num_texts * sizeof(uint32_t));
+    TmHashJob jobs[TM_MAX_THREADS];
+    SDL_Thread *threads[TM_MAX_THREADS];
+    uint32_t first = 0;
+    for (int w = 0; w < workers; w++)
+    {
+        uint32_t n = build.num_texts / workers + ((uint32_t)w < build.num_texts % workers);
+        jobs[w] = (TmHashJob){.build = &build, .first = first, .n = n, .keys = keys};
+        first += n;
+    }
+
+    // The main thread takes the first chunk
+    for (int w = 1; w < workers; w++)
+        threads[w] = SDL_CreateThread(hash_worker, "tmhash", &jobs[w]);
+    hash_worker(&jobs[0]);
+    for (int w = 1; w < workers; w++)
+        SDL_WaitThread(threads[w], NULL);
+
+    TmHeader header = {0};
+    memcpy(header.magic, TM_MAGIC, sizeof(header.magic));
+    header.version = TM_VERSION;
+    header.num_texts = build.num_texts;
+    header.num_lines = build.num_lines;
+    header.num_buckets = num_buckets;
+    header.num_bands = TM_BANDS;
+    header.band_rows = TM_BAND_ROWS;
+    header.num_sections = 8;
+
+    uint64_t num_texts = build.num_texts;
+    uint64_t num_lines = build.num_lines;
+    TmSection sections[8] = {
+        {.type = TM_SECTION_TEXT_OFFSETS, .size = (num_texts + 1) * sizeof(uint64_t)},
+        {.type = TM_SECTION_TEXT, .size = build.text_len},
+        {.type = TM_SECTION_LINE_TEXTS, .size = num_lines * sizeof(uint32_t)},
+        {.type = TM_SECTION_LAST_LINES, .size = num_lines},
+        {.type = TM_SECTION_TEXT_LINE_STARTS, .size = (num_texts + 1) * sizeof(uint32_t)},
+        {.type = TM_SECTION_TEXT_LINES, .size = num_lines * sizeof(uint32_t)},
+        {.type = TM_SECTION_BUCKETS, .size = TM_BANDS * ((uint64_t)num_buckets + 1) * sizeof(uint32_t)},
+        {.type = TM_SECTION_POSTINGS, .size = TM_BANDS * num_texts * sizeof(uint32_t)},
+    };
+
+    // Sections are written in the order they are laid out
+    uint64_t off = sizeof(header) + align_up(sizeof(sections));
+    for (int i = 0; i < 8; i++)
+    {
+        sections[i].offset = off;
+        off = align_up(off + sections[i].size);
+    }
+
+    char tmp_fname[512];
+    FILE *fp = open_file_atomic(out_fname, tmp_fname, sizeof(tmp_fname));
+    int err = fp == NULL;
+    if (!err)
+    {
+        err = fwrite(&header, sizeof(header), 1, fp) != 1 ||
+              write_section(fp, sections, sizeof(sections)) ||
+              write_section(fp, build.text_offsets, sections[0].size) ||
+              write_section(fp, build.text, sections[1].size) ||
+              write_section(fp, build.line_texts, sections[2].size) ||
+              write_section(fp, build.last, sections[3].size) ||
+              write_text_lines(fp, &build) ||
+              write_bands(fp, keys, build.num_texts, num_buckets);
+        err = commit_file_atomic(fp, err, tmp_fname, out_fname);
+    }
+
+    Uint64 ticks = SDL_GetPerformanceCounter() - start;
+    free(keys);
+    free_build(&build);
+
+    if (err)
+    {
+        fprintf(stderr, "failed to write %s\n", out_fname);
+        return 1;
+    }
+
+    double secs = (double)ticks / SDL_GetPerformanceFrequency();
+    if (secs <= 0)
+        secs = 1e-9;
+    printf("%u lines with %u distinct texts from %d files indexed in %.1f ms, %.0f lines/s\n", header.num_lines,
+           header.num_texts, num_read, secs * 1000, header.num_lines / secs);
+    printf("%.1f MB written to %s\n", off / (1024.0 * 1024.0), out_fname);
+    return 0;
+}
+
+// Internal function to get a text of the memory, checking it is in bounds
+// Returns NULL if the memory is corrupt
+static const char *text_at(uint32_t id, int *len)
+{
+    if (id >= tm_index.num_texts)
+        return NULL;
+
+    uint64_t start = tm_index.text_offsets[id];
+    uint64_t end = tm_index.text_offsets[id + 1];
+    if (start >= end || end > tm_index.text_size || tm_index.text[end - 1] != '\0')
+        return NULL;
+
+    *len = end - start - 1;
+    return tm_index.text + start;
+}
+
+// Internal function to add a suggestion, keeping the best ones in order of score
+// Texts with the same trigrams are only suggested once
+static void add_suggestion(TmSuggestion *found, uint32_t *hashes, int *num, const char *text, int len,
+                           uint32_t hash, int score)
+{
+    for (int i = 0; i < *num; i++)
+    {
+        if (hashes[i] != hash)
+            continue;
+        if (found[i].score >= score)
+            return;
+
+        // Placed again below
+        memmove(&found[i], &found[i + 1], (*num - i - 1) * sizeof(TmSuggestion));
+        memmove(&hashes[i], &hashes[i + 1], (*num - i - 1) * sizeof(uint32_t));
+        (*num)--;
+        break;
+    }
+
+    int pos = *num;
+    while (pos > 0 && found[pos - 1].score < score)
+        pos--;
+    if (pos == TM_MAX_SUGGESTIONS)
+        return;
+
+    int n = *num < TM_MAX_SUGGESTIONS ? *num : TM_MAX_SUGGESTIONS - 1;
+    memmove(&found[pos + 1], &found[pos], (n - pos) * sizeof(TmSuggestion));
+    memmove(&hashes[pos + 1], &hashes[pos], (n - pos) * sizeof(uint32_t));
+    found[pos] = (TmSuggestion){.text = text, .len = len, .score = score};
+    hashes[pos] = hash;
+    *num = n + 1;
+}
+
+// Internal function to suggest the texts that came after the lines of a text
+// Each is scored by the match of the text and the share of its lines it followed,
+// so the likeliest come first even when none is likely
+static void add_next_texts(uint32_t id, int score, TmSuggestion *found, uint32_t *hashes, int *num)
+{
+    uint32_t lo = tm_index.text_line_starts[id];
+    uint32_t hi = tm_index.text_line_starts[id + 1];
+    if (lo > hi || hi > tm_index.num_lines)
+        return;
+    if (hi - lo > TM_MAX_FOLLOW_LINES)
+        hi = lo + TM_MAX_FOLLOW_LINES;
+
+    uint32_t next[TM_MAX_FOLLOW_LINES];
+    int num_next = 0;
+    for (uint32_t k = lo; k < hi; k++)
+    {
+        uint32_t line = tm_index.text_lines[k];
+        if (line < tm_index.num_lines - 1 && !tm_index.last[line])
+            next[num_next++] = tm_index.line_texts[line + 1];
+    }
+    sort_u32(next, num_next);
+
+    uint32_t grams[TM_MAX_TEXT];
+    for (int i = 0; i < num_next;)
+    {
+        int run = 1;
+        while (i + run < num_next && next[i + run] == next[i])
+            run++;
+
+        int next_score = score * run / (int)(hi - lo);
+        int len;
+        const char *text = text_at(next[i], &len);
+        if (text != NULL)
+        {
+            int n = trigram_set(text, len, grams);
+            add_suggestion(found, hashes, num, text, len, set_hash(grams, n), next_score);
+        }
+        i += run;
+    }
+}
+
+// Internal function to find the texts most like a query
+// Only texts sharing a band with the query are compared, at most
+// TM_MAX_BAND_CANDIDATES per band, so that lookups take about the same time
+// however large the memory is
+// With follow set, the texts that came after them are suggested instead
+// Returns the number of suggestions
+static int lookup(const char *query, int len, int follow, TmSuggestion *found)
+{
+    uint32_t grams[TM_MAX_TEXT];
+    int num_grams = trigram_set(query, len, grams);
+    if (num_grams == 0)
+        return 0;
+
+    uint32_t keys[TM_BANDS];
+    band_keys(grams, num_grams, keys);
+
+    uint32_t candidates[TM_BANDS * TM_MAX_BAND_CANDIDATES];
+    int num_candidates = 0;
+    for (int b = 0; b < TM_BANDS; b++)
+    {
+        const uint32_t *starts = tm_index.buckets + (uint64_t)b * (tm_index.num_buckets + 1);
+        uint32_t bucket = keys[b] & (tm_index.num_buckets - 1);
+        uint32_t lo = starts[bucket];
+        uint32_t hi = starts[bucket + 1];
+        if (lo > hi || hi > tm_index.num_texts)
+            continue;
+        if (hi - lo > TM_MAX_BAND_CANDIDATES)
+            hi = lo + TM_MAX_BAND_CANDIDATES;
+
+        memcpy(candidates + num_candidates, tm_index.postings + (uint64_t)b * tm_index.num_texts + lo,
+               (hi - lo) * sizeof(uint32_t));
+        num_candidates += hi - lo;
+    }
+
+    // Similar texts usually share several bands
+    sort_u32(candidates, num_candidates);
+
+    int num_found = 0;
+    uint32_t hashes[TM_MAX_SUGGESTIONS];
+    uint32_t text_grams[TM_MAX_TEXT];
+    for (int i = 0; i < num_candidates; i++)
+    {
+        if (i > 0 && candidates[i] == candidates[i - 1])
+            continue;
+
+        int text_len;
+        const char *text = text_at(candidates[i], &text_len);
+        if (text == NULL)
+            continue;
+
+        // Texts in the same bucket may not share the band
+        int num_text_grams = trigram_set(text, text_len, text_grams);
+        int score = dice_score(grams, num_grams, text_grams, num_text_grams);
+        if (score < TM_MIN_SCORE)
+            continue;
+
+        if (follow)
+            add_next_texts(candidates[i], score, found, hashes, &num_found);
+        else
+            add_suggestion(found, hashes, &num_found, text, text_len, set_hash(text_grams, num_text_grams), score);
+    }
+    return num_found;
+}
+
+// Looks up the latest request in the background, so that typing never
+// waits for the memory to be paged in
+static int tm_thread_fn(void *data)
+{
+    SDL_LockMutex(tm_mutex);
+    while (1)
+    {
+        while (!tm_stop && tm_taken == tm_requested)
+            SDL_CondWait(tm_cond, tm_mutex);
+        if (tm_stop)
+            break;
+
+        char query[TM_MAX_TEXT];
+        int len = tm_query_len;
+        int follow = tm_query_follow;
+        memcpy(query, tm_query, len);
+        unsigned int request = tm_taken = tm_requested;
+
+        SDL_UnlockMutex(tm_mutex);
+
+        TmSuggestion found[TM_MAX_SUGGESTIONS];
+        Uint64 span = TRACE_BEGIN();
+        int num_found = lookup(query, len, follow, found);
+        TRACE_END(span, "tm", "lookup");
+
+        SDL_LockMutex(tm_mutex);
+
+        // Newer requests make the results stale
+        if (request != tm_requested)
+            continue;
+        memcpy(tm_found, found, num_found * sizeof(TmSuggestion));
+        tm_num_found = num_found;
+        tm_fresh = 1;
+        if (tm_wakeup)
+        {
+            SDL_Event event = {.type = tm_wakeup};
+            SDL_PushEvent(&event);
+        }
+    }
+    SDL_UnlockMutex(tm_mutex);
+    return 0;
+}
+
+// Set the event pushed to the UI thread when there are suggestions
+void tm_set_wakeup(Uint32 wakeup)
+{
+    tm_wakeup = wakeup;
+}
+
+// Internal function to find a section of the given type
+// Returns NULL if missing or out of bounds
+static const TmSection *find_section(const char *data, size_t data_size, uint32_t type, uint64_t size)
+{
+    const TmHeader *header = (const TmHeader *)data;
+    const TmSection *sections = (const TmSection *)(data + sizeof(TmHeader));
+
+    for (uint32_t i = 0; i < header->num_sections; i++)
+    {
+        if (sections[i].type != type)
+            continue;
+        if (sections[i].size < size || sections[i].offset % TM_ALIGN != 0 ||
+            sections[i].offset > data_size || sections[i].size > data_size - sections[i].offset)
+            return NULL;
+        return &sections[i];
+    }
+    return NULL;
+}
+
+// Map a translation memory and start looking up requests in the background,
+// replacing the memory open before
+// Only the header is read here, texts are paged in as they are looked up
+// Return 0 on success
+int tm_open(const char *filename)
+{
+    tm_close();
+
+    MappedFile map;
+    if (map_file(filename, &map) != 0)
+        return 1;
+
+    const TmHeader *header = (const TmHeader *)map.data;
+    if (map.size < sizeof(TmHeader) ||
+        memcmp(header->magic, TM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TM_VERSION ||
+        header->num_bands != TM_BANDS || header->band_rows != TM_BAND_ROWS ||
+        header->num_buckets == 0 || (header->num_buckets & (header->num_buckets - 1)) != 0 ||
+        header->num_sections > (map.size - sizeof(TmHeader)) / sizeof(TmSection))
+    {
+        unmap_file(&map);
+        return 1;
+    }
+
+    uint64_t num_texts = header->num_texts;
+    uint64_t num_lines = header->num_lines;
+    const char *data = map.data;
+    const TmSection *text_off_sec = find_section(data, map.size, TM_SECTION_TEXT_OFFSETS, (num_texts + 1) * sizeof(uint64_t));
+    const TmSection *text_sec = find_section(data, map.size, TM_SECTION_TEXT, 0);
+    const TmSection *line_sec = find_section(data, map.size, TM_SECTION_LINE_TEXTS, num_lines * sizeof(uint32_t));
+    const TmSection *last_sec = find_section(data, map.size, TM_SECTION_LAST_LINES, num_lines);
+    const TmSection *start_sec = find_section(data, map.size, TM_SECTION_TEXT_LINE_STARTS, (num_texts + 1) * sizeof(uint32_t));
+    const TmSection *text_line_sec = find_section(data, map.size, TM_SECTION_TEXT_LINES, num_lines * sizeof(uint32_t));
+    const TmSection *bucket_sec = find_section(data, map.size, TM_SECTION_BUCKETS,
+                                               TM_BANDS * ((uint64_t)header->num_buckets + 1) * sizeof(uint32_t));
+    const TmSection *post_sec = find_section(data, map.size, TM_SECTION_POSTINGS, TM_BANDS * num_texts * sizeof(uint32_t));
+    if (!text_off_sec || !text_sec || !line_sec || !last_sec || !start_sec || !text_line_sec || !bucket_sec || !post_sec)
+    {
+        unmap_file(&map);
+        return 1;
+    }
+
+    tm_index = (TmIndex){
+        .map = map,
+        .num_texts = header->num_texts,
+        .num_lines = header->num_lines,
+        .num_buckets = header->num_buckets,
+        .text_offsets = (const uint64_t *)(data + text_off_sec->offset),
+        .text = data + text_sec->offset,
+        .text_size = text_sec->size,
+        .line_texts = (const uint32_t *)(data + line_sec->offset),
+        .last = (const uint8_t *)(data + last_sec->offset),
+        .text_line_starts = (const uint32_t *)(data + start_sec->offset),
+        .text_lines = (const uint32_t *)(data + text_line_sec->offset),
+        .buckets = (const uint32_t *)(data + bucket_sec->offset),
+        .postings = (const uint32_t *)(data + post_sec->offset),
+    };
+
+    tm_mutex = SDL_CreateMutex();
+    tm_cond = SDL_CreateCond();
+    tm_stop = 0;
+    tm_requested = tm_taken = 0;
+    tm_fresh = 0;
+
+    tm_thread = SDL_CreateThread(tm_thread_fn, "tm", NULL);
+    if (tm_thread == NULL)
+    {
+        tm_close();
+        return 1;
+    }
+    return 0;
+}
+
+int tm_loaded()
+{
+    return tm_thread != NULL;
+}
+
+uint32_t tm_num_lines()
+{
+    return tm_index.num_lines;
+}
+
+// Ask for the texts of the memory most like a text, replacing the last request
+// With follow set, the texts that came after them are suggested instead
+// Only the text is copied, the UI thread never waits for a lookup
+void tm_request(const char *text, int len, int follow)
+{
+    if (tm_thread == NULL)
+        return;
+    if (len > TM_MAX_TEXT)
+        len = TM_MAX_TEXT;
+
+    SDL_LockMutex(tm_mutex);
+    memcpy(tm_query, text, len);
+    tm_query_len = len;
+    tm_query_follow = follow;
+    tm_requested++;
+    tm_fresh = 0;
+    SDL_CondSignal(tm_cond);
+    SDL_UnlockMutex(tm_mutex);
+}
+
+// Take the suggestions for the last request, once found
+// Text points into the memory, valid until it is closed
+// Returns the number of suggestions, or -1 if they are not found yet
+int tm_results(TmSuggestion *found)
+{
+    if (tm_thread == NULL)
+        return -1;
+
+    SDL_LockMutex(tm_mutex);
+    int n = -1;
+    if (tm_fresh)
+    {
+        n = tm_num_found;
+        memcpy(found, tm_found, n * sizeof(TmSuggestion));
+        tm_fresh = 0;
+    }
+    SDL_UnlockMutex(tm_mutex);
+    return n;
+}
+
+// Stop the lookup thread and unmap the memory
+void tm_close()
+{
+    if (tm_thread != NULL)
+    {
+        SDL_LockMutex(tm_mutex);
+        tm_stop = 1;
+        SDL_CondSignal(tm_cond);
+        SDL_UnlockMutex(tm_mutex);
+
+        SDL_WaitThread(tm_thread, NULL);
+        tm_thread = NULL;
+    }
+
+    if (tm_mutex != NULL)
+    {
+        SDL_DestroyCond(tm_cond);
+        SDL_DestroyMutex(tm_mutex);
+        tm_cond = NULL;
+        tm_mutex = NULL;
+    }
+
+    unmap_file(&tm_index.map);
+    memset(&tm_index, 0, sizeof(tm_index));
+}
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <undo.h>
+#include <store.h>
+#include <main.h>
+#include <subs.h>
+
+// A retained version of the subs to return to
+typedef struct UndoPoint
+{
+    const StoreNode *root;
+    int focused_idx;
+    // Bytes allocated after the point was taken, which keep it alive
+    size_t bytes;
+    size_t mark;
+} UndoPoint;
+
+typedef struct UndoStack
+{
+    UndoPoint *points;
+    int len;
+    int cap;
+} UndoStack;
+
+static UndoStack undo_stack = {0};
+static UndoStack redo_stack = {0};
+
+// Set while changes are merged into the last undo point
+static int undo_open = 0;
+
+// Memory taken by undo points
+static size_t undo_bytes = 0;
+
+static void push_point(UndoStack *stack, int focused_idx)
+{
+    if (stack->len >= stack->cap)
+    {
+        stack->cap = stack->cap ? stack->cap * 2 : 64;
+        stack->points = (UndoPoint *)realloc(stack->points, stack->cap * sizeof(UndoPoint));
+    }
+
+    UndoPoint *point = &stack->points[stack->len++];
+    point->root = store_retain();
+    point->focused_idx = focused_idx;
+    point->bytes = 0;
+    point->mark = store_bytes_allocated();
+}
+
+// Internal function to move the top point of a stack onto another
+static void move_point(UndoStack *from, UndoStack *to)
+{
+    if (to->len >= to->cap)
+    {
+        to->cap = to->cap ? to->cap * 2 : 64;
+        to->points = (UndoPoint *)realloc(to->points, to->cap * sizeof(UndoPoint));
+    }
+
+    UndoPoint *point = &from->points[--from->len];
+    if (from == &undo_stack)
+        undo_bytes -= point->bytes;
+    else
+        undo_bytes += point->bytes;
+
+    to->points[to->len++] = *point;
+}
+
+// Internal function to account for memory allocated since the last point
+static void settle_bytes()
+{
+    if (undo_stack.len == 0)
+        return;
+
+    UndoPoint *point = &undo_stack.points[undo_stack.len - 1];
+    size_t bytes = store_bytes_allocated() - point->mark;
+    undo_bytes += bytes - point->bytes;
+    point->bytes = bytes;
+}
+
+static void clear_stack(UndoStack *stack)
+{
+    for (int i = 0; i < stack->len; i++)
+    {
+        store_drop(stack->points[i].root);
+        if (stack == &undo_stack)
+            undo_bytes -= stack->points[i].bytes;
+    }
+    stack->len = 0;
+}
+
+// Record the current subs as an undo point before changing them
+// Text edits with coalesce set are merged until undo_seal
+void undo_checkpoint(int coalesce)
+{
+    if (undo_open && coalesce)
+        return;
+
+    settle_bytes();
+    clear_stack(&redo_stack);
+    push_point(&undo_stack, get_focused_idx());
+    undo_open = coalesce;
+
+    // Drop the oldest points over the memory cap
+    int drop = 0;
+    while (undo_bytes > UNDO_MAX_BYTES && drop < undo_stack.len - 1)
+    {
+        store_drop(undo_stack.points[drop].root);
+        undo_bytes -= undo_stack.points[drop].bytes;
+        drop++;
+    }
+    if (drop > 0)
+    {
+        undo_stack.len -= drop;
+        memmove(undo_stack.points, undo_stack.points + drop, undo_stack.len * sizeof(UndoPoint));
+    }
+}
+
+// Stop merging text edits into the last undo point
+void undo_seal()
+{
+    undo_open = 0;
+}
+
+// Forget all undo points, when another file is loaded
+void undo_clear()
+{
+    clear_stack(&undo_stack);
+    clear_stack(&redo_stack);
+    undo_open = 0;
+    undo_bytes = 0;
+}
+
+// Point the text of every undo point that lies in one block of memory at
+// the same offsets of another, such as a copy of a file about to be unmapped
+void undo_rebase(const char *from, size_t size, const char *to)
+{
+    int n = undo_stack.len + redo_stack.len;
+    if (n == 0)
+        return;
+
+    const StoreNode **roots = (const StoreNode **)malloc(n * sizeof(StoreNode *));
+    for (int i = 0; i < undo_stack.len; i++)
+        roots[i] = undo_stack.points[i].root;
+    for (int i = 0; i < redo_stack.len; i++)
+        roots[undo_stack.len + i] = redo_stack.points[i].root;
+
+    store_rebase(roots, n, from, size, to);
+
+    for (int i = 0; i < undo_stack.len; i++)
+        undo_stack.points[i].root = roots[i];
+    for (int i = 0; i < redo_stack.len; i++)
+        redo_stack.points[i].root = roots[undo_stack.len + i];
+    free(roots);
+}
+
+// Internal function to move count points from one stack to the other
+// Return 0 if the subs were changed
+static int step(UndoStack *from, UndoStack *to, int count, const char *verb)
+{
+    if (from->len == 0)
+    {
+        show_text(from == &undo_stack ? "Already at oldest change!" : "Already at newest change!", 500);
+        return 1;
+    }
+
+    settle_bytes();
+    undo_open = 0;
+
+    if (count > from->len)
+        count = from->len;
+
+    // Keep the current subs to step back to
+    push_point(to, get_focused_idx());
+
+    // Points stepped over move to the other stack as they are
+    for (int i = 1; i < count; i++)
+        move_point(from, to);
+
+    UndoPoint point = from->points[--from->len];
+    if (from == &undo_stack)
+        undo_bytes -= point.bytes;
+
+    subs_restore(point.root, point.focused_idx);
+    store_drop(point.root);
+
+    // Only later edits add to the memory of the newest point
+    if (undo_stack.len > 0)
+    {
+        UndoPoint *top = &undo_stack.points[undo_stack.len - 1];
+        top->mark = store_bytes_allocated() - top->bytes;
+    }
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "%s, %d more (%zu KiB history)", verb, from->len, (undo_bytes + 1023) / 1024);
+    show_text(msg, 1000);
+    return 0;
+}
+
+// Undo the last count changes
+// Return 0 if the subs were changed
+int undo(int count)
+{
+    return step(&undo_stack, &redo_stack, count, "Undone");
+}
+
+// Redo the last count undone changes
+// Return 0 if the subs were changed
+int redo(int count)
+{
+    return step(&redo_stack, &undo_stack, count, "Redone");
+}
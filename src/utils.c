@@ -4,8 +4,17 @@
 #include <ctype.h>
 #include <stdlib.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include <utils.h>
-#include <slre.h>
 
 // Helper function to set window icon
 inline void set_window_icon(SDL_Window *window)
@@ -100,8 +109,13 @@ int pop_char_at_idx(char *str, int idx)
     if (idx >= len || idx < 0)
         return 1;
 
-    // Ovelap the string at idx with the rest of the string starting from idx+1
-    memmove(&str[idx], &str[idx + 1], strlen(str) - idx);
+    // Pop the continuation bytes of a UTF-8 char along with it
+    int n = 1;
+    while (idx + n < len && (str[idx + n] & 0xC0) == 0x80)
+        n++;
+
+    // Ovelap the string at idx with the rest of the string starting after the char
+    memmove(&str[idx], &str[idx + n], len - idx - n + 1);
     return 0;
 }
 
@@ -112,11 +126,11 @@ char *get_next_word(char *str, int idx)
     size_t len = strlen(str);
 
     // Skip leading chars
-    while (idx < len && !isspace(str[idx]))
+    while (idx < len && !isspace((unsigned char)str[idx]))
         idx++;
 
     // Skip leading spaces
-    while (idx < len && isspace(str[idx]))
+    while (idx < len && isspace((unsigned char)str[idx]))
         idx++;
 
     return &str[idx];
@@ -127,11 +141,11 @@ char *get_next_word(char *str, int idx)
 char *get_prev_word(char *str, int idx)
 {
     // Skip trailing spaces
-    while (idx >= 0 && isspace(str[idx]))
+    while (idx >= 0 && isspace((unsigned char)str[idx]))
         idx--;
 
     // Find previous whitespace if any
-    while (idx >= 0 && !isspace(str[idx]))
+    while (idx >= 0 && !isspace((unsigned char)str[idx]))
         idx--;
 
     return &str[idx + 1];
@@ -156,7 +170,11 @@ int pop_char(char *str)
     if (len <= 0)
         return 1;
 
-    str[len - 1] = '\0';
+    // Pop the whole UTF-8 char
+    len--;
+    while (len > 0 && (str[len] & 0xC0) == 0x80)
+        len--;
+    str[len] = '\0';
     return 0;
 }
 
@@ -169,44 +187,317 @@ void pop_word(char *str)
 }
 
 // Convert a HH:MM:SS string to a timestamp in seconds
+// Returns 0 if the whole string is not a timestamp
 double str_to_timestamp(const char *str)
 {
-    double timestamp = 0.0;
-    struct slre_cap caps[3];
+    double timestamp;
+    const char *end = str + strlen(str);
+    if (scan_timestamp(str, end, &timestamp) != end)
+        return 0.0;
+    return timestamp;
+}
+
+// Parse a HH:MM:SS,mmm timestamp from a string without regex
+// Returns pointer past the timestamp, or NULL if there is none
+const char *scan_timestamp(const char *str, const char *end, double *ts)
+{
+    long parts[3] = {0};
+
+    for (int i = 0; i < 3; i++)
+    {
+        if (str >= end || !isdigit((unsigned char)*str))
+            return NULL;
+        while (str < end && isdigit((unsigned char)*str))
+            parts[i] = parts[i] * 10 + (*str++ - '0');
 
-    if (slre_match("^([0-9]+):([0-9]+):([0-9]+[,|\\.][0-9]+)$", str, strlen(str), caps, 3) > 0)
+        if (i < 2)
+        {
+            if (str >= end || *str != ':')
+                return NULL;
+            str++;
+        }
+    }
+
+    double frac = 0;
+    if (str < end && (*str == ',' || *str == '.'))
     {
-        if (caps[0].len > 0 && caps[1].len > 0 && caps[2].len > 0)
+        str++;
+        double unit = 0.1;
+        if (str >= end || !isdigit((unsigned char)*str))
+            return NULL;
+        while (str < end && isdigit((unsigned char)*str))
         {
-            char hh[16] = {0};
-            char mm[16] = {0};
-            char ss[16] = {0};
+            frac += (*str++ - '0') * unit;
+            unit /= 10;
+        }
+    }
+
+    *ts = parts[0] * 3600 + parts[1] * 60 + parts[2] + frac;
+    return str;
+}
+
+// Check if a line only contains digits, like the index line of a srt sub
+int is_index_line(const char *line, const char *end)
+{
+    if (line >= end)
+        return 0;
+    for (; line < end; line++)
+    {
+        if (!isdigit((unsigned char)*line))
+            return 0;
+    }
+    return 1;
+}
+
+// Parse a "start --> end" srt timing line
+// Return 1 if the line is a timing line
+int scan_timing_line(const char *line, const char *end, double *start_ts, double *end_ts)
+{
+    line = scan_timestamp(line, end, start_ts);
+    if (line == NULL || end - line < 5 || memcmp(line, " --> ", 5) != 0)
+        return 0;
+    return scan_timestamp(line + 5, end, end_ts) != NULL;
+}
+
+// Write a timestamp in seconds as H:MM:SS, with hours padded to hour_digits
+// and frac_digits digits after sep
+// Returns the length written, without the null terminator
+int format_timestamp(const double ts, char *out, int hour_digits, char sep, int frac_digits)
+{
+    long long unit = 1;
+    for (int i = 0; i < frac_digits; i++)
+        unit *= 10;
+
+    // Rounded as a whole, so that seconds never round up to 60
+    long long ticks = ts > 0 ? (long long)(ts * unit + 0.5) : 0;
+    long long frac = ticks % unit;
+    long long secs = ticks / unit;
 
-            strncpy(hh, caps[0].ptr, caps[0].len);
-            strncpy(mm, caps[1].ptr, caps[1].len);
-            strncpy(ss, caps[2].ptr, caps[2].len);
+    char digits[24];
+    int n = 0;
+    long long h = secs / 3600;
+    do
+    {
+        digits[n++] = '0' + h % 10;
+        h /= 10;
+    } while (h > 0);
+    while (n < hour_digits)
+        digits[n++] = '0';
+
+    char *p = out;
+    while (n > 0)
+        *p++ = digits[--n];
 
-            char *pos = strchr(ss, ',');
-            if (pos)
-                *pos = '.';
+    int m = secs / 60 % 60;
+    int s = secs % 60;
+    *p++ = ':';
+    *p++ = '0' + m / 10;
+    *p++ = '0' + m % 10;
+    *p++ = ':';
+    *p++ = '0' + s / 10;
+    *p++ = '0' + s % 10;
 
-            timestamp = strtol(hh, NULL, 10) * 3600 + strtol(mm, NULL, 10) * 60 + strtod(ss, NULL);
+    if (frac_digits > 0)
+    {
+        *p++ = sep;
+        for (int i = frac_digits - 1; i >= 0; i--)
+        {
+            p[i] = '0' + frac % 10;
+            frac /= 10;
         }
+        p += frac_digits;
     }
 
-    return timestamp;
+    *p = '\0';
+    return p - out;
 }
 
-// Convert timestamp from seconds to HH:MM:SS format
+// Convert timestamp from seconds to HH:MM:SS,mmm format
 void timetamp_to_str(const double ts, char *ts_str)
 {
-    const int h = ts / 3600;
-    const int m = fmod((ts / 60), 60);
-    const double s = fmod(ts, 60);
-    sprintf(ts_str, "%02d:%02d:%06.3f", h, m, s);
+    format_timestamp(ts, ts_str, 2, ',', 3);
+}
+
+// Map a whole file read-only into memory
+// Return 0 on success
+int map_file(const char *filename, MappedFile *map)
+{
+    map->data = NULL;
+    map->size = 0;
+    map->handle = NULL;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return 1;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        // Empty files cannot be mapped
+        CloseHandle(file);
+        return 1;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    // The mapping keeps the file open
+    CloseHandle(file);
+    if (mapping == NULL)
+        return 1;
+
+    const char *data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL)
+    {
+        CloseHandle(mapping);
+        return 1;
+    }
+
+    map->data = data;
+    map->size = size.QuadPart;
+    map->handle = mapping;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        // Empty files cannot be mapped
+        close(fd);
+        return 1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file open
+    close(fd);
+    if (data == MAP_FAILED)
+        return 1;
+
+    map->data = (const char *)data;
+    map->size = st.st_size;
+    // Non-NULL to mark as a mapping
+    map->handle = data;
+#endif
+
+    return 0;
+}
+
+void unmap_file(MappedFile *map)
+{
+    if (map->data == NULL)
+        return;
+
+    if (map->handle == NULL)
+    {
+        free((void *)map->data);
+    }
+    else
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(map->data);
+        CloseHandle((HANDLE)map->handle);
+#else
+        munmap((void *)map->data, map->size);
+#endif
+    }
+
+    map->data = NULL;
+    map->size = 0;
+    map->handle = NULL;
+}
+
+// Atomically replace dst with src
+// Return 0 on success
+int replace_file(const char *src, const char *dst)
+{
+#ifdef _WIN32
+    return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) == 0;
+#else
+    return rename(src, dst) != 0;
+#endif
+}
+
+// Flush a file and wait for it to reach the disk
+// Return 0 on success
+int sync_file(FILE *fp)
+{
+    if (fflush(fp) != 0)
+        return 1;
+#ifdef _WIN32
+    return _commit(_fileno(fp)) != 0;
+#else
+    return fsync(fileno(fp)) != 0;
+#endif
+}
+
+// Open a temp file next to filename for writing its replacement
+// tmp_fname receives the temp filename
+FILE *open_file_atomic(const char *filename, char *tmp_fname, size_t sz)
+{
+    snprintf(tmp_fname, sz, "%s.tmp", filename);
+    return fopen(tmp_fname, "wb");
+}
+
+// Sync and close a temp file from open_file_atomic and replace filename
+// The temp file is removed if anything failed
+// Return 0 on success
+int commit_file_atomic(FILE *fp, int err, const char *tmp_fname, const char *filename)
+{
+    err = err || sync_file(fp) != 0;
+
+    if (fclose(fp) != 0 || err || replace_file(tmp_fname, filename) != 0)
+    {
+        remove(tmp_fname);
+        return 1;
+    }
+    return 0;
+}
+
+// Write a header and body to a temp file, sync it and replace filename
+// Return 0 on success
+int write_file_atomic(const char *filename, const void *head, size_t head_size, const void *body, size_t body_size)
+{
+    char tmp_fname[512];
+    FILE *fp = open_file_atomic(filename, tmp_fname, sizeof(tmp_fname));
+    if (fp == NULL)
+        return 1;
 
-    // Convert period to comma
-    char *ret = strchr(ts_str, '.');
-    if (ret)
-        *ret = ',';
+    int err = (head_size && fwrite(head, head_size, 1, fp) != 1) ||
+              (body_size && fwrite(body, body_size, 1, fp) != 1);
+
+    return commit_file_atomic(fp, err, tmp_fname, filename);
+}
+
+// Write text, dropping carriage returns
+// Return 0 on success
+int write_without_cr(FILE *fp, const char *text, int len)
+{
+    const char *cr;
+    while ((cr = memchr(text, '\r', len)) != NULL)
+    {
+        fwrite(text, 1, cr - text, fp);
+        len -= cr - text + 1;
+        text = cr + 1;
+    }
+    return fwrite(text, 1, len, fp) != (size_t)len;
+}
+
+// Find the first occurrence of needle in text that is not null terminated
+// Return NULL if not found
+const char *find_bytes(const char *text, int len, const char *needle, int needle_len)
+{
+    if (needle_len == 0)
+        return text;
+
+    const char *last = text + len - needle_len;
+    for (const char *p = text; p <= last; p++)
+    {
+        p = (const char *)memchr(p, needle[0], last - p + 1);
+        if (p == NULL)
+            return NULL;
+        if (memcmp(p, needle, needle_len) == 0)
+            return p;
+    }
+    return NULL;
 }